@@ -0,0 +1,342 @@
+/**
+ * bitvec.c
+ *
+ * Bit vector parsing, formatting, and AND/OR kernels with runtime CPU
+ * dispatch. See bitvec.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitvec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITVEC_X86 // build the AVX2 and AVX-512 kernels
+#endif
+
+/**
+ * type of an AND/OR kernel
+ */
+typedef void (*bitvec_fn)(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words);
+
+static bitvec_fn and_fn; // kernel used by bitvec_and, NULL until chosen
+static bitvec_fn or_fn; // kernel used by bitvec_or, NULL until chosen
+static const char * kernel_name = "scalar";
+
+/**
+ * andscalar is the portable AND kernel, one 64-bit word at a time.
+ * @param dst pointer to num_words destination words
+ * @param a pointer to num_words words
+ * @param b pointer to num_words words
+ * @param num_words size_t number of words
+ */
+static void andscalar(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words)
+{
+   for (size_t i = 0; i < num_words * BITVEC_WORD_BYTES;
+      i += BITVEC_WORD_BYTES)
+   {
+      uint64_t word1;
+      uint64_t word2;
+
+      // memcpy keeps unaligned words legal and compiles to plain loads
+      memcpy(&word1, a + i, BITVEC_WORD_BYTES);
+      memcpy(&word2, b + i, BITVEC_WORD_BYTES);
+      word1 &= word2;
+      memcpy(dst + i, &word1, BITVEC_WORD_BYTES);
+   }
+}
+
+/**
+ * orscalar is the portable OR kernel, one 64-bit word at a time.
+ * @param dst pointer to num_words destination words
+ * @param a pointer to num_words words
+ * @param b pointer to num_words words
+ * @param num_words size_t number of words
+ */
+static void orscalar(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words)
+{
+   for (size_t i = 0; i < num_words * BITVEC_WORD_BYTES;
+      i += BITVEC_WORD_BYTES)
+   {
+      uint64_t word1;
+      uint64_t word2;
+
+      memcpy(&word1, a + i, BITVEC_WORD_BYTES);
+      memcpy(&word2, b + i, BITVEC_WORD_BYTES);
+      word1 |= word2;
+      memcpy(dst + i, &word1, BITVEC_WORD_BYTES);
+   }
+}
+
+#ifdef BITVEC_X86
+
+/**
+ * andavx2 is the AND kernel for CPUs with AVX2, 4 words per instruction.
+ * @param dst pointer to num_words destination words
+ * @param a pointer to num_words words
+ * @param b pointer to num_words words
+ * @param num_words size_t number of words
+ */
+__attribute__((target("avx2")))
+static void andavx2(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words)
+{
+   size_t i = 0;
+
+   for (; i + 4 <= num_words; i += 4)
+   {
+      __m256i vec1 = _mm256_loadu_si256((const __m256i *) (a + i * 8));
+      __m256i vec2 = _mm256_loadu_si256((const __m256i *) (b + i * 8));
+
+      _mm256_storeu_si256((__m256i *) (dst + i * 8),
+         _mm256_and_si256(vec1, vec2));
+   }
+
+   // Up to 3 words are left over
+   andscalar(dst + i * 8, a + i * 8, b + i * 8, num_words - i);
+}
+
+/**
+ * oravx2 is the OR kernel for CPUs with AVX2, 4 words per instruction.
+ * @param dst pointer to num_words destination words
+ * @param a pointer to num_words words
+ * @param b pointer to num_words words
+ * @param num_words size_t number of words
+ */
+__attribute__((target("avx2")))
+static void oravx2(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words)
+{
+   size_t i = 0;
+
+   for (; i + 4 <= num_words; i += 4)
+   {
+      __m256i vec1 = _mm256_loadu_si256((const __m256i *) (a + i * 8));
+      __m256i vec2 = _mm256_loadu_si256((const __m256i *) (b + i * 8));
+
+      _mm256_storeu_si256((__m256i *) (dst + i * 8),
+         _mm256_or_si256(vec1, vec2));
+   }
+
+   orscalar(dst + i * 8, a + i * 8, b + i * 8, num_words - i);
+}
+
+/**
+ * andavx512 is the AND kernel for CPUs with AVX-512F, 8 words per
+ * instruction. The last partial vector uses masked loads and stores.
+ * @param dst pointer to num_words destination words
+ * @param a pointer to num_words words
+ * @param b pointer to num_words words
+ * @param num_words size_t number of words
+ */
+__attribute__((target("avx512f")))
+static void andavx512(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words)
+{
+   size_t i = 0;
+
+   for (; i + 8 <= num_words; i += 8)
+   {
+      __m512i vec1 = _mm512_loadu_si512(a + i * 8);
+      __m512i vec2 = _mm512_loadu_si512(b + i * 8);
+
+      _mm512_storeu_si512(dst + i * 8, _mm512_and_si512(vec1, vec2));
+   }
+
+   if (i < num_words)
+   {
+      __mmask8 mask = (__mmask8) ((1u << (num_words - i)) - 1);
+      __m512i vec1 = _mm512_maskz_loadu_epi64(mask, a + i * 8);
+      __m512i vec2 = _mm512_maskz_loadu_epi64(mask, b + i * 8);
+
+      _mm512_mask_storeu_epi64(dst + i * 8, mask,
+         _mm512_and_si512(vec1, vec2));
+   }
+}
+
+/**
+ * oravx512 is the OR kernel for CPUs with AVX-512F, 8 words per instruction.
+ * The last partial vector uses masked loads and stores.
+ * @param dst pointer to num_words destination words
+ * @param a pointer to num_words words
+ * @param b pointer to num_words words
+ * @param num_words size_t number of words
+ */
+__attribute__((target("avx512f")))
+static void oravx512(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words)
+{
+   size_t i = 0;
+
+   for (; i + 8 <= num_words; i += 8)
+   {
+      __m512i vec1 = _mm512_loadu_si512(a + i * 8);
+      __m512i vec2 = _mm512_loadu_si512(b + i * 8);
+
+      _mm512_storeu_si512(dst + i * 8, _mm512_or_si512(vec1, vec2));
+   }
+
+   if (i < num_words)
+   {
+      __mmask8 mask = (__mmask8) ((1u << (num_words - i)) - 1);
+      __m512i vec1 = _mm512_maskz_loadu_epi64(mask, a + i * 8);
+      __m512i vec2 = _mm512_maskz_loadu_epi64(mask, b + i * 8);
+
+      _mm512_mask_storeu_epi64(dst + i * 8, mask,
+         _mm512_or_si512(vec1, vec2));
+   }
+}
+
+#endif
+
+/**
+ * choosekernel picks the widest kernel the CPU supports.
+ */
+static void choosekernel()
+{
+   if ((bitvec_usekernel("avx512") == EXIT_FAILURE) &&
+      (bitvec_usekernel("avx2") == EXIT_FAILURE))
+   {
+      bitvec_usekernel("scalar");
+   }
+}
+
+size_t bitvec_words(uint64_t bits)
+{
+   return (size_t) ((bits + 63) / 64);
+}
+
+int bitvec_fromstr(const char * str, size_t len, unsigned char * vec)
+{
+   memset(vec, 0, bitvec_words(len) * BITVEC_WORD_BYTES);
+
+   // Last digit is bit 0
+   for (size_t k = 0; k < len; k++)
+   {
+      char digit = str[len - 1 - k];
+
+      if (digit == '1')
+      {
+         vec[k / 8] |= (unsigned char) (1u << (k % 8));
+      }
+      else if (digit != '0')
+      {
+         return EXIT_FAILURE;
+      }
+   }
+
+   return EXIT_SUCCESS;
+}
+
+void bitvec_truncate(unsigned char * vec, uint64_t bits)
+{
+   size_t end = bitvec_words(bits) * BITVEC_WORD_BYTES;
+
+   if (bits % 8 != 0)
+   {
+      vec[bits / 8] &= (unsigned char) ((1u << (bits % 8)) - 1);
+      bits += 8 - bits % 8;
+   }
+
+   memset(vec + bits / 8, 0, end - (size_t) (bits / 8));
+}
+
+uint64_t bitvec_sigbits(const unsigned char * vec, size_t num_words)
+{
+   // Find the most significant nonzero byte, then its highest set bit
+   for (size_t i = num_words * BITVEC_WORD_BYTES; i > 0; i--)
+   {
+      if (vec[i - 1] != 0)
+      {
+         return (uint64_t) (i - 1) * 8 + 32 - __builtin_clz(vec[i - 1]);
+      }
+   }
+
+   return 0;
+}
+
+void bitvec_tostr(const unsigned char * vec, uint64_t digits, char * str)
+{
+   if (digits == 0)
+   {
+      strcpy(str, "0");
+      return;
+   }
+
+   for (uint64_t i = 0; i < digits; i++)
+   {
+      uint64_t k = digits - 1 - i;
+
+      str[i] = ((vec[k / 8] >> (k % 8)) & 1) ? '1' : '0';
+   }
+   str[digits] = '\0';
+}
+
+void bitvec_and(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words)
+{
+   if (and_fn == NULL)
+   {
+      choosekernel();
+   }
+
+   and_fn(dst, a, b, num_words);
+}
+
+void bitvec_or(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words)
+{
+   if (or_fn == NULL)
+   {
+      choosekernel();
+   }
+
+   or_fn(dst, a, b, num_words);
+}
+
+const char * bitvec_kernel()
+{
+   if (and_fn == NULL)
+   {
+      choosekernel();
+   }
+
+   return kernel_name;
+}
+
+int bitvec_usekernel(const char * name)
+{
+#ifdef BITVEC_X86
+   __builtin_cpu_init();
+
+   if ((strcmp(name, "avx512") == 0) && __builtin_cpu_supports("avx512f"))
+   {
+      and_fn = andavx512;
+      or_fn = oravx512;
+      kernel_name = "avx512";
+      return EXIT_SUCCESS;
+   }
+
+   if ((strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+   {
+      and_fn = andavx2;
+      or_fn = oravx2;
+      kernel_name = "avx2";
+      return EXIT_SUCCESS;
+   }
+#endif
+
+   if (strcmp(name, "scalar") == 0)
+   {
+      and_fn = andscalar;
+      or_fn = orscalar;
+      kernel_name = "scalar";
+      return EXIT_SUCCESS;
+   }
+
+   return EXIT_FAILURE;
+}
@@ -0,0 +1,98 @@
+/**
+ * bitvec.h
+ *
+ * Arbitrary length bit vectors for wide AND/OR jobs.
+ *
+ * A bit vector is stored as little-endian 64-bit words, least significant
+ * word first, exactly as it travels on the wire. Bit k of the vector is bit
+ * (k % 8) of byte k / 8 on every host, so the kernels work on the bytes
+ * directly and never convert byte order.
+ *
+ * bitvec_and() and bitvec_or() pick the widest kernel the CPU supports the
+ * first time they are called: AVX-512, AVX2, or a portable scalar loop.
+ */
+
+#ifndef BITVEC_H
+#define BITVEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BITVEC_WORD_BYTES 8 // number of bytes in a bit vector word
+
+/**
+ * bitvec_words returns the number of words needed to hold a number of bits.
+ * @param bits uint64_t number of bits
+ * @return size_t number of words
+ */
+size_t bitvec_words(uint64_t bits);
+
+/**
+ * bitvec_fromstr parses a string of binary digits into a bit vector.
+ * @param str pointer to binary digits, most significant first
+ * @param len size_t number of digits
+ * @param vec pointer to bitvec_words(len) words
+ * @return int 0 if successful, 1 if str holds anything but '0' and '1'
+ */
+int bitvec_fromstr(const char * str, size_t len, unsigned char * vec);
+
+/**
+ * bitvec_truncate clears the bits of a bit vector's last word above a number
+ * of bits, so a vector received from elsewhere has no stray high bits.
+ * @param vec pointer to bitvec_words(bits) words
+ * @param bits uint64_t number of bits to keep
+ */
+void bitvec_truncate(unsigned char * vec, uint64_t bits);
+
+/**
+ * bitvec_sigbits counts the significant bits of a bit vector, the number of
+ * binary digits left once leading zeros are dropped.
+ * @param vec pointer to bit vector
+ * @param num_words size_t number of words
+ * @return uint64_t number of significant bits, 0 if every bit is zero
+ */
+uint64_t bitvec_sigbits(const unsigned char * vec, size_t num_words);
+
+/**
+ * bitvec_tostr formats the low bits of a bit vector as binary digits.
+ * @param vec pointer to bit vector holding at least digits bits
+ * @param digits uint64_t number of digits, 0 to write the single digit "0"
+ * @param str pointer to at least digits + 1 bytes (2 if digits is 0)
+ */
+void bitvec_tostr(const unsigned char * vec, uint64_t digits, char * str);
+
+/**
+ * bitvec_and stores the bitwise AND of two bit vectors.
+ * @param dst pointer to num_words destination words, may alias a or b
+ * @param a pointer to num_words words
+ * @param b pointer to num_words words
+ * @param num_words size_t number of words
+ */
+void bitvec_and(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words);
+
+/**
+ * bitvec_or stores the bitwise OR of two bit vectors.
+ * @param dst pointer to num_words destination words, may alias a or b
+ * @param a pointer to num_words words
+ * @param b pointer to num_words words
+ * @param num_words size_t number of words
+ */
+void bitvec_or(unsigned char * dst, const unsigned char * a,
+   const unsigned char * b, size_t num_words);
+
+/**
+ * bitvec_kernel names the kernel bitvec_and() and bitvec_or() use.
+ * @return const char * "avx512", "avx2", or "scalar"
+ */
+const char * bitvec_kernel();
+
+/**
+ * bitvec_usekernel makes bitvec_and() and bitvec_or() use a given kernel,
+ * for benchmarks and tests.
+ * @param name pointer to kernel name c string ("avx512", "avx2", "scalar")
+ * @return int 0 if successful, 1 if the CPU or build lacks the kernel
+ */
+int bitvec_usekernel(const char * name);
+
+#endif
@@ -0,0 +1,356 @@
+/**
+ * cache.c
+ *
+ * Result cache for the edge server. See cache.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "cache.h"
+
+/**
+ * hash scrambles a job's key into 64 bits. The top bits pick the shard and
+ * the bottom bits the bucket.
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @param operand1 uint32_t first operand
+ * @param operand2 uint32_t second operand
+ * @return uint64_t hash
+ */
+static uint64_t hash(int opcode, uint32_t operand1, uint32_t operand2);
+
+/**
+ * lock waits until the calling process holds a shard.
+ * @param shard_ptr pointer to struct cache_shard
+ */
+static void lock(struct cache_shard * shard_ptr);
+
+/**
+ * unlock releases a shard.
+ * @param shard_ptr pointer to struct cache_shard
+ */
+static void unlock(struct cache_shard * shard_ptr);
+
+/**
+ * find looks up a job's entry in a shard and marks it recently used. The
+ * shard must be locked.
+ * @param cache_ptr pointer to struct cache
+ * @param s int shard index
+ * @param h uint64_t hash of the job
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @param operand1 uint32_t first operand
+ * @param operand2 uint32_t second operand
+ * @return struct cache_entry * the entry, NULL if the job is not cached
+ */
+static struct cache_entry * find(struct cache * cache_ptr, int s, uint64_t h,
+   int opcode, uint32_t operand1, uint32_t operand2);
+
+/**
+ * unlinklru takes an entry off its shard's least recently used list. The
+ * shard must be locked.
+ * @param cache_ptr pointer to struct cache
+ * @param s int shard index
+ * @param e int32_t entry index within the shard
+ */
+static void unlinklru(struct cache * cache_ptr, int s, int32_t e);
+
+/**
+ * pushlru makes an entry its shard's most recently used one. The shard must
+ * be locked.
+ * @param cache_ptr pointer to struct cache
+ * @param s int shard index
+ * @param e int32_t entry index within the shard
+ */
+static void pushlru(struct cache * cache_ptr, int s, int32_t e);
+
+int cache_init(struct cache * cache_ptr, size_t bytes)
+{
+   cache_ptr->shards = NULL;
+   cache_ptr->bytes = 0;
+
+   if (bytes == 0)
+   {
+      return EXIT_SUCCESS;
+   }
+
+   // Fit as many entries as the cap allows, with at least one bucket each
+   size_t shard_bytes = (bytes > sizeof(struct cache_shard) * CACHE_SHARDS) ?
+      (bytes - sizeof(struct cache_shard) * CACHE_SHARDS) / CACHE_SHARDS : 0;
+   size_t capacity = shard_bytes / (sizeof(struct cache_entry) +
+      sizeof(int32_t));
+   size_t num_buckets = 1;
+
+   if (capacity > INT32_MAX / 2)
+   {
+      capacity = INT32_MAX / 2;
+   }
+
+   while (num_buckets < capacity)
+   {
+      num_buckets *= 2;
+   }
+
+   if (num_buckets * sizeof(int32_t) + capacity * sizeof(struct cache_entry)
+      > shard_bytes)
+   {
+      capacity = (shard_bytes > num_buckets * sizeof(int32_t)) ? (shard_bytes
+         - num_buckets * sizeof(int32_t)) / sizeof(struct cache_entry) : 0;
+   }
+
+   if (capacity == 0)
+   {
+      fprintf(stderr, "ERROR: Cache is too small to hold a result in each of"
+         " its %d shards.\n", CACHE_SHARDS);
+      return EXIT_FAILURE;
+   }
+
+   size_t len = sizeof(struct cache_shard) * CACHE_SHARDS + CACHE_SHARDS *
+      (num_buckets * sizeof(int32_t) + capacity * sizeof(struct cache_entry));
+   unsigned char * base;
+
+   // Entries are shared with the forked children that serve clients
+   if ((base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED |
+      MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+   {
+      fprintf(stderr, "ERROR: Failed to map result cache.\n");
+      return EXIT_FAILURE;
+   }
+
+   cache_ptr->shards = (struct cache_shard *) base;
+   cache_ptr->entries = (struct cache_entry *) (base +
+      sizeof(struct cache_shard) * CACHE_SHARDS);
+   cache_ptr->buckets = (int32_t *) (cache_ptr->entries + CACHE_SHARDS *
+      capacity);
+   cache_ptr->capacity = (int32_t) capacity;
+   cache_ptr->num_buckets = (int32_t) num_buckets;
+   cache_ptr->bytes = len;
+
+   for (int s = 0; s < CACHE_SHARDS; s++)
+   {
+      cache_ptr->shards[s].newest = -1;
+      cache_ptr->shards[s].oldest = -1;
+   }
+
+   for (size_t b = 0; b < CACHE_SHARDS * num_buckets; b++)
+   {
+      cache_ptr->buckets[b] = -1;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+bool cache_get(struct cache * cache_ptr, int opcode, uint32_t operand1,
+   uint32_t operand2, uint32_t * result_ptr)
+{
+   uint64_t h = hash(opcode, operand1, operand2);
+   int s = (int) (h >> 60) & (CACHE_SHARDS - 1);
+   struct cache_shard * shard_ptr = &cache_ptr->shards[s];
+   struct cache_entry * entry_ptr;
+
+   lock(shard_ptr);
+
+   if ((entry_ptr = find(cache_ptr, s, h, opcode, operand1, operand2)) ==
+      NULL)
+   {
+      shard_ptr->misses++;
+      unlock(shard_ptr);
+      return false;
+   }
+
+   *result_ptr = entry_ptr->result;
+   shard_ptr->hits++;
+   unlock(shard_ptr);
+
+   return true;
+}
+
+void cache_put(struct cache * cache_ptr, int opcode, uint32_t operand1,
+   uint32_t operand2, uint32_t result)
+{
+   uint64_t h = hash(opcode, operand1, operand2);
+   int s = (int) (h >> 60) & (CACHE_SHARDS - 1);
+   struct cache_shard * shard_ptr = &cache_ptr->shards[s];
+   struct cache_entry * entries = cache_ptr->entries + (size_t) s *
+      (size_t) cache_ptr->capacity;
+   int32_t * buckets = cache_ptr->buckets + (size_t) s *
+      (size_t) cache_ptr->num_buckets;
+   struct cache_entry * entry_ptr;
+   int32_t e;
+
+   lock(shard_ptr);
+
+   // Another process may have stored the same job in the meantime
+   if ((entry_ptr = find(cache_ptr, s, h, opcode, operand1, operand2)) !=
+      NULL)
+   {
+      entry_ptr->result = result;
+      unlock(shard_ptr);
+      return;
+   }
+
+   if (shard_ptr->num_entries < cache_ptr->capacity)
+   {
+      e = shard_ptr->num_entries++;
+   }
+   else
+   {
+      // Reuse the least recently used entry once it is out of its bucket
+      e = shard_ptr->oldest;
+      entry_ptr = &entries[e];
+
+      int32_t * link_ptr = &buckets[hash(entry_ptr->opcode,
+         entry_ptr->operand1, entry_ptr->operand2) &
+         (uint64_t) (cache_ptr->num_buckets - 1)];
+
+      while (*link_ptr != e)
+      {
+         link_ptr = &entries[*link_ptr].chain;
+      }
+      *link_ptr = entry_ptr->chain;
+
+      unlinklru(cache_ptr, s, e);
+      shard_ptr->evictions++;
+   }
+
+   int32_t * bucket_ptr = &buckets[h & (uint64_t) (cache_ptr->num_buckets -
+      1)];
+
+   entry_ptr = &entries[e];
+   entry_ptr->operand1 = operand1;
+   entry_ptr->operand2 = operand2;
+   entry_ptr->result = result;
+   entry_ptr->opcode = opcode;
+   entry_ptr->chain = *bucket_ptr;
+   *bucket_ptr = e;
+   pushlru(cache_ptr, s, e);
+
+   unlock(shard_ptr);
+}
+
+void cache_getstats(struct cache * cache_ptr, struct cache_stats * stats_ptr)
+{
+   stats_ptr->hits = 0;
+   stats_ptr->misses = 0;
+   stats_ptr->evictions = 0;
+   stats_ptr->entries = 0;
+   stats_ptr->capacity = 0;
+
+   if (cache_ptr->shards == NULL)
+   {
+      return;
+   }
+
+   for (int s = 0; s < CACHE_SHARDS; s++)
+   {
+      struct cache_shard * shard_ptr = &cache_ptr->shards[s];
+
+      lock(shard_ptr);
+      stats_ptr->hits += shard_ptr->hits;
+      stats_ptr->misses += shard_ptr->misses;
+      stats_ptr->evictions += shard_ptr->evictions;
+      stats_ptr->entries += (unsigned long) shard_ptr->num_entries;
+      unlock(shard_ptr);
+   }
+   stats_ptr->capacity = (unsigned long) cache_ptr->capacity * CACHE_SHARDS;
+}
+
+static uint64_t hash(int opcode, uint32_t operand1, uint32_t operand2)
+{
+   uint64_t key = ((uint64_t) operand1 << 32 | operand2) ^
+      ((uint64_t) opcode * 0x9e3779b97f4a7c15ull);
+
+   key = (key ^ (key >> 33)) * 0xff51afd7ed558ccdull;
+   key = (key ^ (key >> 33)) * 0xc4ceb9fe1a85ec53ull;
+   return key ^ (key >> 33);
+}
+
+static void lock(struct cache_shard * shard_ptr)
+{
+   // Critical sections are a few dozen instructions, so give the CPU away
+      //rather than spinning on a holder that is not running
+   while (__atomic_test_and_set(&shard_ptr->locked, __ATOMIC_ACQUIRE))
+   {
+      sched_yield();
+   }
+}
+
+static void unlock(struct cache_shard * shard_ptr)
+{
+   __atomic_clear(&shard_ptr->locked, __ATOMIC_RELEASE);
+}
+
+static struct cache_entry * find(struct cache * cache_ptr, int s, uint64_t h,
+   int opcode, uint32_t operand1, uint32_t operand2)
+{
+   struct cache_entry * entries = cache_ptr->entries + (size_t) s *
+      (size_t) cache_ptr->capacity;
+   int32_t e = cache_ptr->buckets[(size_t) s *
+      (size_t) cache_ptr->num_buckets + (h & (uint64_t)
+      (cache_ptr->num_buckets - 1))];
+
+   while ((e != -1) && ((entries[e].operand1 != operand1) ||
+      (entries[e].operand2 != operand2) || (entries[e].opcode != opcode)))
+   {
+      e = entries[e].chain;
+   }
+
+   if (e == -1)
+   {
+      return NULL;
+   }
+
+   if (cache_ptr->shards[s].newest != e)
+   {
+      unlinklru(cache_ptr, s, e);
+      pushlru(cache_ptr, s, e);
+   }
+
+   return &entries[e];
+}
+
+static void unlinklru(struct cache * cache_ptr, int s, int32_t e)
+{
+   struct cache_shard * shard_ptr = &cache_ptr->shards[s];
+   struct cache_entry * entries = cache_ptr->entries + (size_t) s *
+      (size_t) cache_ptr->capacity;
+
+   if (entries[e].newer == -1)
+   {
+      shard_ptr->newest = entries[e].older;
+   }
+   else
+   {
+      entries[entries[e].newer].older = entries[e].older;
+   }
+
+   if (entries[e].older == -1)
+   {
+      shard_ptr->oldest = entries[e].newer;
+   }
+   else
+   {
+      entries[entries[e].older].newer = entries[e].newer;
+   }
+}
+
+static void pushlru(struct cache * cache_ptr, int s, int32_t e)
+{
+   struct cache_shard * shard_ptr = &cache_ptr->shards[s];
+   struct cache_entry * entries = cache_ptr->entries + (size_t) s *
+      (size_t) cache_ptr->capacity;
+
+   entries[e].newer = -1;
+   entries[e].older = shard_ptr->newest;
+
+   if (shard_ptr->newest == -1)
+   {
+      shard_ptr->oldest = e;
+   }
+   else
+   {
+      entries[shard_ptr->newest].newer = e;
+   }
+   shard_ptr->newest = e;
+}
@@ -0,0 +1,114 @@
+/**
+ * cache.h
+ *
+ * Result cache for the edge server.
+ *
+ * The cache remembers the results of recent AND and OR jobs, keyed on the
+ * operator and both operands, so a job the edge server has seen before is
+ * answered without a round trip to the backend servers. It lives in shared
+ * memory, so every process forked from the one that set it up reads and
+ * fills the same entries.
+ *
+ * The entries are split over CACHE_SHARDS shards by the hash of their key.
+ * Each shard has its own lock, hash table, and least recently used list, and
+ * evicts its least recently used entry once it is full.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_SHARDS 16 // number of independently locked shards, power of 2
+
+/**
+ * struct to store one cached result
+ */
+struct cache_entry {
+   uint32_t operand1;
+   uint32_t operand2;
+   uint32_t result;
+   int32_t chain; // next entry in the same hash bucket, -1 if last
+   int32_t newer; // next more recently used entry, -1 if newest
+   int32_t older; // next less recently used entry, -1 if oldest
+   int opcode; // PROTO_OP_AND or PROTO_OP_OR
+};
+
+/**
+ * struct to store the state of one shard, shared by every process
+ */
+struct cache_shard {
+   bool locked; // held by a process reading or changing the shard
+   int32_t newest; // most recently used entry, -1 if empty
+   int32_t oldest; // least recently used entry, -1 if empty
+   int32_t num_entries;
+   unsigned long hits; // lookups answered
+   unsigned long misses; // lookups not answered
+   unsigned long evictions; // entries dropped to make room
+};
+
+/**
+ * struct to store a result cache
+ */
+struct cache {
+   struct cache_shard * shards; // CACHE_SHARDS shards, NULL if disabled
+   int32_t * buckets; // num_buckets first entries of each shard's buckets
+   struct cache_entry * entries; // capacity entries of each shard
+   int32_t capacity; // number of entries per shard
+   int32_t num_buckets; // number of hash buckets per shard, power of 2
+   size_t bytes; // size of the shared mapping
+};
+
+/**
+ * struct to store the counters of a whole cache
+ */
+struct cache_stats {
+   unsigned long hits;
+   unsigned long misses;
+   unsigned long evictions;
+   unsigned long entries; // number of results held
+   unsigned long capacity; // number of results that fit
+};
+
+/**
+ * cache_init maps a cache of at most the given size. Call it before forking.
+ * @param cache_ptr pointer to struct cache
+ * @param bytes size_t memory cap, 0 to disable the cache
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int cache_init(struct cache * cache_ptr, size_t bytes);
+
+/**
+ * cache_get looks up the result of a job and marks it recently used.
+ * @param cache_ptr pointer to struct cache
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @param operand1 uint32_t first operand
+ * @param operand2 uint32_t second operand
+ * @param result_ptr pointer set to the result if it is cached
+ * @return bool true if the result is cached
+ */
+bool cache_get(struct cache * cache_ptr, int opcode, uint32_t operand1,
+   uint32_t operand2, uint32_t * result_ptr);
+
+/**
+ * cache_put stores the result of a job, evicting the shard's least recently
+ * used result if the shard is full.
+ * @param cache_ptr pointer to struct cache
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @param operand1 uint32_t first operand
+ * @param operand2 uint32_t second operand
+ * @param result uint32_t result
+ */
+void cache_put(struct cache * cache_ptr, int opcode, uint32_t operand1,
+   uint32_t operand2, uint32_t result);
+
+/**
+ * cache_getstats adds up the counters of every shard.
+ * @param cache_ptr pointer to struct cache
+ * @param stats_ptr pointer to struct cache_stats to fill in
+ */
+void cache_getstats(struct cache * cache_ptr, struct cache_stats * stats_ptr);
+
+#endif
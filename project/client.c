@@ -4,14 +4,30 @@
  * Reads an input file containing bitwise and/bitwise or operation jobs,
  * submits the jobs to an edge server, receives the results, and displays them.
  *
- * Usage: ./client <input_filename>
+ * Usage: ./client [-a] [-u] [-w window | -x] <input_filename>
+ *        ./client -k [-u] <input_filename> [input_filename ...]
+ *
+ * -a use the legacy fixed-width ASCII protocol instead of the binary protocol
+ * -u let the edge server stream results in completion order, tagged with their
+ *    job indices (binary protocol only)
+ * -w stream the file to the edge server in batches over one connection,
+ *    reading results while sending, with at most window jobs awaiting results
+ *    (binary protocol only). Memory use does not depend on the number of jobs,
+ *    so the file may hold any number of them. Without -w the file may hold at
+ *    most 100 jobs.
+ * -x send the whole file as one batch of wide jobs whose operands may have any
+ *    number of digits (binary protocol only)
+ * -k send every input file as its own batch over one keep-alive session,
+ *    tagged with its position on the command line as request ID, and print
+ *    each file's results as its batch is answered, in whatever order the
+ *    batches finish (binary protocol only, at most 100 jobs per file)
  *
  * The input file should list one job per line with the following format.
  * 
  * operator,operand1,operand2
  * 
  * operator must be "and" or "or"
- * operands must be in binary with a maximum of 10 digits
+ * operands must be in binary with a maximum of 10 digits (any number with -x)
  *
  * Example: and,1010101,100
  */
@@ -26,21 +42,57 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <poll.h>
+
+#include <stdbool.h>
+
+#include "protocol.h"
+#include "jobfile.h"
+#include "bitvec.h"
 
 #define MAX_ROWS 100 // maximum number of rows allowed
 #define MAX_ROW_BYTES 26 // maximum number of characters in row allowed
+#define ASCII_MAX_DIGITS 10 // maximum number of digits in an operand (ASCII)
 
-#define SEND_BYTES 29 // number of bytes sent to edge server
-#define RECV_BYTES 10 // number of bytes received from edge server
+#define SEND_BYTES 29 // number of bytes sent to edge server (ASCII mode)
+#define RECV_BYTES 10 // number of bytes received from edge server (ASCII mode)
+#define RESULT_CHUNK_BYTES 65536 // maximum number of result bytes per receive
+#define MAX_WINDOW 1048576 // maximum number of jobs in flight (streaming mode)
+#define STREAM_BATCHES 4 // number of batches that fill the window
+#define MAX_STREAM_BATCH_JOBS 4096 // maximum number of jobs per streamed batch
+#define WIDE_INITIAL_BYTES 65536 // initial size of a wide jobs message
 
 #define EDGE_IP "127.0.0.1" // edge server IPv4 address
 #define EDGE_PORT 23926 // edge server port number
 
-typedef char jobsarr[MAX_ROWS][MAX_ROW_BYTES + 1]; // 2D array type for storing
-   //jobs
+typedef unsigned char jobsarr[MAX_ROWS][PROTO_CLIENT_JOB_BYTES]; // 2D array
+   //type for storing encoded jobs
+
+/**
+ * struct to store one input file's batch of a keep-alive session
+ */
+struct file_batch {
+   char * filename;
+   int num_jobs;
+   int num_received; // number of results received
+   char results[MAX_ROWS][PROTO_MAX_WIDTH + 1];
+};
+
+/**
+ * struct to store command line options
+ */
+struct options {
+   bool ascii; // use the legacy ASCII protocol
+   bool unordered; // accept results in completion order
+   int window; // maximum number of jobs in flight, 0 to send one batch
+   bool wide; // send operands of any length as bit vectors
+   bool session; // send each input file as a batch of one keep-alive session
+};
+
+static struct options opts = {false, false, 0, false, false};
 
 /**
- * readjobs reads the input file and stores its contects in a 2D array.
+ * readjobs reads the input file and stores its encoded jobs in a 2D array.
  * @param filename pointer to char array containing name of input file
  * @param jobs_ptr pointer to jobsarr
  * @return int number of jobs read or -1 if unsuccessful
@@ -71,6 +123,75 @@ int sendjobs(int sock_desc, jobsarr * jobs_ptr, int num_jobs);
  */
 int recvresults(int sock_desc, int num_jobs);
 
+/**
+ * streamjobs streams every job in the input file to the edge server in
+ * batches while printing results as they arrive, keeping at most opts.window
+ * jobs awaiting results.
+ * @param sock_desc int socket descriptor
+ * @param filename pointer to char array containing name of input file
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int streamjobs(int sock_desc, char * filename);
+
+/**
+ * sessionjobs sends every input file as a batch of one keep-alive session,
+ * tagged with request ID i + 1 for filenames[i], and prints the results of
+ * each batch once they have all arrived.
+ * @param sock_desc int socket descriptor
+ * @param filenames array of pointers to input file names
+ * @param num_files int number of input files
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int sessionjobs(int sock_desc, char * filenames[], int num_files);
+
+/**
+ * fillbatch encodes the next batch of jobs from the input file.
+ * @param file_ptr pointer to open struct jobfile
+ * @param max_jobs int maximum number of jobs in the batch
+ * @param payload pointer to PROTO_HEADER_BYTES + max_jobs *
+ *    PROTO_CLIENT_JOB_BYTES destination bytes
+ * @return int number of jobs encoded, 0 at end of file, -1 if a job is invalid
+ */
+int fillbatch(struct jobfile * file_ptr, int max_jobs,
+   unsigned char * payload);
+
+/**
+ * packjob encodes a job line as a binary client job record.
+ * @param view_ptr pointer to struct job_view of the job line
+ * @param record pointer to PROTO_CLIENT_JOB_BYTES destination bytes
+ * @return int 0 if successful, 1 if the job is invalid
+ */
+int packjob(const struct job_view * view_ptr, unsigned char * record);
+
+/**
+ * readwidejobs reads the input file and encodes its jobs as one wide jobs
+ * message.
+ * @param filename pointer to char array containing name of input file
+ * @param payload_ptr pointer set to the allocated message
+ * @param len_ptr pointer set to the number of bytes in the message
+ * @return int number of jobs read or -1 if unsuccessful
+ */
+int readwidejobs(char * filename, unsigned char ** payload_ptr,
+   size_t * len_ptr);
+
+/**
+ * packwidejob encodes a job line as a wide client job record.
+ * @param view_ptr pointer to struct job_view of the job line
+ * @param record pointer to PROTO_WIDE_JOB_BYTES destination bytes followed by
+ *    room for the words of both operands
+ * @return int 0 if successful, 1 if the job is invalid
+ */
+int packwidejob(const struct job_view * view_ptr, unsigned char * record);
+
+/**
+ * recvwideresults receives bit vector results from the edge server and prints
+ * each one as it arrives.
+ * @param sock_desc int socket descriptor
+ * @param num_jobs int number of jobs
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int recvwideresults(int sock_desc, int num_jobs);
+
 /**
  * main
  * input file is read, jobs are sent to edge server, results are received and
@@ -82,19 +203,128 @@ int recvresults(int sock_desc, int num_jobs);
 int main(int argc, char * argv[])
 {
    // Check command line arguments
-	if (argc != 2)
+   int opt;
+
+   while ((opt = getopt(argc, argv, "auw:xk")) != -1)
    {
-      fprintf(stderr, "ERROR: Usage: %s input_filename\n", argv[0]);
+      switch (opt)
+      {
+         case 'a':
+            opts.ascii = true;
+            break;
+         case 'u':
+            opts.unordered = true;
+            break;
+         case 'w':
+            opts.window = atoi(optarg);
+            if ((opts.window < 1) || (opts.window > MAX_WINDOW))
+            {
+               fprintf(stderr, "ERROR: Window must be between 1 and %d"
+                  " jobs.\n", MAX_WINDOW);
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'x':
+            opts.wide = true;
+            break;
+         case 'k':
+            opts.session = true;
+            break;
+         default:
+            fprintf(stderr, "ERROR: Usage: %s [-a] [-u] [-w window | -x]"
+               " input_filename, or %s -k [-u] input_filename ...\n",
+               argv[0], argv[0]);
+            return EXIT_FAILURE;
+      }
+   }
+
+	if ((optind == argc) || ((optind != argc - 1) && !opts.session) ||
+      (opts.ascii && opts.unordered) ||
+      ((opts.window != 0) && (opts.ascii || opts.unordered)) ||
+      (opts.wide && (opts.ascii || opts.unordered || (opts.window != 0))) ||
+      (opts.session && (opts.ascii || opts.wide || (opts.window != 0))))
+   {
+      fprintf(stderr, "ERROR: Usage: %s [-a] [-u] [-w window | -x]"
+         " input_filename, or %s -k [-u] input_filename ...\n", argv[0],
+         argv[0]);
       return EXIT_FAILURE;
 	}
 
-   // Define 2 dimensional char array to store job strings
-   char jobs[MAX_ROWS][MAX_ROW_BYTES + 1];
+   if (opts.session)
+   {
+      // Every file is a batch of the same connection
+      int sock_desc;
+
+      if (((sock_desc = setupsocket()) == -1) || (sessionjobs(sock_desc,
+         argv + optind, argc - optind) == EXIT_FAILURE))
+      {
+         return EXIT_FAILURE;
+      }
+
+      return EXIT_SUCCESS;
+   }
+
+   if (opts.wide)
+   {
+      // Send every job as bit vectors in one batch
+      unsigned char * payload;
+      size_t payload_len;
+      int num_jobs;
+      int sock_desc;
+
+      if ((num_jobs = readwidejobs(argv[optind], &payload, &payload_len))
+         == -1)
+      {
+         return EXIT_FAILURE;
+      }
+
+      if ((sock_desc = setupsocket()) == -1)
+      {
+         free(payload);
+         return EXIT_FAILURE;
+      }
+
+      if (proto_sendall(sock_desc, payload, payload_len) == EXIT_FAILURE)
+      {
+         fprintf(stderr, "ERROR: Failed to send jobs.\n");
+         free(payload);
+         close(sock_desc);
+         return EXIT_FAILURE;
+      }
+      free(payload);
+
+      // Print message indicating client send jobs
+      fprintf(stdout, "The client has successfully finished sending %d jobs"
+         " to the edge server.\n", num_jobs);
+
+      int status = recvwideresults(sock_desc, num_jobs);
+
+      close(sock_desc);
+
+      return status;
+   }
+
+   if (opts.window != 0)
+   {
+      // Stream the file without holding it in memory
+      int sock_desc;
+
+      if (((sock_desc = setupsocket()) == -1) ||
+         (streamjobs(sock_desc, argv[optind]) == EXIT_FAILURE))
+      {
+         return EXIT_FAILURE;
+      }
+
+      return EXIT_SUCCESS;
+   }
+
+   // Define 2 dimensional array to store encoded jobs
+   jobsarr jobs;
    jobsarr * jobs_ptr = &jobs;
 
-   // Read input file and store job strings
+   // Read input file and store encoded jobs
    int num_jobs;
-   if ((num_jobs = readjobs(argv[1], jobs_ptr)) == -1)
+   if ((num_jobs = readjobs(argv[optind], jobs_ptr)) == -1)
    {
       return EXIT_FAILURE;
    }
@@ -126,41 +356,45 @@ int main(int argc, char * argv[])
 
 int readjobs(char * filename, jobsarr * jobs_ptr)
 {
-   // Open input file
-   FILE * file_ptr;
+   // Map input file
+   struct jobfile file;
 
-   if ((file_ptr = fopen(filename, "r")) == NULL)
+   if (jobfile_open(&file, filename) == EXIT_FAILURE)
    {
-      fprintf(stderr, "ERROR: Unable to open %s\n", filename);
       return -1;
    }
    
-   // Read jobs from input file and store
+   // Scan jobs in place and store them encoded
    int i = 0;
+   struct job_view view;
+   int status;
    
-   while (fgets((*jobs_ptr)[i], MAX_ROW_BYTES + 1, file_ptr) != NULL)
+   while ((status = jobfile_next(&file, &view)) == 1)
    {
-      (*jobs_ptr)[i][strlen((*jobs_ptr)[i]) - 1] = '\0'; // remove '\n'
-         //character from end of string 
-      
-      if (strlen((*jobs_ptr)[i]) != 0)
+      if (i == MAX_ROWS)
       {
-         for(int j = 0; j < strlen((*jobs_ptr)[i]); j++) // replace commas with
-            //spaces
-         {
-            if ((*jobs_ptr)[i][j] == ',')
-            {
-               (*jobs_ptr)[i][j] = ' ';
-            }
-         }
-         i++;
+         fprintf(stderr, "ERROR: %s has more than %d jobs, use -w to stream"
+            " it.\n", filename, MAX_ROWS);
+         jobfile_close(&file);
+         return -1;
       }
+
+      if ((packjob(&view, (*jobs_ptr)[i]) == EXIT_FAILURE) || (opts.ascii &&
+         (((*jobs_ptr)[i][1] > ASCII_MAX_DIGITS) ||
+         ((*jobs_ptr)[i][2] > ASCII_MAX_DIGITS))))
+      {
+         fprintf(stderr, "ERROR: Invalid job on line %lld of %s.\n",
+            file.line, filename);
+         status = -1;
+         break;
+      }
+      i++;
    }
    int num_jobs = i;
 
-   fclose(file_ptr);
+   jobfile_close(&file);
 
-   return num_jobs;
+   return (status == -1) ? -1 : num_jobs;
 }
 
 int setupsocket()
@@ -199,15 +433,47 @@ int setupsocket()
 
 int sendjobs(int sock_desc, jobsarr * jobs_ptr, int num_jobs)
 {
-   char payload[SEND_BYTES + 1];
+   if (opts.ascii)
+   {
+      char payload[SEND_BYTES + 1];
+
+      for (int j = 0; j < num_jobs; j++)
+      {
+         // Rebuild the job string, widths keep any leading zeros
+         const unsigned char * record = (*jobs_ptr)[j];
+         char job[MAX_ROW_BYTES + 1];
+         char operand1[PROTO_MAX_WIDTH + 1];
+         char operand2[PROTO_MAX_WIDTH + 1];
+
+         proto_wordtostr(proto_getle32(record + 4), record[1], operand1);
+         proto_wordtostr(proto_getle32(record + 8), record[2], operand2);
+         snprintf(job, sizeof(job), "%.3s %.10s %.10s", proto_opname(record[0]),
+            operand1, operand2);
+         sprintf(payload, "%25s %3d", job, num_jobs);
 
-   for (int j = 0; j < num_jobs; j++)
+         if (send(sock_desc, payload, strlen(payload), 0) != SEND_BYTES)
+         {
+            fprintf(stderr, "ERROR: Failed to send job.\n");
+            close(sock_desc);
+            return EXIT_FAILURE;
+         }
+      }
+   }
+   else
    {
-      sprintf(payload, "%25s %3d", (*jobs_ptr)[j], num_jobs);
+      // Encode the whole batch so it can be sent with a single call
+      unsigned char payload[PROTO_HEADER_BYTES +
+         MAX_ROWS * PROTO_CLIENT_JOB_BYTES];
+
+      proto_packheader(payload, PROTO_OP_JOBS, opts.unordered ?
+         PROTO_FLAG_UNORDERED : 0, (uint32_t) num_jobs);
+      memcpy(payload + PROTO_HEADER_BYTES, *jobs_ptr,
+         (size_t) num_jobs * PROTO_CLIENT_JOB_BYTES);
 
-      if (send(sock_desc, payload, strlen(payload), 0) != SEND_BYTES)
+      if (proto_sendall(sock_desc, payload, PROTO_HEADER_BYTES +
+         num_jobs * PROTO_CLIENT_JOB_BYTES) == EXIT_FAILURE)
       {
-         fprintf(stderr, "ERROR: Failed to send job.\n");
+         fprintf(stderr, "ERROR: Failed to send jobs.\n");
          close(sock_desc);
          return EXIT_FAILURE;
       }
@@ -222,26 +488,109 @@ int sendjobs(int sock_desc, jobsarr * jobs_ptr, int num_jobs)
 
 int recvresults(int sock_desc, int num_jobs)
 {
-   char results[num_jobs][RECV_BYTES + 1];
+   char results[num_jobs][PROTO_MAX_WIDTH + 1];
 
-   for (int i = 0; i < num_jobs; i++)
-   {   
-      char buffer[RECV_BYTES + 1];  
+   if (opts.ascii)
+   {
+      for (int i = 0; i < num_jobs; i++)
+      {
+         char buffer[RECV_BYTES + 1];
+
+         if (recv(sock_desc, &buffer, RECV_BYTES, 0) != RECV_BYTES)
+         {
+            fprintf(stderr, "ERROR: Failed to receive result.\n");
+            close(sock_desc);
+            return EXIT_FAILURE;
+         }
+	      buffer[RECV_BYTES] = '\0'; // append null character to buffer
+
+         if (sscanf(buffer, "%s", results[i]) != 1)
+         {
+            fprintf(stderr, "ERROR: Failed to read result\n.");
+            close(sock_desc);
+            return EXIT_FAILURE;
+         }
+      }
+   }
+   else
+   {
+      unsigned char header_buf[PROTO_HEADER_BYTES];
+      struct proto_header header;
 
-      if (recv(sock_desc, &buffer, RECV_BYTES, 0) != RECV_BYTES)
+      if ((proto_recvall(sock_desc, header_buf, PROTO_HEADER_BYTES)
+         == EXIT_FAILURE) || (proto_unpackheader(header_buf, &header)
+         == EXIT_FAILURE))
       {
-         fprintf(stderr, "ERROR: Failed to receive result.\n");
+         fprintf(stderr, "ERROR: Failed to receive results header.\n");
          close(sock_desc);
          return EXIT_FAILURE;
       }
-	   buffer[RECV_BYTES] = '\0'; // append null character to buffer
 
-      if (sscanf(buffer, "%s", results[i]) != 1)
+      bool indexed = (header.opcode == PROTO_OP_INDEXED_RESULTS);
+
+      if ((!indexed && (header.opcode != PROTO_OP_RESULTS)) ||
+         (header.job_count != (uint32_t) num_jobs))
       {
-         fprintf(stderr, "ERROR: Failed to read result\n.");
+         fprintf(stderr, "ERROR: Unexpected results header.\n");
          close(sock_desc);
          return EXIT_FAILURE;
       }
+
+      // Decode results as the edge server streams them
+      size_t record_bytes = indexed ? PROTO_INDEXED_RESULT_BYTES :
+         PROTO_CLIENT_RESULT_BYTES;
+      unsigned char buffer[RESULT_CHUNK_BYTES];
+      size_t buffered = 0;
+      int num_received = 0;
+
+      while (num_received < num_jobs)
+      {
+         ssize_t received = recv(sock_desc, buffer + buffered,
+            sizeof(buffer) - buffered, 0);
+
+         if (received <= 0)
+         {
+            if ((received == -1) && (errno == EINTR))
+            {
+               continue;
+            }
+            fprintf(stderr, "ERROR: Failed to receive result.\n");
+            close(sock_desc);
+            return EXIT_FAILURE;
+         }
+         buffered += (size_t) received;
+
+         size_t used = 0;
+
+         for (; (buffered - used >= record_bytes) && (num_received < num_jobs);
+            used += record_bytes)
+         {
+            int i = num_received;
+            uint32_t result = proto_getle32(buffer + used);
+
+            if (indexed)
+            {
+               uint32_t index = result;
+
+               result = proto_getle32(buffer + used + 4);
+
+               if (index >= (uint32_t) num_jobs)
+               {
+                  fprintf(stderr, "ERROR: Invalid job index in result.\n");
+                  close(sock_desc);
+                  return EXIT_FAILURE;
+               }
+               i = (int) index;
+            }
+
+            proto_wordtostr(result, 0, results[i]);
+            num_received++;
+         }
+
+         // Keep a partial record for the next receive
+         memmove(buffer, buffer + used, buffered - used);
+         buffered -= used;
+      }
    }
 
    // Print message indicating all results are received
@@ -257,3 +606,702 @@ int recvresults(int sock_desc, int num_jobs)
    return EXIT_SUCCESS;
 }
 
+int packjob(const struct job_view * view_ptr, unsigned char * record)
+{
+   uint32_t word1;
+   uint32_t word2;
+   int opcode;
+   int width1;
+   int width2;
+
+   if (((opcode = proto_opcode(view_ptr->operator, view_ptr->operator_len))
+      == -1) || ((width1 = proto_strtoword(view_ptr->operand1,
+      view_ptr->operand1_len, &word1)) == -1) ||
+      ((width2 = proto_strtoword(view_ptr->operand2, view_ptr->operand2_len,
+      &word2)) == -1))
+   {
+      return EXIT_FAILURE;
+   }
+
+   record[0] = (unsigned char) opcode;
+   record[1] = (unsigned char) width1;
+   record[2] = (unsigned char) width2;
+   record[3] = 0;
+   proto_putle32(record + 4, word1);
+   proto_putle32(record + 8, word2);
+
+   return EXIT_SUCCESS;
+}
+
+int streamjobs(int sock_desc, char * filename)
+{
+   // Map input file
+   struct jobfile file;
+
+   if (jobfile_open(&file, filename) == EXIT_FAILURE)
+   {
+      close(sock_desc);
+      return EXIT_FAILURE;
+   }
+
+   // Several batches fit in the window so the edge server always has work
+   int batch_jobs = opts.window / STREAM_BATCHES;
+
+   if (batch_jobs < 1)
+   {
+      batch_jobs = 1;
+   }
+   else if (batch_jobs > MAX_STREAM_BATCH_JOBS)
+   {
+      batch_jobs = MAX_STREAM_BATCH_JOBS;
+   }
+
+   unsigned char * payload = malloc(PROTO_HEADER_BYTES +
+      (size_t) batch_jobs * PROTO_CLIENT_JOB_BYTES);
+   unsigned char buffer[RESULT_CHUNK_BYTES];
+
+   if (payload == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+      jobfile_close(&file);
+      close(sock_desc);
+      return EXIT_FAILURE;
+   }
+
+   fprintf(stdout, "The client is streaming jobs to the edge server with up to"
+      " %d jobs in flight.\nThe computation results are:\n", opts.window);
+
+   size_t payload_len = 0; // number of bytes in the batch being sent
+   size_t payload_sent = 0; // number of bytes of the batch sent so far
+   size_t buffered = 0; // number of result bytes not yet decoded
+   uint32_t results_left = 0; // records left in the current results message
+   bool end_of_file = false;
+   long long num_sent = 0; // number of jobs sent or being sent
+   long long num_received = 0; // number of results received
+   int status = EXIT_SUCCESS;
+
+   while (!end_of_file || (num_received < num_sent))
+   {
+      // Encode the next batch once the last one is out and the window has room
+      if ((payload_sent == payload_len) && !end_of_file &&
+         (num_sent - num_received + batch_jobs <= opts.window))
+      {
+         int num_jobs = fillbatch(&file, batch_jobs, payload);
+
+         if (num_jobs == -1)
+         {
+            status = EXIT_FAILURE;
+            break;
+         }
+         else if (num_jobs == 0)
+         {
+            // Tell the edge server no more batches are coming
+            end_of_file = true;
+            shutdown(sock_desc, SHUT_WR);
+            continue;
+         }
+
+         payload_len = PROTO_HEADER_BYTES +
+            (size_t) num_jobs * PROTO_CLIENT_JOB_BYTES;
+         payload_sent = 0;
+         num_sent += num_jobs;
+      }
+
+      // Wait until jobs can be sent or results can be received
+      struct pollfd poll_fd;
+
+      poll_fd.fd = sock_desc;
+      poll_fd.events = (num_received < num_sent) ? POLLIN : 0;
+      if (payload_sent < payload_len)
+      {
+         poll_fd.events |= POLLOUT;
+      }
+
+      if (poll(&poll_fd, 1, -1) == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         fprintf(stderr, "ERROR: Failed to wait for the edge server.\n");
+         status = EXIT_FAILURE;
+         break;
+      }
+
+      if (poll_fd.revents & POLLOUT)
+      {
+         ssize_t sent = send(sock_desc, payload + payload_sent,
+            payload_len - payload_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+         if (sent == -1)
+         {
+            if ((errno != EINTR) && (errno != EAGAIN) &&
+               (errno != EWOULDBLOCK))
+            {
+               fprintf(stderr, "ERROR: Failed to send jobs.\n");
+               status = EXIT_FAILURE;
+               break;
+            }
+         }
+         else
+         {
+            payload_sent += (size_t) sent;
+         }
+      }
+
+      if (!(poll_fd.revents & (POLLIN | POLLHUP | POLLERR)))
+      {
+         continue;
+      }
+
+      ssize_t received = recv(sock_desc, buffer + buffered,
+         sizeof(buffer) - buffered, MSG_DONTWAIT);
+
+      if (received <= 0)
+      {
+         if ((received == -1) && ((errno == EINTR) || (errno == EAGAIN) ||
+            (errno == EWOULDBLOCK)))
+         {
+            continue;
+         }
+         fprintf(stderr, "ERROR: Failed to receive result.\n");
+         status = EXIT_FAILURE;
+         break;
+      }
+      buffered += (size_t) received;
+
+      // Decode every complete results header and result record
+      size_t used = 0;
+
+      while (status == EXIT_SUCCESS)
+      {
+         if (results_left == 0)
+         {
+            // Every results message starts with its own header
+            struct proto_header header;
+
+            if (buffered - used < PROTO_HEADER_BYTES)
+            {
+               break;
+            }
+
+            if ((proto_unpackheader(buffer + used, &header) == EXIT_FAILURE)
+               || (header.opcode != PROTO_OP_RESULTS) ||
+               (header.job_count == 0) ||
+               (header.job_count > num_sent - num_received))
+            {
+               fprintf(stderr, "ERROR: Unexpected results header.\n");
+               status = EXIT_FAILURE;
+               break;
+            }
+
+            used += PROTO_HEADER_BYTES;
+            results_left = header.job_count;
+            continue;
+         }
+
+         if (buffered - used < PROTO_CLIENT_RESULT_BYTES)
+         {
+            break;
+         }
+
+         char result[PROTO_MAX_WIDTH + 1];
+
+         proto_wordtostr(proto_getle32(buffer + used), 0, result);
+         fprintf(stdout, "%s\n", result);
+         used += PROTO_CLIENT_RESULT_BYTES;
+         results_left--;
+         num_received++;
+      }
+
+      if (status == EXIT_FAILURE)
+      {
+         break;
+      }
+
+      // Keep a partial header or record for the next receive
+      memmove(buffer, buffer + used, buffered - used);
+      buffered -= used;
+   }
+
+   free(payload);
+   jobfile_close(&file);
+   close(sock_desc);
+
+   if (status == EXIT_SUCCESS)
+   {
+      // Print message indicating all jobs are sent and all results received
+      fprintf(stdout, "The client has successfully finished sending %lld jobs"
+         " to and receiving all computation results from the edge server.\n",
+         num_sent);
+   }
+
+   return status;
+}
+
+int sessionjobs(int sock_desc, char * filenames[], int num_files)
+{
+   size_t header_len = proto_headerbytes(PROTO_OP_JOBS, PROTO_FLAG_SESSION);
+   struct file_batch * batches = calloc((size_t) num_files,
+      sizeof(struct file_batch));
+   unsigned char * payload = malloc((size_t) num_files * (header_len +
+      MAX_ROWS * PROTO_CLIENT_JOB_BYTES));
+   size_t payload_len = 0;
+
+   if ((batches == NULL) || (payload == NULL))
+   {
+      fprintf(stderr, "ERROR: Failed to allocate batches.\n");
+      free(batches);
+      free(payload);
+      close(sock_desc);
+      return EXIT_FAILURE;
+   }
+
+   // Encode every file as a batch whose header ends with its request ID
+   for (int f = 0; f < num_files; f++)
+   {
+      jobsarr jobs;
+      int num_jobs;
+
+      if ((num_jobs = readjobs(filenames[f], &jobs)) == -1)
+      {
+         free(batches);
+         free(payload);
+         close(sock_desc);
+         return EXIT_FAILURE;
+      }
+
+      if (num_jobs == 0)
+      {
+         fprintf(stderr, "ERROR: %s has no jobs.\n", filenames[f]);
+         free(batches);
+         free(payload);
+         close(sock_desc);
+         return EXIT_FAILURE;
+      }
+
+      batches[f].filename = filenames[f];
+      batches[f].num_jobs = num_jobs;
+      proto_packheader(payload + payload_len, PROTO_OP_JOBS,
+         PROTO_FLAG_SESSION | (opts.unordered ? PROTO_FLAG_UNORDERED : 0),
+         (uint32_t) num_jobs);
+      proto_putle64(payload + payload_len + PROTO_HEADER_BYTES,
+         (uint64_t) f + 1);
+      memcpy(payload + payload_len + header_len, jobs,
+         (size_t) num_jobs * PROTO_CLIENT_JOB_BYTES);
+      payload_len += header_len + (size_t) num_jobs * PROTO_CLIENT_JOB_BYTES;
+   }
+
+   unsigned char buffer[RESULT_CHUNK_BYTES];
+   size_t payload_sent = 0; // number of bytes of the batches sent so far
+   size_t buffered = 0; // number of result bytes not yet decoded
+   struct file_batch * current = NULL; // batch of the results message being
+      //decoded, NULL between messages
+   bool indexed = false; // the current results message holds indexed results
+   int num_done = 0; // number of batches whose results all arrived
+   int status = EXIT_SUCCESS;
+
+   while (num_done < num_files)
+   {
+      // Send batches while reading results so neither side's buffers fill up
+      struct pollfd poll_fd;
+
+      poll_fd.fd = sock_desc;
+      poll_fd.events = POLLIN;
+      if (payload_sent < payload_len)
+      {
+         poll_fd.events |= POLLOUT;
+      }
+
+      if (poll(&poll_fd, 1, -1) == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         fprintf(stderr, "ERROR: Failed to wait for the edge server.\n");
+         status = EXIT_FAILURE;
+         break;
+      }
+
+      if (poll_fd.revents & POLLOUT)
+      {
+         ssize_t sent = send(sock_desc, payload + payload_sent,
+            payload_len - payload_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+         if (sent == -1)
+         {
+            if ((errno != EINTR) && (errno != EAGAIN) &&
+               (errno != EWOULDBLOCK))
+            {
+               fprintf(stderr, "ERROR: Failed to send jobs.\n");
+               status = EXIT_FAILURE;
+               break;
+            }
+         }
+         else if ((payload_sent += (size_t) sent) == payload_len)
+         {
+            // Print message indicating client sent jobs
+            fprintf(stdout, "The client has successfully finished sending %d"
+               " batch%s to the edge server over one keep-alive session.\n",
+               num_files, (num_files == 1) ? "" : "es");
+         }
+      }
+
+      if (!(poll_fd.revents & (POLLIN | POLLHUP | POLLERR)))
+      {
+         continue;
+      }
+
+      ssize_t received = recv(sock_desc, buffer + buffered,
+         sizeof(buffer) - buffered, MSG_DONTWAIT);
+
+      if (received <= 0)
+      {
+         if ((received == -1) && ((errno == EINTR) || (errno == EAGAIN) ||
+            (errno == EWOULDBLOCK)))
+         {
+            continue;
+         }
+         fprintf(stderr, "ERROR: Failed to receive result.\n");
+         status = EXIT_FAILURE;
+         break;
+      }
+      buffered += (size_t) received;
+
+      // Decode every complete results header and result record
+      size_t used = 0;
+
+      while (status == EXIT_SUCCESS)
+      {
+         if (current == NULL)
+         {
+            // Results messages name their batch by its request ID
+            struct proto_header header;
+            uint64_t request_id;
+
+            if (buffered - used < header_len)
+            {
+               break;
+            }
+
+            if ((proto_unpackheader(buffer + used, &header) == EXIT_FAILURE)
+               || ((header.opcode != PROTO_OP_RESULTS) &&
+               (header.opcode != PROTO_OP_INDEXED_RESULTS)) ||
+               ((header.flags & PROTO_FLAG_SESSION) == 0) ||
+               ((request_id = proto_getle64(buffer + used +
+               PROTO_HEADER_BYTES)) < 1) || (request_id > (uint64_t) num_files)
+               || (batches[request_id - 1].num_received != 0) ||
+               (header.job_count != (uint32_t) batches[request_id -
+               1].num_jobs))
+            {
+               fprintf(stderr, "ERROR: Unexpected results header.\n");
+               status = EXIT_FAILURE;
+               break;
+            }
+
+            used += header_len;
+            current = &batches[request_id - 1];
+            indexed = (header.opcode == PROTO_OP_INDEXED_RESULTS);
+            continue;
+         }
+
+         size_t record_bytes = indexed ? PROTO_INDEXED_RESULT_BYTES :
+            PROTO_CLIENT_RESULT_BYTES;
+         int i = current->num_received;
+
+         if (buffered - used < record_bytes)
+         {
+            break;
+         }
+
+         if (indexed)
+         {
+            uint32_t index = proto_getle32(buffer + used);
+
+            if (index >= (uint32_t) current->num_jobs)
+            {
+               fprintf(stderr, "ERROR: Invalid job index in result.\n");
+               status = EXIT_FAILURE;
+               break;
+            }
+            i = (int) index;
+         }
+
+         proto_wordtostr(proto_getle32(buffer + used + record_bytes -
+            PROTO_CLIENT_RESULT_BYTES), 0, current->results[i]);
+         used += record_bytes;
+
+         if (++current->num_received < current->num_jobs)
+         {
+            continue;
+         }
+
+         fprintf(stdout, "The client has received the computation results of"
+            " %s (request ID %d):\n", current->filename,
+            (int) (current - batches) + 1);
+         for (int j = 0; j < current->num_jobs; j++)
+         {
+            fprintf(stdout, "%s\n", current->results[j]);
+         }
+         current = NULL;
+         num_done++;
+      }
+
+      if (status == EXIT_FAILURE)
+      {
+         break;
+      }
+
+      // Keep a partial header or record for the next receive
+      memmove(buffer, buffer + used, buffered - used);
+      buffered -= used;
+   }
+
+   free(batches);
+   free(payload);
+   close(sock_desc);
+
+   if (status == EXIT_SUCCESS)
+   {
+      // Print message indicating all results are received
+      fprintf(stdout, "The client has successfully finished receiving the"
+         " computation results of %s%d batch%s from the edge server.\n",
+         (num_files == 1) ? "" : "all ", num_files,
+         (num_files == 1) ? "" : "es");
+   }
+
+   return status;
+}
+
+int fillbatch(struct jobfile * file_ptr, int max_jobs,
+   unsigned char * payload)
+{
+   struct job_view view;
+   int num_jobs = 0;
+   int status = 0;
+
+   while ((num_jobs < max_jobs) &&
+      ((status = jobfile_next(file_ptr, &view)) == 1))
+   {
+      if (packjob(&view, payload + PROTO_HEADER_BYTES +
+         num_jobs * PROTO_CLIENT_JOB_BYTES) == EXIT_FAILURE)
+      {
+         fprintf(stderr, "ERROR: Invalid job on line %lld of %s.\n",
+            file_ptr->line, file_ptr->filename);
+         return -1;
+      }
+      num_jobs++;
+   }
+
+   if (status == -1)
+   {
+      return -1;
+   }
+
+   if (num_jobs != 0)
+   {
+      proto_packheader(payload, PROTO_OP_JOBS, 0, (uint32_t) num_jobs);
+   }
+
+   return num_jobs;
+}
+
+int readwidejobs(char * filename, unsigned char ** payload_ptr,
+   size_t * len_ptr)
+{
+   // Map input file
+   struct jobfile file;
+
+   if (jobfile_open(&file, filename) == EXIT_FAILURE)
+   {
+      return -1;
+   }
+
+   // The message grows as jobs are encoded, operands are not limited in size
+   size_t cap = WIDE_INITIAL_BYTES;
+   size_t len = PROTO_WIDE_HEADER_BYTES;
+   unsigned char * payload = malloc(cap);
+   int num_jobs = 0;
+   struct job_view view;
+   int status = 0;
+
+   while ((payload != NULL) && ((status = jobfile_next(&file, &view)) == 1))
+   {
+      size_t record_bytes = PROTO_WIDE_JOB_BYTES +
+         (bitvec_words(view.operand1_len) + bitvec_words(view.operand2_len)) *
+         BITVEC_WORD_BYTES;
+
+      if (len + record_bytes > cap)
+      {
+         unsigned char * grown;
+
+         cap = (2 * cap > len + record_bytes) ? 2 * cap : len + record_bytes;
+
+         if ((grown = realloc(payload, cap)) == NULL)
+         {
+            free(payload);
+            payload = NULL;
+            break;
+         }
+         payload = grown;
+      }
+
+      if (packwidejob(&view, payload + len) == EXIT_FAILURE)
+      {
+         fprintf(stderr, "ERROR: Invalid job on line %lld of %s.\n",
+            file.line, filename);
+         status = -1;
+         break;
+      }
+      len += record_bytes;
+      num_jobs++;
+   }
+
+   jobfile_close(&file);
+
+   if (payload == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+      return -1;
+   }
+
+   if ((status != -1) && ((num_jobs == 0) ||
+      (len - PROTO_WIDE_HEADER_BYTES > PROTO_MAX_WIDE_BYTES)))
+   {
+      fprintf(stderr, "ERROR: %s must hold between 1 job and %u bytes of"
+         " operands.\n", filename, PROTO_MAX_WIDE_BYTES);
+      status = -1;
+   }
+
+   if (status == -1)
+   {
+      free(payload);
+      return -1;
+   }
+
+   proto_packheader(payload, PROTO_OP_WIDE_JOBS, 0, (uint32_t) num_jobs);
+   proto_putle64(payload + PROTO_HEADER_BYTES,
+      (uint64_t) (len - PROTO_WIDE_HEADER_BYTES));
+   *payload_ptr = payload;
+   *len_ptr = len;
+
+   return num_jobs;
+}
+
+int packwidejob(const struct job_view * view_ptr, unsigned char * record)
+{
+   int opcode = proto_opcode(view_ptr->operator, view_ptr->operator_len);
+   unsigned char * words1 = record + PROTO_WIDE_JOB_BYTES;
+   unsigned char * words2 = words1 + bitvec_words(view_ptr->operand1_len) *
+      BITVEC_WORD_BYTES;
+
+   if ((opcode == -1) || (view_ptr->operand1_len == 0) ||
+      (view_ptr->operand2_len == 0) || (view_ptr->operand1_len > UINT32_MAX) ||
+      (view_ptr->operand2_len > UINT32_MAX) ||
+      (bitvec_fromstr(view_ptr->operand1, view_ptr->operand1_len, words1)
+      == EXIT_FAILURE) || (bitvec_fromstr(view_ptr->operand2,
+      view_ptr->operand2_len, words2) == EXIT_FAILURE))
+   {
+      return EXIT_FAILURE;
+   }
+
+   record[0] = (unsigned char) opcode;
+   record[1] = 0;
+   proto_putle16(record + 2, 0);
+   proto_putle32(record + 4, (uint32_t) view_ptr->operand1_len);
+   proto_putle32(record + 8, (uint32_t) view_ptr->operand2_len);
+
+   return EXIT_SUCCESS;
+}
+
+int recvwideresults(int sock_desc, int num_jobs)
+{
+   unsigned char header_buf[PROTO_HEADER_BYTES];
+   struct proto_header header;
+
+   if ((proto_recvall(sock_desc, header_buf, PROTO_HEADER_BYTES)
+      == EXIT_FAILURE) || (proto_unpackheader(header_buf, &header)
+      == EXIT_FAILURE) || (header.opcode != PROTO_OP_WIDE_RESULTS) ||
+      (header.job_count != (uint32_t) num_jobs))
+   {
+      fprintf(stderr, "ERROR: Failed to receive results header.\n");
+      return EXIT_FAILURE;
+   }
+
+   fprintf(stdout, "The computation results are:\n");
+
+   // Buffers grow to the largest result
+   unsigned char * words = NULL;
+   char * digits = NULL;
+   size_t words_cap = 0;
+   size_t digits_cap = 0;
+   int status = EXIT_SUCCESS;
+
+   for (int i = 0; (i < num_jobs) && (status == EXIT_SUCCESS); i++)
+   {
+      unsigned char record[PROTO_WIDE_RESULT_BYTES];
+
+      if (proto_recvall(sock_desc, record, PROTO_WIDE_RESULT_BYTES)
+         == EXIT_FAILURE)
+      {
+         fprintf(stderr, "ERROR: Failed to receive result.\n");
+         status = EXIT_FAILURE;
+         break;
+      }
+
+      uint64_t sig_bits = proto_getle32(record);
+      size_t num_words = proto_getle32(record + 4);
+
+      if ((num_words == 0) || (sig_bits > (uint64_t) num_words * 64))
+      {
+         fprintf(stderr, "ERROR: Invalid result.\n");
+         status = EXIT_FAILURE;
+         break;
+      }
+
+      if (num_words * BITVEC_WORD_BYTES > words_cap)
+      {
+         free(words);
+         words_cap = num_words * BITVEC_WORD_BYTES;
+         words = malloc(words_cap);
+      }
+
+      if (sig_bits + 2 > digits_cap)
+      {
+         free(digits);
+         digits_cap = (size_t) sig_bits + 2;
+         digits = malloc(digits_cap);
+      }
+
+      if ((words == NULL) || (digits == NULL))
+      {
+         fprintf(stderr, "ERROR: Failed to allocate results.\n");
+         status = EXIT_FAILURE;
+         break;
+      }
+
+      if (proto_recvall(sock_desc, words, num_words * BITVEC_WORD_BYTES)
+         == EXIT_FAILURE)
+      {
+         fprintf(stderr, "ERROR: Failed to receive result.\n");
+         status = EXIT_FAILURE;
+         break;
+      }
+
+      bitvec_tostr(words, sig_bits, digits);
+      fprintf(stdout, "%s\n", digits);
+   }
+
+   free(words);
+   free(digits);
+
+   if (status == EXIT_SUCCESS)
+   {
+      // Print message indicating all results are received
+      fprintf(stdout, "The client has successfully finished receiving all"
+         " computation results from the edge server.\n");
+   }
+
+   return status;
+}
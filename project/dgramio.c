@@ -0,0 +1,742 @@
+/**
+ * dgramio.c
+ *
+ * Batched datagram I/O built on sendmmsg()/recvmmsg() with optional
+ * UDP_SEGMENT/UDP_GRO offload and io_uring receives. See dgramio.h.
+ */
+
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "dgramio.h"
+#include "logger.h"
+
+#define DGRAM_MAX_GSO_BYTES 65507 // largest payload of one GSO send
+#define DGRAM_RING_ENTRIES 32 // submission entries of a receive ring, whose
+   //completion ring holds a completion for every provided buffer
+#define DGRAM_RING_GROUP 0 // buffer group of a receive ring
+
+__thread struct dgram_counters dgram_counters;
+
+/**
+ * sameaddr compares two IPv4 socket addresses.
+ * @param a_ptr pointer to first socket address
+ * @param b_ptr pointer to second socket address
+ * @return bool true if address and port match
+ */
+static bool sameaddr(const struct sockaddr_in * a_ptr,
+   const struct sockaddr_in * b_ptr)
+{
+   return (a_ptr->sin_addr.s_addr == b_ptr->sin_addr.s_addr) &&
+      (a_ptr->sin_port == b_ptr->sin_port);
+}
+
+/**
+ * retrysend decides whether a failed send should be retried, waiting for
+ * room in the send buffer when the socket is nonblocking.
+ * @param sock_desc int datagram socket descriptor
+ * @return bool true if the send should be retried
+ */
+static bool retrysend(int sock_desc)
+{
+   if (errno == EINTR)
+   {
+      return true;
+   }
+
+   if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+   {
+      struct pollfd pfd = {sock_desc, POLLOUT, 0};
+
+      while ((poll(&pfd, 1, -1) == -1) && (errno == EINTR));
+      return true;
+   }
+
+   return false;
+}
+
+/**
+ * sendsegments sends a run of queued datagrams to one address with a single
+ * UDP_SEGMENT sendmsg() call.
+ * @param sock_desc int datagram socket descriptor
+ * @param tx_ptr pointer to struct dgram_tx
+ * @param first int index of the first queued datagram in the run
+ * @param count int number of datagrams in the run
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int sendsegments(int sock_desc, struct dgram_tx * tx_ptr, int first,
+   int count)
+{
+#ifdef UDP_SEGMENT
+   struct iovec iovs[DGRAM_MAX_SEGMENTS];
+   char ctrl[CMSG_SPACE(sizeof(uint16_t))];
+   struct msghdr msg;
+
+   for (int i = 0; i < count; i++)
+   {
+      iovs[i].iov_base = tx_ptr->bufs + (first + i) * DGRAM_BUF_BYTES;
+      iovs[i].iov_len = tx_ptr->lens[first + i];
+   }
+
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_name = &tx_ptr->addrs[first];
+   msg.msg_namelen = sizeof(tx_ptr->addrs[first]);
+   msg.msg_iov = iovs;
+   msg.msg_iovlen = count;
+
+   // Every datagram but the last must be exactly the segment size
+   if (count > 1)
+   {
+      struct cmsghdr * cmsg;
+      uint16_t seg_bytes = (uint16_t) tx_ptr->lens[first];
+
+      memset(ctrl, 0, sizeof(ctrl));
+      msg.msg_control = ctrl;
+      msg.msg_controllen = sizeof(ctrl);
+      cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(seg_bytes));
+      memcpy(CMSG_DATA(cmsg), &seg_bytes, sizeof(seg_bytes));
+   }
+
+   while (sendmsg(sock_desc, &msg, 0) == -1)
+   {
+      if (!retrysend(sock_desc))
+      {
+         return EXIT_FAILURE;
+      }
+   }
+   dgram_counters.send_calls++;
+   dgram_counters.datagrams_sent += count;
+
+   return EXIT_SUCCESS;
+#else
+   (void) sock_desc;
+   (void) tx_ptr;
+   (void) first;
+   (void) count;
+   errno = ENOPROTOOPT;
+   return EXIT_FAILURE;
+#endif
+}
+
+/**
+ * sendbatch sends queued datagrams with as few sendmmsg() calls as possible.
+ * @param sock_desc int datagram socket descriptor
+ * @param tx_ptr pointer to struct dgram_tx
+ * @param first int index of the first queued datagram to send
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int sendbatch(int sock_desc, struct dgram_tx * tx_ptr, int first)
+{
+   struct mmsghdr msgs[DGRAM_BATCH];
+   struct iovec iovs[DGRAM_BATCH];
+   int count = tx_ptr->num_msgs - first;
+
+   memset(msgs, 0, count * sizeof(struct mmsghdr));
+
+   for (int i = 0; i < count; i++)
+   {
+      iovs[i].iov_base = tx_ptr->bufs + (first + i) * DGRAM_BUF_BYTES;
+      iovs[i].iov_len = tx_ptr->lens[first + i];
+      msgs[i].msg_hdr.msg_name = &tx_ptr->addrs[first + i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(tx_ptr->addrs[first + i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   // sendmmsg may stop early, keep going until every datagram is out
+   int sent = 0;
+
+   while (sent < count)
+   {
+      int num_sent = sendmmsg(sock_desc, msgs + sent, count - sent, 0);
+
+      if (num_sent == -1)
+      {
+         if (retrysend(sock_desc))
+         {
+            continue;
+         }
+         return EXIT_FAILURE;
+      }
+      dgram_counters.send_calls++;
+      dgram_counters.datagrams_sent += num_sent;
+      sent += num_sent;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+/**
+ * sendqueue sends every queued datagram, corked or not.
+ * @param sock_desc int datagram socket descriptor
+ * @param tx_ptr pointer to struct dgram_tx
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int sendqueue(int sock_desc, struct dgram_tx * tx_ptr)
+{
+   int first = 0;
+
+   // Send runs of equal sized datagrams to the same address as one GSO send
+   while (tx_ptr->gso && (first < tx_ptr->num_msgs))
+   {
+      size_t seg_bytes = tx_ptr->lens[first];
+      size_t total = seg_bytes;
+      int count = 1;
+
+      while ((first + count < tx_ptr->num_msgs) &&
+         (count < DGRAM_MAX_SEGMENTS) &&
+         (sameaddr(&tx_ptr->addrs[first + count], &tx_ptr->addrs[first])) &&
+         (tx_ptr->lens[first + count] <= seg_bytes) &&
+         (tx_ptr->lens[first + count] > 0) &&
+         (total + tx_ptr->lens[first + count] <= DGRAM_MAX_GSO_BYTES))
+      {
+         total += tx_ptr->lens[first + count];
+         count++;
+
+         // A shorter datagram can only end a run
+         if (tx_ptr->lens[first + count - 1] < seg_bytes)
+         {
+            break;
+         }
+      }
+
+      if (sendsegments(sock_desc, tx_ptr, first, count) == EXIT_FAILURE)
+      {
+         // Fall back to sendmmsg if the route cannot segment
+         if ((errno == EIO) || (errno == EINVAL) || (errno == ENOPROTOOPT))
+         {
+            tx_ptr->gso = false;
+            break;
+         }
+         fprintf(stderr, "ERROR: Failed to send datagrams.\n");
+         tx_ptr->num_msgs = 0;
+         return EXIT_FAILURE;
+      }
+      first += count;
+   }
+
+   if ((first < tx_ptr->num_msgs) &&
+      (sendbatch(sock_desc, tx_ptr, first) == EXIT_FAILURE))
+   {
+      fprintf(stderr, "ERROR: Failed to send datagrams.\n");
+      tx_ptr->num_msgs = 0;
+      return EXIT_FAILURE;
+   }
+
+   tx_ptr->num_msgs = 0;
+
+   return EXIT_SUCCESS;
+}
+
+/**
+ * grosegment reads the GRO segment size from a received message's control
+ * data.
+ * @param msg_ptr pointer to struct msghdr of the received message
+ * @return size_t segment size, 0 if the datagrams were not coalesced
+ */
+static size_t grosegment(struct msghdr * msg_ptr)
+{
+#ifdef UDP_GRO
+   for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(msg_ptr); cmsg != NULL;
+      cmsg = CMSG_NXTHDR(msg_ptr, cmsg))
+   {
+      if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO))
+      {
+         int seg_bytes;
+
+         memcpy(&seg_bytes, CMSG_DATA(cmsg), sizeof(seg_bytes));
+         return (size_t) seg_bytes;
+      }
+   }
+#else
+   (void) msg_ptr;
+#endif
+
+   return 0;
+}
+
+/**
+ * recvbatch receives a batch of datagrams with one recvmmsg() call.
+ * @param sock_desc int datagram socket descriptor
+ * @param rx_ptr pointer to struct dgram_rx
+ * @return int number of datagrams received, -1 if unsuccessful
+ */
+static int recvbatch(int sock_desc, struct dgram_rx * rx_ptr)
+{
+   struct mmsghdr msgs[DGRAM_BATCH];
+   struct iovec iovs[DGRAM_BATCH];
+   char ctrl[DGRAM_BATCH][CMSG_SPACE(sizeof(int))];
+   int num_msgs;
+
+   memset(msgs, 0, sizeof(msgs));
+
+   for (int i = 0; i < DGRAM_BATCH; i++)
+   {
+      rx_ptr->msgs[i] = rx_ptr->bufs + i * DGRAM_BUF_BYTES;
+      iovs[i].iov_base = rx_ptr->msgs[i];
+      iovs[i].iov_len = DGRAM_BUF_BYTES;
+      msgs[i].msg_hdr.msg_name = &rx_ptr->addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(rx_ptr->addrs[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = ctrl[i];
+      msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+   }
+
+   // Block for the first datagram, then take whatever else is queued. A
+      //nonblocking socket with nothing queued fails with EAGAIN instead
+   while ((num_msgs = recvmmsg(sock_desc, msgs, DGRAM_BATCH, MSG_WAITFORONE,
+      NULL)) == -1)
+   {
+      if (errno != EINTR)
+      {
+         return -1;
+      }
+   }
+   dgram_counters.recv_calls++;
+
+   for (int i = 0; i < num_msgs; i++)
+   {
+      rx_ptr->lens[i] = msgs[i].msg_len;
+      rx_ptr->seg_bytes[i] = grosegment(&msgs[i].msg_hdr);
+   }
+
+   return num_msgs;
+}
+
+/**
+ * armring queues a multishot receive on the ring of a dgram_rx.
+ * @param sock_desc int datagram socket descriptor
+ * @param rx_ptr pointer to struct dgram_rx
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int armring(int sock_desc, struct dgram_rx * rx_ptr)
+{
+   struct io_uring_sqe * sqe = uring_getsqe(rx_ptr->ring_ptr,
+      IORING_OP_RECVMSG, sock_desc, 0);
+
+   if (sqe == NULL)
+   {
+      return EXIT_FAILURE;
+   }
+
+   sqe->addr = (uint64_t) (uintptr_t) &rx_ptr->ring_msg;
+   sqe->len = 1;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = DGRAM_RING_GROUP;
+   rx_ptr->armed = true;
+
+   return EXIT_SUCCESS;
+}
+
+/**
+ * recvring takes a batch of datagrams from the completion ring of a dgram_rx,
+ * first handing the buffers of the last batch back to the kernel. It enters
+ * the kernel only when no completion is waiting.
+ * @param sock_desc int datagram socket descriptor
+ * @param rx_ptr pointer to struct dgram_rx
+ * @return int number of datagrams taken, -1 if unsuccessful
+ */
+static int recvring(int sock_desc, struct dgram_rx * rx_ptr)
+{
+   struct msghdr * layout_ptr = &rx_ptr->ring_msg;
+   size_t head_bytes = sizeof(struct io_uring_recvmsg_out) +
+      layout_ptr->msg_namelen + layout_ptr->msg_controllen;
+   int num_msgs = 0;
+   int error = 0;
+
+   for (int i = 0; i < rx_ptr->num_msgs; i++)
+   {
+      uring_bufput(&rx_ptr->ring_bufs, rx_ptr->bids[i]);
+   }
+   rx_ptr->num_msgs = 0;
+   rx_ptr->next_msg = 0;
+
+   while (1)
+   {
+      struct io_uring_cqe * cqe;
+
+      while ((num_msgs < DGRAM_BATCH) &&
+         ((cqe = uring_peek(rx_ptr->ring_ptr)) != NULL))
+      {
+         int res = cqe->res;
+         uint32_t flags = cqe->flags;
+
+         uring_seen(rx_ptr->ring_ptr);
+
+         if (!(flags & IORING_CQE_F_MORE))
+         {
+            rx_ptr->armed = false;
+         }
+
+         // Running out of buffers only ends the receive, it is armed again
+         if (!(flags & IORING_CQE_F_BUFFER))
+         {
+            if ((res < 0) && (res != -ENOBUFS))
+            {
+               error = -res;
+            }
+            continue;
+         }
+
+         uint16_t bid = (uint16_t) (flags >> IORING_CQE_BUFFER_SHIFT);
+         unsigned char * buf = uring_buf(&rx_ptr->ring_bufs, bid);
+         struct io_uring_recvmsg_out out;
+
+         if ((res < 0) || ((size_t) res < head_bytes))
+         {
+            uring_bufput(&rx_ptr->ring_bufs, bid);
+            continue;
+         }
+
+         // The kernel lays out the source address and control data ahead of
+            //the datagram, as asked for by ring_msg
+         struct msghdr msg;
+
+         memcpy(&out, buf, sizeof(out));
+         memset(&msg, 0, sizeof(msg));
+         msg.msg_control = buf + sizeof(out) + layout_ptr->msg_namelen;
+         msg.msg_controllen = out.controllen;
+         memcpy(&rx_ptr->addrs[num_msgs], buf + sizeof(out),
+            sizeof(rx_ptr->addrs[num_msgs]));
+
+         rx_ptr->msgs[num_msgs] = buf + head_bytes;
+         rx_ptr->lens[num_msgs] = (size_t) res - head_bytes;
+         rx_ptr->seg_bytes[num_msgs] = grosegment(&msg);
+         rx_ptr->bids[num_msgs] = bid;
+         num_msgs++;
+      }
+
+      if (num_msgs > 0)
+      {
+         return num_msgs;
+      }
+
+      if (error != 0)
+      {
+         errno = error;
+         return -1;
+      }
+
+      bool arming = !rx_ptr->armed;
+
+      if (arming && (armring(sock_desc, rx_ptr) == EXIT_FAILURE))
+      {
+         return -1;
+      }
+
+      if (rx_ptr->nonblocking && !arming)
+      {
+         errno = EAGAIN;
+         return -1;
+      }
+
+      // Wait for the first datagram, or only hand the receive over when the
+         //socket is nonblocking
+      if (uring_enter(rx_ptr->ring_ptr, rx_ptr->nonblocking ? 0 : 1, -1) ==
+         EXIT_FAILURE)
+      {
+         return -1;
+      }
+      dgram_counters.recv_calls++;
+   }
+}
+
+void dgram_enableoffload(int sock_desc, bool * gso_ptr, bool * gro_ptr)
+{
+   *gso_ptr = false;
+   *gro_ptr = false;
+
+#ifdef UDP_SEGMENT
+   // UDP_SEGMENT is only known to kernels that can segment
+   int seg_bytes;
+   socklen_t seg_len = sizeof(seg_bytes);
+
+   if (getsockopt(sock_desc, SOL_UDP, UDP_SEGMENT, &seg_bytes, &seg_len) == 0)
+   {
+      *gso_ptr = true;
+   }
+#endif
+
+#ifdef UDP_GRO
+   int yes = 1;
+
+   if (setsockopt(sock_desc, SOL_UDP, UDP_GRO, &yes, sizeof(yes)) == 0)
+   {
+      *gro_ptr = true;
+   }
+#endif
+}
+
+int dgram_sockbufbytes(const char * str)
+{
+   char * end;
+   long bytes = strtol(str, &end, 10);
+
+   if ((*end != '\0') || (bytes < 1) || (bytes > DGRAM_MAX_SOCKBUF_BYTES))
+   {
+      fprintf(stderr, "ERROR: Socket buffer size must be between 1 and %d"
+         " bytes.\n", DGRAM_MAX_SOCKBUF_BYTES);
+      return -1;
+   }
+
+   return (int) bytes;
+}
+
+int dgram_setbuffers(int sock_desc, int rcvbuf, int sndbuf, int * rcvbuf_ptr,
+   int * sndbuf_ptr)
+{
+   socklen_t len = sizeof(int);
+
+   if (((rcvbuf != 0) && (setsockopt(sock_desc, SOL_SOCKET, SO_RCVBUF,
+      &rcvbuf, sizeof(rcvbuf)) == -1)) || ((sndbuf != 0) &&
+      (setsockopt(sock_desc, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf))
+      == -1)))
+   {
+      fprintf(stderr, "ERROR: setsockopt for socket buffer size failed.\n");
+      return EXIT_FAILURE;
+   }
+
+   if ((getsockopt(sock_desc, SOL_SOCKET, SO_RCVBUF, rcvbuf_ptr, &len) == -1)
+      || (getsockopt(sock_desc, SOL_SOCKET, SO_SNDBUF, sndbuf_ptr, &len) ==
+      -1))
+   {
+      fprintf(stderr, "ERROR: getsockopt for socket buffer size failed.\n");
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int dgram_txinit(struct dgram_tx * tx_ptr, bool gso)
+{
+   if ((tx_ptr->bufs = malloc(DGRAM_BATCH * DGRAM_BUF_BYTES)) == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate datagram buffers.\n");
+      return EXIT_FAILURE;
+   }
+   tx_ptr->num_msgs = 0;
+   tx_ptr->gso = gso;
+   tx_ptr->corked = false;
+
+   return EXIT_SUCCESS;
+}
+
+void dgram_txfree(struct dgram_tx * tx_ptr)
+{
+   free(tx_ptr->bufs);
+   tx_ptr->bufs = NULL;
+}
+
+unsigned char * dgram_txbuf(struct dgram_tx * tx_ptr)
+{
+   return tx_ptr->bufs + tx_ptr->num_msgs * DGRAM_BUF_BYTES;
+}
+
+int dgram_txpush(int sock_desc, struct dgram_tx * tx_ptr, size_t len,
+   const struct sockaddr_in * addr_ptr)
+{
+   tx_ptr->lens[tx_ptr->num_msgs] = len;
+   tx_ptr->addrs[tx_ptr->num_msgs] = *addr_ptr;
+   tx_ptr->num_msgs++;
+
+   if (tx_ptr->num_msgs == DGRAM_BATCH)
+   {
+      return sendqueue(sock_desc, tx_ptr);
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int dgram_txflush(int sock_desc, struct dgram_tx * tx_ptr)
+{
+   return tx_ptr->corked ? EXIT_SUCCESS : sendqueue(sock_desc, tx_ptr);
+}
+
+void dgram_txcork(struct dgram_tx * tx_ptr)
+{
+   tx_ptr->corked = true;
+}
+
+int dgram_txuncork(int sock_desc, struct dgram_tx * tx_ptr)
+{
+   tx_ptr->corked = false;
+
+   return sendqueue(sock_desc, tx_ptr);
+}
+
+int dgram_rxinit(struct dgram_rx * rx_ptr)
+{
+   if ((rx_ptr->bufs = malloc(DGRAM_BATCH * DGRAM_BUF_BYTES)) == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate datagram buffers.\n");
+      return EXIT_FAILURE;
+   }
+   rx_ptr->num_msgs = 0;
+   rx_ptr->next_msg = 0;
+   rx_ptr->next_offset = 0;
+   rx_ptr->ring_ptr = NULL;
+   rx_ptr->armed = false;
+
+   return EXIT_SUCCESS;
+}
+
+void dgram_rxfree(struct dgram_rx * rx_ptr)
+{
+   free(rx_ptr->bufs);
+   rx_ptr->bufs = NULL;
+
+   if (rx_ptr->ring_ptr != NULL)
+   {
+      uring_bufsfree(rx_ptr->ring_ptr, &rx_ptr->ring_bufs);
+      uring_free(rx_ptr->ring_ptr);
+      free(rx_ptr->ring_ptr);
+      rx_ptr->ring_ptr = NULL;
+   }
+}
+
+int dgram_rxuring(int sock_desc, struct dgram_rx * rx_ptr)
+{
+   struct uring * ring_ptr = malloc(sizeof(struct uring));
+   int flags = fcntl(sock_desc, F_GETFL, 0);
+
+   if ((ring_ptr == NULL) || (flags == -1) ||
+      (uring_init(ring_ptr, DGRAM_RING_ENTRIES) == EXIT_FAILURE))
+   {
+      free(ring_ptr);
+      return EXIT_FAILURE;
+   }
+
+   // Each buffer has room for the receive's header, the source address, and
+      //the GRO control data ahead of the datagram
+   if (uring_bufsinit(ring_ptr, &rx_ptr->ring_bufs, DGRAM_RING_GROUP,
+      DGRAM_RING_BUFS, sizeof(struct io_uring_recvmsg_out) +
+      sizeof(struct sockaddr_in) + CMSG_SPACE(sizeof(int)) + DGRAM_BUF_BYTES)
+      == EXIT_FAILURE)
+   {
+      uring_free(ring_ptr);
+      free(ring_ptr);
+      return EXIT_FAILURE;
+   }
+
+   memset(&rx_ptr->ring_msg, 0, sizeof(rx_ptr->ring_msg));
+   rx_ptr->ring_msg.msg_namelen = sizeof(struct sockaddr_in);
+   rx_ptr->ring_msg.msg_controllen = CMSG_SPACE(sizeof(int));
+   rx_ptr->ring_ptr = ring_ptr;
+   rx_ptr->nonblocking = (flags & O_NONBLOCK) != 0;
+
+   // Arm the receive now, so the ring has completions before the first call
+   if ((armring(sock_desc, rx_ptr) == EXIT_FAILURE) ||
+      (uring_enter(ring_ptr, 0, -1) == EXIT_FAILURE))
+   {
+      uring_bufsfree(ring_ptr, &rx_ptr->ring_bufs);
+      uring_free(ring_ptr);
+      free(ring_ptr);
+      rx_ptr->ring_ptr = NULL;
+      return EXIT_FAILURE;
+   }
+   dgram_counters.recv_calls++;
+
+   return EXIT_SUCCESS;
+}
+
+int dgram_rxwaitfd(int sock_desc, const struct dgram_rx * rx_ptr)
+{
+   return (rx_ptr->ring_ptr != NULL) ? rx_ptr->ring_ptr->fd : sock_desc;
+}
+
+ssize_t dgram_recv(int sock_desc, struct dgram_rx * rx_ptr,
+   unsigned char ** buf_ptr, struct sockaddr_in * addr_ptr)
+{
+   // Refill the batch once every datagram has been handed out
+   if (rx_ptr->next_msg >= rx_ptr->num_msgs)
+   {
+      int num_msgs = (rx_ptr->ring_ptr != NULL) ?
+         recvring(sock_desc, rx_ptr) : recvbatch(sock_desc, rx_ptr);
+
+      if (num_msgs == -1)
+      {
+         return -1;
+      }
+
+      rx_ptr->num_msgs = num_msgs;
+      rx_ptr->next_msg = 0;
+      rx_ptr->next_offset = 0;
+   }
+
+   // Hand out the next datagram, splitting coalesced GRO buffers
+   int i = rx_ptr->next_msg;
+   size_t remaining = rx_ptr->lens[i] - rx_ptr->next_offset;
+   size_t len = remaining;
+
+   if ((rx_ptr->seg_bytes[i] > 0) && (rx_ptr->seg_bytes[i] < remaining))
+   {
+      len = rx_ptr->seg_bytes[i];
+   }
+
+   *buf_ptr = rx_ptr->msgs[i] + rx_ptr->next_offset;
+
+   if (addr_ptr != NULL)
+   {
+      *addr_ptr = rx_ptr->addrs[i];
+   }
+
+   rx_ptr->next_offset += len;
+
+   if (rx_ptr->next_offset >= rx_ptr->lens[i])
+   {
+      rx_ptr->next_msg++;
+      rx_ptr->next_offset = 0;
+   }
+   dgram_counters.datagrams_received++;
+
+   return (ssize_t) len;
+}
+
+bool dgram_rxpending(const struct dgram_rx * rx_ptr)
+{
+   return (rx_ptr->next_msg < rx_ptr->num_msgs) ||
+      ((rx_ptr->ring_ptr != NULL) && (uring_peek(rx_ptr->ring_ptr) != NULL));
+}
+
+void dgram_printcounters(const char * name, long num_jobs)
+{
+   unsigned long calls = dgram_counters.send_calls + dgram_counters.recv_calls;
+   unsigned long loop_calls = dgram_counters.stream_calls +
+      dgram_counters.wait_calls;
+
+   logger_printf(LOGGER_INFO, "The %s made %lu datagram system calls (%lu send,"
+      " %lu receive) for %lu datagrams and %ld jobs: %.4f system calls per"
+      " job.\n", name, calls, dgram_counters.send_calls,
+      dgram_counters.recv_calls, dgram_counters.datagrams_sent +
+      dgram_counters.datagrams_received, num_jobs,
+      num_jobs > 0 ? (double) calls / num_jobs : 0.0);
+
+   // Only an event loop counts its stream socket and waiting calls
+   if (loop_calls > 0)
+   {
+      logger_printf(LOGGER_INFO, "The %s's event loop made %lu more (%lu"
+         " stream, %lu wait): %.4f system calls per job in all.\n", name,
+         loop_calls, dgram_counters.stream_calls, dgram_counters.wait_calls,
+         num_jobs > 0 ? (double) (calls + loop_calls) / num_jobs : 0.0);
+   }
+
+   memset(&dgram_counters, 0, sizeof(dgram_counters));
+}
@@ -0,0 +1,251 @@
+/**
+ * dgramio.h
+ *
+ * Batched datagram I/O shared by the edge server and backend servers.
+ *
+ * Outgoing datagrams are queued in a dgram_tx and sent with one sendmmsg()
+ * call per DGRAM_BATCH datagrams. Incoming datagrams are read into a dgram_rx
+ * with one recvmmsg() call per DGRAM_BATCH datagrams and handed out one at a
+ * time.
+ *
+ * A dgram_rx may instead receive through io_uring (dgram_rxuring): one
+ * multishot receive stays armed on the socket and fills buffers from a
+ * provided buffer ring, and dgram_recv reads the datagrams straight from the
+ * completion ring. It only enters the kernel when the completion ring is
+ * empty, so under sustained load receiving takes almost no system calls.
+ *
+ * When segmentation offload is enabled, runs of equal sized datagrams to the
+ * same address are sent with a single UDP_SEGMENT (GSO) sendmsg() call, and
+ * coalesced UDP_GRO receives are split back into their original datagrams.
+ * Offload is only used when the kernel supports it.
+ *
+ * Sockets may be blocking or nonblocking. Sends on a nonblocking socket wait
+ * for room in the send buffer rather than dropping datagrams.
+ */
+
+#ifndef DGRAMIO_H
+#define DGRAMIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "uring.h"
+
+#define DGRAM_BATCH 32 // maximum number of datagrams per system call
+#define DGRAM_BUF_BYTES 65536 // size of each datagram buffer
+#define DGRAM_MAX_SEGMENTS 64 // maximum number of datagrams per GSO send
+#define DGRAM_MAX_SOCKBUF_BYTES (1 << 30) // largest socket buffer to ask for
+#define DGRAM_RING_BUFS 64 // provided buffers of an io_uring receive, a power
+   //of 2 and at least twice DGRAM_BATCH
+
+/**
+ * struct to count datagram system calls, and those the edge server's event
+ * loop makes for its stream sockets and waiting
+ */
+struct dgram_counters {
+   unsigned long send_calls; // sendmmsg/sendmsg/sendto calls
+   unsigned long recv_calls; // recvmmsg/recvfrom/io_uring_enter calls
+   unsigned long stream_calls; // accept/recv/send/epoll_ctl calls
+   unsigned long wait_calls; // epoll_wait/io_uring_enter calls of an event
+      //loop
+   unsigned long datagrams_sent;
+   unsigned long datagrams_received;
+};
+
+/**
+ * struct to queue outgoing datagrams
+ */
+struct dgram_tx {
+   unsigned char * bufs; // DGRAM_BATCH buffers of DGRAM_BUF_BYTES
+   size_t lens[DGRAM_BATCH]; // number of bytes queued in each buffer
+   struct sockaddr_in addrs[DGRAM_BATCH]; // destination of each buffer
+   int num_msgs; // number of queued datagrams
+   bool gso; // send runs of equal sized datagrams with UDP_SEGMENT
+   bool corked; // dgram_txflush leaves datagrams queued until dgram_txuncork
+};
+
+/**
+ * struct to hold a batch of incoming datagrams
+ */
+struct dgram_rx {
+   unsigned char * bufs; // DGRAM_BATCH buffers of DGRAM_BUF_BYTES
+   size_t lens[DGRAM_BATCH]; // number of bytes received in each buffer
+   size_t seg_bytes[DGRAM_BATCH]; // GRO segment size, 0 if not coalesced
+   struct sockaddr_in addrs[DGRAM_BATCH]; // source of each buffer
+   unsigned char * msgs[DGRAM_BATCH]; // first byte of each buffer
+   int num_msgs; // number of buffers filled by the last receive
+   int next_msg; // buffer holding the next datagram to hand out
+   size_t next_offset; // offset of the next datagram within that buffer
+   struct uring * ring_ptr; // ring receiving the datagrams, NULL to use
+      //recvmmsg()
+   struct uring_bufs ring_bufs; // provided buffers the ring receives into
+   uint16_t bids[DGRAM_BATCH]; // provided buffer of each received buffer
+   struct msghdr ring_msg; // layout of the name and control data the ring
+      //writes ahead of each datagram
+   bool armed; // the ring's multishot receive is in flight
+   bool nonblocking; // the socket was nonblocking when the ring was set up
+};
+
+extern __thread struct dgram_counters dgram_counters; // this thread's counts
+
+/**
+ * dgram_enableoffload turns on UDP_GRO for a socket and reports whether the
+ * kernel supports UDP_SEGMENT.
+ * @param sock_desc int datagram socket descriptor
+ * @param gso_ptr pointer to bool set true if UDP_SEGMENT can be used
+ * @param gro_ptr pointer to bool set true if UDP_GRO was enabled
+ */
+void dgram_enableoffload(int sock_desc, bool * gso_ptr, bool * gro_ptr);
+
+/**
+ * dgram_sockbufbytes parses a socket buffer size given on the command line.
+ * @param str pointer to c string holding the size in bytes
+ * @return int size in bytes, -1 if it is invalid
+ */
+int dgram_sockbufbytes(const char * str);
+
+/**
+ * dgram_setbuffers sizes a socket's receive and send buffers and reads back
+ * the sizes the kernel granted. The kernel doubles a requested size to leave
+ * room for its own bookkeeping and caps it at net.core.rmem_max or
+ * net.core.wmem_max.
+ * @param sock_desc int datagram socket descriptor
+ * @param rcvbuf int SO_RCVBUF bytes to ask for, 0 to keep the default
+ * @param sndbuf int SO_SNDBUF bytes to ask for, 0 to keep the default
+ * @param rcvbuf_ptr pointer to int set to the granted receive buffer bytes
+ * @param sndbuf_ptr pointer to int set to the granted send buffer bytes
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int dgram_setbuffers(int sock_desc, int rcvbuf, int sndbuf, int * rcvbuf_ptr,
+   int * sndbuf_ptr);
+
+/**
+ * dgram_txinit allocates the buffers of a dgram_tx.
+ * @param tx_ptr pointer to struct dgram_tx
+ * @param gso bool true to use UDP_SEGMENT
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int dgram_txinit(struct dgram_tx * tx_ptr, bool gso);
+
+/**
+ * dgram_txfree releases the buffers of a dgram_tx.
+ * @param tx_ptr pointer to struct dgram_tx
+ */
+void dgram_txfree(struct dgram_tx * tx_ptr);
+
+/**
+ * dgram_txbuf returns the buffer the next queued datagram should be written
+ * to.
+ * @param tx_ptr pointer to struct dgram_tx
+ * @return unsigned char * pointer to DGRAM_BUF_BYTES bytes
+ */
+unsigned char * dgram_txbuf(struct dgram_tx * tx_ptr);
+
+/**
+ * dgram_txpush queues the datagram written to dgram_txbuf and sends the queue
+ * once it is full.
+ * @param sock_desc int datagram socket descriptor
+ * @param tx_ptr pointer to struct dgram_tx
+ * @param len size_t number of bytes in the datagram
+ * @param addr_ptr pointer to destination socket address
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int dgram_txpush(int sock_desc, struct dgram_tx * tx_ptr, size_t len,
+   const struct sockaddr_in * addr_ptr);
+
+/**
+ * dgram_txflush sends every queued datagram, unless the dgram_tx is
+ * corked.
+ * @param sock_desc int datagram socket descriptor
+ * @param tx_ptr pointer to struct dgram_tx
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int dgram_txflush(int sock_desc, struct dgram_tx * tx_ptr);
+
+/**
+ * dgram_txcork holds back dgram_txflush, so the datagrams queued by every
+ * batch an event loop handles in one round go out together. A full queue is
+ * still sent at once.
+ * @param tx_ptr pointer to struct dgram_tx
+ */
+void dgram_txcork(struct dgram_tx * tx_ptr);
+
+/**
+ * dgram_txuncork stops holding back dgram_txflush and sends every queued
+ * datagram.
+ * @param sock_desc int datagram socket descriptor
+ * @param tx_ptr pointer to struct dgram_tx
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int dgram_txuncork(int sock_desc, struct dgram_tx * tx_ptr);
+
+/**
+ * dgram_rxinit allocates the buffers of a dgram_rx.
+ * @param rx_ptr pointer to struct dgram_rx
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int dgram_rxinit(struct dgram_rx * rx_ptr);
+
+/**
+ * dgram_rxfree releases the buffers of a dgram_rx and its ring, if any.
+ * @param rx_ptr pointer to struct dgram_rx
+ */
+void dgram_rxfree(struct dgram_rx * rx_ptr);
+
+/**
+ * dgram_rxuring switches a dgram_rx to receiving through io_uring. Whether
+ * dgram_recv waits for datagrams is taken from the socket's O_NONBLOCK flag
+ * at the time of the call.
+ * @param sock_desc int datagram socket descriptor
+ * @param rx_ptr pointer to struct dgram_rx set up by dgram_rxinit
+ * @return int 0 if successful, 1 if io_uring is not available, in which case
+ *    the dgram_rx keeps using recvmmsg()
+ */
+int dgram_rxuring(int sock_desc, struct dgram_rx * rx_ptr);
+
+/**
+ * dgram_rxwaitfd returns the descriptor that becomes readable when dgram_recv
+ * has datagrams to hand out: the ring of a dgram_rx receiving through
+ * io_uring, the socket otherwise.
+ * @param sock_desc int datagram socket descriptor
+ * @param rx_ptr pointer to struct dgram_rx
+ * @return int descriptor to poll for POLLIN
+ */
+int dgram_rxwaitfd(int sock_desc, const struct dgram_rx * rx_ptr);
+
+/**
+ * dgram_recv returns the next received datagram, blocking in recvmmsg() only
+ * when every datagram from the previous call has been handed out. On a
+ * nonblocking socket it fails with errno EAGAIN once nothing is queued.
+ * Through io_uring it blocks in io_uring_enter() only when no completion is
+ * waiting.
+ * @param sock_desc int datagram socket descriptor
+ * @param rx_ptr pointer to struct dgram_rx
+ * @param buf_ptr pointer set to the datagram bytes, valid until the next call
+ * @param addr_ptr pointer to source socket address, may be NULL
+ * @return ssize_t number of bytes in the datagram, -1 if unsuccessful
+ */
+ssize_t dgram_recv(int sock_desc, struct dgram_rx * rx_ptr,
+   unsigned char ** buf_ptr, struct sockaddr_in * addr_ptr);
+
+/**
+ * dgram_rxpending reports whether dgram_recv can hand out another datagram
+ * without a system call.
+ * @param rx_ptr pointer to struct dgram_rx
+ * @return bool true if datagrams from the last receive are left, or
+ *    completions are waiting in the ring
+ */
+bool dgram_rxpending(const struct dgram_rx * rx_ptr);
+
+/**
+ * dgram_printcounters prints the system call counters per job and resets
+ * them.
+ * @param name pointer to c string naming the server
+ * @param num_jobs long number of jobs the calls were made for
+ */
+void dgram_printcounters(const char * name, long num_jobs);
+
+#endif
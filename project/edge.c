@@ -5,7 +5,47 @@
  * backend AND/backend OR servers, and  sends the results to the appropriate
  * client.
  *
- * Usage: ./edge
+ * Usage: ./edge [-a] [-e] [-U] [-g] [-m datagram_bytes] [-A and_replicas]
+ *    [-O or_replicas] [-b least|p2c] [-H percentile]
+ *    [-C cache_bytes] [-L] [-r rcvbuf_bytes] [-s sndbuf_bytes] [-q]
+ *    [-S stats_port] [-k idle_sec]
+ *
+ * -a use the legacy fixed-width ASCII protocol instead of the binary protocol
+ * -e serve all clients from one epoll event loop instead of forking a process
+ *    per connection (binary protocol only)
+ * -U run the event loop (implies -e) on io_uring if the kernel has it, with
+ *    epoll otherwise
+ * -g use UDP segmentation offload (UDP_SEGMENT/UDP_GRO) if the kernel has it
+ * -m maximum size of datagrams sent to the backend servers (default 1472)
+ * -A comma separated ip:port list of AND server replicas
+ *    (default 127.0.0.1:22926)
+ * -O comma separated ip:port list of OR server replicas
+ *    (default 127.0.0.1:21926)
+ * -b balance jobs over the replicas by least outstanding jobs (least, the
+ *    default) or power of two choices (p2c); the ASCII protocol only uses the
+ *    first replica of each server
+ * -H hedge a shard of jobs by sending a copy to a second replica once it has
+ *    waited longer than this percentile of recent shard latencies (1 to 99)
+ * -C answer repeated jobs from a result cache using at most this many bytes
+ * -L compute a batch in the edge server when that is expected to be faster
+ *    than the backend servers' recent median latency
+ * -r SO_RCVBUF size asked for each datagram socket (default: the kernel's)
+ * -s SO_SNDBUF size asked for each datagram socket (default: the kernel's)
+ * -q quiet, log the summary lines of each batch but not one line per job
+ * -S serve stage latency histograms and counters on this 127.0.0.1 port
+ * -k close a connection that has had no batch in flight and sent nothing for
+ *    this many seconds (default 60, 0 to keep it open for ever)
+ *
+ * A connection carries any number of batches. A client that flags its
+ * batches PROTO_FLAG_SESSION holds a keep-alive session and tags each batch
+ * with a request ID that its results message echoes, so the event loop mode
+ * can answer the session's batches in whatever order they finish.
+ *
+ * Lines are logged through per-thread ring buffers written out by a
+ * background thread (see logger.h), so a slow stdout never stalls a batch.
+ *
+ * How long each stage of every batch takes (see STAGE_* in edge.h) is always
+ * recorded in histograms shared by every child process (see stats.h).
  */
 
 #include <stdio.h>
@@ -16,46 +56,97 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+#include <stdbool.h>
+
+#include "protocol.h"
+#include "dgramio.h"
+#include "bitvec.h"
+#include "logger.h"
+#include "edge.h"
+
+#define CLIENT_RECV_BYTES 29 // number of bytes received from client (ASCII)
+#define BACKEND_SEND_BYTES 29 // number of bytes send to backend server (ASCII)
+#define BACKEND_RECV_BYTES 14 // number of bytes received from backend (ASCII)
+#define CLIENT_SEND_BYTES 10 // number of bytes sent to client (ASCII)
 
-#define CLIENT_RECV_BYTES 29 // number of bytes received from client
-#define BACKEND_SEND_BYTES 29 // number of bytes send to backend server
-#define BACKEND_RECV_BYTES 14 // number of bytes received from backend server
-#define CLIENT_SEND_BYTES 10 // number of bytes sent to client
 
 #define OPERATOR_BYTES 3 // maximum number of bytes used by operator
 #define OPERAND_BYTES 10 // maximum number of bytes used by operand
 #define RESULT_BYTES 10 // maximum number of bytes used by result
 
-#define EDGE_IP "127.0.0.1" // edge server IPv4 address
-#define DGRAM_PORT 24926 // datagram socket port number
-#define WELCOME_PORT 23926 // welcoming stream socket port number
-#define BACKLOG 5 // buffer size for welcoming stream socket
-
-#define AND_IP "127.0.0.1" // and server IPv4 address
-#define AND_PORT 22926 // and server port number
-
-#define OR_IP "127.0.0.1" // or server IPv4 address
-#define OR_PORT 21926 // or server port number
+/**
+ * struct to store a finished shard that may still answer: the loser of a
+ * hedge race or a copy some of whose jobs were resent
+ */
+struct late_shard {
+   uint64_t request_id; // request ID of the shard, 0 if unused
+   uint64_t won_usec; // time the winner answered the last job
+   bool hedge_won; // hedge beat the original and saving is not yet counted
+};
 
 /**
- * struct to store job data
+ * struct to count hedged shards
  */
-struct job {
-   char operator[OPERATOR_BYTES + 1];  
-   char operand1[OPERAND_BYTES + 1];
-   char operand2[OPERAND_BYTES + 1];
-   char result[RESULT_BYTES + 1]; 
+struct hedge_stats {
+   unsigned long shards; // shards sent, not counting hedges
+   unsigned long hedged; // shards a hedge was sent for
+   unsigned long wins; // hedges that answered before the original
+   unsigned long saved; // losing originals heard from after their hedge won
+   uint64_t saved_usec; // total time between those hedges and originals
 };
 
+struct options opts = {false, false, false, false, PROTO_DGRAM_BYTES,
+   AND_REPLICAS, OR_REPLICAS, POOL_LEAST, 0, 0, false, 0, 0, false, 0,
+   IDLE_SEC};
+
+struct stats edge_stats;
+
+static const char * const stage_names[NUM_STAGES] = {"recvjobs", "sendjobs",
+   "recvresults", "sendresults", "batch"};
+static const char * const counter_names[NUM_COUNTERS] = {"batches", "jobs",
+   "bytes_received", "bytes_sent", "jobs_resent", "shards_hedged",
+   "late_datagrams", "batches_failed", "connections", "sessions",
+   "idle_closed"};
+
+struct dgram_tx backend_tx;
+struct dgram_rx backend_rx;
+
+static uint64_t num_requests; // number of request IDs handed out
+
+static int rcvbuf_bytes; // receive buffer size granted to datagram sockets
+static int sndbuf_bytes; // send buffer size granted to datagram sockets
+
+static struct hedge_stats hedge_stats; // hedging counters of this process
+static struct late_shard late_shards[LATE_SHARDS]; // recently finished
+   //shards that may still answer
+static int next_late; // slot of late_shards to fill next
+
+static struct cache result_cache; // results of recent jobs, shared
+
+static double local_job_nsec = LOCAL_JOB_NSEC; // measured time to compute
+   //one job in this process
+
 /**
  * setupdgramsock creates a datagram socket and binds it.
+ * @param port int port number, 0 for any free port
  * @return int socket descriptor, -1 if unsuccessful
  */
-int setupdgramsock();
+int setupdgramsock(int port);
+
+/**
+ * getport returns the port a socket is bound to.
+ * @param sock_desc int socket descriptor
+ * @return int port number, -1 if unsuccessful
+ */
+int getport(int sock_desc);
 
 /**
  * setupwelcstreamsock creates a welcoming stream socket, binds it, and listens
@@ -77,51 +168,260 @@ void sigchldhandler(int s);
 int reapzombproc();
 
 /**
- * recvjob receives a job from a client.
+ * recvjob receives a job from a client using the ASCII protocol.
  * @param connect_sd int connected stream socket descriptor
  * @param job_ptr pointer to struct job
- * @param num_and_jobs_ptr pointer to int number of AND jobs
- * @param num_or_jobs_ptr pointer to int number of OR jobs
  * @return int number of jobs, -1 if unsuccessful
  */
-int recvjob(int connect_sd, struct job * job_ptr, int * num_and_jobs_ptr,
-   int * num_or_jobs_ptr);
+int recvjob(int connect_sd, struct job * job_ptr);
+
+/**
+ * recvjobs receives all of a client's jobs.
+ * @param connect_sd int connected stream socket descriptor
+ * @param session_ptr pointer to struct session of the connection
+ * @param batch_ptr pointer to struct batch
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int recvjobs(int connect_sd, struct session * session_ptr,
+   struct batch * batch_ptr);
+
+/**
+ * sendbackendjobs splits one backend server's jobs into shards, one per
+ * replica but never less than a full datagram, gives each shard to the
+ * replica with the least load, and sends the first burst of each.
+ * @param dgram_sd int datagram socket descriptor
+ * @param pool_ptr pointer to backend server replica pool
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @param batch_ptr pointer to struct batch
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int sendbackendjobs(int dgram_sd, struct pool * pool_ptr, int opcode,
+   struct batch * batch_ptr);
+
+/**
+ * sendrange packs a range of the jobs of one shard into as few datagrams as
+ * possible on backend_tx, addressed to the shard's replica.
+ * @param dgram_sd int datagram socket descriptor
+ * @param batch_ptr pointer to struct batch
+ * @param s int index of the shard
+ * @param first int shard job number of the first job to send
+ * @param count int number of jobs to send
+ * @param flags uint16_t PROTO_FLAG_* values of the last datagram
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int sendrange(int dgram_sd, struct batch * batch_ptr, int s, int first,
+   int count, uint16_t flags);
+
+/**
+ * sendburst sends a shard copy's next jobs, as many as its replica's window
+ * has room for, asking the replica to report when it has read them if any
+ * jobs are left. A copy with no jobs awaiting that report may always send
+ * one datagram, so a full window held by other batches cannot stall it.
+ * @param dgram_sd int datagram socket descriptor
+ * @param batch_ptr pointer to struct batch
+ * @param s int index of the shard or hedge
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int sendburst(int dgram_sd, struct batch * batch_ptr, int s);
+
+/**
+ * readjobs records that a shard copy's replica has read its first num_read
+ * jobs off its socket, freeing that much of its window.
+ * @param shard_ptr pointer to struct shard
+ * @param num_read int number of the copy's jobs the replica has received
+ */
+void readjobs(struct shard * shard_ptr, int num_read);
+
+/**
+ * resendshard resends the jobs of a shard copy that neither copy has
+ * answered, asking its replica to report any other jobs it is missing. A copy
+ * still waiting to send a burst resends only its last job sent, asking the
+ * replica for the report of jobs received it is waiting for as well.
+ * @param dgram_sd int datagram socket descriptor
+ * @param batch_ptr pointer to struct batch
+ * @param s int index of the shard or hedge
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int resendshard(int dgram_sd, struct batch * batch_ptr, int s);
+
+/**
+ * finishshard records the latency of a shard whose jobs have all been
+ * answered, stops the timers of both its copies, takes the jobs they did not
+ * answer off their replicas' counts, and remembers the copies that may still
+ * answer.
+ * @param batch_ptr pointer to struct batch
+ * @param s int index of the shard or hedge that answered the last job
+ */
+void finishshard(struct batch * batch_ptr, int s);
+
+/**
+ * expectlate remembers a finished shard whose results may still arrive,
+ * overwriting the oldest one remembered.
+ * @param request_id uint64_t request ID of the shard
+ * @param hedge_won bool true if the shard lost to its hedge
+ */
+void expectlate(uint64_t request_id, bool hedge_won);
+
+/**
+ * nowusec reads the monotonic clock.
+ * @return uint64_t time in microseconds
+ */
+uint64_t nowusec();
+
+/**
+ * nownsec reads the monotonic clock.
+ * @return uint64_t time in nanoseconds
+ */
+uint64_t nownsec();
+
+/**
+ * chooselocal decides whether a batch is computed in the edge server by
+ * comparing the expected time to compute it there with the recent median
+ * latency of the backend servers it would go to.
+ * @param and_pool_ptr pointer to backend AND server replica pool
+ * @param or_pool_ptr pointer to backend OR server replica pool
+ * @param batch_ptr pointer to struct batch
+ * @return bool true to compute the batch in the edge server
+ */
+bool chooselocal(struct pool * and_pool_ptr, struct pool * or_pool_ptr,
+   struct batch * batch_ptr);
+
+/**
+ * computelocal computes the jobs of a batch that are still waiting for a
+ * result with the backend servers' kernels, and times them.
+ * @param batch_ptr pointer to struct batch
+ */
+void computelocal(struct batch * batch_ptr);
+
+/**
+ * segmentwords returns the number of words of a wide job sent to a backend
+ * server in each segment datagram.
+ * @return uint32_t number of words per segment
+ */
+uint32_t segmentwords();
+
+/**
+ * pushsegment packs one segment of a wide job on backend_tx, addressed to
+ * the segment's replica.
+ * @param dgram_sd int datagram socket descriptor
+ * @param batch_ptr pointer to struct batch
+ * @param segment size_t index of the segment
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int pushsegment(int dgram_sd, struct batch * batch_ptr, size_t segment);
 
 /**
- * sendjobs sends a client's jobs to the backend servers.
+ * copysegment copies the words of a segment out of an operand, padding with
+ * zero words past the operand's last word.
+ * @param dst pointer to num_words destination words
+ * @param vec pointer to operand words
+ * @param vec_words size_t number of words in the operand
+ * @param first_word uint32_t first word of the segment
+ * @param num_words uint32_t number of words in the segment
+ */
+void copysegment(unsigned char * dst, const unsigned char * vec,
+   size_t vec_words, uint32_t first_word, uint32_t num_words);
+
+/**
+ * handlesegment stores a result segment of a wide job and encodes every
+ * result that can now be streamed to the client.
+ * @param batch_ptr pointer to struct batch
+ * @param header_ptr pointer to unpacked segment header
+ * @param buffer pointer to received datagram
+ * @return int 0 if successful, 1 if the segment does not belong to the batch
+ */
+int handlesegment(struct batch * batch_ptr,
+   const struct proto_header * header_ptr, const unsigned char * buffer);
+
+/**
+ * recvresults receives the results from both backend servers in whatever
+ * order they arrive, streaming them to the client as they become ready, and
+ * sends the rest of a batch's wide job segments as room frees up.
  * @param dgram_sd int datagram socket descriptor
- * @param and_addr_ptr pointer to backend AND server socket address
- * @param or_addr_ptr pointer to backend OR server socket address
+ * @param connect_sd int connected stream socket descriptor
+ * @param and_pool_ptr pointer to backend AND server replica pool
+ * @param or_pool_ptr pointer to backend OR server replica pool
+ * @param batch_ptr pointer to struct batch
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int recvresults(int dgram_sd, int connect_sd, struct pool * and_pool_ptr,
+   struct pool * or_pool_ptr, struct batch * batch_ptr);
+
+/**
+ * mapbackendjobs maps backend job numbers to job indices.
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
  * @param jobs array of jobs
  * @param num_jobs int number of jobs
- * @param num_and_jobs int number of AND jobs
- * @param num_or_jobs int number of OR jobs
+ * @param num_backend_jobs int number of jobs with the given op code that
+ *    still need a result
+ * @param done pointer to num_jobs flags, nonzero for jobs that already have
+ *    a result and are skipped, NULL if none do
+ * @return int * allocated array of job indices, NULL if unsuccessful
+ */
+int * mapbackendjobs(int opcode, struct job jobs[], int num_jobs,
+   int num_backend_jobs, const unsigned char * done);
+
+/**
+ * handlemissing resends the jobs a replica reports missing from a shard,
+ * asking it again to report any it is still missing.
+ * @param dgram_sd int datagram socket descriptor
+ * @param batch_ptr pointer to struct batch
+ * @param header_ptr pointer to unpacked PROTO_OP_MISSING datagram header
+ * @param buffer pointer to received datagram
  * @return int 0 if successful, 1 if unsuccessful
  */
-int sendjobs(int dgram_sd, struct sockaddr_in * and_addr_ptr,
-   struct sockaddr_in * or_addr_ptr, struct job jobs[], int num_jobs,
-   int num_and_jobs, int num_or_jobs);
+int handlemissing(int dgram_sd, struct batch * batch_ptr,
+   const struct proto_header * header_ptr, const unsigned char * buffer);
 
 /**
- * recvresults receives the results from a backend server.
+ * handlecredit records the receive buffer size a replica advertised and how
+ * many of a shard copy's jobs it has read, and sends the copy's next burst.
  * @param dgram_sd int datagram socket descriptor
- * @param backend_addr_ptr pointer to backend server socket address
- * @param backend_addr_len socklen_t length of socket address
- * @param num_backend_jobs int number of backend jobs
- * @param jobs array of jobs
+ * @param batch_ptr pointer to struct batch
+ * @param header_ptr pointer to unpacked PROTO_OP_CREDIT datagram header
+ * @param buffer pointer to received datagram
  * @return int 0 if successful, 1 if unsuccessful
  */
-int recvresults(int dgram_sd, struct sockaddr_in * backend_addr_ptr,
-   socklen_t backend_addr_len, int num_backend_jobs, struct job jobs[]);
+int handlecredit(int dgram_sd, struct batch * batch_ptr,
+   const struct proto_header * header_ptr, const unsigned char * buffer);
 
 /**
- * sendresults sends the results to the client.
+ * finishjob records a job's result and queues it for the client if results
+ * are streamed in any order.
+ * @param batch_ptr pointer to struct batch
+ * @param i int job index
+ * @param result uint32_t result
+ */
+void finishjob(struct batch * batch_ptr, int i, uint32_t result);
+
+/**
+ * readyresults encodes the results that can be streamed in job order.
+ * @param batch_ptr pointer to struct batch
+ */
+void readyresults(struct batch * batch_ptr);
+
+/**
+ * dedupjobs links every job to the later jobs of its batch with the same
+ * operator and operands, so only the first is sent to a backend server and
+ * its result is copied to the others.
+ * @param batch_ptr pointer to struct batch
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int dedupjobs(struct batch * batch_ptr);
+
+/**
+ * cachehits answers a batch's jobs from the result cache.
+ * @param batch_ptr pointer to struct batch
+ */
+void cachehits(struct batch * batch_ptr);
+
+/**
+ * sendresults sends the results not yet streamed to the client.
  * @param connect_sd int connected stream socket descriptor
- * @param num_jobs int number of jobs
- * @param jobs array of jobs
+ * @param batch_ptr pointer to struct batch
  * @return int 0 if successful, 1 if unsuccessful
  */
-int sendresults(int connect_sd, int num_jobs, struct job jobs[]);
+int sendresults(int connect_sd, struct batch * batch_ptr);
 
 /**
  * main
@@ -131,12 +431,187 @@ int sendresults(int connect_sd, int num_jobs, struct job jobs[]);
  * @param argv pointer to array of c string argument pointers
  * @return int 0 if successful, 1 if unsuccessful
  */
-int main(void)
+int main(int argc, char * argv[])
 {
+   // Check command line arguments
+   int opt;
+
+   while ((opt = getopt(argc, argv, "aeUgm:A:O:b:H:C:Lr:s:qS:k:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'a':
+            opts.ascii = true;
+            break;
+         case 'e':
+            opts.reactor = true;
+            break;
+         case 'U':
+            opts.reactor = true;
+            opts.uring = true;
+            break;
+         case 'g':
+            opts.offload = true;
+            break;
+         case 'm':
+            if ((opts.dgram_bytes = proto_dgrambytes(optarg)) == -1)
+            {
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'A':
+            opts.and_replicas = optarg;
+            break;
+         case 'O':
+            opts.or_replicas = optarg;
+            break;
+         case 'b':
+            if ((opts.policy = pool_policy(optarg)) == -1)
+            {
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'L':
+            opts.local = true;
+            break;
+         case 'C':
+            opts.cache_bytes = strtoul(optarg, NULL, 10);
+            break;
+         case 'H':
+            opts.hedge = atoi(optarg);
+            if ((opts.hedge < 1) || (opts.hedge > 99))
+            {
+               fprintf(stderr, "ERROR: Hedge percentile must be 1 to 99.\n");
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'r':
+            if ((opts.rcvbuf = dgram_sockbufbytes(optarg)) == -1)
+            {
+               return EXIT_FAILURE;
+            }
+            break;
+         case 's':
+            if ((opts.sndbuf = dgram_sockbufbytes(optarg)) == -1)
+            {
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'q':
+            opts.quiet = true;
+            break;
+         case 'S':
+            opts.stats_port = atoi(optarg);
+            if ((opts.stats_port < 1) || (opts.stats_port > 65535))
+            {
+               fprintf(stderr, "ERROR: Stats port must be 1 to 65535.\n");
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'k':
+            opts.idle_sec = atoi(optarg);
+            if ((opts.idle_sec < 0) || (opts.idle_sec > INT32_MAX / 1000))
+            {
+               fprintf(stderr, "ERROR: Idle time must be 0 to %d seconds.\n",
+                  INT32_MAX / 1000);
+               return EXIT_FAILURE;
+            }
+            break;
+         default:
+            fprintf(stderr, "ERROR: Usage: %s [-a] [-e] [-U] [-g] [-m"
+               " datagram_bytes] [-A and_replicas] [-O or_replicas]"
+               " [-b least|p2c] [-H percentile] [-C cache_bytes] [-L]"
+               " [-r rcvbuf_bytes] [-s sndbuf_bytes] [-q] [-S stats_port]"
+               " [-k idle_sec]\n", argv[0]);
+            return EXIT_FAILURE;
+      }
+   }
+
+   if (opts.ascii && opts.reactor)
+   {
+      fprintf(stderr, "ERROR: The event loop (-e, -U) requires the binary"
+         " protocol.\n");
+      return EXIT_FAILURE;
+   }
+
+   // Start the logger before forking, every child starts its own writer
+   if (logger_init(opts.quiet ? LOGGER_INFO : LOGGER_JOB) == EXIT_FAILURE)
+   {
+      return EXIT_FAILURE;
+   }
+
+   // Setup stats, shared by every child process and served by this one
+   if ((stats_init(&edge_stats, "edge server", stage_names, NUM_STAGES,
+      counter_names, NUM_COUNTERS) == EXIT_FAILURE) ||
+      ((opts.stats_port != 0) && (stats_serve(&edge_stats, opts.stats_port)
+      == EXIT_FAILURE)))
+   {
+      return EXIT_FAILURE;
+   }
+
+   if (opts.stats_port != 0)
+   {
+      logger_printf(LOGGER_INFO, "The edge server is serving stats on"
+         " 127.0.0.1 port %d.\n", opts.stats_port);
+   }
+
+   // Setup backend server replica pools, shared by every child process
+   struct pool and_pool;
+   struct pool or_pool;
+
+   if ((pool_init(&and_pool, opts.and_replicas) == EXIT_FAILURE) ||
+      (pool_init(&or_pool, opts.or_replicas) == EXIT_FAILURE) ||
+      (cache_init(&result_cache, opts.ascii ? 0 : opts.cache_bytes) ==
+      EXIT_FAILURE))
+   {
+      return EXIT_FAILURE;
+   }
+
+   if ((and_pool.num_replicas > 1) || (or_pool.num_replicas > 1))
+   {
+      logger_printf(LOGGER_INFO, "The edge server is balancing jobs over %d AND"
+         " and %d OR server replicas by %s.\n", and_pool.num_replicas,
+         or_pool.num_replicas, (opts.policy == POOL_P2C) ?
+         "power of two choices" : "least outstanding jobs");
+   }
+
+   if (opts.hedge != 0)
+   {
+      logger_printf(LOGGER_INFO, "The edge server is hedging shards slower than"
+         " the %dth percentile.\n", opts.hedge);
+   }
+
+   if (result_cache.shards != NULL)
+   {
+      logger_printf(LOGGER_INFO, "The edge server is caching up to %d results"
+         " in %zu bytes.\n", result_cache.capacity * CACHE_SHARDS,
+         result_cache.bytes);
+   }
+
    // Setup datagram socket
    int dgram_sd;
-   if ((dgram_sd = setupdgramsock()) == -1)
+   if ((dgram_sd = setupdgramsock(DGRAM_PORT)) == -1)
+   {
+      return EXIT_FAILURE;
+   }
+   logger_printf(LOGGER_INFO, "The edge server's datagram sockets have %d byte"
+      " receive and %d byte send buffers.\n", rcvbuf_bytes, sndbuf_bytes);
+
+   // Setup batched datagram I/O, children inherit the buffers in fork mode
+   bool gso = false;
+   bool gro = false;
+
+   if (opts.offload)
+   {
+      dgram_enableoffload(dgram_sd, &gso, &gro);
+      logger_printf(LOGGER_INFO, "The edge server is using UDP_SEGMENT %s and"
+         " UDP_GRO %s.\n", gso ? "on" : "off", gro ? "on" : "off");
+   }
+
+   if ((dgram_txinit(&backend_tx, gso) == EXIT_FAILURE) ||
+      (dgram_rxinit(&backend_rx) == EXIT_FAILURE))
    {
+      close(dgram_sd);
       return EXIT_FAILURE;
    }
 
@@ -156,30 +631,22 @@ int main(void)
       return EXIT_FAILURE;
    }
 
-   // Specify AND server address information
-   struct sockaddr_in and_addr;
-   and_addr.sin_family = AF_INET;
-   and_addr.sin_port = htons(AND_PORT); // store in network byte order
-   and_addr.sin_addr.s_addr = inet_addr(AND_IP);
-   memset(and_addr.sin_zero, '\0', sizeof(and_addr.sin_zero)); // allows for
-      //typecasting
-   socklen_t and_addr_len = sizeof(and_addr);
-
-   // Specify OR server address information
-   struct sockaddr_in or_addr;
-   or_addr.sin_family = AF_INET;
-   or_addr.sin_port = htons(OR_PORT); // store in network byte order
-   or_addr.sin_addr.s_addr = inet_addr(OR_IP);
-   memset(or_addr.sin_zero, '\0', sizeof(or_addr.sin_zero)); // allows for
-      //typecasting
-   socklen_t or_addr_len = sizeof(or_addr);
+   // Serve every client from one event loop instead of forking
+   if (opts.reactor)
+   {
+      logger_printf(LOGGER_INFO, "The edge server is up and running.\n");
+      runreactor(welcome_sd, dgram_sd, &and_pool, &or_pool);
+      close(dgram_sd);
+      close(welcome_sd);
+      return EXIT_FAILURE;
+   }
 
    struct sockaddr_storage client_addr;  
    socklen_t client_addr_len = sizeof(client_addr);
    int connect_sd;
 
    // Print message indicating edge server is up and running
-   fprintf(stdout, "The edge server is up and running.\n");
+   logger_printf(LOGGER_INFO, "The edge server is up and running.\n");
 
    while (1)
    {
@@ -195,91 +662,116 @@ int main(void)
       {
          // Child process
          close(welcome_sd);
+         close(dgram_sd);
 
-         // Receive initial job from client to get number of jobs
-         struct job job0;         
-         int num_jobs;
-         int num_and_jobs = 0;
-         int num_or_jobs = 0;
-         
-         if ((num_jobs = recvjob(connect_sd, &job0, &num_and_jobs,
-            &num_or_jobs)) == -1)
+         if (setnodelay(connect_sd) == EXIT_FAILURE)
          {
             close(connect_sd);
             exit(EXIT_FAILURE);
          }
 
-         struct job jobs[num_jobs];
-         jobs[0] = job0;
-
-         // Receive remaining jobs from client
-         if (num_jobs > 1)
-         {
-            for (int i = 1; i < num_jobs; i++)
-            {
-               if (recvjob(connect_sd, &jobs[i], &num_and_jobs, &num_or_jobs)
-                  == -1)
-               {
-                  close(connect_sd);
-                  exit(EXIT_FAILURE);
-               }              
-            }
-         }
-
-         // Print message indicating edge server has received jobs from client
-         fprintf(stdout, "The edge server has received %d jobs from the client"
-            " using TCP over port %d.\n", num_jobs, WELCOME_PORT);
+         // Each child gets its own datagram socket so results from the
+            //backend servers reach the child that sent the jobs
+         int port;
 
-         // Send jobs to backend servers
-         if (sendjobs(dgram_sd, &and_addr, &or_addr, jobs, num_jobs,
-            num_and_jobs, num_or_jobs) == EXIT_FAILURE)
+         if (((dgram_sd = setupdgramsock(0)) == -1) ||
+            ((port = getport(dgram_sd)) == -1))
          {
             close(connect_sd);
             exit(EXIT_FAILURE);
          }
 
-         // Receive results from AND server
-         if (recvresults(dgram_sd, &and_addr, and_addr_len, num_and_jobs, jobs)
-            == EXIT_FAILURE)
+         if (opts.offload)
          {
-            close(connect_sd);
-            exit(EXIT_FAILURE);
+            dgram_enableoffload(dgram_sd, &gso, &gro);
          }
 
-         // Receive jobs from OR server
-         if (recvresults(dgram_sd, &or_addr, or_addr_len, num_or_jobs, jobs)
-            == EXIT_FAILURE)
-         {
-            close(connect_sd);
-            exit(EXIT_FAILURE);
-         }
+         // Serve batches until the client closes its side of the connection
+            //or waits too long to send the next one
+         struct session session;
+         char next_byte;
 
-         // Print message indicating edge server has started receiving results
-            //from the backend servers
-         fprintf(stdout, "The edge server has started receiving the computation"
-            " results from the backend AND server and the backend OR server"
-            " using UDP over port %d.\nThe computation results are:\n",
-            DGRAM_PORT);
+         opensession(&session);
 
-         // Print computation results
-         for (int i = 0; i < num_jobs; i++)
+         while (1)
          {
-            fprintf(stdout, "%s %s %s = %s\n", jobs[i].operand1,
-               jobs[i].operator, jobs[i].operand2, jobs[i].result);
-         }
+            struct pollfd pfd = {connect_sd, POLLIN, 0};
 
-         // Print message indicating edge server has received all results
-         fprintf(stdout, "The edge server has successfully finished receiving"
-             " all computation results from the backend AND server and the"
-             " backend OR server.\n");
-         
-         // Send results to client
-         if (sendresults(connect_sd, num_jobs, jobs) == EXIT_FAILURE)
-         {
-            close(connect_sd);
-            exit(EXIT_FAILURE);
+            if ((opts.idle_sec != 0) &&
+               (poll(&pfd, 1, opts.idle_sec * 1000) == 0))
+            {
+               stats_count(&edge_stats, COUNTER_IDLE_CLOSED, 1);
+               logger_printf(LOGGER_INFO, "The edge server has closed a"
+                  " connection that was idle for %d seconds.\n",
+                  opts.idle_sec);
+               break;
+            }
+
+            if (recv(connect_sd, &next_byte, 1, MSG_PEEK) != 1)
+            {
+               break;
+            }
+
+            // Receive jobs from client
+            struct batch batch;
+            uint64_t recv_nsec = stats_nownsec();
+
+            if (recvjobs(connect_sd, &session, &batch) == EXIT_FAILURE)
+            {
+               close(connect_sd);
+               exit(EXIT_FAILURE);
+            }
+            batch.request_id = newrequestid();
+            batch.recv_nsec = recv_nsec;
+
+            uint64_t send_nsec = recordstage(STAGE_RECVJOBS, recv_nsec);
+
+            // Print message indicating edge server has received jobs from
+               //client
+            logger_printf(LOGGER_INFO, "The edge server has received %d jobs"
+               " from the client using TCP over port %d.\n", batch.num_jobs,
+               WELCOME_PORT);
+
+            // Send jobs to backend servers, then receive results from AND and
+               //OR servers
+            if (sendjobs(dgram_sd, &and_pool, &or_pool, &batch) ==
+               EXIT_FAILURE)
+            {
+               stats_count(&edge_stats, COUNTER_BATCHES_FAILED, 1);
+               freebatch(&batch);
+               close(connect_sd);
+               exit(EXIT_FAILURE);
+            }
+            batch.sent_nsec = recordstage(STAGE_SENDJOBS, send_nsec);
+
+            if (recvresults(dgram_sd, connect_sd, &and_pool, &or_pool, &batch)
+               == EXIT_FAILURE)
+            {
+               stats_count(&edge_stats, COUNTER_BATCHES_FAILED, 1);
+               freebatch(&batch);
+               close(connect_sd);
+               exit(EXIT_FAILURE);
+            }
+            batch.done_nsec = recordstage(STAGE_RECVRESULTS, batch.sent_nsec);
+
+            printresults(&batch, port);
+            
+            // Send remaining results to client
+            if (sendresults(connect_sd, &batch) == EXIT_FAILURE)
+            {
+               stats_count(&edge_stats, COUNTER_BATCHES_FAILED, 1);
+               freebatch(&batch);
+               close(connect_sd);
+               exit(EXIT_FAILURE);
+            }
+            recordbatch(&batch);
+            session.num_answered++;
+            session.num_jobs += (unsigned long) batch.num_jobs;
+            
+            freebatch(&batch);
          }
-         
+
+         closesession(&session);
          close(connect_sd);
          exit(EXIT_FAILURE);
       }
@@ -293,7 +785,7 @@ int main(void)
 	return 0;
 }
 
-int setupdgramsock()
+int setupdgramsock(int port)
 {
    // Create datagram socket
    int dgram_sd;
@@ -317,7 +809,7 @@ int setupdgramsock()
    // Specify datagram socket address information
    struct sockaddr_in dgram_addr;
    dgram_addr.sin_family = AF_INET;
-   dgram_addr.sin_port = htons(DGRAM_PORT); // store in network byte order
+   dgram_addr.sin_port = htons(port); // store in network byte order
    dgram_addr.sin_addr.s_addr = inet_addr(EDGE_IP);
    memset(dgram_addr.sin_zero, '\0', sizeof(dgram_addr.sin_zero)); // allows for
       //typecasting 
@@ -331,9 +823,30 @@ int setupdgramsock()
       return -1;
    }
 
+   if (dgram_setbuffers(dgram_sd, opts.rcvbuf, opts.sndbuf, &rcvbuf_bytes,
+      &sndbuf_bytes) == EXIT_FAILURE)
+   {
+      close(dgram_sd);
+      return -1;
+   }
+
    return dgram_sd;
 }
 
+int getport(int sock_desc)
+{
+   struct sockaddr_in addr;
+   socklen_t addr_len = sizeof(addr);
+
+   if (getsockname(sock_desc, (struct sockaddr *) &addr, &addr_len) == -1)
+   {
+      fprintf(stderr, "ERROR: Failed to get datagram socket port.\n");
+      return -1;
+   }
+
+   return ntohs(addr.sin_port);
+}
+
 int setupwelcstreamsock()
 {
    // Create welcoming stream socket  
@@ -411,8 +924,7 @@ int reapzombproc()
    return EXIT_SUCCESS;
 }
 
-int recvjob(int connect_sd, struct job * job_ptr, int * num_and_jobs_ptr,
-   int * num_or_jobs_ptr)
+int recvjob(int connect_sd, struct job * job_ptr)
 {
    char buffer[CLIENT_RECV_BYTES + 1];
 
@@ -424,136 +936,1988 @@ int recvjob(int connect_sd, struct job * job_ptr, int * num_and_jobs_ptr,
    buffer[CLIENT_RECV_BYTES] = '\0'; // append null character to buffer
 
    int num_jobs;
+   char operator[OPERATOR_BYTES + 1];
+   char operand1[OPERAND_BYTES + 1];
+   char operand2[OPERAND_BYTES + 1];
+   int width1;
+   int width2;
 
    // Extract data from client message
-   if (sscanf(buffer, "%s %s %s %d", job_ptr->operator, job_ptr->operand1,
-      job_ptr->operand2, &num_jobs) != 4)
+   if (sscanf(buffer, "%3s %10s %10s %d", operator, operand1, operand2,
+      &num_jobs) != 4)
    {
       fprintf(stderr, "ERROR: Failed to extract fields from job message.\n");
       return -1;
    }
 
-   if (strcmp(job_ptr->operator, "and") == 0)
-   {
-      (*num_and_jobs_ptr)++;
-   }
-   else if (strcmp(job_ptr->operator, "or") == 0)
+   if ((job_ptr->opcode = proto_opcode(operator, strlen(operator))) == -1)
    {
-      (*num_or_jobs_ptr)++;
+      fprintf(stderr, "ERROR: Invalid operator received from client.\n");
+      return -1;
    }
-   else
+
+   if (((width1 = proto_strtoword(operand1, strlen(operand1),
+      &job_ptr->operand1)) == -1) || ((width2 = proto_strtoword(operand2,
+      strlen(operand2), &job_ptr->operand2)) == -1))
    {
-      fprintf(stderr, "ERROR: Invalid operator received from client.\n");
+      fprintf(stderr, "ERROR: Invalid operand received from client.\n");
       return -1;
    }
+   job_ptr->width1 = (uint8_t) width1;
+   job_ptr->width2 = (uint8_t) width2;
 
    return num_jobs;
 }
 
-int sendjobs(int dgram_sd, struct sockaddr_in * and_addr_ptr,
-   struct sockaddr_in * or_addr_ptr, struct job jobs[], int num_jobs,
-   int num_and_jobs, int num_or_jobs)
+int recvjobs(int connect_sd, struct session * session_ptr,
+   struct batch * batch_ptr)
 {
-   for (int i = 0; i < num_jobs; i++)
+   struct job * jobs;
+   int num_jobs;
+   uint16_t flags = 0;
+   uint64_t client_id = 0;
+   struct wide_job * wide_jobs = NULL;
+
+   if (opts.ascii)
    {
-      char payload[BACKEND_SEND_BYTES + 1];
+      // Receive initial job from client to get number of jobs
+      struct job job0;
 
-      if (strcmp(jobs[i].operator, "and") == 0)
+      if ((num_jobs = recvjob(connect_sd, &job0)) < 1)
       {
-         sprintf(payload, "%10s %10s %3d %3d", jobs[i].operand1,
-            jobs[i].operand2, i, num_and_jobs);
-
-         if (sendto(dgram_sd, payload, strlen(payload), 0,
-            (struct sockaddr *) and_addr_ptr, sizeof(*and_addr_ptr))
-            != BACKEND_SEND_BYTES)
-         {
-            fprintf(stderr, "ERROR: Failed to send job to backend AND"
-               " server.\n");
-            return EXIT_FAILURE;
-         }
+         return EXIT_FAILURE;
       }
-      else if (strcmp(jobs[i].operator, "or") == 0)
+
+      if ((jobs = malloc(num_jobs * sizeof(struct job))) == NULL)
       {
-         sprintf(payload, "%10s %10s %3d %3d", jobs[i].operand1,
-            jobs[i].operand2, i, num_or_jobs);
+         fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+         return EXIT_FAILURE;
+      }
+      jobs[0] = job0;
 
-         if (sendto(dgram_sd, payload, strlen(payload), 0,
-            (struct sockaddr *) or_addr_ptr, sizeof(*or_addr_ptr))
-            != BACKEND_SEND_BYTES)
+      // Receive remaining jobs from client
+      for (int i = 1; i < num_jobs; i++)
+      {
+         if (recvjob(connect_sd, &jobs[i]) == -1)
          {
-            fprintf(stderr, "ERROR: Failed to send job to backend OR"
-               " server.\n");
+            free(jobs);
             return EXIT_FAILURE;
          }
       }
-      else
-      {
-         fprintf(stderr, "ERROR: Invalid operator.\n");
-         return EXIT_FAILURE;
-      }
+      stats_count(&edge_stats, COUNTER_BYTES_RECEIVED,
+         (unsigned long) num_jobs * CLIENT_RECV_BYTES);
+   }
+   else
+   {
+      unsigned char header_buf[PROTO_MAX_HEADER_BYTES];
+      struct proto_header header;
+      size_t header_len = PROTO_HEADER_BYTES;
+      size_t len = 0;
+
+      // Wide jobs give the size of their records after the header, and
+         //session batches end it with their request ID
+      if ((proto_recvall(connect_sd, header_buf, PROTO_HEADER_BYTES)
+         == EXIT_SUCCESS) && (proto_unpackheader(header_buf, &header)
+         == EXIT_SUCCESS) && (((header_len = proto_headerbytes(header.opcode,
+         header.flags)) == PROTO_HEADER_BYTES) || (proto_recvall(connect_sd,
+         header_buf + PROTO_HEADER_BYTES, header_len - PROTO_HEADER_BYTES)
+         == EXIT_SUCCESS)))
+      {
+         len = jobrecordbytes(header_buf, &header);
+      }
+
+      if (len == 0)
+      {
+         fprintf(stderr, "ERROR: Failed to receive job header from client.\n");
+         return EXIT_FAILURE;
+      }
+
+      if (joinsession(session_ptr, &header) == EXIT_FAILURE)
+      {
+         return EXIT_FAILURE;
+      }
+      num_jobs = (int) header.job_count;
+      flags = header.flags;
+      if ((flags & PROTO_FLAG_SESSION) != 0)
+      {
+         client_id = proto_getle64(header_buf + header_len -
+            PROTO_REQUEST_ID_BYTES);
+      }
+
+      unsigned char * records = malloc(len);
+
+      if (records == NULL)
+      {
+         fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+         return EXIT_FAILURE;
+      }
+
+      if (proto_recvall(connect_sd, records, len) == EXIT_FAILURE)
+      {
+         fprintf(stderr, "ERROR: Failed to receive jobs from client.\n");
+         free(records);
+         return EXIT_FAILURE;
+      }
+
+      stats_count(&edge_stats, COUNTER_BYTES_RECEIVED, len + header_len);
+
+      jobs = (header.opcode == PROTO_OP_WIDE_JOBS) ?
+         decodewidejobs(records, len, num_jobs, &wide_jobs) :
+         decodejobs(records, num_jobs);
+      free(records);
+
+      if (jobs == NULL)
+      {
+         return EXIT_FAILURE;
+      }
+   }
+
+   return initbatch(batch_ptr, jobs, num_jobs, flags, client_id, wide_jobs);
+}
+
+int setnodelay(int connect_sd)
+{
+   int yes = 1;
+
+   if (setsockopt(connect_sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int))
+      == -1)
+   {
+      fprintf(stderr, "ERROR: setsockopt for connected stream socket"
+         " failed.\n");
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+void opensession(struct session * session_ptr)
+{
+   session_ptr->keepalive = false;
+   session_ptr->num_received = 0;
+   session_ptr->num_answered = 0;
+   session_ptr->num_jobs = 0;
+   session_ptr->open_nsec = stats_nownsec();
+   stats_count(&edge_stats, COUNTER_CONNECTIONS, 1);
+}
+
+int joinsession(struct session * session_ptr,
+   const struct proto_header * header_ptr)
+{
+   bool keepalive = (header_ptr->flags & PROTO_FLAG_SESSION) != 0;
+
+   if (session_ptr->num_received == 0)
+   {
+      session_ptr->keepalive = keepalive;
+      if (keepalive)
+      {
+         stats_count(&edge_stats, COUNTER_SESSIONS, 1);
+      }
+   }
+   else if (keepalive != session_ptr->keepalive)
+   {
+      fprintf(stderr, "ERROR: Client mixed session and plain batches on one"
+         " connection.\n");
+      return EXIT_FAILURE;
+   }
+   session_ptr->num_received++;
+
+   return EXIT_SUCCESS;
+}
+
+void closesession(const struct session * session_ptr)
+{
+   if (!session_ptr->keepalive)
+   {
+      return;
+   }
+
+   logger_printf(LOGGER_INFO, "The edge server has closed a keep-alive session"
+      " that answered %lu batches of %lu jobs in %.3f seconds.\n",
+      session_ptr->num_answered, session_ptr->num_jobs,
+      (double) (stats_nownsec() - session_ptr->open_nsec) / 1e9);
+}
+
+uint64_t newrequestid()
+{
+   // Process ID keeps the IDs of forked children and of a restarted edge
+      //server apart, the low bits number the batch's shards
+   return ((uint64_t) getpid() << PID_SHIFT) |
+      ((++num_requests << SHARD_BITS) & ((1ull << PID_SHIFT) - 1));
+}
+
+size_t jobrecordbytes(const unsigned char * header_buf,
+   const struct proto_header * header_ptr)
+{
+   if ((header_ptr->job_count == 0) || (header_ptr->job_count > INT32_MAX /
+      PROTO_CLIENT_JOB_BYTES))
+   {
+      return 0;
+   }
+
+   if (header_ptr->opcode == PROTO_OP_JOBS)
+   {
+      return (size_t) header_ptr->job_count * PROTO_CLIENT_JOB_BYTES;
+   }
+
+   if (header_ptr->opcode == PROTO_OP_WIDE_JOBS)
+   {
+      uint64_t len = proto_getle64(header_buf + PROTO_HEADER_BYTES);
+
+      // Every wide job holds at least one word of each operand
+      if ((len >= (uint64_t) header_ptr->job_count * (PROTO_WIDE_JOB_BYTES +
+         2 * BITVEC_WORD_BYTES)) && (len <= PROTO_MAX_WIDE_BYTES))
+      {
+         return (size_t) len;
+      }
+   }
+
+   return 0;
+}
+
+bool validwidth(int width, uint32_t operand)
+{
+   int digits = (operand == 0) ? 1 : 32 - __builtin_clz(operand);
+
+   return (width >= digits) && (width <= PROTO_MAX_WIDTH);
+}
+
+struct job * decodejobs(const unsigned char * records, int num_jobs)
+{
+   struct job * jobs = malloc(num_jobs * sizeof(struct job));
+
+   if (jobs == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+      return NULL;
+   }
+
+   // Extract data from client records
+   for (int i = 0; i < num_jobs; i++)
+   {
+      const unsigned char * record = records + i * PROTO_CLIENT_JOB_BYTES;
+
+      jobs[i].opcode = record[0];
+      jobs[i].width1 = record[1];
+      jobs[i].width2 = record[2];
+      jobs[i].operand1 = proto_getle32(record + 4);
+      jobs[i].operand2 = proto_getle32(record + 8);
+
+      // Results are formatted at the operands' widths, which must hold
+         //every significant bit and fit in PROTO_MAX_WIDTH digits
+      if (!validwidth(jobs[i].width1, jobs[i].operand1) ||
+         !validwidth(jobs[i].width2, jobs[i].operand2))
+      {
+         fprintf(stderr, "ERROR: Invalid job received from client.\n");
+         free(jobs);
+         return NULL;
+      }
+   }
+
+   return jobs;
+}
+
+struct job * decodewidejobs(const unsigned char * records, size_t len,
+   int num_jobs, struct wide_job ** wide_jobs_ptr)
+{
+   size_t array_bytes = num_jobs * sizeof(struct wide_job);
+   struct job * jobs = calloc(num_jobs, sizeof(struct job));
+   struct wide_job * wide_jobs = malloc(array_bytes + len);
+
+   if ((jobs == NULL) || (wide_jobs == NULL))
+   {
+      fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+      free(jobs);
+      free(wide_jobs);
+      return NULL;
+   }
+
+   // Operands point into a copy of the records kept after the array
+   unsigned char * copy = (unsigned char *) wide_jobs + array_bytes;
+   size_t pos = 0;
+
+   memcpy(copy, records, len);
+
+   for (int i = 0; i < num_jobs; i++)
+   {
+      struct wide_job * wide_ptr = &wide_jobs[i];
+      size_t words1 = 0;
+      size_t words2 = 0;
+
+      if (len - pos >= PROTO_WIDE_JOB_BYTES)
+      {
+         jobs[i].opcode = copy[pos];
+         wide_ptr->bits1 = proto_getle32(copy + pos + 4);
+         wide_ptr->bits2 = proto_getle32(copy + pos + 8);
+         words1 = bitvec_words(wide_ptr->bits1);
+         words2 = bitvec_words(wide_ptr->bits2);
+         pos += PROTO_WIDE_JOB_BYTES;
+      }
+
+      if ((words1 == 0) || (words2 == 0) ||
+         ((len - pos) / BITVEC_WORD_BYTES < words1 + words2))
+      {
+         fprintf(stderr, "ERROR: Invalid wide job received from client.\n");
+         free(jobs);
+         free(wide_jobs);
+         return NULL;
+      }
+
+      // High bits past the operand's digits must not reach the result
+      bitvec_truncate(copy + pos, wide_ptr->bits1);
+      bitvec_truncate(copy + pos + words1 * BITVEC_WORD_BYTES,
+         wide_ptr->bits2);
+      wide_ptr->words1 = copy + pos;
+      wide_ptr->words2 = copy + pos + words1 * BITVEC_WORD_BYTES;
+      pos += (words1 + words2) * BITVEC_WORD_BYTES;
+
+      // AND results cannot be longer than the shorter operand, OR results
+         //are as long as the longer one
+      if (jobs[i].opcode == PROTO_OP_AND)
+      {
+         wide_ptr->num_words = (uint32_t) (words1 < words2 ? words1 : words2);
+      }
+      else
+      {
+         wide_ptr->num_words = (uint32_t) (words1 > words2 ? words1 : words2);
+      }
+   }
+
+   if (pos != len)
+   {
+      fprintf(stderr, "ERROR: Invalid wide job received from client.\n");
+      free(jobs);
+      free(wide_jobs);
+      return NULL;
+   }
+
+   *wide_jobs_ptr = wide_jobs;
+
+   return jobs;
+}
+
+int initbatch(struct batch * batch_ptr, struct job * jobs, int num_jobs,
+   uint16_t flags, uint64_t client_id, struct wide_job * wide_jobs)
+{
+   // Wide results are always sent in job order
+   bool unordered = ((flags & PROTO_FLAG_UNORDERED) != 0) &&
+      (wide_jobs == NULL);
+   uint16_t out_flags = flags & PROTO_FLAG_SESSION;
+   size_t header_len = proto_headerbytes(PROTO_OP_RESULTS, out_flags);
+
+   batch_ptr->jobs = jobs;
+   batch_ptr->num_jobs = num_jobs;
+   batch_ptr->num_and_jobs = 0;
+   batch_ptr->num_or_jobs = 0;
+   batch_ptr->and_index = NULL;
+   batch_ptr->or_index = NULL;
+   batch_ptr->twins = NULL;
+   batch_ptr->num_twins = 0;
+   batch_ptr->local = false;
+   batch_ptr->probe = false;
+   batch_ptr->local_usec = 0.0;
+   batch_ptr->offload_usec = -1;
+   batch_ptr->num_shards = 0;
+   batch_ptr->num_received = 0;
+   batch_ptr->unordered = unordered;
+   batch_ptr->wide_jobs = wide_jobs;
+   batch_ptr->segment_job = 0;
+   batch_ptr->segment_word = 0;
+   batch_ptr->segments_out = 0;
+   batch_ptr->segments = NULL;
+   batch_ptr->num_segments = 0;
+   batch_ptr->segment_base = 0;
+   batch_ptr->num_resent = 0;
+   batch_ptr->done = NULL;
+   batch_ptr->next_job = 0;
+   batch_ptr->session = (out_flags != 0);
+   batch_ptr->client_id = client_id;
+   batch_ptr->out = NULL;
+   batch_ptr->out_len = header_len + (size_t) num_jobs *
+      (unordered ? PROTO_INDEXED_RESULT_BYTES : PROTO_CLIENT_RESULT_BYTES);
+   batch_ptr->out_ready = 0;
+   batch_ptr->out_sent = 0;
+
+   // Count jobs for each backend server
+   for (int i = 0; i < num_jobs; i++)
+   {
+      jobs[i].twin = false;
+
+      if (jobs[i].opcode == PROTO_OP_AND)
+      {
+         batch_ptr->num_and_jobs++;
+      }
+      else if (jobs[i].opcode == PROTO_OP_OR)
+      {
+         batch_ptr->num_or_jobs++;
+      }
+      else
+      {
+         fprintf(stderr, "ERROR: Invalid operator received from client.\n");
+         freebatch(batch_ptr);
+         return EXIT_FAILURE;
+      }
+   }
+
+   // Wide jobs travel in segments, each tracked in done
+   size_t num_done = (size_t) num_jobs;
+
+   if (wide_jobs != NULL)
+   {
+      uint32_t segment_words = segmentwords();
+
+      num_done = 0;
+      batch_ptr->out_len = header_len;
+
+      for (int i = 0; i < num_jobs; i++)
+      {
+         wide_jobs[i].first_segment = num_done;
+         num_done += (wide_jobs[i].num_words + segment_words - 1) /
+            segment_words;
+         batch_ptr->out_len += PROTO_WIDE_RESULT_BYTES +
+            (size_t) wide_jobs[i].num_words * BITVEC_WORD_BYTES;
+      }
+
+      if ((batch_ptr->segments = calloc(num_done, sizeof(struct segment)))
+         == NULL)
+      {
+         fprintf(stderr, "ERROR: Failed to allocate segments.\n");
+         freebatch(batch_ptr);
+         return EXIT_FAILURE;
+      }
+      batch_ptr->num_segments = num_done;
+   }
+
+   // The whole results message is allocated up front and filled in as
+      //results arrive
+   if (((batch_ptr->done = calloc(num_done, 1)) == NULL) ||
+      ((batch_ptr->out = malloc(batch_ptr->out_len)) == NULL))
+   {
+      fprintf(stderr, "ERROR: Failed to allocate results.\n");
+      freebatch(batch_ptr);
+      return EXIT_FAILURE;
+   }
+
+   proto_packheader(batch_ptr->out, (wide_jobs != NULL) ?
+      PROTO_OP_WIDE_RESULTS : unordered ? PROTO_OP_INDEXED_RESULTS :
+      PROTO_OP_RESULTS, out_flags, (uint32_t) num_jobs);
+   if (batch_ptr->session)
+   {
+      proto_putle64(batch_ptr->out + PROTO_HEADER_BYTES, client_id);
+   }
+   batch_ptr->out_ready = header_len;
+
+   // Each wide result has a fixed place in the message
+   size_t offset = header_len;
+
+   for (int i = 0; (wide_jobs != NULL) && (i < num_jobs); i++)
+   {
+      wide_jobs[i].result = batch_ptr->out + offset;
+      wide_jobs[i].words_left = wide_jobs[i].num_words;
+      proto_putle32(wide_jobs[i].result + 4, wide_jobs[i].num_words);
+      offset += PROTO_WIDE_RESULT_BYTES +
+         (size_t) wide_jobs[i].num_words * BITVEC_WORD_BYTES;
+   }
+
+   // Repeated and cached jobs never go to the backend servers
+   const unsigned char * cached = NULL;
+
+   if ((wide_jobs == NULL) && !opts.ascii &&
+      (dedupjobs(batch_ptr) == EXIT_FAILURE))
+   {
+      freebatch(batch_ptr);
+      return EXIT_FAILURE;
+   }
+
+   if ((result_cache.shards != NULL) && (wide_jobs == NULL))
+   {
+      cachehits(batch_ptr);
+      cached = batch_ptr->done;
+   }
+
+   if (((batch_ptr->and_index = mapbackendjobs(PROTO_OP_AND, jobs, num_jobs,
+      batch_ptr->num_and_jobs, cached)) == NULL) || ((batch_ptr->or_index =
+      mapbackendjobs(PROTO_OP_OR, jobs, num_jobs, batch_ptr->num_or_jobs,
+      cached)) == NULL))
+   {
+      freebatch(batch_ptr);
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int dedupjobs(struct batch * batch_ptr)
+{
+   struct job * jobs = batch_ptr->jobs;
+   size_t num_slots = 2;
+   int * slots;
+
+   // Open addressing table at most half full, each slot holding the first
+      //job index with its key
+   while (num_slots < 2 * (size_t) batch_ptr->num_jobs)
+   {
+      num_slots *= 2;
+   }
+
+   if (((batch_ptr->twins = malloc((size_t) batch_ptr->num_jobs *
+      sizeof(int))) == NULL) || ((slots = malloc(num_slots * sizeof(int))) ==
+      NULL))
+   {
+      fprintf(stderr, "ERROR: Failed to allocate duplicate job table.\n");
+      return EXIT_FAILURE;
+   }
+   memset(slots, -1, num_slots * sizeof(int));
+
+   for (int i = 0; i < batch_ptr->num_jobs; i++)
+   {
+      uint64_t key = ((uint64_t) jobs[i].operand1 << 32 | jobs[i].operand2) ^
+         (uint64_t) jobs[i].opcode;
+      size_t slot = (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) &
+         (num_slots - 1);
+
+      batch_ptr->twins[i] = -1;
+
+      while ((slots[slot] != -1) && ((jobs[slots[slot]].opcode !=
+         jobs[i].opcode) || (jobs[slots[slot]].operand1 != jobs[i].operand1)
+         || (jobs[slots[slot]].operand2 != jobs[i].operand2)))
+      {
+         slot = (slot + 1) & (num_slots - 1);
+      }
+
+      if (slots[slot] == -1)
+      {
+         slots[slot] = i;
+         continue;
+      }
+
+      // Chain the repeat right behind the first job, order does not matter
+      int first = slots[slot];
+
+      jobs[i].twin = true;
+      batch_ptr->twins[i] = batch_ptr->twins[first];
+      batch_ptr->twins[first] = i;
+      batch_ptr->num_twins++;
+
+      if (jobs[i].opcode == PROTO_OP_AND)
+      {
+         batch_ptr->num_and_jobs--;
+      }
+      else
+      {
+         batch_ptr->num_or_jobs--;
+      }
+   }
+
+   free(slots);
+
+   return EXIT_SUCCESS;
+}
+
+void cachehits(struct batch * batch_ptr)
+{
+   for (int i = 0; i < batch_ptr->num_jobs; i++)
+   {
+      struct job * job_ptr = &batch_ptr->jobs[i];
+      uint32_t result;
+
+      if (job_ptr->twin || !cache_get(&result_cache, job_ptr->opcode,
+         job_ptr->operand1, job_ptr->operand2, &result))
+      {
+         continue;
+      }
+
+      if (job_ptr->opcode == PROTO_OP_AND)
+      {
+         batch_ptr->num_and_jobs--;
+      }
+      else
+      {
+         batch_ptr->num_or_jobs--;
+      }
+      finishjob(batch_ptr, i, result);
+   }
+
+   readyresults(batch_ptr);
+}
+
+void freebatch(struct batch * batch_ptr)
+{
+   // Results that never arrived and jobs never read no longer count against
+      //their replicas
+   for (int s = 0; s < batch_ptr->num_shards; s++)
+   {
+      pool_add(batch_ptr->shards[s].replica_ptr,
+         -batch_ptr->shards[s].num_left);
+      readjobs(&batch_ptr->shards[s], batch_ptr->shards[s].num_sent);
+   }
+   batch_ptr->num_shards = 0;
+
+   for (size_t s = 0; s < batch_ptr->num_segments; s++)
+   {
+      if (batch_ptr->segments[s].replica_ptr != NULL)
+      {
+         pool_add(batch_ptr->segments[s].replica_ptr, -1);
+      }
+   }
+   batch_ptr->num_segments = 0;
+
+   free(batch_ptr->jobs);
+   free(batch_ptr->and_index);
+   free(batch_ptr->or_index);
+   free(batch_ptr->twins);
+   free(batch_ptr->wide_jobs);
+   free(batch_ptr->segments);
+   free(batch_ptr->done);
+   free(batch_ptr->out);
+   batch_ptr->jobs = NULL;
+   batch_ptr->and_index = NULL;
+   batch_ptr->or_index = NULL;
+   batch_ptr->twins = NULL;
+   batch_ptr->wide_jobs = NULL;
+   batch_ptr->segments = NULL;
+   batch_ptr->done = NULL;
+   batch_ptr->out = NULL;
+}
+
+int sendjobs(int dgram_sd, struct pool * and_pool_ptr,
+   struct pool * or_pool_ptr, struct batch * batch_ptr)
+{
+   if (batch_ptr->wide_jobs != NULL)
+   {
+      if (sendsegments(dgram_sd, and_pool_ptr, or_pool_ptr, batch_ptr)
+         == EXIT_FAILURE)
+      {
+         return EXIT_FAILURE;
+      }
+   }
+   else if (opts.local && !opts.ascii && chooselocal(and_pool_ptr,
+      or_pool_ptr, batch_ptr))
+   {
+      computelocal(batch_ptr);
+   }
+   else if (!opts.ascii)
+   {
+      if ((sendbackendjobs(dgram_sd, and_pool_ptr, PROTO_OP_AND, batch_ptr)
+         == EXIT_FAILURE) || (sendbackendjobs(dgram_sd, or_pool_ptr,
+         PROTO_OP_OR, batch_ptr) == EXIT_FAILURE) ||
+         (dgram_txflush(dgram_sd, &backend_tx) == EXIT_FAILURE))
+      {
+         return EXIT_FAILURE;
+      }
+   }
+   else
+   {
+      struct job * jobs = batch_ptr->jobs;
+
+      for (int i = 0; i < batch_ptr->num_jobs; i++)
+      {
+         struct sockaddr_in * backend_addr_ptr;
+         int num_backend_jobs;
+
+         // The ASCII protocol has no request IDs to tell shards apart
+         if (jobs[i].opcode == PROTO_OP_AND)
+         {
+            backend_addr_ptr = &and_pool_ptr->replicas[0].addr;
+            num_backend_jobs = batch_ptr->num_and_jobs;
+         }
+         else
+         {
+            backend_addr_ptr = &or_pool_ptr->replicas[0].addr;
+            num_backend_jobs = batch_ptr->num_or_jobs;
+         }
+
+         char payload[BACKEND_SEND_BYTES + PROTO_MAX_WIDTH * 2];
+         char operand1[PROTO_MAX_WIDTH + 1];
+         char operand2[PROTO_MAX_WIDTH + 1];
+
+         proto_wordtostr(jobs[i].operand1, jobs[i].width1, operand1);
+         proto_wordtostr(jobs[i].operand2, jobs[i].width2, operand2);
+         sprintf(payload, "%10s %10s %3d %3d", operand1, operand2, i,
+            num_backend_jobs);
+
+         if (sendto(dgram_sd, payload, strlen(payload), 0,
+            (struct sockaddr *) backend_addr_ptr, sizeof(*backend_addr_ptr))
+            != BACKEND_SEND_BYTES)
+         {
+            fprintf(stderr, "ERROR: Failed to send job to backend %s server.\n",
+               jobs[i].opcode == PROTO_OP_AND ? "AND" : "OR");
+            return EXIT_FAILURE;
+         }
+         dgram_counters.send_calls++;
+         dgram_counters.datagrams_sent++;
+      }
+   }
+
+   // Print messages indicating that jobs were sent to the backend servers
+   logger_printf(LOGGER_INFO, "The edge server has successfully sent %d lines"
+      " to the backend AND server.\n", batch_ptr->num_and_jobs);
+   logger_printf(LOGGER_INFO, "The edge server has successfully sent %d lines"
+      " to the backend OR server.\n", batch_ptr->num_or_jobs);
+
+   return EXIT_SUCCESS;
+}
+
+int sendbackendjobs(int dgram_sd, struct pool * pool_ptr, int opcode,
+   struct batch * batch_ptr)
+{
+   int num_backend_jobs = (opcode == PROTO_OP_AND) ? batch_ptr->num_and_jobs :
+      batch_ptr->num_or_jobs;
+   int max_records = (opts.dgram_bytes - PROTO_DGRAM_HEADER_BYTES) /
+      PROTO_BACKEND_JOB_BYTES;
+   int num_shards = (num_backend_jobs + max_records - 1) / max_records;
+   uint32_t used = 0; // replicas already holding a shard of these jobs
+   int backend_job = 0; // backend job number of the next shard's first job
+   uint64_t now = nowusec();
+   long hedge_after = -1;
+   long rto = pool_rto(pool_ptr);
+
+   if (num_shards > pool_ptr->num_replicas)
+   {
+      num_shards = pool_ptr->num_replicas;
+   }
+
+   // Only a pool with another replica to send a copy to can hedge
+   if ((opts.hedge != 0) && (pool_ptr->num_replicas > 1) &&
+      ((hedge_after = pool_latency(pool_ptr, opts.hedge)) != -1) &&
+      (hedge_after < HEDGE_MIN_USEC))
+   {
+      hedge_after = HEDGE_MIN_USEC;
+   }
+
+   for (int n = 0; n < num_shards; n++)
+   {
+      // Each shard goes to a different replica so their batches stay apart
+      int s = batch_ptr->num_shards;
+      struct shard * shard_ptr = &batch_ptr->shards[s];
+      int replica = pool_pick(pool_ptr, opts.policy,
+         batch_ptr->request_id | (uint64_t) s, used);
+
+      used |= 1u << replica;
+      shard_ptr->pool_ptr = pool_ptr;
+      shard_ptr->replica_ptr = &pool_ptr->replicas[replica];
+      shard_ptr->opcode = opcode;
+      shard_ptr->first_job = backend_job;
+      shard_ptr->num_jobs = num_backend_jobs / num_shards +
+         ((n < num_backend_jobs % num_shards) ? 1 : 0);
+      shard_ptr->num_left = shard_ptr->num_jobs;
+      shard_ptr->num_pending = shard_ptr->num_jobs;
+      shard_ptr->partner = -1;
+      shard_ptr->hedge = false;
+      shard_ptr->sent_usec = now;
+      shard_ptr->hedge_usec = (hedge_after == -1) ? 0 :
+         now + (uint64_t) hedge_after;
+      shard_ptr->retry_usec = now + (uint64_t) rto;
+      shard_ptr->retries = 0;
+      shard_ptr->resent = false;
+      shard_ptr->num_sent = 0;
+      shard_ptr->num_read = 0;
+      pool_add(shard_ptr->replica_ptr, shard_ptr->num_jobs);
+      batch_ptr->num_shards++;
+      hedge_stats.shards++;
+
+      if (sendburst(dgram_sd, batch_ptr, s) == EXIT_FAILURE)
+      {
+         return EXIT_FAILURE;
+      }
+
+      backend_job += shard_ptr->num_jobs;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int sendrange(int dgram_sd, struct batch * batch_ptr, int s, int first,
+   int count, uint16_t flags)
+{
+   struct shard * shard_ptr = &batch_ptr->shards[s];
+   struct job * jobs = batch_ptr->jobs;
+   int * job_index = ((shard_ptr->opcode == PROTO_OP_AND) ?
+      batch_ptr->and_index : batch_ptr->or_index) + shard_ptr->first_job;
+   uint64_t shard_id = batch_ptr->request_id | (uint64_t) s;
+   int max_records = (opts.dgram_bytes - PROTO_DGRAM_HEADER_BYTES) /
+      PROTO_BACKEND_JOB_BYTES;
+   unsigned char * payload = dgram_txbuf(&backend_tx);
+   int first_job = first; // shard job number of first record in payload
+   int num_records = 0;
+
+   for (int k = first; k < first + count; k++)
+   {
+      struct job * job_ptr = &jobs[job_index[k]];
+      unsigned char * record = payload + PROTO_DGRAM_HEADER_BYTES +
+         num_records * PROTO_BACKEND_JOB_BYTES;
+
+      record[0] = job_ptr->width1;
+      record[1] = job_ptr->width2;
+      proto_putle16(record + 2, 0);
+      proto_putle32(record + 4, job_ptr->operand1);
+      proto_putle32(record + 8, job_ptr->operand2);
+      num_records++;
+
+      // Queue payload once it is full or holds the range's last job
+      if ((num_records == max_records) || (k == first + count - 1))
+      {
+         proto_packdgramheader(payload, shard_ptr->opcode, shard_id,
+            (uint32_t) shard_ptr->num_jobs, (uint32_t) first_job,
+            (uint32_t) num_records);
+         if (k == first + count - 1)
+         {
+            proto_putle16(payload + 6, flags);
+         }
+
+         if (dgram_txpush(dgram_sd, &backend_tx, PROTO_DGRAM_HEADER_BYTES +
+            num_records * PROTO_BACKEND_JOB_BYTES,
+            &shard_ptr->replica_ptr->addr) == EXIT_FAILURE)
+         {
+            fprintf(stderr, "ERROR: Failed to send jobs to backend %s"
+               " server.\n", proto_opname(shard_ptr->opcode));
+            return EXIT_FAILURE;
+         }
+
+         payload = dgram_txbuf(&backend_tx);
+         first_job = k + 1;
+         num_records = 0;
+      }
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int resendshard(int dgram_sd, struct batch * batch_ptr, int s)
+{
+   struct shard * shard_ptr = &batch_ptr->shards[s];
+   int * job_index = ((shard_ptr->opcode == PROTO_OP_AND) ?
+      batch_ptr->and_index : batch_ptr->or_index) + shard_ptr->first_job;
+   int first = -1; // first job of the last unanswered range found
+   int count = 0;
+   int num_resent = 0;
+
+   shard_ptr->resent = true;
+
+   // The replica cannot have finished, the report is enough to go on
+   if (shard_ptr->num_sent < shard_ptr->num_jobs)
+   {
+      batch_ptr->num_resent++;
+      return sendrange(dgram_sd, batch_ptr, s, shard_ptr->num_sent - 1, 1,
+         PROTO_FLAG_POLL | PROTO_FLAG_CREDIT);
+   }
+
+   // Each range is sent once the next is found, so the last one can poll
+   for (int k = 0; k < shard_ptr->num_jobs; k++)
+   {
+      if (batch_ptr->done[job_index[k]])
+      {
+         continue;
+      }
+
+      int end = k + 1;
+
+      while ((end < shard_ptr->num_jobs) && !batch_ptr->done[job_index[end]])
+      {
+         end++;
+      }
+
+      if ((count > 0) && (sendrange(dgram_sd, batch_ptr, s, first, count, 0)
+         == EXIT_FAILURE))
+      {
+         return EXIT_FAILURE;
+      }
+      first = k;
+      count = end - k;
+      num_resent += count;
+      k = end;
+   }
+   batch_ptr->num_resent += num_resent;
+
+   return (count == 0) ? EXIT_SUCCESS : sendrange(dgram_sd, batch_ptr, s,
+      first, count, PROTO_FLAG_POLL);
+}
+
+int sendburst(int dgram_sd, struct batch * batch_ptr, int s)
+{
+   struct shard * shard_ptr = &batch_ptr->shards[s];
+   struct shard * origin_ptr = shard_ptr->hedge ?
+      &batch_ptr->shards[shard_ptr->partner] : shard_ptr;
+   long max_records = (opts.dgram_bytes - PROTO_DGRAM_HEADER_BYTES) /
+      PROTO_BACKEND_JOB_BYTES;
+   long credit = pool_credit(shard_ptr->replica_ptr, 2 *
+      (long) opts.dgram_bytes + DGRAM_COST_OVERHEAD, max_records);
+
+   if ((shard_ptr->num_sent == shard_ptr->num_jobs) ||
+      (origin_ptr->num_pending == 0))
+   {
+      return EXIT_SUCCESS;
+   }
+
+   if (credit < max_records)
+   {
+      if (shard_ptr->num_read < shard_ptr->num_sent)
+      {
+         return EXIT_SUCCESS; // the replica's report will free room
+      }
+      credit = max_records;
+   }
+
+   // Whole datagrams only, so every burst but the last is full
+   int count = shard_ptr->num_jobs - shard_ptr->num_sent;
+
+   if (count > credit / max_records * max_records)
+   {
+      count = (int) (credit / max_records * max_records);
+   }
+
+   if (sendrange(dgram_sd, batch_ptr, s, shard_ptr->num_sent, count,
+      (shard_ptr->num_sent + count < shard_ptr->num_jobs) ?
+      PROTO_FLAG_CREDIT : 0) == EXIT_FAILURE)
+   {
+      return EXIT_FAILURE;
+   }
+   pool_charge(shard_ptr->replica_ptr, count);
+   shard_ptr->num_sent += count;
+
+   return EXIT_SUCCESS;
+}
+
+void readjobs(struct shard * shard_ptr, int num_read)
+{
+   if (num_read > shard_ptr->num_sent)
+   {
+      num_read = shard_ptr->num_sent;
+   }
+
+   if (num_read > shard_ptr->num_read)
+   {
+      pool_charge(shard_ptr->replica_ptr, -(num_read - shard_ptr->num_read));
+      shard_ptr->num_read = num_read;
+   }
+}
+
+int runtimers(int dgram_sd, struct batch * batch_ptr)
+{
+   uint64_t now = nowusec();
+   int num_shards = batch_ptr->num_shards; // hedges are never hedged
+   bool sent = false;
+
+   for (int s = 0; s < num_shards; s++)
+   {
+      struct shard * shard_ptr = &batch_ptr->shards[s];
+
+      if ((shard_ptr->hedge_usec == 0) || (shard_ptr->num_pending == 0) ||
+         (now < shard_ptr->hedge_usec))
+      {
+         continue;
+      }
+      shard_ptr->hedge_usec = 0;
+
+      struct pool * pool_ptr = shard_ptr->pool_ptr;
+      int h = batch_ptr->num_shards;
+      int replica = pool_pick(pool_ptr, opts.policy,
+         batch_ptr->request_id | (uint64_t) h,
+         1u << (shard_ptr->replica_ptr - pool_ptr->replicas));
+
+      if ((h == MAX_SHARDS) || (replica == -1))
+      {
+         continue;
+      }
+
+      struct shard * hedge_ptr = &batch_ptr->shards[h];
+
+      *hedge_ptr = *shard_ptr;
+      hedge_ptr->replica_ptr = &pool_ptr->replicas[replica];
+      hedge_ptr->num_left = hedge_ptr->num_jobs;
+      hedge_ptr->partner = s;
+      hedge_ptr->hedge = true;
+      hedge_ptr->sent_usec = now;
+      hedge_ptr->retry_usec = now + (uint64_t) pool_rto(pool_ptr);
+      hedge_ptr->retries = 0;
+      hedge_ptr->resent = false;
+      hedge_ptr->num_sent = 0;
+      hedge_ptr->num_read = 0;
+      shard_ptr->partner = h;
+      pool_add(hedge_ptr->replica_ptr, hedge_ptr->num_jobs);
+      batch_ptr->num_shards++;
+      hedge_stats.hedged++;
+      stats_count(&edge_stats, COUNTER_SHARDS_HEDGED, 1);
+
+      if (sendburst(dgram_sd, batch_ptr, h) == EXIT_FAILURE)
+      {
+         return EXIT_FAILURE;
+      }
+      sent = true;
+   }
+
+   // Resend whatever a copy has left unanswered for too long
+   for (int s = 0; s < batch_ptr->num_shards; s++)
+   {
+      struct shard * shard_ptr = &batch_ptr->shards[s];
+      struct shard * origin_ptr = shard_ptr->hedge ?
+         &batch_ptr->shards[shard_ptr->partner] : shard_ptr;
+
+      if ((shard_ptr->retry_usec == 0) || (now < shard_ptr->retry_usec))
+      {
+         continue;
+      }
+
+      if (origin_ptr->num_pending == 0)
+      {
+         shard_ptr->retry_usec = 0;
+         continue;
+      }
+
+      if (++shard_ptr->retries > RETRY_LIMIT)
+      {
+         fprintf(stderr, "ERROR: Backend %s server did not answer after %d"
+            " retries.\n", proto_opname(shard_ptr->opcode), RETRY_LIMIT);
+         return EXIT_FAILURE;
+      }
+
+      long rto = pool_rto(shard_ptr->pool_ptr) << shard_ptr->retries;
+
+      shard_ptr->retry_usec = now + (uint64_t) ((rto < POOL_RTO_MAX_USEC) ?
+         rto : POOL_RTO_MAX_USEC);
+
+      if (resendshard(dgram_sd, batch_ptr, s) == EXIT_FAILURE)
+      {
+         return EXIT_FAILURE;
+      }
+      sent = true;
+   }
+
+   for (size_t g = batch_ptr->segment_base; g < batch_ptr->num_segments; g++)
+   {
+      struct segment * segment_ptr = &batch_ptr->segments[g];
+
+      // Segments are sent in order, so none past the first unsent one is out
+      if ((segment_ptr->replica_ptr == NULL) && !batch_ptr->done[g])
+      {
+         break;
+      }
+
+      if ((segment_ptr->replica_ptr == NULL) ||
+         (now < segment_ptr->retry_usec))
+      {
+         continue;
+      }
+
+      if (++segment_ptr->retries > RETRY_LIMIT)
+      {
+         fprintf(stderr, "ERROR: Backend %s server did not answer after %d"
+            " retries.\n", proto_opname(
+            batch_ptr->jobs[segment_ptr->job].opcode), RETRY_LIMIT);
+         return EXIT_FAILURE;
+      }
+
+      long rto = pool_rto(segment_ptr->pool_ptr) << segment_ptr->retries;
+
+      segment_ptr->retry_usec = now + (uint64_t) ((rto < POOL_RTO_MAX_USEC) ?
+         rto : POOL_RTO_MAX_USEC);
+      batch_ptr->num_resent++;
+
+      if (pushsegment(dgram_sd, batch_ptr, g) == EXIT_FAILURE)
+      {
+         return EXIT_FAILURE;
+      }
+      sent = true;
+   }
+
+   return sent ? dgram_txflush(dgram_sd, &backend_tx) : EXIT_SUCCESS;
+}
+
+long timerwait(const struct batch * batch_ptr)
+{
+   uint64_t now = nowusec();
+   uint64_t next = 0; // earliest time a timer is due, 0 if none
+
+   for (int s = 0; s < batch_ptr->num_shards; s++)
+   {
+      const struct shard * shard_ptr = &batch_ptr->shards[s];
+
+      if ((shard_ptr->hedge_usec != 0) && (shard_ptr->num_pending != 0) &&
+         ((next == 0) || (shard_ptr->hedge_usec < next)))
+      {
+         next = shard_ptr->hedge_usec;
+      }
+
+      if ((shard_ptr->retry_usec != 0) &&
+         ((next == 0) || (shard_ptr->retry_usec < next)))
+      {
+         next = shard_ptr->retry_usec;
+      }
+   }
+
+   for (size_t g = batch_ptr->segment_base; g < batch_ptr->num_segments; g++)
+   {
+      const struct segment * segment_ptr = &batch_ptr->segments[g];
+
+      // Segments are sent in order, so none past the first unsent one is out
+      if ((segment_ptr->replica_ptr == NULL) && !batch_ptr->done[g])
+      {
+         break;
+      }
+
+      if ((segment_ptr->replica_ptr != NULL) &&
+         ((next == 0) || (segment_ptr->retry_usec < next)))
+      {
+         next = segment_ptr->retry_usec;
+      }
+   }
+
+   if (next == 0)
+   {
+      return -1;
+   }
+
+   return (next > now) ? (long) (next - now) : 0;
+}
+
+void finishshard(struct batch * batch_ptr, int s)
+{
+   struct shard * shard_ptr = &batch_ptr->shards[s];
+   uint64_t now = nowusec();
+
+   pool_observe(shard_ptr->pool_ptr, (long) (now - shard_ptr->sent_usec));
+
+   // Neither copy needs to answer or be sent anything more
+   for (int c = s; c != -1; c = (c == s) ? shard_ptr->partner : -1)
+   {
+      struct shard * copy_ptr = &batch_ptr->shards[c];
+
+      pool_add(copy_ptr->replica_ptr, -copy_ptr->num_left);
+      copy_ptr->num_left = 0;
+      copy_ptr->retry_usec = 0;
+      readjobs(copy_ptr, copy_ptr->num_sent);
+   }
+
+   // Resent jobs may be answered twice, possibly after the batch is gone
+   if (shard_ptr->resent)
+   {
+      expectlate(batch_ptr->request_id | (uint64_t) s, false);
+   }
+
+   if (shard_ptr->partner == -1)
+   {
+      return;
+   }
+
+   // The other copy may still answer too
+   expectlate(batch_ptr->request_id | (uint64_t) shard_ptr->partner,
+      shard_ptr->hedge);
+
+   if (shard_ptr->hedge)
+   {
+      hedge_stats.wins++;
+   }
+}
+
+void expectlate(uint64_t request_id, bool hedge_won)
+{
+   struct late_shard * late_ptr = &late_shards[next_late];
+
+   late_ptr->request_id = request_id;
+   late_ptr->won_usec = nowusec();
+   late_ptr->hedge_won = hedge_won;
+   next_late = (next_late + 1) % LATE_SHARDS;
+}
+
+bool lateresults(uint64_t request_id)
+{
+   for (int k = 0; k < LATE_SHARDS; k++)
+   {
+      struct late_shard * late_ptr = &late_shards[k];
+
+      if (late_ptr->request_id != request_id)
+      {
+         continue;
+      }
+
+      if (late_ptr->hedge_won)
+      {
+         hedge_stats.saved++;
+         hedge_stats.saved_usec += nowusec() - late_ptr->won_usec;
+         late_ptr->hedge_won = false;
+      }
+      stats_count(&edge_stats, COUNTER_LATE_DATAGRAMS, 1);
+
+      return true;
+   }
+
+   return false;
+}
+
+uint64_t nowusec()
+{
+   return nownsec() / 1000;
+}
+
+uint64_t nownsec()
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+bool chooselocal(struct pool * and_pool_ptr, struct pool * or_pool_ptr,
+   struct batch * batch_ptr)
+{
+   long and_usec = (batch_ptr->num_and_jobs == 0) ? 0 :
+      pool_latency(and_pool_ptr, 50);
+   long or_usec = (batch_ptr->num_or_jobs == 0) ? 0 :
+      pool_latency(or_pool_ptr, 50);
+
+   // Shards of both backend servers are answered side by side
+   batch_ptr->offload_usec = ((and_usec == -1) || (or_usec == -1)) ? -1 :
+      (and_usec > or_usec) ? and_usec : or_usec;
+   batch_ptr->local_usec = local_job_nsec * (double)
+      (batch_ptr->num_and_jobs + batch_ptr->num_or_jobs) / 1000.0;
+
+   // Keep measuring the backend servers even while they are not worth it
+   batch_ptr->probe = (((batch_ptr->request_id * 0x9e3779b97f4a7c15ull) >>
+      32) % LOCAL_PROBE_ODDS) == 0;
+
+   batch_ptr->local = (batch_ptr->offload_usec != -1) && !batch_ptr->probe &&
+      (batch_ptr->local_usec <= (double) batch_ptr->offload_usec);
+
+   return batch_ptr->local;
+}
+
+void computelocal(struct batch * batch_ptr)
+{
+   int num_computed = batch_ptr->num_and_jobs + batch_ptr->num_or_jobs;
+   uint64_t start = nownsec();
+
+   for (int i = 0; i < batch_ptr->num_jobs; i++)
+   {
+      struct job * job_ptr = &batch_ptr->jobs[i];
+
+      if (job_ptr->twin || batch_ptr->done[i])
+      {
+         continue;
+      }
+
+      finishjob(batch_ptr, i, (job_ptr->opcode == PROTO_OP_AND) ?
+         job_ptr->operand1 & job_ptr->operand2 :
+         job_ptr->operand1 | job_ptr->operand2);
+   }
+   readyresults(batch_ptr);
+
+   batch_ptr->num_and_jobs = 0;
+   batch_ptr->num_or_jobs = 0;
+
+   // Follow the measured cost slowly so one descheduled batch does not
+      //swing the policy
+   if (num_computed > 0)
+   {
+      local_job_nsec += ((double) (nownsec() - start) / num_computed -
+         local_job_nsec) / 8.0;
+   }
+}
+
+uint32_t segmentwords()
+{
+   return (uint32_t) ((opts.dgram_bytes - PROTO_SEGMENT_HEADER_BYTES) /
+      PROTO_SEGMENT_JOB_BYTES);
+}
+
+int sendsegments(int dgram_sd, struct pool * and_pool_ptr,
+   struct pool * or_pool_ptr, struct batch * batch_ptr)
+{
+   uint32_t segment_words = segmentwords();
+   int window = SEGMENT_WINDOW_BYTES / opts.dgram_bytes;
+
+   // Small datagrams still cost a buffer each at the backend servers
+   if (window < 2)
+   {
+      window = 2;
+   }
+   else if (window > DGRAM_BATCH)
+   {
+      window = DGRAM_BATCH;
    }
 
-   // Print messages indicating that jobs were sent to the backend servers
-   fprintf(stdout, "The edge server has successfully sent %d lines to the"
-      " backend AND server.\n", num_and_jobs);
-   fprintf(stdout, "The edge server has successfully sent %d lines to the"
-      " backend OR server.\n", num_or_jobs);
+   // Refill the window in bursts rather than one segment per result
+   if (batch_ptr->segments_out > window / 2)
+   {
+      return EXIT_SUCCESS;
+   }
+
+   while ((batch_ptr->segments_out < window) &&
+      (batch_ptr->segment_job < batch_ptr->num_jobs))
+   {
+      int i = batch_ptr->segment_job;
+      struct wide_job * wide_ptr = &batch_ptr->wide_jobs[i];
+      uint32_t first_word = batch_ptr->segment_word;
+      uint32_t num_words = wide_ptr->num_words - first_word < segment_words ?
+         wide_ptr->num_words - first_word : segment_words;
+      size_t segment = wide_ptr->first_segment + first_word / segment_words;
+      struct segment * segment_ptr = &batch_ptr->segments[segment];
+      struct pool * pool_ptr = (batch_ptr->jobs[i].opcode == PROTO_OP_AND) ?
+         and_pool_ptr : or_pool_ptr;
+
+      // Segments need no state at the backends, so each may go anywhere
+      segment_ptr->pool_ptr = pool_ptr;
+      segment_ptr->replica_ptr = &pool_ptr->replicas[pool_pick(pool_ptr,
+         opts.policy, batch_ptr->request_id ^ segment, 0)];
+      segment_ptr->job = i;
+      segment_ptr->first_word = first_word;
+      segment_ptr->retry_usec = nowusec() + (uint64_t) pool_rto(pool_ptr);
+      segment_ptr->retries = 0;
+      pool_add(segment_ptr->replica_ptr, 1);
+      batch_ptr->segments_out++;
+
+      if (pushsegment(dgram_sd, batch_ptr, segment) == EXIT_FAILURE)
+      {
+         return EXIT_FAILURE;
+      }
+
+      // Move on to the next job once every segment of this one is out
+      batch_ptr->segment_word += num_words;
+      if (batch_ptr->segment_word == wide_ptr->num_words)
+      {
+         batch_ptr->segment_job++;
+         batch_ptr->segment_word = 0;
+      }
+   }
+
+   return dgram_txflush(dgram_sd, &backend_tx);
+}
+
+int pushsegment(int dgram_sd, struct batch * batch_ptr, size_t segment)
+{
+   struct segment * segment_ptr = &batch_ptr->segments[segment];
+   struct wide_job * wide_ptr = &batch_ptr->wide_jobs[segment_ptr->job];
+   int opcode = batch_ptr->jobs[segment_ptr->job].opcode;
+   uint32_t segment_words = segmentwords();
+   uint32_t first_word = segment_ptr->first_word;
+   uint32_t num_words = wide_ptr->num_words - first_word < segment_words ?
+      wide_ptr->num_words - first_word : segment_words;
+   unsigned char * payload = dgram_txbuf(&backend_tx);
+   unsigned char * operand1 = payload + PROTO_SEGMENT_HEADER_BYTES;
+
+   proto_packsegheader(payload, opcode, batch_ptr->request_id,
+      (uint32_t) segment_ptr->job, wide_ptr->num_words, first_word, num_words);
+   copysegment(operand1, wide_ptr->words1, bitvec_words(wide_ptr->bits1),
+      first_word, num_words);
+   copysegment(operand1 + num_words * BITVEC_WORD_BYTES, wide_ptr->words2,
+      bitvec_words(wide_ptr->bits2), first_word, num_words);
+
+   if (dgram_txpush(dgram_sd, &backend_tx, PROTO_SEGMENT_HEADER_BYTES +
+      num_words * PROTO_SEGMENT_JOB_BYTES, &segment_ptr->replica_ptr->addr)
+      == EXIT_FAILURE)
+   {
+      fprintf(stderr, "ERROR: Failed to send jobs to backend %s server.\n",
+         proto_opname(opcode));
+      return EXIT_FAILURE;
+   }
 
    return EXIT_SUCCESS;
 }
 
-int recvresults(int dgram_sd, struct sockaddr_in * backend_addr_ptr,
-   socklen_t backend_addr_len, int num_backend_jobs, struct job jobs[])
+void copysegment(unsigned char * dst, const unsigned char * vec,
+   size_t vec_words, uint32_t first_word, uint32_t num_words)
+{
+   size_t copy_words = 0;
+
+   if (first_word < vec_words)
+   {
+      copy_words = vec_words - first_word < num_words ?
+         vec_words - first_word : num_words;
+      memcpy(dst, vec + (size_t) first_word * BITVEC_WORD_BYTES,
+         copy_words * BITVEC_WORD_BYTES);
+   }
+
+   memset(dst + copy_words * BITVEC_WORD_BYTES, 0,
+      (num_words - copy_words) * BITVEC_WORD_BYTES);
+}
+
+int recvresults(int dgram_sd, int connect_sd, struct pool * and_pool_ptr,
+   struct pool * or_pool_ptr, struct batch * batch_ptr)
 {
-   for (int i = 0; i < num_backend_jobs; i++)
+   if (opts.ascii)
+   {
+      for (int i = 0; i < batch_ptr->num_jobs; i++)
+      {
+         char buffer[BACKEND_RECV_BYTES + 1];
+
+         if (recvfrom(dgram_sd, buffer, BACKEND_RECV_BYTES, 0, NULL, NULL)
+            != BACKEND_RECV_BYTES)
+         {
+            fprintf(stderr, "ERROR: Failed to receive result from backend"
+               " server.\n");
+            return EXIT_FAILURE;
+         }
+         buffer[BACKEND_RECV_BYTES] = '\0'; // append null character to buffer
+         dgram_counters.recv_calls++;
+         dgram_counters.datagrams_received++;
+
+         int job_number;
+         char result_str[RESULT_BYTES + 1];
+         uint32_t result;
+
+         if ((sscanf(buffer, "%d %10s", &job_number, result_str) != 2) ||
+            (proto_strtoword(result_str, strlen(result_str), &result) == -1))
+         {
+            fprintf(stderr, "ERROR: Failed to extract fields from result\n.");
+            return EXIT_FAILURE;
+         }
+
+         if ((job_number < 0) || (job_number >= batch_ptr->num_jobs))
+         {
+            fprintf(stderr, "ERROR: Invalid job number in result.\n");
+            return EXIT_FAILURE;
+         }
+
+         batch_ptr->jobs[job_number].result = result;
+      }
+      batch_ptr->num_received = batch_ptr->num_jobs;
+
+      return EXIT_SUCCESS;
+   }
+
+   // Results answered from the cache need not wait for the backend servers
+   if (flushresults(connect_sd, batch_ptr) == EXIT_FAILURE)
+   {
+      return EXIT_FAILURE;
+   }
+
+   while (batch_ptr->num_received < batch_ptr->num_jobs)
    {
-      char buffer[BACKEND_RECV_BYTES + 1];
-      int and_addr_len;
+      unsigned char * buffer;
+      ssize_t len;
+      struct proto_header header;
+      long wait_usec;
+
+      // Wait for results only until the next shard is due to be hedged or
+         //resent
+      if (!dgram_rxpending(&backend_rx) &&
+         ((wait_usec = timerwait(batch_ptr)) != -1))
+      {
+         struct pollfd pfd = {dgram_sd, POLLIN, 0};
+
+         if (poll(&pfd, 1, (int) ((wait_usec + 999) / 1000)) == 0)
+         {
+            if (runtimers(dgram_sd, batch_ptr) == EXIT_FAILURE)
+            {
+               return EXIT_FAILURE;
+            }
+            continue;
+         }
+      }
 
-      if (recvfrom(dgram_sd, buffer, BACKEND_RECV_BYTES, 0,
-         (struct sockaddr *) backend_addr_ptr, &backend_addr_len)
-         != BACKEND_RECV_BYTES)
+      if ((len = dgram_recv(dgram_sd, &backend_rx, &buffer, NULL)) == -1)
       {
-         fprintf(stderr, "ERROR: Failed to receive result from backend AND"
+         fprintf(stderr, "ERROR: Failed to receive results from backend"
             " server.\n");
          return EXIT_FAILURE;
       }
-      buffer[BACKEND_RECV_BYTES] = '\0'; // append null character to buffer
 
-      int job_number;
-      char result[11];
+      if (proto_unpackdgramheader(buffer, (size_t) len,
+         PROTO_BACKEND_RESULT_BYTES, &header) == EXIT_FAILURE)
+      {
+         fprintf(stderr, "ERROR: Failed to extract fields from results.\n");
+         continue;
+      }
 
-      if (sscanf(buffer, "%d %s", &job_number, result) != 2)
+      if ((handleresults(dgram_sd, batch_ptr, &header, buffer) ==
+         EXIT_SUCCESS) &&
+         ((flushresults(connect_sd, batch_ptr) == EXIT_FAILURE) ||
+         ((batch_ptr->wide_jobs != NULL) && (sendsegments(dgram_sd,
+         and_pool_ptr, or_pool_ptr, batch_ptr) == EXIT_FAILURE))))
       {
-         fprintf(stderr, "ERROR: Failed to extract fields from result\n.");
          return EXIT_FAILURE;
       }
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int handleresults(int dgram_sd, struct batch * batch_ptr,
+   const struct proto_header * header_ptr, const unsigned char * buffer)
+{
+   if ((header_ptr->request_id & ~SHARD_MASK) != batch_ptr->request_id)
+   {
+      // Hedge losers and resent shards may answer after their batch is done
+      if (!lateresults(header_ptr->request_id))
+      {
+         fprintf(stderr, "ERROR: Received results for a different batch.\n");
+      }
+      return EXIT_FAILURE;
+   }
+
+   if ((header_ptr->flags & PROTO_FLAG_SEGMENT) != 0)
+   {
+      return handlesegment(batch_ptr, header_ptr, buffer);
+   }
+
+   // Results are numbered separately for each shard
+   int s = (int) (header_ptr->request_id & SHARD_MASK);
+   struct shard * shard_ptr = &batch_ptr->shards[s];
+
+   if ((s >= batch_ptr->num_shards) || ((header_ptr->opcode !=
+      ((shard_ptr->opcode == PROTO_OP_AND) ? PROTO_OP_AND_RESULTS :
+      PROTO_OP_OR_RESULTS)) && (header_ptr->opcode != PROTO_OP_MISSING) &&
+      (header_ptr->opcode != PROTO_OP_CREDIT)) ||
+      (header_ptr->job_count != (uint32_t) shard_ptr->num_jobs))
+   {
+      fprintf(stderr, "ERROR: Results do not match their batch.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (header_ptr->opcode == PROTO_OP_MISSING)
+   {
+      return handlemissing(dgram_sd, batch_ptr, header_ptr, buffer);
+   }
+
+   if (header_ptr->opcode == PROTO_OP_CREDIT)
+   {
+      return handlecredit(dgram_sd, batch_ptr, header_ptr, buffer);
+   }
+
+   int * job_index = ((shard_ptr->opcode == PROTO_OP_AND) ?
+      batch_ptr->and_index : batch_ptr->or_index) + shard_ptr->first_job;
+   int num_new = 0;
+
+   for (uint32_t k = 0; k < header_ptr->record_count; k++)
+   {
+      int i = job_index[header_ptr->first_job + k];
+
+      if (batch_ptr->done[i])
+      {
+         continue; // duplicate datagram
+      }
+      num_new++;
+
+      finishjob(batch_ptr, i, proto_getle32(buffer +
+         PROTO_DGRAM_HEADER_BYTES + k * PROTO_BACKEND_RESULT_BYTES));
+
+      if (result_cache.shards != NULL)
+      {
+         struct job * job_ptr = &batch_ptr->jobs[i];
+
+         cache_put(&result_cache, job_ptr->opcode, job_ptr->operand1,
+            job_ptr->operand2, job_ptr->result);
+      }
+   }
+
+   struct shard * origin_ptr = shard_ptr->hedge ?
+      &batch_ptr->shards[shard_ptr->partner] : shard_ptr;
+   uint64_t now = nowusec();
+
+   // Only a copy's first answer to jobs sent once times the round trip
+   if ((num_new > 0) && !shard_ptr->resent &&
+      (shard_ptr->num_left == shard_ptr->num_jobs))
+   {
+      pool_rtt(shard_ptr->pool_ptr, (long) (now - shard_ptr->sent_usec));
+   }
+
+   // A copy that answers is alive, so its timer starts over
+   if (shard_ptr->retry_usec != 0)
+   {
+      shard_ptr->retry_usec = now + (uint64_t) pool_rto(shard_ptr->pool_ptr);
+      shard_ptr->retries = 0;
+   }
+
+   // Results only come once the replica has read every job of the shard
+   readjobs(shard_ptr, shard_ptr->num_sent);
 
-      strcpy(jobs[job_number].result, result);
+   // Jobs the other copy answered first stay counted until the shard finishes
+   shard_ptr->num_left -= num_new;
+   pool_add(shard_ptr->replica_ptr, -num_new);
+
+   if (num_new > 0)
+   {
+      origin_ptr->num_pending -= num_new;
+      if (origin_ptr->num_pending == 0)
+      {
+         finishshard(batch_ptr, s);
+      }
+   }
+   else if (origin_ptr->num_pending == 0)
+   {
+      lateresults(header_ptr->request_id);
    }
 
+   readyresults(batch_ptr);
+
    return EXIT_SUCCESS;
 }
 
-int sendresults(int connect_sd, int num_jobs, struct job jobs[])
+int handlemissing(int dgram_sd, struct batch * batch_ptr,
+   const struct proto_header * header_ptr, const unsigned char * buffer)
 {
-   char payload[CLIENT_SEND_BYTES + 1];
+   int s = (int) (header_ptr->request_id & SHARD_MASK);
+   struct shard * shard_ptr = &batch_ptr->shards[s];
+   struct shard * origin_ptr = shard_ptr->hedge ?
+      &batch_ptr->shards[shard_ptr->partner] : shard_ptr;
 
-   for (int i = 0; i < num_jobs; i++)
+   // A finished shard's replica may still be waiting, but no one needs it
+   if (origin_ptr->num_pending == 0)
+   {
+      return EXIT_SUCCESS;
+   }
+
+   // Jobs not sent yet are missing too, they go out with the next burst
+   for (uint32_t k = 0; k < header_ptr->record_count; k++)
    {
-      sprintf(payload, "%10s", jobs[i].result);
+      const unsigned char * record = buffer + PROTO_DGRAM_HEADER_BYTES +
+         k * PROTO_MISSING_BYTES;
+      uint32_t first = proto_getle32(record);
+      uint32_t count = proto_getle32(record + 4);
+
+      if ((count == 0) || (first >= (uint32_t) shard_ptr->num_jobs) ||
+         (count > (uint32_t) shard_ptr->num_jobs - first))
+      {
+         fprintf(stderr, "ERROR: Missing jobs do not match their batch.\n");
+         return EXIT_FAILURE;
+      }
+
+      if (first >= (uint32_t) shard_ptr->num_sent)
+      {
+         break;
+      }
 
-      if (send(connect_sd, payload, strlen(payload), 0) != CLIENT_SEND_BYTES)
+      if (count > (uint32_t) shard_ptr->num_sent - first)
+      {
+         count = (uint32_t) shard_ptr->num_sent - first;
+      }
+
+      if (sendrange(dgram_sd, batch_ptr, s, (int) first, (int) count,
+         (k == header_ptr->record_count - 1) ? PROTO_FLAG_POLL : 0) ==
+         EXIT_FAILURE)
       {
-         fprintf(stderr, "ERROR: Failed to send result to client.\n");
          return EXIT_FAILURE;
       }
+      batch_ptr->num_resent += (int) count;
    }
+   shard_ptr->resent = true;
 
-   // Print message indicating edge server has sent all results to the client
-   fprintf(stdout, "The edge server has successfully finished sending all"
-      " computation results to the client.\n");
+   // The replica just answered, so the resent jobs get a full timeout
+   shard_ptr->retry_usec = nowusec() + (uint64_t) pool_rto(shard_ptr->pool_ptr);
+
+   return dgram_txflush(dgram_sd, &backend_tx);
+}
+
+int handlecredit(int dgram_sd, struct batch * batch_ptr,
+   const struct proto_header * header_ptr, const unsigned char * buffer)
+{
+   int s = (int) (header_ptr->request_id & SHARD_MASK);
+   struct shard * shard_ptr = &batch_ptr->shards[s];
+
+   pool_advertise(shard_ptr->replica_ptr, (long) proto_getle32(buffer +
+      PROTO_DGRAM_HEADER_BYTES));
+   readjobs(shard_ptr, (int) header_ptr->first_job);
+
+   if (shard_ptr->retry_usec != 0)
+   {
+      shard_ptr->retry_usec = nowusec() +
+         (uint64_t) pool_rto(shard_ptr->pool_ptr);
+      shard_ptr->retries = 0;
+   }
+
+   return ((sendburst(dgram_sd, batch_ptr, s) == EXIT_FAILURE) ||
+      (dgram_txflush(dgram_sd, &backend_tx) == EXIT_FAILURE)) ?
+      EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void finishjob(struct batch * batch_ptr, int i, uint32_t result)
+{
+   // Repeats of the job share its result
+   for (; i != -1; i = (batch_ptr->twins == NULL) ? -1 : batch_ptr->twins[i])
+   {
+      batch_ptr->jobs[i].result = result;
+      batch_ptr->done[i] = 1;
+      batch_ptr->num_received++;
+
+      // Out of order results can be streamed right away
+      if (batch_ptr->unordered)
+      {
+         unsigned char * record = batch_ptr->out + batch_ptr->out_ready;
+
+         proto_putle32(record, (uint32_t) i);
+         proto_putle32(record + 4, result);
+         batch_ptr->out_ready += PROTO_INDEXED_RESULT_BYTES;
+      }
+   }
+}
+
+void readyresults(struct batch * batch_ptr)
+{
+   // In order results can be streamed once every earlier result is known
+   while (!batch_ptr->unordered && (batch_ptr->next_job < batch_ptr->num_jobs)
+      && batch_ptr->done[batch_ptr->next_job])
+   {
+      proto_putle32(batch_ptr->out + batch_ptr->out_ready,
+         batch_ptr->jobs[batch_ptr->next_job].result);
+      batch_ptr->out_ready += PROTO_CLIENT_RESULT_BYTES;
+      batch_ptr->next_job++;
+   }
+}
+
+int handlesegment(struct batch * batch_ptr,
+   const struct proto_header * header_ptr, const unsigned char * buffer)
+{
+   uint32_t segment_words = segmentwords();
+   uint32_t i = header_ptr->segment_job;
+   struct wide_job * wide_ptr = NULL;
+   uint32_t num_words = 0;
+
+   if ((batch_ptr->wide_jobs != NULL) &&
+      (i < (uint32_t) batch_ptr->num_jobs) &&
+      (header_ptr->opcode == ((batch_ptr->jobs[i].opcode == PROTO_OP_AND) ?
+      PROTO_OP_AND_RESULTS : PROTO_OP_OR_RESULTS)))
+   {
+      wide_ptr = &batch_ptr->wide_jobs[i];
+      num_words = wide_ptr->num_words - header_ptr->first_job <
+         segment_words ? wide_ptr->num_words - header_ptr->first_job :
+         segment_words;
+   }
+
+   // Segments must line up with the ones that were sent
+   if ((wide_ptr == NULL) || (header_ptr->job_count != wide_ptr->num_words)
+      || (header_ptr->first_job % segment_words != 0) ||
+      (header_ptr->record_count != num_words))
+   {
+      fprintf(stderr, "ERROR: Results do not match their batch.\n");
+      return EXIT_FAILURE;
+   }
+
+   size_t segment = wide_ptr->first_segment + header_ptr->first_job /
+      segment_words;
+
+   if (batch_ptr->done[segment])
+   {
+      return EXIT_SUCCESS; // duplicate datagram
+   }
+
+   memcpy(wide_ptr->result + PROTO_WIDE_RESULT_BYTES +
+      (size_t) header_ptr->first_job * BITVEC_WORD_BYTES,
+      buffer + PROTO_SEGMENT_HEADER_BYTES, num_words * BITVEC_WORD_BYTES);
+   batch_ptr->done[segment] = 1;
+   batch_ptr->segments_out--;
+   pool_add(batch_ptr->segments[segment].replica_ptr, -1);
+   batch_ptr->segments[segment].replica_ptr = NULL;
+   wide_ptr->words_left -= num_words;
+
+   while ((batch_ptr->segment_base < batch_ptr->num_segments) &&
+      batch_ptr->done[batch_ptr->segment_base])
+   {
+      batch_ptr->segment_base++;
+   }
+
+   // Resent segments may be answered twice, possibly after the batch is gone
+   if ((batch_ptr->segment_base == batch_ptr->num_segments) &&
+      (batch_ptr->num_resent > 0))
+   {
+      expectlate(batch_ptr->request_id, false);
+   }
+
+   // Leading zeros are trimmed once every word of the result is known
+   if (wide_ptr->words_left == 0)
+   {
+      proto_putle32(wide_ptr->result, (uint32_t) bitvec_sigbits(
+         wide_ptr->result + PROTO_WIDE_RESULT_BYTES, wide_ptr->num_words));
+      batch_ptr->num_received++;
+   }
+
+   while ((batch_ptr->next_job < batch_ptr->num_jobs) &&
+      (batch_ptr->wide_jobs[batch_ptr->next_job].words_left == 0))
+   {
+      batch_ptr->out_ready += PROTO_WIDE_RESULT_BYTES +
+         (size_t) batch_ptr->wide_jobs[batch_ptr->next_job].num_words *
+         BITVEC_WORD_BYTES;
+      batch_ptr->next_job++;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int * mapbackendjobs(int opcode, struct job jobs[], int num_jobs,
+   int num_backend_jobs, const unsigned char * done)
+{
+   int * job_index = malloc((num_backend_jobs + 1) * sizeof(int));
+
+   if (job_index == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate job index.\n");
+      return NULL;
+   }
+
+   for (int i = 0, backend_job = 0; i < num_jobs; i++)
+   {
+      if ((jobs[i].opcode == opcode) && !jobs[i].twin &&
+         ((done == NULL) || !done[i]))
+      {
+         job_index[backend_job++] = i;
+      }
+   }
+
+   return job_index;
+}
+
+void printresults(struct batch * batch_ptr, int port)
+{
+   // Print message indicating edge server has started receiving results from
+      //the backend servers
+   logger_printf(LOGGER_INFO, "The edge server has started receiving the"
+      " computation results from the backend AND server and the backend OR"
+      " server using UDP over port %d.\nThe computation results are:\n", port);
+
+   // Print computation results, unless only summary lines are logged
+   for (int i = 0; logger_enabled(LOGGER_JOB) && (i < batch_ptr->num_jobs);
+      i++)
+   {
+      struct job * job_ptr = &batch_ptr->jobs[i];
+
+      // Wide operands can be millions of digits, print their lengths
+      if (batch_ptr->wide_jobs != NULL)
+      {
+         struct wide_job * wide_ptr = &batch_ptr->wide_jobs[i];
+
+         logger_printf(LOGGER_JOB, "%u digits %s %u digits = %u digits\n",
+            wide_ptr->bits1, proto_opname(job_ptr->opcode), wide_ptr->bits2,
+            proto_getle32(wide_ptr->result));
+         continue;
+      }
+
+      char operand1[PROTO_MAX_WIDTH + 1];
+      char operand2[PROTO_MAX_WIDTH + 1];
+      char result[PROTO_MAX_WIDTH + 1];
+
+      proto_wordtostr(job_ptr->operand1, job_ptr->width1, operand1);
+      proto_wordtostr(job_ptr->operand2, job_ptr->width2, operand2);
+      proto_wordtostr(job_ptr->result, 0, result);
+      logger_printf(LOGGER_JOB, "%s %s %s = %s\n", operand1,
+         proto_opname(job_ptr->opcode), operand2, result);
+   }
+
+   // Print message indicating edge server has received all results
+   logger_printf(LOGGER_INFO, "The edge server has successfully finished"
+      " receiving all computation results from the backend AND server and the"
+      " backend OR server.\n");
+   dgram_printcounters("edge server", batch_ptr->num_jobs);
+
+   if (opts.local && (batch_ptr->twins != NULL))
+   {
+      char expected[32];
+
+      snprintf(expected, sizeof(expected), (batch_ptr->offload_usec == -1) ?
+         "unknown" : "%ld us", batch_ptr->offload_usec);
+      logger_printf(LOGGER_INFO, "The edge server has %s (%.1f us expected"
+         " locally, %s at the backend servers%s).\n", batch_ptr->local ?
+         "computed the batch itself" :
+         "sent the batch to the backend servers", batch_ptr->local_usec,
+         expected, batch_ptr->probe ? ", probing their latency" : "");
+   }
+
+   if (batch_ptr->twins != NULL)
+   {
+      logger_printf(LOGGER_INFO, "The edge server has sent %d of %d jobs to the"
+         " backend servers, %d repeated an earlier job of the batch.\n",
+         batch_ptr->num_and_jobs + batch_ptr->num_or_jobs, batch_ptr->num_jobs,
+         batch_ptr->num_twins);
+   }
+
+   if (batch_ptr->num_resent > 0)
+   {
+      logger_printf(LOGGER_INFO, "The edge server has resent %d jobs whose"
+         " results were overdue.\n", batch_ptr->num_resent);
+   }
+
+   if (opts.hedge != 0)
+   {
+      logger_printf(LOGGER_INFO, "The edge server has hedged %lu of %lu shards"
+         " (%.1f%%), %lu hedges won, saving %.3f ms on average.\n",
+         hedge_stats.hedged, hedge_stats.shards, (hedge_stats.shards == 0) ?
+         0.0 : 100.0 * (double) hedge_stats.hedged /
+         (double) hedge_stats.shards, hedge_stats.wins,
+         (hedge_stats.saved == 0) ? 0.0 : (double) hedge_stats.saved_usec /
+         1000.0 / (double) hedge_stats.saved);
+   }
+
+   if (result_cache.shards != NULL)
+   {
+      struct cache_stats stats;
+
+      cache_getstats(&result_cache, &stats);
+      logger_printf(LOGGER_INFO, "The edge server's result cache has answered"
+         " %lu of %lu jobs (%.1f%%), holds %lu of %lu results, and has evicted"
+         " %lu.\n", stats.hits, stats.hits + stats.misses, (stats.hits +
+         stats.misses == 0) ? 0.0 : 100.0 * (double) stats.hits /
+         (double) (stats.hits + stats.misses), stats.entries, stats.capacity,
+         stats.evictions);
+   }
+}
+
+uint64_t recordstage(int stage, uint64_t start_nsec)
+{
+   uint64_t now = stats_nownsec();
+
+   stats_record(&edge_stats, stage, now - start_nsec);
+
+   return now;
+}
+
+void recordbatch(const struct batch * batch_ptr)
+{
+   uint64_t now = recordstage(STAGE_SENDRESULTS, batch_ptr->done_nsec);
+
+   stats_record(&edge_stats, STAGE_BATCH, now - batch_ptr->recv_nsec);
+
+   stats_count(&edge_stats, COUNTER_BATCHES, 1);
+   stats_count(&edge_stats, COUNTER_JOBS, (unsigned long) batch_ptr->num_jobs);
+   stats_count(&edge_stats, COUNTER_BYTES_SENT, opts.ascii ?
+      (unsigned long) batch_ptr->num_jobs * CLIENT_SEND_BYTES :
+      batch_ptr->out_len);
+   stats_count(&edge_stats, COUNTER_JOBS_RESENT,
+      (unsigned long) batch_ptr->num_resent);
+}
+
+int flushresults(int connect_sd, struct batch * batch_ptr)
+{
+   if (batch_ptr->out_ready == batch_ptr->out_sent)
+   {
+      return EXIT_SUCCESS;
+   }
+
+   if (proto_sendall(connect_sd, batch_ptr->out + batch_ptr->out_sent,
+      batch_ptr->out_ready - batch_ptr->out_sent) == EXIT_FAILURE)
+   {
+      fprintf(stderr, "ERROR: Failed to send results to client.\n");
+      return EXIT_FAILURE;
+   }
+   batch_ptr->out_sent = batch_ptr->out_ready;
 
    return EXIT_SUCCESS;
 }
 
+int sendresults(int connect_sd, struct batch * batch_ptr)
+{
+   if (opts.ascii)
+   {
+      char payload[CLIENT_SEND_BYTES + 1];
+
+      for (int i = 0; i < batch_ptr->num_jobs; i++)
+      {
+         char result[PROTO_MAX_WIDTH + 1];
+
+         proto_wordtostr(batch_ptr->jobs[i].result, 0, result);
+         snprintf(payload, sizeof(payload), "%10s", result);
+
+         if (send(connect_sd, payload, strlen(payload), 0) != CLIENT_SEND_BYTES)
+         {
+            fprintf(stderr, "ERROR: Failed to send result to client.\n");
+            return EXIT_FAILURE;
+         }
+      }
+   }
+   else if (flushresults(connect_sd, batch_ptr) == EXIT_FAILURE)
+   {
+      return EXIT_FAILURE;
+   }
+
+   // Print message indicating edge server has sent all results to the client
+   logger_printf(LOGGER_INFO, "The edge server has successfully finished"
+      " sending all computation results to the client.\n");
+
+   return EXIT_SUCCESS;
+}
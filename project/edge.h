@@ -0,0 +1,457 @@
+/**
+ * edge.h
+ *
+ * Declarations shared by the edge server's fork-per-connection mode (edge.c)
+ * and its epoll event loop mode (edge_reactor.c).
+ */
+
+#ifndef EDGE_H
+#define EDGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+#include "dgramio.h"
+#include "pool.h"
+#include "cache.h"
+#include "stats.h"
+
+#define EDGE_IP "127.0.0.1" // edge server IPv4 address
+#define DGRAM_PORT 24926 // datagram socket port number
+#define WELCOME_PORT 23926 // welcoming stream socket port number
+#define BACKLOG 5 // buffer size for welcoming stream socket
+#define IDLE_SEC 60 // default time a connection may wait for its next batch
+
+#define AND_REPLICAS "127.0.0.1:22926" // default and server replica list
+#define OR_REPLICAS "127.0.0.1:21926" // default or server replica list
+
+#define SHARD_BITS 6 // low bits of a request ID numbering the batch's shards
+#define MAX_SHARDS (1 << SHARD_BITS) // 2 * POOL_MAX_REPLICAS and their hedges
+#define SHARD_MASK ((uint64_t) MAX_SHARDS - 1)
+#define PID_SHIFT 42 // request ID bit the process ID starts at, leaving 22
+   //bits for the largest pid_max
+
+#define HEDGE_MIN_USEC 200 // shortest wait before a shard is hedged
+#define LATE_SHARDS 1024 // number of finished shards whose late results are
+   //recognized
+#define RETRY_LIMIT 8 // resends of a shard or segment without any results
+   //before its backend server is given up on
+
+#define LOCAL_JOB_NSEC 50.0 // first guess of the time to compute one job in
+   //the edge server, refined by timing every batch computed there
+#define LOCAL_PROBE_ODDS 16 // one in this many batches is sent to the backend
+   //servers anyway, so their latency keeps being measured
+
+#define DGRAM_COST_OVERHEAD 768 // receive buffer bytes a datagram may take up
+   //beyond twice its size, as the kernel rounds its allocation up
+
+#define SEGMENT_WINDOW_BYTES 65536 // bytes of wide job segments a batch may
+   //have at the backend servers, keeps their receive buffers from overflowing
+
+#define STAGE_RECVJOBS 0 // first bytes of a batch until all its jobs arrived
+#define STAGE_SENDJOBS 1 // sending the jobs to the backend servers
+#define STAGE_RECVRESULTS 2 // jobs sent until every result is known
+#define STAGE_SENDRESULTS 3 // every result known until all are sent
+#define STAGE_BATCH 4 // first bytes of a batch until its last result is sent
+#define NUM_STAGES 5
+
+#define COUNTER_BATCHES 0 // batches answered
+#define COUNTER_JOBS 1 // jobs answered
+#define COUNTER_BYTES_RECEIVED 2 // bytes of jobs received from clients
+#define COUNTER_BYTES_SENT 3 // bytes of results sent to clients
+#define COUNTER_JOBS_RESENT 4 // jobs and segments resent to backend servers
+#define COUNTER_SHARDS_HEDGED 5 // shards a hedge was sent for
+#define COUNTER_LATE_DATAGRAMS 6 // results dropped as their shard was done
+#define COUNTER_BATCHES_FAILED 7 // batches dropped with their connection
+#define COUNTER_CONNECTIONS 8 // client connections accepted
+#define COUNTER_SESSIONS 9 // connections that held keep-alive sessions
+#define COUNTER_IDLE_CLOSED 10 // connections closed for sitting idle
+#define NUM_COUNTERS 11
+
+/**
+ * struct to store job data
+ */
+struct job {
+   int opcode; // PROTO_OP_AND or PROTO_OP_OR
+   uint8_t width1; // number of digits operand1 was written with
+   uint8_t width2; // number of digits operand2 was written with
+   bool twin; // repeats an earlier job of the batch, which gets the result
+   uint32_t operand1;
+   uint32_t operand2;
+   uint32_t result;
+};
+
+/**
+ * struct to store the bit vector operands and result of a wide job
+ */
+struct wide_job {
+   uint32_t bits1; // number of digits operand1 was written with
+   uint32_t bits2; // number of digits operand2 was written with
+   const unsigned char * words1; // bitvec_words(bits1) words of operand1
+   const unsigned char * words2; // bitvec_words(bits2) words of operand2
+   uint32_t num_words; // number of words in the result
+   uint32_t words_left; // number of result words still at the backend servers
+   size_t first_segment; // index in done of the job's first segment
+   unsigned char * result; // the job's record in the results message
+};
+
+/**
+ * struct to store the part of a batch's AND or OR jobs sent to one replica.
+ * The replica sees it as a batch of its own whose request ID is the batch's
+ * request ID plus the shard's index. A hedge is a copy of a slow shard sent
+ * to another replica under its own index; the first result for each job
+ * wins and the other copy's result is dropped. A copy whose results are
+ * overdue has its unanswered jobs resent to the same replica. A copy is sent
+ * in bursts that fit the room left in its replica's window.
+ */
+struct shard {
+   struct pool * pool_ptr; // pool the replica belongs to
+   struct replica * replica_ptr; // replica the shard was sent to
+   int opcode; // PROTO_OP_AND or PROTO_OP_OR
+   int first_job; // backend job number of the shard's first job
+   int num_jobs;
+   int num_left; // number of jobs the replica has not answered
+   int num_pending; // number of jobs answered by neither copy of the shard
+   int partner; // index of the shard's hedge, or of the shard a hedge
+      //copies, -1 if none
+   bool hedge; // copies its partner
+   uint64_t sent_usec; // time the shard was sent, in microseconds
+   uint64_t hedge_usec; // time to hedge the shard if it is still pending,
+      //0 for never
+   uint64_t retry_usec; // time to resend the copy's unanswered jobs, 0 once
+      //the shard is finished
+   int retries; // resends since the copy last answered
+   bool resent; // some of the copy's jobs were sent more than once
+   int num_sent; // number of the copy's jobs sent so far, in job order
+   int num_read; // number of those the replica has reported receiving
+};
+
+/**
+ * struct to store one wide job segment while its result is awaited
+ */
+struct segment {
+   struct pool * pool_ptr; // pool the replica belongs to
+   struct replica * replica_ptr; // replica the segment was sent to, NULL
+      //once its result has arrived or before it is sent
+   int job; // index of the wide job
+   uint32_t first_word; // first word of the job the segment holds
+   uint64_t retry_usec; // time to resend the segment
+   int retries; // resends of the segment so far
+};
+
+/**
+ * struct to store one client's jobs while they are at the backend servers
+ */
+struct batch {
+   uint64_t request_id; // tags the batch's datagrams to and from the backends
+   struct job * jobs; // allocated array of jobs
+   int num_jobs;
+   int num_and_jobs;
+   int num_or_jobs;
+   int * and_index; // job index of each backend AND job number
+   int * or_index; // job index of each backend OR job number
+   int * twins; // index of the next job repeating each job, -1 if none, NULL
+      //if the batch was not deduplicated
+   int num_twins; // number of jobs repeating an earlier job
+   bool local; // computed in the edge server instead of the backend servers
+   bool probe; // sent to the backend servers only to measure their latency
+   double local_usec; // expected time to compute the jobs in the edge server
+   long offload_usec; // expected time to get results from the backend
+      //servers, -1 if unknown
+   struct shard shards[MAX_SHARDS]; // AND shards and OR shards
+   int num_shards;
+   int num_received; // number of results received from the backend servers
+   bool unordered; // stream results tagged with job indices in any order
+   struct wide_job * wide_jobs; // bit vector jobs, NULL for ordinary jobs
+   int segment_job; // wide job holding the next segment to send
+   uint32_t segment_word; // first word of the next segment to send
+   int segments_out; // segments sent whose results have not arrived
+   struct segment * segments; // state of every segment of all wide jobs
+   size_t num_segments; // number of segments of all wide jobs
+   size_t segment_base; // first segment whose result has not arrived
+   int num_resent; // jobs and segments resent because results were overdue
+   unsigned char * done; // nonzero once a job's result (a segment of a wide
+      //job's result) has been received
+   int next_job; // next job to stream to the client in order
+   bool session; // batch of a keep-alive session, answered with client_id
+   uint64_t client_id; // request ID the client gave the batch in a session
+   unsigned char * out; // results message for the client
+   size_t out_len; // number of bytes in the complete results message
+   size_t out_ready; // number of bytes of out encoded so far
+   size_t out_sent; // number of bytes of out sent to the client so far
+   uint64_t recv_nsec; // time the batch's first bytes arrived
+   uint64_t sent_nsec; // time the batch's jobs were sent on
+   uint64_t done_nsec; // time the batch's last result became known
+};
+
+/**
+ * struct to store the state a client connection keeps across its batches
+ */
+struct session {
+   bool keepalive; // batches carry the client's request IDs
+   unsigned long num_received; // number of batches received
+   unsigned long num_answered; // number of batches whose results were sent
+   unsigned long num_jobs; // number of jobs answered
+   uint64_t open_nsec; // time the connection was accepted
+};
+
+/**
+ * struct to store command line options
+ */
+struct options {
+   bool ascii; // use the legacy ASCII protocol
+   bool offload; // use UDP segmentation offload
+   bool reactor; // serve every client from one epoll event loop
+   bool uring; // run the event loop on io_uring instead of epoll
+   int dgram_bytes; // maximum size of datagrams sent to backend servers
+   const char * and_replicas; // and server replica list
+   const char * or_replicas; // or server replica list
+   int policy; // POOL_LEAST or POOL_P2C
+   int hedge; // latency percentile after which shards are hedged, 0 for off
+   size_t cache_bytes; // memory cap of the result cache, 0 for no cache
+   bool local; // compute jobs in the edge server when that is expected to be
+      //faster than sending them to the backend servers
+   int rcvbuf; // SO_RCVBUF bytes to ask for, 0 for the default
+   int sndbuf; // SO_SNDBUF bytes to ask for, 0 for the default
+   bool quiet; // log summary lines only, not one line per job
+   int stats_port; // localhost port of the stats endpoint, 0 for none
+   int idle_sec; // seconds a connection may wait for its next batch, 0 for
+      //ever
+};
+
+extern struct options opts;
+
+extern struct stats edge_stats; // stage latencies and counters, shared
+
+extern struct dgram_tx backend_tx; // datagrams queued for backend servers
+extern struct dgram_rx backend_rx; // datagrams received from backend servers
+
+/**
+ * newrequestid returns a request ID no other batch in flight is using. Its
+ * low SHARD_BITS bits are zero so they can number the batch's shards. A
+ * process hands out 2^36 IDs before any repeats.
+ * @return uint64_t request ID
+ */
+uint64_t newrequestid();
+
+/**
+ * setnodelay disables Nagle's algorithm on a client connection so results
+ * streamed in small pieces are not held back waiting for acknowledgements.
+ * @param connect_sd int connected stream socket descriptor
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int setnodelay(int connect_sd);
+
+/**
+ * opensession starts the state of a newly accepted client connection.
+ * @param session_ptr pointer to struct session
+ */
+void opensession(struct session * session_ptr);
+
+/**
+ * joinsession admits a batch to its connection's session. The first batch
+ * decides whether the connection is a keep-alive session, and every later
+ * batch must agree.
+ * @param session_ptr pointer to struct session
+ * @param header_ptr pointer to the unpacked job header of the batch
+ * @return int 0 if successful, 1 if the batch does not fit the session
+ */
+int joinsession(struct session * session_ptr,
+   const struct proto_header * header_ptr);
+
+/**
+ * closesession logs what a keep-alive session answered once its connection
+ * is closed.
+ * @param session_ptr pointer to struct session
+ */
+void closesession(const struct session * session_ptr);
+
+/**
+ * jobrecordbytes validates a client's job header and returns the number of
+ * bytes of job records that follow it.
+ * @param header_buf pointer to the received header, proto_headerbytes() long
+ * @param header_ptr pointer to the unpacked header
+ * @return size_t number of bytes of job records, 0 if the header is invalid
+ */
+size_t jobrecordbytes(const unsigned char * header_buf,
+   const struct proto_header * header_ptr);
+
+/**
+ * validwidth checks an operand's width from a client job record.
+ * @param width int number of binary digits the client gave the operand
+ * @param operand uint32_t operand
+ * @return bool true if width is 1 to PROTO_MAX_WIDTH and holds the operand
+ */
+bool validwidth(int width, uint32_t operand);
+
+/**
+ * decodejobs extracts jobs from binary client job records, rejecting the
+ * batch if an operand's width is invalid.
+ * @param records pointer to num_jobs PROTO_CLIENT_JOB_BYTES records
+ * @param num_jobs int number of jobs
+ * @return struct job * allocated array of jobs, NULL if unsuccessful
+ */
+struct job * decodejobs(const unsigned char * records, int num_jobs);
+
+/**
+ * decodewidejobs extracts jobs from wide client job records. The operands are
+ * copied into the returned array's allocation, so records may be freed.
+ * @param records pointer to len bytes of wide job records
+ * @param len size_t number of bytes of records
+ * @param num_jobs int number of jobs
+ * @param wide_jobs_ptr pointer set to the allocated array of wide jobs
+ * @return struct job * allocated array of jobs, NULL if unsuccessful
+ */
+struct job * decodewidejobs(const unsigned char * records, size_t len,
+   int num_jobs, struct wide_job ** wide_jobs_ptr);
+
+/**
+ * initbatch counts a client's jobs for each backend server, maps backend job
+ * numbers to job indices, and starts the results message. Repeated jobs and
+ * jobs in the result cache are not given backend job numbers. The batch takes
+ * ownership of jobs and wide_jobs.
+ * @param batch_ptr pointer to struct batch
+ * @param jobs allocated array of jobs
+ * @param num_jobs int number of jobs
+ * @param flags uint16_t flags of the client's job header:
+ *    PROTO_FLAG_UNORDERED to stream indexed results in any order, ignored for
+ *    wide jobs, and PROTO_FLAG_SESSION to answer with client_id
+ * @param client_id uint64_t request ID of a session batch, ignored otherwise
+ * @param wide_jobs allocated array of wide jobs, NULL for ordinary jobs
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int initbatch(struct batch * batch_ptr, struct job * jobs, int num_jobs,
+   uint16_t flags, uint64_t client_id, struct wide_job * wide_jobs);
+
+/**
+ * freebatch releases the jobs and indices of a batch, and takes any jobs
+ * whose results have not arrived off their replicas' outstanding counts and
+ * windows.
+ * @param batch_ptr pointer to struct batch
+ */
+void freebatch(struct batch * batch_ptr);
+
+/**
+ * sendjobs sends a client's jobs to the backend servers. The AND and OR jobs
+ * are each split into shards of at least a full datagram, one per replica,
+ * and every shard goes to the replica the balancing policy picks, in bursts
+ * that fit the replica's receive buffer. With -L the jobs are computed on the
+ * spot instead if that is expected to be faster.
+ * @param dgram_sd int datagram socket descriptor
+ * @param and_pool_ptr pointer to backend AND server replica pool
+ * @param or_pool_ptr pointer to backend OR server replica pool
+ * @param batch_ptr pointer to struct batch
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int sendjobs(int dgram_sd, struct pool * and_pool_ptr,
+   struct pool * or_pool_ptr, struct batch * batch_ptr);
+
+/**
+ * sendsegments sends segments of a batch's wide jobs to the backend servers
+ * until SEGMENT_WINDOW_BYTES of them, but no more than DGRAM_BATCH datagrams,
+ * are awaiting results. It is called again
+ * as results arrive and sends nothing while the window is more than half
+ * full. Each segment goes to the replica the balancing policy picks.
+ * @param dgram_sd int datagram socket descriptor
+ * @param and_pool_ptr pointer to backend AND server replica pool
+ * @param or_pool_ptr pointer to backend OR server replica pool
+ * @param batch_ptr pointer to struct batch
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int sendsegments(int dgram_sd, struct pool * and_pool_ptr,
+   struct pool * or_pool_ptr, struct batch * batch_ptr);
+
+/**
+ * runtimers sends a hedge of every shard of a batch that is past its hedge
+ * time to the least loaded replica other than the shard's, and resends the
+ * unanswered jobs of every shard copy and segment whose results are overdue.
+ * Each resend without an answer doubles the wait before the next one.
+ * @param dgram_sd int datagram socket descriptor
+ * @param batch_ptr pointer to struct batch
+ * @return int 0 if successful, 1 if unsuccessful or a backend server has not
+ *    answered after RETRY_LIMIT resends
+ */
+int runtimers(int dgram_sd, struct batch * batch_ptr);
+
+/**
+ * timerwait returns how long until the next shard of a batch is due to be
+ * hedged or resent.
+ * @param batch_ptr pointer to struct batch
+ * @return long microseconds, 0 if one is due now, -1 if none will be
+ */
+long timerwait(const struct batch * batch_ptr);
+
+/**
+ * lateresults checks whether results came from a shard that was already
+ * finished, the loser of a hedge race or a copy whose jobs were resent, and
+ * whose results may keep arriving after its batch is finished. The first
+ * time a losing original shard is heard from, the time since its hedge won
+ * is counted as latency saved.
+ * @param request_id uint64_t request ID of the results
+ * @return bool true if the results are late
+ */
+bool lateresults(uint64_t request_id);
+
+/**
+ * handleresults stores the results carried by one binary datagram from a
+ * backend server and encodes every result that can now be streamed to the
+ * client. Results that were already received are ignored. A
+ * PROTO_OP_MISSING datagram has the jobs it lists resent. The datagram's
+ * request ID may carry a shard index in its low SHARD_BITS bits.
+ * @param dgram_sd int datagram socket descriptor
+ * @param batch_ptr pointer to struct batch
+ * @param header_ptr pointer to unpacked datagram header
+ * @param buffer pointer to received datagram
+ * @return int 0 if successful, 1 if the datagram does not belong to the batch
+ */
+int handleresults(int dgram_sd, struct batch * batch_ptr,
+   const struct proto_header * header_ptr, const unsigned char * buffer);
+
+/**
+ * printresults prints the computation results of a finished batch, and the
+ * hedging counters of this process when hedging is on.
+ * @param batch_ptr pointer to struct batch
+ * @param port int port the results were received on
+ */
+void printresults(struct batch * batch_ptr, int port);
+
+/**
+ * recordstage adds the time since a stage started to its histogram.
+ * @param stage int STAGE_* value
+ * @param start_nsec uint64_t time the stage started, from stats_nownsec
+ * @return uint64_t time now, when the next stage starts
+ */
+uint64_t recordstage(int stage, uint64_t start_nsec);
+
+/**
+ * recordbatch records the last stages of a batch whose results have all been
+ * sent to the client, and counts its jobs and bytes.
+ * @param batch_ptr pointer to struct batch
+ */
+void recordbatch(const struct batch * batch_ptr);
+
+/**
+ * flushresults sends every encoded result not yet sent to the client.
+ * @param connect_sd int connected stream socket descriptor
+ * @param batch_ptr pointer to struct batch
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int flushresults(int connect_sd, struct batch * batch_ptr);
+
+/**
+ * runreactor serves every client connection and the backend servers from one
+ * event loop, on io_uring if opts.uring is set and the kernel has it and on
+ * nonblocking epoll otherwise. Returns only on a fatal error.
+ * @param welcome_sd int welcoming stream socket descriptor
+ * @param dgram_sd int datagram socket descriptor
+ * @param and_pool_ptr pointer to backend AND server replica pool
+ * @param or_pool_ptr pointer to backend OR server replica pool
+ * @return int 1
+ */
+int runreactor(int welcome_sd, int dgram_sd, struct pool * and_pool_ptr,
+   struct pool * or_pool_ptr);
+
+#endif
@@ -0,0 +1,1674 @@
+/**
+ * edge_reactor.c
+ *
+ * Event loop mode of the edge server (-e). A single process serves every
+ * client connection and the backend datagram socket from one epoll loop.
+ * Each connection is a small state machine driven by readiness events:
+ *
+ *    CONN_RECV_HEADER -> CONN_RECV_JOBS -> CONN_RECV_HEADER -> ...
+ *
+ * A client may send any number of batches back to back on one connection.
+ * Every batch is sent to the backend servers as soon as it has arrived, tagged
+ * with its own request ID, and queued on its connection. Results are routed
+ * back to their batch through a hash table of in-flight request IDs, so any
+ * number of batches can be at the backend servers at once. The connection
+ * streams the results of its oldest batch while the rest are still at the
+ * backend servers, and closes once the client has stopped sending and every
+ * batch has been answered.
+ *
+ * A keep-alive session (PROTO_FLAG_SESSION) is answered in the order its
+ * batches finish instead: each results message carries the client's request
+ * ID, so the connection sends whichever queued batch has all of its results
+ * first, and a slow batch does not hold up the ones behind it. Connections
+ * with nothing queued are kept in a list ordered by when they went idle, and
+ * the ones idle for longer than opts.idle_sec are closed.
+ *
+ * Datagrams for the backend servers are held back (see dgram_txcork) while a
+ * round of events is handled, and everything the round queued is sent
+ * together just before the loop waits again.
+ *
+ * With -U the loop runs on io_uring instead of epoll if the kernel has it
+ * (see uring.h). One multishot accept takes every new connection, and each
+ * connection's bytes arrive through a multishot receive into buffers taken
+ * from a provided buffer ring shared by all connections. readconn reads them
+ * from there through recvconn just as it would call recv(). Results go out
+ * one send operation per connection at a time, and each send's completion
+ * carries on writing. Datagrams from the backend servers arrive through a
+ * ring of their own (see dgram_rxuring) that the loop polls. Everything a
+ * round of completions asks for is handed to the kernel by the same
+ * io_uring_enter() that waits for the next completions, so under sustained
+ * load the loop makes almost no other system calls. A closed connection is
+ * shut down at once, but its descriptor and batches are only released once
+ * the ring has finished every operation on it, since operations queued in
+ * the same round are still to reach the kernel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+#include "dgramio.h"
+#include "uring.h"
+#include "logger.h"
+#include "edge.h"
+
+#define MAX_EVENTS 64 // maximum number of events handled per epoll_wait
+#define DEMUX_BUCKETS 1024 // number of in-flight request buckets, power of 2
+#define MAX_PIPELINED 16 // maximum number of batches queued per connection
+#define RING_ENTRIES 256 // submission entries of the io_uring event loop
+#define RING_BUFS 1024 // provided buffers client bytes are received into, a
+   //power of 2
+#define RING_BUF_BYTES 16384 // size of each provided buffer
+#define RING_GROUP 0 // buffer group of the provided buffers
+
+#define OP_RECV 1 // user_data tag of a connection's multishot receive
+#define OP_SEND 2 // user_data tag of a connection's send
+#define OP_MASK 3 // user_data bits holding the tag, the rest is the connection
+
+#define CONN_RECV_HEADER 0 // receiving a batch header
+#define CONN_RECV_JOBS 1 // receiving the job records of a batch
+#define CONN_DRAINING 2 // client finished sending, answering queued batches
+
+/**
+ * struct to store one batch of a client connection
+ */
+struct request {
+   struct batch batch; // jobs and the results message being streamed
+   struct conn * conn_ptr; // connection the batch arrived on
+   struct request * next; // next batch queued on the same connection
+   struct request * bucket_next; // next request in its demux bucket
+};
+
+/**
+ * struct to store the state of one client connection
+ */
+struct conn {
+   int sd; // connected stream socket descriptor, -1 once closed
+   int state; // CONN_* value
+   unsigned char header_buf[PROTO_MAX_HEADER_BYTES];
+   unsigned char * buf; // job records being received
+   size_t buf_len; // number of bytes expected in buf
+   size_t buf_done; // number of bytes received into buf
+   int num_jobs; // number of jobs in the batch being received
+   uint16_t flags; // PROTO_FLAG_* values of the batch being received
+   uint64_t client_id; // request ID of the session batch being received
+   bool wide; // batch being received holds wide jobs
+   struct session session; // state kept across the connection's batches
+   uint32_t events; // EPOLL* events being watched
+   struct request * head; // oldest queued batch, the one being streamed
+   struct request * tail; // newest queued batch
+   int num_requests; // number of queued batches
+   uint64_t recv_nsec; // time the first bytes of the batch being received
+      //arrived
+   bool idle; // in the idle list
+   uint64_t idle_nsec; // time the connection went idle
+   struct conn * idle_prev; // connection that went idle before this one
+   struct conn * idle_next; // connection that went idle after this one
+   struct conn * next; // next connection in the closed list
+   int closed_sd; // descriptor of a closed connection the ring may still
+      //use, closed by freeclosed, -1 if already closed
+   struct request * closed_head; // batches of a closed connection, freed by
+      //freeclosed
+   int ops; // io_uring operations in flight on the connection
+   bool recv_armed; // a multishot receive is in flight
+   bool recv_cancelled; // the receive has been asked to stop
+   bool sending; // a send is in flight
+   int in_head; // provided buffer with the oldest received bytes not yet
+      //read, -1 if none
+   int in_tail; // provided buffer with the newest
+   int in_error; // errno of a failed receive, reported once the received
+      //bytes are read, 0 if none
+   bool in_eof; // client shut down its side, reported once the received
+      //bytes are read
+   bool ready; // in the ready list
+   struct conn * ready_next; // next connection in the ready list
+   bool starved; // in the starved list
+   struct conn * starved_next; // next connection in the starved list
+};
+
+/**
+ * struct to store the bytes a provided buffer holds for a connection
+ */
+struct inbuf {
+   size_t len; // number of bytes received into the buffer
+   size_t offset; // number of them read
+   int next; // buffer with the connection's next received bytes, -1 if none
+};
+
+static int epoll_fd;
+static int listen_tag; // epoll tag of the welcoming stream socket
+static int dgram_tag; // epoll tag of the datagram socket
+
+static int backend_sd; // datagram socket descriptor
+static struct pool * backend_and_pool_ptr;
+static struct pool * backend_or_pool_ptr;
+
+static struct request * inflight[DEMUX_BUCKETS]; // batches at the backends
+static int num_inflight; // number of batches in inflight
+static struct conn * closed; // connections to free once events are handled
+static struct conn * idle_head; // connection idle the longest
+static struct conn * idle_tail; // connection idle the shortest
+
+static bool use_ring; // the loop runs on io_uring instead of epoll
+static struct uring ring;
+static struct uring_bufs ring_bufs; // buffers client bytes are received into
+static struct inbuf inbufs[RING_BUFS]; // bytes each provided buffer holds
+static unsigned ring_free; // number of provided buffers the kernel may fill
+static struct conn * ready; // connections to read from once completions are
+   //handled
+static struct conn * starved; // connections waiting for a free provided
+   //buffer to arm their receive
+
+/**
+ * runepoll serves every connection from an epoll event loop.
+ * @param welcome_sd int welcoming stream socket descriptor
+ * @param dgram_sd int datagram socket descriptor
+ * @return int 1, only on a fatal error
+ */
+static int runepoll(int welcome_sd, int dgram_sd);
+
+/**
+ * runring serves every connection from an io_uring event loop.
+ * @param welcome_sd int welcoming stream socket descriptor
+ * @param dgram_sd int datagram socket descriptor
+ * @return int 1, only on a fatal error
+ */
+static int runring(int welcome_sd, int dgram_sd);
+
+/**
+ * looptimeout sends the hedges and resends that are due, closes the
+ * connections idle for too long, and works out how long the loop may wait.
+ * @return int milliseconds until the next of them is due, -1 if none is
+ */
+static int looptimeout();
+
+/**
+ * freeclosed frees the connections closed while handling a round of events
+ * that no ring operation or ready list refers to any more, along with their
+ * batches and descriptors.
+ */
+static void freeclosed();
+
+/**
+ * setnonblocking puts a socket in nonblocking mode.
+ * @param sock_desc int socket descriptor
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int setnonblocking(int sock_desc);
+
+/**
+ * watch changes the events a connection is served for. With io_uring only
+ * EPOLLIN matters: it keeps the connection's receive running, and turning it
+ * off cancels the receive.
+ * @param conn_ptr pointer to struct conn
+ * @param events uint32_t EPOLL* event mask
+ */
+static void watch(struct conn * conn_ptr, uint32_t events);
+
+/**
+ * acceptconns accepts every pending client connection.
+ * @param welcome_sd int welcoming stream socket descriptor
+ */
+static void acceptconns(int welcome_sd);
+
+/**
+ * openconn sets up the state of a newly accepted connection.
+ * @param connect_sd int connected stream socket descriptor
+ */
+static void openconn(int connect_sd);
+
+/**
+ * recvconn receives bytes from a client like recv(): with io_uring it reads
+ * the bytes the connection's receive has already put in provided buffers.
+ * @param conn_ptr pointer to struct conn
+ * @param dest pointer to buffer
+ * @param len size_t most bytes to receive
+ * @return ssize_t number of bytes received, 0 once the client has shut down
+ *    its side, -1 if unsuccessful or none are waiting (errno EAGAIN)
+ */
+static ssize_t recvconn(struct conn * conn_ptr, unsigned char * dest,
+   size_t len);
+
+/**
+ * sendconn sends bytes to a client like send(): with io_uring it starts a
+ * send unless one is in flight and fails with errno EAGAIN, and the send's
+ * completion calls writeconn again.
+ * @param conn_ptr pointer to struct conn
+ * @param buf pointer to bytes, unchanged until they are sent
+ * @param len size_t number of bytes
+ * @return ssize_t number of bytes sent, -1 if unsuccessful
+ */
+static ssize_t sendconn(struct conn * conn_ptr, const unsigned char * buf,
+   size_t len);
+
+/**
+ * armrecv starts a connection's multishot receive unless it is in flight or
+ * the client has stopped sending. With every provided buffer taken, the
+ * connection waits in the starved list until reading hands some back.
+ * @param conn_ptr pointer to struct conn
+ */
+static void armrecv(struct conn * conn_ptr);
+
+/**
+ * addready adds a connection to the ready list, to be read from and have its
+ * receive armed once the current completions are handled.
+ * @param conn_ptr pointer to struct conn
+ */
+static void addready(struct conn * conn_ptr);
+
+/**
+ * recvdone handles a completion of a connection's multishot receive.
+ * @param conn_ptr pointer to struct conn
+ * @param res int bytes received, 0 at end of stream, or -errno
+ * @param flags uint32_t IORING_CQE_F_* values
+ */
+static void recvdone(struct conn * conn_ptr, int res, uint32_t flags);
+
+/**
+ * senddone handles the completion of a connection's send.
+ * @param conn_ptr pointer to struct conn
+ * @param res int bytes sent or -errno
+ */
+static void senddone(struct conn * conn_ptr, int res);
+
+/**
+ * putbuf hands a provided buffer back to the kernel.
+ * @param bid int buffer ID
+ */
+static void putbuf(int bid);
+
+/**
+ * closeconn closes a connection and schedules it and its queued batches to be
+ * freed after the current events are handled. Results that arrive later for
+ * its request IDs are dropped.
+ * @param conn_ptr pointer to struct conn
+ */
+static void closeconn(struct conn * conn_ptr);
+
+/**
+ * checkidle adds a connection to the idle list once it has no batch queued
+ * or partly received, and takes it off once it has.
+ * @param conn_ptr pointer to struct conn
+ */
+static void checkidle(struct conn * conn_ptr);
+
+/**
+ * expireidle closes every connection idle for longer than opts.idle_sec.
+ * @return int milliseconds until the next one is due to close, -1 if none is
+ *    idle
+ */
+static int expireidle();
+
+/**
+ * readconn receives as much of a client's batches as is available and stops
+ * reading while MAX_PIPELINED batches are queued.
+ * @param conn_ptr pointer to struct conn
+ */
+static void readconn(struct conn * conn_ptr);
+
+/**
+ * writeconn sends as many of the encoded results as the socket accepts,
+ * moving on to the next queued batch whenever one is fully sent, and closes
+ * the connection once the client has stopped sending and every batch is out.
+ * @param conn_ptr pointer to struct conn
+ */
+static void writeconn(struct conn * conn_ptr);
+
+/**
+ * nextanswer moves the first queued batch of a keep-alive session whose
+ * results are all encoded to the head of the queue, unless the head has
+ * started sending.
+ * @param conn_ptr pointer to struct conn
+ * @return bool true if the head of the queue can be sent
+ */
+static bool nextanswer(struct conn * conn_ptr);
+
+/**
+ * track adds a batch to the in-flight request table.
+ * @param request_ptr pointer to struct request
+ */
+static void track(struct request * request_ptr);
+
+/**
+ * untrack removes a batch from the in-flight request table.
+ * @param request_ptr pointer to struct request
+ */
+static void untrack(struct request * request_ptr);
+
+/**
+ * lookup finds the batch a request ID belongs to.
+ * @param request_id uint64_t request ID, possibly of one of the batch's shards
+ * @return struct request * batch, NULL if the request is not in flight
+ */
+static struct request * lookup(uint64_t request_id);
+
+/**
+ * timeall sends the hedges and resends that are due for every batch in
+ * flight.
+ * @return int milliseconds until the next one is due, -1 if none is
+ */
+static int timeall();
+
+/**
+ * dispatch queues a received batch on its connection and sends it to the
+ * backend servers.
+ * @param conn_ptr pointer to struct conn
+ * @param jobs allocated array of jobs, owned by the batch afterwards
+ * @param wide_jobs allocated array of wide jobs, NULL for ordinary jobs,
+ *    owned by the batch afterwards
+ */
+static void dispatch(struct conn * conn_ptr, struct job * jobs,
+   struct wide_job * wide_jobs);
+
+/**
+ * drainresults routes every datagram waiting on the datagram socket to the
+ * batch whose request it answers.
+ */
+static void drainresults();
+
+/**
+ * freerequest releases a batch.
+ * @param request_ptr pointer to struct request
+ */
+static void freerequest(struct request * request_ptr);
+
+int runreactor(int welcome_sd, int dgram_sd, struct pool * and_pool_ptr,
+   struct pool * or_pool_ptr)
+{
+   backend_sd = dgram_sd;
+   backend_and_pool_ptr = and_pool_ptr;
+   backend_or_pool_ptr = or_pool_ptr;
+
+   if ((setnonblocking(welcome_sd) == EXIT_FAILURE) ||
+      (setnonblocking(dgram_sd) == EXIT_FAILURE))
+   {
+      return EXIT_FAILURE;
+   }
+
+   if (opts.uring)
+   {
+      if (uring_init(&ring, RING_ENTRIES) == EXIT_SUCCESS)
+      {
+         if (uring_bufsinit(&ring, &ring_bufs, RING_GROUP, RING_BUFS,
+            RING_BUF_BYTES) == EXIT_SUCCESS)
+         {
+            use_ring = true;
+            ring_free = RING_BUFS;
+         }
+         else
+         {
+            uring_free(&ring);
+         }
+      }
+
+      if (!use_ring)
+      {
+         logger_printf(LOGGER_INFO, "io_uring is not available, the edge"
+            " server is falling back to epoll.\n");
+      }
+   }
+
+   if (!use_ring)
+   {
+      return runepoll(welcome_sd, dgram_sd);
+   }
+
+   if (dgram_rxuring(dgram_sd, &backend_rx) == EXIT_FAILURE)
+   {
+      logger_printf(LOGGER_INFO, "The edge server is receiving datagrams with"
+         " recvmmsg.\n");
+   }
+
+   return runring(welcome_sd, dgram_sd);
+}
+
+static int runepoll(int welcome_sd, int dgram_sd)
+{
+   if ((epoll_fd = epoll_create1(0)) == -1)
+   {
+      fprintf(stderr, "ERROR: Failed to create epoll instance.\n");
+      return EXIT_FAILURE;
+   }
+
+   // Listening and datagram sockets are told apart by their tag addresses
+   struct epoll_event event;
+
+   event.events = EPOLLIN;
+   event.data.ptr = &listen_tag;
+
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, welcome_sd, &event) == -1)
+   {
+      fprintf(stderr, "ERROR: Failed to watch welcoming stream socket.\n");
+      close(epoll_fd);
+      return EXIT_FAILURE;
+   }
+
+   event.events = EPOLLIN;
+   event.data.ptr = &dgram_tag;
+
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dgram_sd, &event) == -1)
+   {
+      fprintf(stderr, "ERROR: Failed to watch datagram socket.\n");
+      close(epoll_fd);
+      return EXIT_FAILURE;
+   }
+
+   logger_printf(LOGGER_INFO, "The edge server is serving clients from one"
+      " event loop.\n");
+
+   while (1)
+   {
+      struct epoll_event events[MAX_EVENTS];
+      int num_events;
+      int timeout_msec = looptimeout();
+
+      // A failed send is resent by the timers
+      (void) dgram_txuncork(dgram_sd, &backend_tx);
+
+      if ((num_events = epoll_wait(epoll_fd, events, MAX_EVENTS,
+         timeout_msec)) == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         fprintf(stderr, "ERROR: epoll_wait failed.\n");
+         close(epoll_fd);
+         return EXIT_FAILURE;
+      }
+      dgram_counters.wait_calls++;
+      dgram_txcork(&backend_tx);
+
+      for (int i = 0; i < num_events; i++)
+      {
+         if (events[i].data.ptr == &listen_tag)
+         {
+            acceptconns(welcome_sd);
+         }
+         else if (events[i].data.ptr == &dgram_tag)
+         {
+            drainresults();
+         }
+         else
+         {
+            struct conn * conn_ptr = events[i].data.ptr;
+
+            if (conn_ptr->sd == -1)
+            {
+               continue; // closed earlier in this round of events
+            }
+
+            if (events[i].events & EPOLLOUT)
+            {
+               writeconn(conn_ptr);
+            }
+
+            if ((conn_ptr->sd == -1) ||
+               !(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            {
+               continue;
+            }
+            else if (conn_ptr->events & EPOLLIN)
+            {
+               readconn(conn_ptr);
+            }
+            else if (events[i].events & (EPOLLHUP | EPOLLERR))
+            {
+               // Client went away while its jobs were at the backends
+               closeconn(conn_ptr);
+            }
+
+            if (conn_ptr->sd != -1)
+            {
+               checkidle(conn_ptr);
+            }
+         }
+      }
+
+      freeclosed();
+   }
+}
+
+static int runring(int welcome_sd, int dgram_sd)
+{
+   // Wait on the backend datagrams' own ring if they have one
+   int wait_fd = dgram_rxwaitfd(dgram_sd, &backend_rx);
+   bool arm_accept = true;
+   bool arm_poll = true;
+
+   logger_printf(LOGGER_INFO, "The edge server is serving clients from one"
+      " io_uring event loop.\n");
+
+   while (1)
+   {
+      struct io_uring_sqe * sqe;
+
+      // Multishot operations end on errors and have to be armed again
+      if (arm_accept)
+      {
+         if ((sqe = uring_getsqe(&ring, IORING_OP_ACCEPT, welcome_sd,
+            (uintptr_t) &listen_tag)) == NULL)
+         {
+            return EXIT_FAILURE;
+         }
+         sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+         arm_accept = false;
+      }
+
+      if (arm_poll)
+      {
+         if ((sqe = uring_getsqe(&ring, IORING_OP_POLL_ADD, wait_fd,
+            (uintptr_t) &dgram_tag)) == NULL)
+         {
+            return EXIT_FAILURE;
+         }
+         sqe->poll32_events = POLLIN;
+         sqe->len = IORING_POLL_ADD_MULTI;
+         arm_poll = false;
+      }
+
+      int timeout_msec = looptimeout();
+
+      // A failed send is resent by the timers
+      (void) dgram_txuncork(dgram_sd, &backend_tx);
+
+      // Connections made ready by the last round are read before waiting
+      if (uring_enter(&ring, (ready != NULL) ? 0 : 1, timeout_msec) ==
+         EXIT_FAILURE)
+      {
+         return EXIT_FAILURE;
+      }
+      dgram_counters.wait_calls++;
+      dgram_txcork(&backend_tx);
+
+      struct io_uring_cqe * cqe;
+
+      while ((cqe = uring_peek(&ring)) != NULL)
+      {
+         uint64_t user_data = cqe->user_data;
+         int res = cqe->res;
+         uint32_t flags = cqe->flags;
+
+         uring_seen(&ring);
+
+         if (user_data == (uintptr_t) &listen_tag)
+         {
+            if (res >= 0)
+            {
+               openconn(res);
+            }
+            else if ((res != -EINTR) && (res != -ECONNABORTED))
+            {
+               fprintf(stderr, "ERROR: Failed to accept client connection.\n");
+            }
+            arm_accept = !(flags & IORING_CQE_F_MORE);
+         }
+         else if (user_data == (uintptr_t) &dgram_tag)
+         {
+            drainresults();
+            arm_poll = !(flags & IORING_CQE_F_MORE);
+         }
+         else if ((user_data & OP_MASK) == OP_RECV)
+         {
+            recvdone((struct conn *) (uintptr_t) (user_data & ~OP_MASK), res,
+               flags);
+         }
+         else if ((user_data & OP_MASK) == OP_SEND)
+         {
+            senddone((struct conn *) (uintptr_t) (user_data & ~OP_MASK), res);
+         }
+         // Failed cancellations complete with user_data 0 and need nothing
+      }
+
+      // Read what connections received while reading was held up
+      struct conn * waiting = ready;
+
+      ready = NULL;
+      while (waiting != NULL)
+      {
+         struct conn * conn_ptr = waiting;
+
+         waiting = conn_ptr->ready_next;
+         conn_ptr->ready = false;
+
+         if ((conn_ptr->sd == -1) || !(conn_ptr->events & EPOLLIN))
+         {
+            continue;
+         }
+
+         readconn(conn_ptr);
+
+         if ((conn_ptr->sd != -1) && (conn_ptr->events & EPOLLIN))
+         {
+            armrecv(conn_ptr);
+         }
+
+         if (conn_ptr->sd != -1)
+         {
+            checkidle(conn_ptr);
+         }
+      }
+
+      // Reading handed buffers back, arm the receives that went without
+      waiting = (ring_free > 0) ? starved : NULL;
+
+      if (waiting != NULL)
+      {
+         starved = NULL;
+      }
+
+      while (waiting != NULL)
+      {
+         struct conn * conn_ptr = waiting;
+
+         waiting = conn_ptr->starved_next;
+         conn_ptr->starved = false;
+
+         if ((conn_ptr->sd != -1) && (conn_ptr->events & EPOLLIN))
+         {
+            armrecv(conn_ptr);
+         }
+      }
+
+      freeclosed();
+   }
+}
+
+static int looptimeout()
+{
+   int timeout = (num_inflight > 0) ? timeall() : -1;
+   int idle_timeout = (opts.idle_sec != 0) ? expireidle() : -1;
+
+   if ((idle_timeout != -1) && ((timeout == -1) || (idle_timeout < timeout)))
+   {
+      timeout = idle_timeout;
+   }
+
+   return timeout;
+}
+
+static void freeclosed()
+{
+   struct conn ** link_ptr = &closed;
+
+   while (*link_ptr != NULL)
+   {
+      struct conn * conn_ptr = *link_ptr;
+
+      // The ring may still complete operations on it, keep it until then
+      if ((conn_ptr->ops > 0) || conn_ptr->ready || conn_ptr->starved)
+      {
+         link_ptr = &conn_ptr->next;
+         continue;
+      }
+
+      *link_ptr = conn_ptr->next;
+      if (conn_ptr->closed_sd != -1)
+      {
+         close(conn_ptr->closed_sd);
+      }
+
+      while (conn_ptr->closed_head != NULL)
+      {
+         struct request * request_ptr = conn_ptr->closed_head;
+
+         conn_ptr->closed_head = request_ptr->next;
+         freerequest(request_ptr);
+      }
+      free(conn_ptr->buf);
+      free(conn_ptr);
+   }
+}
+
+static int setnonblocking(int sock_desc)
+{
+   int flags;
+
+   if (((flags = fcntl(sock_desc, F_GETFL, 0)) == -1) ||
+      (fcntl(sock_desc, F_SETFL, flags | O_NONBLOCK) == -1))
+   {
+      fprintf(stderr, "ERROR: Failed to make socket nonblocking.\n");
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+static void watch(struct conn * conn_ptr, uint32_t events)
+{
+   struct epoll_event event;
+
+   if (conn_ptr->events == events)
+   {
+      return;
+   }
+
+   if (use_ring)
+   {
+      uint32_t started = events & ~conn_ptr->events;
+
+      conn_ptr->events = events;
+
+      if (started & EPOLLIN)
+      {
+         // Bytes received before reading stopped are read first
+         addready(conn_ptr);
+      }
+      else if (!(events & EPOLLIN) && conn_ptr->recv_armed &&
+         !conn_ptr->recv_cancelled)
+      {
+         struct io_uring_sqe * sqe = uring_getsqe(&ring,
+            IORING_OP_ASYNC_CANCEL, -1, 0);
+
+         if (sqe != NULL)
+         {
+            sqe->addr = (uintptr_t) conn_ptr | OP_RECV;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            conn_ptr->recv_cancelled = true;
+         }
+      }
+      return;
+   }
+
+   event.events = events;
+   event.data.ptr = conn_ptr;
+
+   dgram_counters.stream_calls++;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn_ptr->sd, &event) == -1)
+   {
+      fprintf(stderr, "ERROR: Failed to update client connection events.\n");
+      return;
+   }
+   conn_ptr->events = events;
+}
+
+static void acceptconns(int welcome_sd)
+{
+   while (1)
+   {
+      int connect_sd = accept(welcome_sd, NULL, NULL);
+
+      dgram_counters.stream_calls++;
+      if (connect_sd == -1)
+      {
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+         {
+            fprintf(stderr, "ERROR: Failed to accept client connection.\n");
+         }
+         return;
+      }
+
+      openconn(connect_sd);
+   }
+}
+
+static void openconn(int connect_sd)
+{
+   struct conn * conn_ptr = calloc(1, sizeof(struct conn));
+   struct epoll_event event;
+
+   event.events = EPOLLIN;
+   event.data.ptr = conn_ptr;
+
+   // The ring waits for the socket itself, only epoll needs it nonblocking
+   if ((conn_ptr == NULL) || (setnodelay(connect_sd) == EXIT_FAILURE) ||
+      (!use_ring && ((setnonblocking(connect_sd) == EXIT_FAILURE) ||
+      (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connect_sd, &event) == -1))))
+   {
+      fprintf(stderr, "ERROR: Failed to set up client connection.\n");
+      free(conn_ptr);
+      close(connect_sd);
+      return;
+   }
+
+   conn_ptr->sd = connect_sd;
+   conn_ptr->state = CONN_RECV_HEADER;
+   conn_ptr->buf_len = PROTO_HEADER_BYTES;
+   conn_ptr->events = EPOLLIN;
+   conn_ptr->in_head = -1;
+   conn_ptr->in_tail = -1;
+   opensession(&conn_ptr->session);
+
+   if (use_ring)
+   {
+      armrecv(conn_ptr);
+   }
+   checkidle(conn_ptr);
+}
+
+static void closeconn(struct conn * conn_ptr)
+{
+   if (use_ring)
+   {
+      // A receive or send queued this round only reaches the kernel at the
+         //next uring_enter, so the descriptor and the batch it sends from
+         //are kept until freeclosed finds every operation finished.
+         //Shutting down makes the operations end without sending anything
+      shutdown(conn_ptr->sd, SHUT_RDWR);
+      conn_ptr->closed_sd = conn_ptr->sd;
+
+      while (conn_ptr->in_head != -1)
+      {
+         int bid = conn_ptr->in_head;
+
+         conn_ptr->in_head = inbufs[bid].next;
+         putbuf(bid);
+      }
+      conn_ptr->in_tail = -1;
+   }
+   else
+   {
+      close(conn_ptr->sd); // also removes it from the epoll instance
+      conn_ptr->closed_sd = -1;
+   }
+   conn_ptr->sd = -1;
+   checkidle(conn_ptr);
+   closesession(&conn_ptr->session);
+
+   for (struct request * request_ptr = conn_ptr->head; request_ptr != NULL;
+      request_ptr = request_ptr->next)
+   {
+      if (request_ptr->batch.num_received < request_ptr->batch.num_jobs)
+      {
+         untrack(request_ptr);
+      }
+   }
+   stats_count(&edge_stats, COUNTER_BATCHES_FAILED,
+      (unsigned long) conn_ptr->num_requests);
+   conn_ptr->closed_head = conn_ptr->head;
+   conn_ptr->head = NULL;
+   conn_ptr->tail = NULL;
+   conn_ptr->num_requests = 0;
+
+   conn_ptr->next = closed;
+   closed = conn_ptr;
+}
+
+static void readconn(struct conn * conn_ptr)
+{
+   while (1)
+   {
+      unsigned char * dest = (conn_ptr->state == CONN_RECV_HEADER) ?
+         conn_ptr->header_buf : conn_ptr->buf;
+      ssize_t received = recvconn(conn_ptr, dest + conn_ptr->buf_done,
+         conn_ptr->buf_len - conn_ptr->buf_done);
+
+      if (received == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+         {
+            fprintf(stderr, "ERROR: Failed to receive jobs from client.\n");
+            closeconn(conn_ptr);
+         }
+         return;
+      }
+      else if (received == 0)
+      {
+         if ((conn_ptr->state != CONN_RECV_HEADER) ||
+            (conn_ptr->buf_done != 0))
+         {
+            fprintf(stderr, "ERROR: Client closed the connection early.\n");
+            closeconn(conn_ptr);
+            return;
+         }
+
+         // Client has sent its last batch, answer the ones still queued
+         conn_ptr->state = CONN_DRAINING;
+         watch(conn_ptr, conn_ptr->events & ~EPOLLIN);
+         if (conn_ptr->head == NULL)
+         {
+            closeconn(conn_ptr);
+         }
+         return;
+      }
+
+      if ((conn_ptr->state == CONN_RECV_HEADER) && (conn_ptr->buf_done == 0))
+      {
+         conn_ptr->recv_nsec = stats_nownsec();
+      }
+      conn_ptr->buf_done += (size_t) received;
+      stats_count(&edge_stats, COUNTER_BYTES_RECEIVED,
+         (unsigned long) received);
+
+      if (conn_ptr->buf_done < conn_ptr->buf_len)
+      {
+         continue;
+      }
+
+      if (conn_ptr->state == CONN_RECV_HEADER)
+      {
+         struct proto_header header;
+         size_t len = 0;
+
+         if (proto_unpackheader(conn_ptr->header_buf, &header)
+            == EXIT_SUCCESS)
+         {
+            // Wide jobs give the size of their records after the header,
+               //and session batches end it with their request ID
+            size_t header_len = proto_headerbytes(header.opcode,
+               header.flags);
+
+            if (conn_ptr->buf_len < header_len)
+            {
+               conn_ptr->buf_len = header_len;
+               continue;
+            }
+            len = jobrecordbytes(conn_ptr->header_buf, &header);
+         }
+
+         if (len == 0)
+         {
+            fprintf(stderr, "ERROR: Failed to receive job header from"
+               " client.\n");
+            closeconn(conn_ptr);
+            return;
+         }
+
+         if (joinsession(&conn_ptr->session, &header) == EXIT_FAILURE)
+         {
+            closeconn(conn_ptr);
+            return;
+         }
+
+         conn_ptr->num_jobs = (int) header.job_count;
+         conn_ptr->flags = header.flags;
+         conn_ptr->client_id = ((header.flags & PROTO_FLAG_SESSION) != 0) ?
+            proto_getle64(conn_ptr->header_buf + conn_ptr->buf_len -
+            PROTO_REQUEST_ID_BYTES) : 0;
+         conn_ptr->wide = (header.opcode == PROTO_OP_WIDE_JOBS);
+         conn_ptr->buf_len = len;
+         conn_ptr->buf_done = 0;
+
+         if ((conn_ptr->buf = malloc(conn_ptr->buf_len)) == NULL)
+         {
+            fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+            closeconn(conn_ptr);
+            return;
+         }
+         conn_ptr->state = CONN_RECV_JOBS;
+         continue;
+      }
+
+      // Every job record of the batch has arrived
+      struct wide_job * wide_jobs = NULL;
+      struct job * jobs = conn_ptr->wide ? decodewidejobs(conn_ptr->buf,
+         conn_ptr->buf_len, conn_ptr->num_jobs, &wide_jobs) :
+         decodejobs(conn_ptr->buf, conn_ptr->num_jobs);
+
+      free(conn_ptr->buf);
+      conn_ptr->buf = NULL;
+      conn_ptr->state = CONN_RECV_HEADER;
+      conn_ptr->buf_len = PROTO_HEADER_BYTES;
+      conn_ptr->buf_done = 0;
+
+      if (jobs == NULL)
+      {
+         closeconn(conn_ptr);
+         return;
+      }
+
+      dispatch(conn_ptr, jobs, wide_jobs);
+
+      if (conn_ptr->sd == -1)
+      {
+         return;
+      }
+
+      if (conn_ptr->num_requests >= MAX_PIPELINED)
+      {
+         // Leave further batches in the socket until the oldest is answered
+         watch(conn_ptr, conn_ptr->events & ~EPOLLIN);
+         return;
+      }
+   }
+}
+
+static void writeconn(struct conn * conn_ptr)
+{
+   while ((conn_ptr->head != NULL) && nextanswer(conn_ptr))
+   {
+      struct request * request_ptr = conn_ptr->head;
+      struct batch * batch_ptr = &request_ptr->batch;
+
+      while (batch_ptr->out_sent < batch_ptr->out_ready)
+      {
+         ssize_t sent = sendconn(conn_ptr,
+            batch_ptr->out + batch_ptr->out_sent,
+            batch_ptr->out_ready - batch_ptr->out_sent);
+
+         if (sent == -1)
+         {
+            if (errno == EINTR)
+            {
+               continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+               fprintf(stderr, "ERROR: Failed to send results to client.\n");
+               closeconn(conn_ptr);
+               return;
+            }
+
+            // Socket is full, carry on once the client catches up
+            watch(conn_ptr, conn_ptr->events | EPOLLOUT);
+            return;
+         }
+         batch_ptr->out_sent += (size_t) sent;
+      }
+
+      if (batch_ptr->out_sent < batch_ptr->out_len)
+      {
+         break; // rest of the batch is still at the backend servers
+      }
+
+      recordbatch(batch_ptr);
+      conn_ptr->session.num_answered++;
+      conn_ptr->session.num_jobs += (unsigned long) batch_ptr->num_jobs;
+
+      // Print message indicating edge server has sent all results to the
+         //client
+      logger_printf(LOGGER_INFO, "The edge server has successfully finished"
+         " sending all computation results to the client.\n");
+
+      conn_ptr->head = request_ptr->next;
+      if (conn_ptr->head == NULL)
+      {
+         conn_ptr->tail = NULL;
+      }
+      conn_ptr->num_requests--;
+      freerequest(request_ptr);
+   }
+
+   if ((conn_ptr->state == CONN_DRAINING) && (conn_ptr->head == NULL))
+   {
+      closeconn(conn_ptr);
+      return;
+   }
+
+   // Caught up, wait for more results and read batches while there is room
+   watch(conn_ptr, ((conn_ptr->state != CONN_DRAINING) &&
+      (conn_ptr->num_requests < MAX_PIPELINED)) ? EPOLLIN : 0);
+   checkidle(conn_ptr);
+}
+
+static bool nextanswer(struct conn * conn_ptr)
+{
+   struct request * head_ptr = conn_ptr->head;
+
+   // Other connections stream their oldest batch as its results arrive
+   if (!conn_ptr->session.keepalive)
+   {
+      return true;
+   }
+
+   // A session sends whole results messages, one at a time
+   if ((head_ptr->batch.out_sent != 0) || conn_ptr->sending ||
+      (head_ptr->batch.out_ready == head_ptr->batch.out_len))
+   {
+      return true;
+   }
+
+   for (struct request * prev_ptr = head_ptr; prev_ptr->next != NULL;
+      prev_ptr = prev_ptr->next)
+   {
+      struct request * request_ptr = prev_ptr->next;
+
+      if (request_ptr->batch.out_ready == request_ptr->batch.out_len)
+      {
+         prev_ptr->next = request_ptr->next;
+         if (conn_ptr->tail == request_ptr)
+         {
+            conn_ptr->tail = prev_ptr;
+         }
+         request_ptr->next = head_ptr;
+         conn_ptr->head = request_ptr;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static ssize_t recvconn(struct conn * conn_ptr, unsigned char * dest,
+   size_t len)
+{
+   if (!use_ring)
+   {
+      dgram_counters.stream_calls++;
+      return recv(conn_ptr->sd, dest, len, 0);
+   }
+
+   // Report the end of the stream or an error only after every byte before it
+   if (conn_ptr->in_head == -1)
+   {
+      if (conn_ptr->in_error != 0)
+      {
+         errno = conn_ptr->in_error;
+         return -1;
+      }
+
+      if (conn_ptr->in_eof)
+      {
+         return 0;
+      }
+
+      errno = EAGAIN;
+      return -1;
+   }
+
+   int bid = conn_ptr->in_head;
+   struct inbuf * inbuf_ptr = &inbufs[bid];
+   size_t available = inbuf_ptr->len - inbuf_ptr->offset;
+
+   if (len > available)
+   {
+      len = available;
+   }
+
+   memcpy(dest, uring_buf(&ring_bufs, (uint16_t) bid) + inbuf_ptr->offset,
+      len);
+   inbuf_ptr->offset += len;
+
+   if (inbuf_ptr->offset == inbuf_ptr->len)
+   {
+      conn_ptr->in_head = inbuf_ptr->next;
+      if (conn_ptr->in_head == -1)
+      {
+         conn_ptr->in_tail = -1;
+      }
+      putbuf(bid);
+   }
+
+   return (ssize_t) len;
+}
+
+static ssize_t sendconn(struct conn * conn_ptr, const unsigned char * buf,
+   size_t len)
+{
+   if (!use_ring)
+   {
+      dgram_counters.stream_calls++;
+      return send(conn_ptr->sd, buf, len, MSG_NOSIGNAL);
+   }
+
+   // One send at a time keeps the results in order
+   if (!conn_ptr->sending)
+   {
+      struct io_uring_sqe * sqe = uring_getsqe(&ring, IORING_OP_SEND,
+         conn_ptr->sd, (uintptr_t) conn_ptr | OP_SEND);
+
+      if (sqe == NULL)
+      {
+         errno = ENOBUFS;
+         return -1;
+      }
+
+      sqe->addr = (uintptr_t) buf;
+      sqe->len = (uint32_t) len;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      conn_ptr->sending = true;
+      conn_ptr->ops++;
+   }
+
+   errno = EAGAIN;
+   return -1;
+}
+
+static void armrecv(struct conn * conn_ptr)
+{
+   if (conn_ptr->recv_armed || conn_ptr->in_eof || (conn_ptr->in_error != 0))
+   {
+      return;
+   }
+
+   if (ring_free == 0)
+   {
+      if (!conn_ptr->starved)
+      {
+         conn_ptr->starved = true;
+         conn_ptr->starved_next = starved;
+         starved = conn_ptr;
+      }
+      return;
+   }
+
+   struct io_uring_sqe * sqe = uring_getsqe(&ring, IORING_OP_RECV,
+      conn_ptr->sd, (uintptr_t) conn_ptr | OP_RECV);
+
+   if (sqe == NULL)
+   {
+      closeconn(conn_ptr);
+      return;
+   }
+
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = RING_GROUP;
+   conn_ptr->recv_armed = true;
+   conn_ptr->recv_cancelled = false;
+   conn_ptr->ops++;
+}
+
+static void addready(struct conn * conn_ptr)
+{
+   if (!conn_ptr->ready)
+   {
+      conn_ptr->ready = true;
+      conn_ptr->ready_next = ready;
+      ready = conn_ptr;
+   }
+}
+
+static void recvdone(struct conn * conn_ptr, int res, uint32_t flags)
+{
+   if (!(flags & IORING_CQE_F_MORE))
+   {
+      conn_ptr->recv_armed = false;
+      conn_ptr->ops--;
+   }
+
+   if (flags & IORING_CQE_F_BUFFER)
+   {
+      int bid = (int) (flags >> IORING_CQE_BUFFER_SHIFT);
+
+      ring_free--;
+      if ((conn_ptr->sd == -1) || (res <= 0))
+      {
+         putbuf(bid);
+      }
+      else
+      {
+         // Queue the bytes behind the ones not read yet
+         inbufs[bid].len = (size_t) res;
+         inbufs[bid].offset = 0;
+         inbufs[bid].next = -1;
+         if (conn_ptr->in_tail == -1)
+         {
+            conn_ptr->in_head = bid;
+         }
+         else
+         {
+            inbufs[conn_ptr->in_tail].next = bid;
+         }
+         conn_ptr->in_tail = bid;
+      }
+   }
+   else if (res == 0)
+   {
+      conn_ptr->in_eof = true;
+   }
+   else if ((res != -ENOBUFS) && (res != -ECANCELED))
+   {
+      conn_ptr->in_error = -res;
+   }
+
+   if ((conn_ptr->sd == -1) || !(conn_ptr->events & EPOLLIN))
+   {
+      return;
+   }
+
+   readconn(conn_ptr);
+
+   // A receive that ran out of buffers or was cancelled too late is armed
+      //again while reading goes on
+   if ((conn_ptr->sd != -1) && (conn_ptr->events & EPOLLIN))
+   {
+      armrecv(conn_ptr);
+   }
+
+   if (conn_ptr->sd != -1)
+   {
+      checkidle(conn_ptr);
+   }
+}
+
+static void senddone(struct conn * conn_ptr, int res)
+{
+   conn_ptr->sending = false;
+   conn_ptr->ops--;
+
+   if (conn_ptr->sd == -1)
+   {
+      return;
+   }
+
+   if (res < 0)
+   {
+      fprintf(stderr, "ERROR: Failed to send results to client.\n");
+      closeconn(conn_ptr);
+      return;
+   }
+
+   conn_ptr->head->batch.out_sent += (size_t) res;
+   writeconn(conn_ptr);
+}
+
+static void putbuf(int bid)
+{
+   uring_bufput(&ring_bufs, (uint16_t) bid);
+   ring_free++;
+}
+
+static void checkidle(struct conn * conn_ptr)
+{
+   bool idle = (conn_ptr->sd != -1) && (conn_ptr->head == NULL) &&
+      (conn_ptr->state == CONN_RECV_HEADER) && (conn_ptr->buf_done == 0);
+
+   if (idle == conn_ptr->idle)
+   {
+      return;
+   }
+   conn_ptr->idle = idle;
+
+   if (idle)
+   {
+      conn_ptr->idle_nsec = stats_nownsec();
+      conn_ptr->idle_prev = idle_tail;
+      conn_ptr->idle_next = NULL;
+      if (idle_tail == NULL)
+      {
+         idle_head = conn_ptr;
+      }
+      else
+      {
+         idle_tail->idle_next = conn_ptr;
+      }
+      idle_tail = conn_ptr;
+      return;
+   }
+
+   if (conn_ptr->idle_prev == NULL)
+   {
+      idle_head = conn_ptr->idle_next;
+   }
+   else
+   {
+      conn_ptr->idle_prev->idle_next = conn_ptr->idle_next;
+   }
+
+   if (conn_ptr->idle_next == NULL)
+   {
+      idle_tail = conn_ptr->idle_prev;
+   }
+   else
+   {
+      conn_ptr->idle_next->idle_prev = conn_ptr->idle_prev;
+   }
+}
+
+static int expireidle()
+{
+   uint64_t idle_nsec = (uint64_t) opts.idle_sec * 1000000000;
+   uint64_t now = stats_nownsec();
+
+   // Every connection waits equally long, so the oldest closes first
+   while ((idle_head != NULL) && (now - idle_head->idle_nsec >= idle_nsec))
+   {
+      stats_count(&edge_stats, COUNTER_IDLE_CLOSED, 1);
+      logger_printf(LOGGER_INFO, "The edge server has closed a connection that"
+         " was idle for %d seconds.\n", opts.idle_sec);
+      closeconn(idle_head);
+   }
+
+   if (idle_head == NULL)
+   {
+      return -1;
+   }
+
+   return (int) ((idle_head->idle_nsec + idle_nsec - now + 999999) / 1000000);
+}
+
+static void track(struct request * request_ptr)
+{
+   struct request ** bucket_ptr =
+      &inflight[(request_ptr->batch.request_id >> SHARD_BITS) &
+      (DEMUX_BUCKETS - 1)];
+
+   request_ptr->bucket_next = *bucket_ptr;
+   *bucket_ptr = request_ptr;
+   num_inflight++;
+}
+
+static void untrack(struct request * request_ptr)
+{
+   struct request ** link_ptr =
+      &inflight[(request_ptr->batch.request_id >> SHARD_BITS) &
+      (DEMUX_BUCKETS - 1)];
+
+   while (*link_ptr != NULL)
+   {
+      if (*link_ptr == request_ptr)
+      {
+         *link_ptr = request_ptr->bucket_next;
+         num_inflight--;
+         return;
+      }
+      link_ptr = &(*link_ptr)->bucket_next;
+   }
+}
+
+static struct request * lookup(uint64_t request_id)
+{
+   // Request IDs end in a per-process counter above the shard bits, so the
+      //bits above them spread evenly
+   struct request * request_ptr =
+      inflight[(request_id >> SHARD_BITS) & (DEMUX_BUCKETS - 1)];
+
+   while ((request_ptr != NULL) &&
+      (request_ptr->batch.request_id != (request_id & ~SHARD_MASK)))
+   {
+      request_ptr = request_ptr->bucket_next;
+   }
+
+   return request_ptr;
+}
+
+static int timeall()
+{
+   long wait_usec = -1;
+
+   for (int b = 0; b < DEMUX_BUCKETS; b++)
+   {
+      for (struct request * request_ptr = inflight[b]; request_ptr != NULL;
+         request_ptr = request_ptr->bucket_next)
+      {
+         long wait;
+
+         if (runtimers(backend_sd, &request_ptr->batch) == EXIT_FAILURE)
+         {
+            // Closing untracks the batch, so the scan cannot go on
+            closeconn(request_ptr->conn_ptr);
+            return 0;
+         }
+
+         if (((wait = timerwait(&request_ptr->batch)) != -1) &&
+            ((wait_usec == -1) || (wait < wait_usec)))
+         {
+            wait_usec = wait;
+         }
+      }
+   }
+
+   return (wait_usec == -1) ? -1 : (int) ((wait_usec + 999) / 1000);
+}
+
+static void dispatch(struct conn * conn_ptr, struct job * jobs,
+   struct wide_job * wide_jobs)
+{
+   struct request * request_ptr = calloc(1, sizeof(struct request));
+
+   if (request_ptr == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate batch.\n");
+      free(jobs);
+      free(wide_jobs);
+      closeconn(conn_ptr);
+      return;
+   }
+
+   // A session's request IDs must tell its queued batches apart
+   for (struct request * queued_ptr = conn_ptr->head;
+      conn_ptr->session.keepalive && (queued_ptr != NULL);
+      queued_ptr = queued_ptr->next)
+   {
+      if (queued_ptr->batch.client_id == conn_ptr->client_id)
+      {
+         fprintf(stderr, "ERROR: Client reused request ID %llu while it was"
+            " in flight.\n", (unsigned long long) conn_ptr->client_id);
+         free(request_ptr);
+         free(jobs);
+         free(wide_jobs);
+         closeconn(conn_ptr);
+         return;
+      }
+   }
+
+   if (initbatch(&request_ptr->batch, jobs, conn_ptr->num_jobs,
+      conn_ptr->flags, conn_ptr->client_id, wide_jobs) == EXIT_FAILURE)
+   {
+      free(request_ptr);
+      closeconn(conn_ptr);
+      return;
+   }
+   request_ptr->batch.recv_nsec = conn_ptr->recv_nsec;
+
+   uint64_t send_nsec = recordstage(STAGE_RECVJOBS, conn_ptr->recv_nsec);
+
+   // Print message indicating edge server has received jobs from client
+   logger_printf(LOGGER_INFO, "The edge server has received %d jobs from the"
+      " client using TCP over port %d.\n", conn_ptr->num_jobs, WELCOME_PORT);
+
+   // Queue the batch behind the connection's earlier batches
+   request_ptr->conn_ptr = conn_ptr;
+   if (conn_ptr->tail == NULL)
+   {
+      conn_ptr->head = request_ptr;
+   }
+   else
+   {
+      conn_ptr->tail->next = request_ptr;
+   }
+   conn_ptr->tail = request_ptr;
+   conn_ptr->num_requests++;
+
+   // Send jobs to backend servers
+   request_ptr->batch.request_id = newrequestid();
+   track(request_ptr);
+
+   if (sendjobs(backend_sd, backend_and_pool_ptr, backend_or_pool_ptr,
+      &request_ptr->batch) == EXIT_FAILURE)
+   {
+      closeconn(conn_ptr);
+      return;
+   }
+   request_ptr->batch.sent_nsec = recordstage(STAGE_SENDJOBS, send_nsec);
+
+   // The result cache may have answered some or all of the jobs already
+   if (request_ptr->batch.num_received == 0)
+   {
+      return;
+   }
+
+   if (request_ptr->batch.num_received == request_ptr->batch.num_jobs)
+   {
+      untrack(request_ptr);
+      request_ptr->batch.done_nsec = recordstage(STAGE_RECVRESULTS,
+         request_ptr->batch.sent_nsec);
+      printresults(&request_ptr->batch, DGRAM_PORT);
+   }
+
+   if ((request_ptr == conn_ptr->head) || conn_ptr->session.keepalive)
+   {
+      writeconn(conn_ptr);
+   }
+}
+
+static void drainresults()
+{
+   while (1)
+   {
+      unsigned char * buffer;
+      ssize_t len;
+      struct proto_header header;
+      struct request * request_ptr;
+
+      if ((len = dgram_recv(backend_sd, &backend_rx, &buffer, NULL)) == -1)
+      {
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+         {
+            fprintf(stderr, "ERROR: Failed to receive results from backend"
+               " server.\n");
+         }
+         return;
+      }
+
+      if (proto_unpackdgramheader(buffer, (size_t) len,
+         PROTO_BACKEND_RESULT_BYTES, &header) == EXIT_FAILURE)
+      {
+         fprintf(stderr, "ERROR: Failed to extract fields from results.\n");
+         continue;
+      }
+
+      if ((request_ptr = lookup(header.request_id)) == NULL)
+      {
+         // Hedge losers and resent shards may answer after their batch is done
+         if (!lateresults(header.request_id))
+         {
+            fprintf(stderr, "ERROR: Received results for a request that is"
+               " not in flight.\n");
+         }
+         continue;
+      }
+
+      if (handleresults(backend_sd, &request_ptr->batch, &header, buffer) ==
+         EXIT_FAILURE)
+      {
+         continue;
+      }
+
+      // Wide jobs send more segments as their results come back
+      if ((request_ptr->batch.wide_jobs != NULL) &&
+         (sendsegments(backend_sd, backend_and_pool_ptr, backend_or_pool_ptr,
+         &request_ptr->batch) == EXIT_FAILURE))
+      {
+         closeconn(request_ptr->conn_ptr);
+         continue;
+      }
+
+      if (request_ptr->batch.num_received == request_ptr->batch.num_jobs)
+      {
+         untrack(request_ptr);
+         request_ptr->batch.done_nsec = recordstage(STAGE_RECVRESULTS,
+            request_ptr->batch.sent_nsec);
+         printresults(&request_ptr->batch, DGRAM_PORT);
+      }
+
+      // Only the connection's oldest batch streams, later ones wait their
+         //turn unless they finish first in a session
+      if ((request_ptr == request_ptr->conn_ptr->head) ||
+         (request_ptr->conn_ptr->session.keepalive &&
+         (request_ptr->batch.num_received == request_ptr->batch.num_jobs)))
+      {
+         writeconn(request_ptr->conn_ptr);
+      }
+   }
+}
+
+static void freerequest(struct request * request_ptr)
+{
+   freebatch(&request_ptr->batch);
+   free(request_ptr);
+}
@@ -0,0 +1,932 @@
+/**
+ * edgeclient.c
+ *
+ * Client library for submitting jobs to the edge server. See edgeclient.h.
+ */
+
+#define _GNU_SOURCE // ppoll
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "edgeclient.h"
+
+#define ADDR_BYTES 32 // longest "ip:port" address
+#define RESULT_CHUNK_BYTES 65536 // maximum number of result bytes per receive
+
+#define BATCH_FREE 0 // on the free list
+#define BATCH_OPEN 1 // taking jobs
+#define BATCH_SEALED 2 // queued, being sent, or awaiting results
+
+/**
+ * struct to store how to complete one job
+ */
+struct completion {
+   edgeclient_callback callback;
+   void * arg;
+};
+
+/**
+ * struct to store one batch of a connection, its index doubles as the
+ * request ID of the session batch
+ */
+struct batch {
+   int state; // BATCH_FREE, BATCH_OPEN, or BATCH_SEALED
+   int num_jobs;
+   int num_received; // number of results delivered, those of the first jobs
+      //since results arrive in job order
+   int next; // next batch on the free list or send queue, -1 if last
+   uint64_t open_nsec; // time its first job was submitted
+   unsigned char * payload; // header followed by EDGECLIENT_BATCH_JOBS job
+      //records
+   struct completion * completions; // one per job
+};
+
+/**
+ * struct to store one connection of the pool and the thread driving it
+ */
+struct conn {
+   struct edgeclient * client_ptr;
+   pthread_t thread;
+   bool started; // the thread was created
+   pthread_mutex_t mutex; // guards the batches' states and lists below
+   pthread_cond_t space; // signalled whenever a batch is freed
+   struct batch batches[EDGECLIENT_MAX_BATCHES];
+   int free_head; // first free batch, -1 if none
+   int open; // batch taking jobs, -1 if none
+   int send_head; // first sealed batch not fully sent, -1 if none
+   int send_tail; // last sealed batch not fully sent, -1 if none
+   int num_sealed; // number of sealed batches not yet answered
+   bool stopping; // the client is closing
+   int wake_fd; // event file descriptor submitters wake the thread with
+   int sd; // connected stream socket descriptor, -1 if not connected, used
+      //by the thread alone like everything below
+   size_t head_sent; // bytes of the send queue's first batch sent
+   int num_sent; // batches at least partly sent and not yet answered
+   int current; // batch the results message being decoded answers, -1
+      //between messages
+   size_t buffered; // number of bytes in buffer
+   unsigned char buffer[RESULT_CHUNK_BYTES]; // received bytes not yet decoded
+};
+
+/**
+ * struct to store a client and its pool of connections
+ */
+struct edgeclient {
+   struct sockaddr_in addr; // edge server address
+   size_t header_len; // bytes in the header of a session batch and of its
+      //results
+   struct conn * conns;
+   int num_conns;
+   pthread_mutex_t wait_mutex; // guards waiting on futures
+   pthread_cond_t done; // broadcast when jobs complete while someone waits
+   int num_waiters; // number of threads waiting on a future
+};
+
+static unsigned long num_threads; // number of threads that have submitted
+static __thread unsigned long thread_number; // calling thread's number
+   //starting at 1, 0 until it first submits
+
+/**
+ * enqueue adds a job to the open batch of the calling thread's connection,
+ * waiting for a free batch if every one is taken.
+ * @param client_ptr pointer to struct edgeclient
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @param operand1 uint32_t first operand
+ * @param operand2 uint32_t second operand
+ * @param callback edgeclient_callback function completing the job
+ * @param arg pointer passed to the callback
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int enqueue(struct edgeclient * client_ptr, int opcode,
+   uint32_t operand1, uint32_t operand2, edgeclient_callback callback,
+   void * arg);
+
+/**
+ * seal writes the header of the open batch and queues it to be sent. The
+ * connection's mutex must be held.
+ * @param conn_ptr pointer to struct conn
+ */
+static void seal(struct conn * conn_ptr);
+
+/**
+ * runconn is a connection's thread. It seals open batches when they are due,
+ * sends them, and completes their jobs as results arrive, until the client
+ * closes and every batch has been answered.
+ * @param conn_ptr pointer to struct conn
+ * @return void * NULL
+ */
+static void * runconn(void * conn_ptr);
+
+/**
+ * connectconn connects a connection's socket to the edge server.
+ * @param conn_ptr pointer to struct conn
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int connectconn(struct conn * conn_ptr);
+
+/**
+ * sendbatches sends as much of the queued batches as the socket takes.
+ * @param conn_ptr pointer to struct conn
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int sendbatches(struct conn * conn_ptr);
+
+/**
+ * recvresults receives the results that have arrived and completes their
+ * jobs. An idle connection the edge server closed is just closed too.
+ * @param conn_ptr pointer to struct conn
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int recvresults(struct conn * conn_ptr);
+
+/**
+ * freebatch returns an answered batch to the free list.
+ * @param conn_ptr pointer to struct conn
+ * @param b int index of the batch
+ */
+static void freebatch(struct conn * conn_ptr, int b);
+
+/**
+ * failbatches closes a connection and fails every job of its sealed batches
+ * that has not completed.
+ * @param conn_ptr pointer to struct conn
+ */
+static void failbatches(struct conn * conn_ptr);
+
+/**
+ * completefuture is the callback of jobs submitted with a future.
+ * @param arg pointer to struct edgeclient_future
+ * @param status int 0 if successful, 1 if the job failed
+ * @param result uint32_t result of the job
+ */
+static void completefuture(void * arg, int status, uint32_t result);
+
+/**
+ * notifywaiters wakes every thread waiting on a future so it can check
+ * whether its job has completed.
+ * @param client_ptr pointer to struct edgeclient
+ */
+static void notifywaiters(struct edgeclient * client_ptr);
+
+/**
+ * bitwidth returns the number of binary digits a word is written with.
+ * @param word uint32_t value
+ * @return int number of digits, at least 1
+ */
+static int bitwidth(uint32_t word);
+
+/**
+ * nownsec reads the monotonic clock.
+ * @return uint64_t nanoseconds
+ */
+static uint64_t nownsec(void);
+
+struct edgeclient * edgeclient_open(const char * address, int num_conns)
+{
+   char addr[ADDR_BYTES];
+   char * colon;
+   long port = 0;
+   struct edgeclient * client_ptr;
+
+   if (address == NULL)
+   {
+      address = EDGECLIENT_ADDRESS;
+   }
+
+   if ((num_conns < 1) || (num_conns > EDGECLIENT_MAX_CONNS))
+   {
+      fprintf(stderr, "ERROR: A client must have 1 to %d connections.\n",
+         EDGECLIENT_MAX_CONNS);
+      return NULL;
+   }
+
+   if ((client_ptr = calloc(1, sizeof(struct edgeclient))) == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate client.\n");
+      return NULL;
+   }
+
+   // Parse the edge server address
+   snprintf(addr, sizeof(addr), "%s", address);
+   client_ptr->addr.sin_family = AF_INET;
+
+   if ((colon = strchr(addr, ':')) != NULL)
+   {
+      *colon = '\0';
+      port = strtol(colon + 1, NULL, 10);
+   }
+
+   if ((colon == NULL) || (port < 1) || (port > 65535) ||
+      (inet_aton(addr, &client_ptr->addr.sin_addr) == 0))
+   {
+      fprintf(stderr, "ERROR: Edge server address must be ip:port.\n");
+      free(client_ptr);
+      return NULL;
+   }
+   client_ptr->addr.sin_port = htons((uint16_t) port);
+   client_ptr->header_len = proto_headerbytes(PROTO_OP_JOBS,
+      PROTO_FLAG_SESSION);
+   pthread_mutex_init(&client_ptr->wait_mutex, NULL);
+   pthread_cond_init(&client_ptr->done, NULL);
+
+   if ((client_ptr->conns = calloc((size_t) num_conns, sizeof(struct conn)))
+      == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate connections.\n");
+      pthread_mutex_destroy(&client_ptr->wait_mutex);
+      pthread_cond_destroy(&client_ptr->done);
+      free(client_ptr);
+      return NULL;
+   }
+   client_ptr->num_conns = num_conns;
+
+   // Set up every connection before starting any thread, so closing can
+      //clean up after a failure part way through
+   for (int c = 0; c < num_conns; c++)
+   {
+      struct conn * conn_ptr = &client_ptr->conns[c];
+
+      conn_ptr->client_ptr = client_ptr;
+      pthread_mutex_init(&conn_ptr->mutex, NULL);
+      pthread_cond_init(&conn_ptr->space, NULL);
+      conn_ptr->free_head = 0;
+      conn_ptr->open = -1;
+      conn_ptr->send_head = -1;
+      conn_ptr->send_tail = -1;
+      conn_ptr->sd = -1;
+      conn_ptr->current = -1;
+      conn_ptr->wake_fd = -1;
+
+      for (int b = 0; b < EDGECLIENT_MAX_BATCHES; b++)
+      {
+         conn_ptr->batches[b].next = (b + 1 < EDGECLIENT_MAX_BATCHES) ?
+            b + 1 : -1;
+      }
+   }
+
+   for (int c = 0; c < num_conns; c++)
+   {
+      struct conn * conn_ptr = &client_ptr->conns[c];
+      bool allocated = true;
+
+      for (int b = 0; b < EDGECLIENT_MAX_BATCHES; b++)
+      {
+         struct batch * batch_ptr = &conn_ptr->batches[b];
+
+         if (((batch_ptr->payload = malloc(client_ptr->header_len +
+            EDGECLIENT_BATCH_JOBS * PROTO_CLIENT_JOB_BYTES)) == NULL) ||
+            ((batch_ptr->completions = malloc(EDGECLIENT_BATCH_JOBS *
+            sizeof(struct completion))) == NULL))
+         {
+            allocated = false;
+            break;
+         }
+      }
+
+      if (!allocated)
+      {
+         fprintf(stderr, "ERROR: Failed to allocate batches.\n");
+         edgeclient_close(client_ptr);
+         return NULL;
+      }
+
+      if ((conn_ptr->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+      {
+         fprintf(stderr, "ERROR: Failed to create event file descriptor.\n");
+         edgeclient_close(client_ptr);
+         return NULL;
+      }
+
+      if (pthread_create(&conn_ptr->thread, NULL, runconn, conn_ptr) != 0)
+      {
+         fprintf(stderr, "ERROR: Failed to create thread.\n");
+         edgeclient_close(client_ptr);
+         return NULL;
+      }
+      conn_ptr->started = true;
+   }
+
+   return client_ptr;
+}
+
+int edgeclient_submit(struct edgeclient * client_ptr, int opcode,
+   uint32_t operand1, uint32_t operand2,
+   struct edgeclient_future * future_ptr)
+{
+   future_ptr->status = EDGECLIENT_PENDING;
+   future_ptr->result = 0;
+   future_ptr->client = client_ptr;
+
+   if (enqueue(client_ptr, opcode, operand1, operand2, completefuture,
+      future_ptr) == EXIT_FAILURE)
+   {
+      future_ptr->status = EXIT_FAILURE;
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int edgeclient_submitcb(struct edgeclient * client_ptr, int opcode,
+   uint32_t operand1, uint32_t operand2, edgeclient_callback callback,
+   void * arg)
+{
+   return enqueue(client_ptr, opcode, operand1, operand2, callback, arg);
+}
+
+bool edgeclient_ready(const struct edgeclient_future * future_ptr)
+{
+   return __atomic_load_n(&future_ptr->status, __ATOMIC_ACQUIRE) !=
+      EDGECLIENT_PENDING;
+}
+
+int edgeclient_wait(struct edgeclient_future * future_ptr)
+{
+   struct edgeclient * client_ptr = future_ptr->client;
+
+   if (edgeclient_ready(future_ptr))
+   {
+      return future_ptr->status;
+   }
+
+   // Announce the wait before checking again, so a connection thread
+      //completing the job right now is sure to see it and wake us
+   pthread_mutex_lock(&client_ptr->wait_mutex);
+   __atomic_add_fetch(&client_ptr->num_waiters, 1, __ATOMIC_SEQ_CST);
+   while (__atomic_load_n(&future_ptr->status, __ATOMIC_SEQ_CST) ==
+      EDGECLIENT_PENDING)
+   {
+      pthread_cond_wait(&client_ptr->done, &client_ptr->wait_mutex);
+   }
+   __atomic_sub_fetch(&client_ptr->num_waiters, 1, __ATOMIC_SEQ_CST);
+   pthread_mutex_unlock(&client_ptr->wait_mutex);
+
+   return future_ptr->status;
+}
+
+void edgeclient_flush(struct edgeclient * client_ptr)
+{
+   for (int c = 0; c < client_ptr->num_conns; c++)
+   {
+      struct conn * conn_ptr = &client_ptr->conns[c];
+      bool sealed = false;
+
+      pthread_mutex_lock(&conn_ptr->mutex);
+      if (conn_ptr->open != -1)
+      {
+         seal(conn_ptr);
+         sealed = true;
+      }
+      pthread_mutex_unlock(&conn_ptr->mutex);
+
+      if (sealed)
+      {
+         uint64_t one = 1;
+
+         if (write(conn_ptr->wake_fd, &one, sizeof(one)) == -1)
+         {
+            // The counter is already nonzero, the thread will wake anyway
+         }
+      }
+   }
+}
+
+void edgeclient_close(struct edgeclient * client_ptr)
+{
+   // Let every thread finish its batches and stop
+   for (int c = 0; c < client_ptr->num_conns; c++)
+   {
+      struct conn * conn_ptr = &client_ptr->conns[c];
+      uint64_t one = 1;
+
+      pthread_mutex_lock(&conn_ptr->mutex);
+      conn_ptr->stopping = true;
+      pthread_cond_broadcast(&conn_ptr->space);
+      pthread_mutex_unlock(&conn_ptr->mutex);
+
+      if ((conn_ptr->wake_fd != -1) &&
+         (write(conn_ptr->wake_fd, &one, sizeof(one)) == -1))
+      {
+         // The counter is already nonzero, the thread will wake anyway
+      }
+   }
+
+   for (int c = 0; c < client_ptr->num_conns; c++)
+   {
+      struct conn * conn_ptr = &client_ptr->conns[c];
+
+      if (conn_ptr->started)
+      {
+         pthread_join(conn_ptr->thread, NULL);
+      }
+
+      if (conn_ptr->sd != -1)
+      {
+         close(conn_ptr->sd);
+      }
+      if (conn_ptr->wake_fd != -1)
+      {
+         close(conn_ptr->wake_fd);
+      }
+
+      for (int b = 0; b < EDGECLIENT_MAX_BATCHES; b++)
+      {
+         free(conn_ptr->batches[b].payload);
+         free(conn_ptr->batches[b].completions);
+      }
+      pthread_mutex_destroy(&conn_ptr->mutex);
+      pthread_cond_destroy(&conn_ptr->space);
+   }
+
+   pthread_mutex_destroy(&client_ptr->wait_mutex);
+   pthread_cond_destroy(&client_ptr->done);
+   free(client_ptr->conns);
+   free(client_ptr);
+}
+
+static int enqueue(struct edgeclient * client_ptr, int opcode,
+   uint32_t operand1, uint32_t operand2, edgeclient_callback callback,
+   void * arg)
+{
+   if ((opcode != PROTO_OP_AND) && (opcode != PROTO_OP_OR))
+   {
+      fprintf(stderr, "ERROR: Jobs must be AND or OR jobs.\n");
+      return EXIT_FAILURE;
+   }
+
+   // Each thread sticks to one connection, spreading threads over the pool
+   if (thread_number == 0)
+   {
+      thread_number = __atomic_add_fetch(&num_threads, 1, __ATOMIC_RELAXED);
+   }
+
+   struct conn * conn_ptr = &client_ptr->conns[(thread_number - 1) %
+      (unsigned long) client_ptr->num_conns];
+   struct batch * batch_ptr;
+   bool wake = false;
+
+   pthread_mutex_lock(&conn_ptr->mutex);
+
+   while (!conn_ptr->stopping && (conn_ptr->open == -1) &&
+      (conn_ptr->free_head == -1))
+   {
+      pthread_cond_wait(&conn_ptr->space, &conn_ptr->mutex);
+   }
+
+   if (conn_ptr->stopping)
+   {
+      pthread_mutex_unlock(&conn_ptr->mutex);
+      fprintf(stderr, "ERROR: Job submitted to a closed client.\n");
+      return EXIT_FAILURE;
+   }
+
+   // The thread decides when a newly opened batch is due
+   if (conn_ptr->open == -1)
+   {
+      conn_ptr->open = conn_ptr->free_head;
+      batch_ptr = &conn_ptr->batches[conn_ptr->open];
+      conn_ptr->free_head = batch_ptr->next;
+      batch_ptr->state = BATCH_OPEN;
+      batch_ptr->num_jobs = 0;
+      batch_ptr->num_received = 0;
+      batch_ptr->open_nsec = nownsec();
+      wake = true;
+   }
+   batch_ptr = &conn_ptr->batches[conn_ptr->open];
+
+   unsigned char * record = batch_ptr->payload + client_ptr->header_len +
+      (size_t) batch_ptr->num_jobs * PROTO_CLIENT_JOB_BYTES;
+
+   record[0] = (unsigned char) opcode;
+   record[1] = (unsigned char) bitwidth(operand1);
+   record[2] = (unsigned char) bitwidth(operand2);
+   record[3] = 0;
+   proto_putle32(record + 4, operand1);
+   proto_putle32(record + 8, operand2);
+   batch_ptr->completions[batch_ptr->num_jobs].callback = callback;
+   batch_ptr->completions[batch_ptr->num_jobs].arg = arg;
+
+   if (++batch_ptr->num_jobs == EDGECLIENT_BATCH_JOBS)
+   {
+      seal(conn_ptr);
+      wake = true;
+   }
+
+   pthread_mutex_unlock(&conn_ptr->mutex);
+
+   if (wake)
+   {
+      uint64_t one = 1;
+
+      if (write(conn_ptr->wake_fd, &one, sizeof(one)) == -1)
+      {
+         // The counter is already nonzero, the thread will wake anyway
+      }
+   }
+
+   return EXIT_SUCCESS;
+}
+
+static void seal(struct conn * conn_ptr)
+{
+   int b = conn_ptr->open;
+   struct batch * batch_ptr = &conn_ptr->batches[b];
+
+   // The batch's index is its request ID, unique among the batches in flight
+   proto_packheader(batch_ptr->payload, PROTO_OP_JOBS, PROTO_FLAG_SESSION,
+      (uint32_t) batch_ptr->num_jobs);
+   proto_putle64(batch_ptr->payload + PROTO_HEADER_BYTES, (uint64_t) b);
+
+   batch_ptr->state = BATCH_SEALED;
+   batch_ptr->next = -1;
+   if (conn_ptr->send_tail == -1)
+   {
+      conn_ptr->send_head = b;
+   }
+   else
+   {
+      conn_ptr->batches[conn_ptr->send_tail].next = b;
+   }
+   conn_ptr->send_tail = b;
+   conn_ptr->num_sealed++;
+   conn_ptr->open = -1;
+}
+
+static void * runconn(void * arg)
+{
+   struct conn * conn_ptr = arg;
+
+   while (1)
+   {
+      struct pollfd poll_fds[2];
+      struct timespec linger;
+      struct timespec * timeout_ptr = NULL;
+      nfds_t num_fds = 1;
+      bool sending;
+
+      pthread_mutex_lock(&conn_ptr->mutex);
+
+      // Send the open batch at once if nothing is in flight, otherwise let
+         //it fill until it has lingered long enough
+      if (conn_ptr->open != -1)
+      {
+         uint64_t waited_nsec = nownsec() -
+            conn_ptr->batches[conn_ptr->open].open_nsec;
+
+         if ((conn_ptr->num_sealed == 0) || conn_ptr->stopping ||
+            (waited_nsec >= EDGECLIENT_LINGER_USEC * 1000ull))
+         {
+            seal(conn_ptr);
+         }
+         else
+         {
+            uint64_t left_nsec = EDGECLIENT_LINGER_USEC * 1000ull -
+               waited_nsec;
+
+            linger.tv_sec = (time_t) (left_nsec / 1000000000ull);
+            linger.tv_nsec = (long) (left_nsec % 1000000000ull);
+            timeout_ptr = &linger;
+         }
+      }
+
+      if (conn_ptr->stopping && (conn_ptr->num_sealed == 0))
+      {
+         pthread_mutex_unlock(&conn_ptr->mutex);
+         break;
+      }
+
+      sending = (conn_ptr->send_head != -1);
+      pthread_mutex_unlock(&conn_ptr->mutex);
+
+      if (sending && (conn_ptr->sd == -1) &&
+         (connectconn(conn_ptr) == EXIT_FAILURE))
+      {
+         failbatches(conn_ptr);
+         continue;
+      }
+
+      poll_fds[0].fd = conn_ptr->wake_fd;
+      poll_fds[0].events = POLLIN;
+      if (conn_ptr->sd != -1)
+      {
+         // Always read, to notice an idle connection being closed
+         poll_fds[1].fd = conn_ptr->sd;
+         poll_fds[1].events = POLLIN | (sending ? POLLOUT : 0);
+         num_fds = 2;
+      }
+
+      if (ppoll(poll_fds, num_fds, timeout_ptr, NULL) == -1)
+      {
+         if (errno != EINTR)
+         {
+            fprintf(stderr, "ERROR: Failed to wait for the edge server.\n");
+            failbatches(conn_ptr);
+         }
+         continue;
+      }
+
+      if (poll_fds[0].revents & POLLIN)
+      {
+         uint64_t count;
+
+         if (read(conn_ptr->wake_fd, &count, sizeof(count)) == -1)
+         {
+            // Another wake up already reset the counter
+         }
+      }
+
+      if ((num_fds == 2) && (((poll_fds[1].revents & POLLOUT) &&
+         (sendbatches(conn_ptr) == EXIT_FAILURE)) ||
+         ((poll_fds[1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+         (recvresults(conn_ptr) == EXIT_FAILURE))))
+      {
+         failbatches(conn_ptr);
+      }
+   }
+
+   return NULL;
+}
+
+static int connectconn(struct conn * conn_ptr)
+{
+   int sock_desc;
+   int yes = 1;
+
+   if ((sock_desc = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+   {
+      fprintf(stderr, "ERROR: Failed to create socket.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (connect(sock_desc, (struct sockaddr *) &conn_ptr->client_ptr->addr,
+      sizeof(conn_ptr->client_ptr->addr)) == -1)
+   {
+      fprintf(stderr, "ERROR: Failed to connect socket.\n");
+      close(sock_desc);
+      return EXIT_FAILURE;
+   }
+
+   // Batches are sent whole, waiting for acknowledgements only adds latency
+   setsockopt(sock_desc, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+   conn_ptr->sd = sock_desc;
+   conn_ptr->head_sent = 0;
+   conn_ptr->num_sent = 0;
+   conn_ptr->current = -1;
+   conn_ptr->buffered = 0;
+
+   return EXIT_SUCCESS;
+}
+
+static int sendbatches(struct conn * conn_ptr)
+{
+   size_t header_len = conn_ptr->client_ptr->header_len;
+
+   while (1)
+   {
+      int b;
+
+      pthread_mutex_lock(&conn_ptr->mutex);
+      b = conn_ptr->send_head;
+      pthread_mutex_unlock(&conn_ptr->mutex);
+
+      if (b == -1)
+      {
+         return EXIT_SUCCESS;
+      }
+
+      // Sealed batches belong to this thread alone
+      struct batch * batch_ptr = &conn_ptr->batches[b];
+      size_t len = header_len + (size_t) batch_ptr->num_jobs *
+         PROTO_CLIENT_JOB_BYTES;
+      ssize_t sent = send(conn_ptr->sd, batch_ptr->payload +
+         conn_ptr->head_sent, len - conn_ptr->head_sent,
+         MSG_DONTWAIT | MSG_NOSIGNAL);
+
+      if (sent == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+         {
+            return EXIT_SUCCESS;
+         }
+         fprintf(stderr, "ERROR: Failed to send jobs.\n");
+         return EXIT_FAILURE;
+      }
+
+      if (conn_ptr->head_sent == 0)
+      {
+         conn_ptr->num_sent++;
+      }
+
+      if ((conn_ptr->head_sent += (size_t) sent) < len)
+      {
+         continue;
+      }
+
+      pthread_mutex_lock(&conn_ptr->mutex);
+      if ((conn_ptr->send_head = batch_ptr->next) == -1)
+      {
+         conn_ptr->send_tail = -1;
+      }
+      pthread_mutex_unlock(&conn_ptr->mutex);
+      conn_ptr->head_sent = 0;
+   }
+}
+
+static int recvresults(struct conn * conn_ptr)
+{
+   ssize_t received = recv(conn_ptr->sd, conn_ptr->buffer + conn_ptr->buffered,
+      sizeof(conn_ptr->buffer) - conn_ptr->buffered, MSG_DONTWAIT);
+
+   if (received <= 0)
+   {
+      if ((received == -1) && ((errno == EINTR) || (errno == EAGAIN) ||
+         (errno == EWOULDBLOCK)))
+      {
+         return EXIT_SUCCESS;
+      }
+
+      // The edge server closes connections that stay idle, the next batch
+         //opens a new one
+      if ((received == 0) && (conn_ptr->num_sent == 0) &&
+         (conn_ptr->buffered == 0))
+      {
+         close(conn_ptr->sd);
+         conn_ptr->sd = -1;
+         return EXIT_SUCCESS;
+      }
+
+      fprintf(stderr, (received == 0) ? "ERROR: The edge server closed the"
+         " connection early.\n" : "ERROR: Failed to receive results.\n");
+      return EXIT_FAILURE;
+   }
+   conn_ptr->buffered += (size_t) received;
+
+   // Decode every complete results header and result record
+   size_t header_len = conn_ptr->client_ptr->header_len;
+   size_t used = 0;
+
+   while (1)
+   {
+      if (conn_ptr->current == -1)
+      {
+         // Results messages name their batch by its request ID
+         struct proto_header header;
+         uint64_t request_id;
+
+         if (conn_ptr->buffered - used < header_len)
+         {
+            break;
+         }
+
+         if ((proto_unpackheader(conn_ptr->buffer + used, &header) ==
+            EXIT_FAILURE) || (header.opcode != PROTO_OP_RESULTS) ||
+            (header.flags != PROTO_FLAG_SESSION) || ((request_id =
+            proto_getle64(conn_ptr->buffer + used + PROTO_HEADER_BYTES)) >=
+            EDGECLIENT_MAX_BATCHES) ||
+            (conn_ptr->batches[request_id].state != BATCH_SEALED) ||
+            (conn_ptr->batches[request_id].num_received != 0) ||
+            (header.job_count !=
+            (uint32_t) conn_ptr->batches[request_id].num_jobs))
+         {
+            fprintf(stderr, "ERROR: Unexpected results header.\n");
+            return EXIT_FAILURE;
+         }
+
+         used += header_len;
+         conn_ptr->current = (int) request_id;
+         continue;
+      }
+
+      if (conn_ptr->buffered - used < PROTO_CLIENT_RESULT_BYTES)
+      {
+         break;
+      }
+
+      struct batch * batch_ptr = &conn_ptr->batches[conn_ptr->current];
+      struct completion * completion_ptr =
+         &batch_ptr->completions[batch_ptr->num_received];
+
+      completion_ptr->callback(completion_ptr->arg, EXIT_SUCCESS,
+         proto_getle32(conn_ptr->buffer + used));
+      used += PROTO_CLIENT_RESULT_BYTES;
+
+      if (++batch_ptr->num_received == batch_ptr->num_jobs)
+      {
+         freebatch(conn_ptr, conn_ptr->current);
+         conn_ptr->current = -1;
+         conn_ptr->num_sent--;
+      }
+   }
+
+   // Keep a partial header or record for the next receive
+   memmove(conn_ptr->buffer, conn_ptr->buffer + used,
+      conn_ptr->buffered - used);
+   conn_ptr->buffered -= used;
+   notifywaiters(conn_ptr->client_ptr);
+
+   return EXIT_SUCCESS;
+}
+
+static void freebatch(struct conn * conn_ptr, int b)
+{
+   struct batch * batch_ptr = &conn_ptr->batches[b];
+
+   pthread_mutex_lock(&conn_ptr->mutex);
+   batch_ptr->state = BATCH_FREE;
+   batch_ptr->next = conn_ptr->free_head;
+   conn_ptr->free_head = b;
+   conn_ptr->num_sealed--;
+   pthread_cond_broadcast(&conn_ptr->space);
+   pthread_mutex_unlock(&conn_ptr->mutex);
+}
+
+static void failbatches(struct conn * conn_ptr)
+{
+   bool failed[EDGECLIENT_MAX_BATCHES];
+
+   if (conn_ptr->sd != -1)
+   {
+      close(conn_ptr->sd);
+      conn_ptr->sd = -1;
+   }
+
+   // Take the sealed batches off the send queue, batches sealed after this
+      //are sent over a new connection
+   pthread_mutex_lock(&conn_ptr->mutex);
+   for (int b = 0; b < EDGECLIENT_MAX_BATCHES; b++)
+   {
+      failed[b] = (conn_ptr->batches[b].state == BATCH_SEALED);
+   }
+   conn_ptr->send_head = -1;
+   conn_ptr->send_tail = -1;
+   pthread_mutex_unlock(&conn_ptr->mutex);
+
+   for (int b = 0; b < EDGECLIENT_MAX_BATCHES; b++)
+   {
+      struct batch * batch_ptr = &conn_ptr->batches[b];
+
+      if (!failed[b])
+      {
+         continue;
+      }
+
+      for (int i = batch_ptr->num_received; i < batch_ptr->num_jobs; i++)
+      {
+         batch_ptr->completions[i].callback(batch_ptr->completions[i].arg,
+            EXIT_FAILURE, 0);
+      }
+      freebatch(conn_ptr, b);
+   }
+
+   notifywaiters(conn_ptr->client_ptr);
+}
+
+static void completefuture(void * arg, int status, uint32_t result)
+{
+   struct edgeclient_future * future_ptr = arg;
+
+   future_ptr->result = result;
+   __atomic_store_n(&future_ptr->status, status, __ATOMIC_SEQ_CST);
+}
+
+static void notifywaiters(struct edgeclient * client_ptr)
+{
+   if (__atomic_load_n(&client_ptr->num_waiters, __ATOMIC_SEQ_CST) > 0)
+   {
+      pthread_mutex_lock(&client_ptr->wait_mutex);
+      pthread_cond_broadcast(&client_ptr->done);
+      pthread_mutex_unlock(&client_ptr->wait_mutex);
+   }
+}
+
+static int bitwidth(uint32_t word)
+{
+   return (word == 0) ? 1 : 32 - __builtin_clz(word);
+}
+
+static uint64_t nownsec(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
@@ -0,0 +1,135 @@
+/**
+ * edgeclient.h
+ *
+ * Client library for submitting jobs to the edge server from inside another
+ * program, without a connection or a process per batch.
+ *
+ * A client holds a small pool of keep-alive session connections to the edge
+ * server (see protocol.h), each driven by a thread of its own. Any thread may
+ * submit single jobs; submitting only encodes the job into its connection's
+ * open batch and never waits for results. Each calling thread sticks to one
+ * connection of the pool, so threads rarely contend for the same lock.
+ *
+ * Jobs are batched automatically. A connection with no batch in flight sends
+ * its open batch at once, so a lone job is not held back. While earlier
+ * batches are in flight, jobs collect in the open batch until it holds
+ * EDGECLIENT_BATCH_JOBS jobs or its first job has waited
+ * EDGECLIENT_LINGER_USEC, whichever comes first. Up to EDGECLIENT_MAX_BATCHES
+ * batches per connection may be open, queued, or in flight; once they are all
+ * taken, submitting waits for the oldest to be answered so a caller that
+ * outruns the edge server cannot use unbounded memory.
+ *
+ * A job completes either through a future the caller owns, which can be
+ * polled or waited on, or through a callback. Callbacks run on the
+ * connection's thread as results arrive, so they should be short and must not
+ * submit jobs or wait on futures. A connection the edge server closes while it
+ * is idle is opened again for the next batch. Jobs in flight on a connection
+ * that fails complete with a failure status.
+ */
+
+#ifndef EDGECLIENT_H
+#define EDGECLIENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EDGECLIENT_ADDRESS "127.0.0.1:23926" // default edge server address
+#define EDGECLIENT_MAX_CONNS 64 // maximum number of connections in a pool
+#define EDGECLIENT_BATCH_JOBS 4096 // most jobs sent in one batch
+#define EDGECLIENT_MAX_BATCHES 64 // batches per connection open, queued, or
+   //in flight
+#define EDGECLIENT_LINGER_USEC 100 // longest the first job of a batch waits
+   //for more jobs while earlier batches are in flight
+
+#define EDGECLIENT_PENDING -1 // status of a job whose result has not arrived
+
+struct edgeclient;
+
+/**
+ * edgeclient_callback is called once for every job submitted with
+ * edgeclient_submitcb, on the thread of the connection that sent it.
+ * @param arg pointer passed to edgeclient_submitcb
+ * @param status int 0 if successful, 1 if the job failed
+ * @param result uint32_t result of the job, 0 if it failed
+ */
+typedef void (* edgeclient_callback)(void * arg, int status, uint32_t result);
+
+/**
+ * struct to store the outcome of a job submitted with edgeclient_submit,
+ * owned by the caller until the job completes
+ */
+struct edgeclient_future {
+   int status; // EDGECLIENT_PENDING, then 0 if successful, 1 if unsuccessful
+   uint32_t result; // result of the job once status is 0
+   struct edgeclient * client; // client the job was submitted to
+};
+
+/**
+ * edgeclient_open starts a client. Connections are made when their first
+ * batch is sent.
+ * @param address pointer to c string "ip:port" of the edge server, NULL for
+ *    EDGECLIENT_ADDRESS
+ * @param num_conns int number of connections in the pool, 1 to
+ *    EDGECLIENT_MAX_CONNS
+ * @return struct edgeclient * client, NULL if unsuccessful
+ */
+struct edgeclient * edgeclient_open(const char * address, int num_conns);
+
+/**
+ * edgeclient_submit queues a job whose outcome is stored in a future.
+ * @param client_ptr pointer to struct edgeclient
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @param operand1 uint32_t first operand
+ * @param operand2 uint32_t second operand
+ * @param future_ptr pointer to struct edgeclient_future, which must stay
+ *    valid until the job completes
+ * @return int 0 if the job was queued, 1 if unsuccessful
+ */
+int edgeclient_submit(struct edgeclient * client_ptr, int opcode,
+   uint32_t operand1, uint32_t operand2,
+   struct edgeclient_future * future_ptr);
+
+/**
+ * edgeclient_submitcb queues a job whose outcome is passed to a callback.
+ * @param client_ptr pointer to struct edgeclient
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @param operand1 uint32_t first operand
+ * @param operand2 uint32_t second operand
+ * @param callback edgeclient_callback function called once the job completes
+ * @param arg pointer passed to the callback
+ * @return int 0 if the job was queued, 1 if unsuccessful, in which case the
+ *    callback is never called
+ */
+int edgeclient_submitcb(struct edgeclient * client_ptr, int opcode,
+   uint32_t operand1, uint32_t operand2, edgeclient_callback callback,
+   void * arg);
+
+/**
+ * edgeclient_ready tells whether a future's job has completed.
+ * @param future_ptr pointer to struct edgeclient_future
+ * @return bool true if the job has completed
+ */
+bool edgeclient_ready(const struct edgeclient_future * future_ptr);
+
+/**
+ * edgeclient_wait waits until a future's job has completed.
+ * @param future_ptr pointer to struct edgeclient_future
+ * @return int 0 if successful, 1 if the job failed
+ */
+int edgeclient_wait(struct edgeclient_future * future_ptr);
+
+/**
+ * edgeclient_flush sends every open batch without waiting for it to fill.
+ * @param client_ptr pointer to struct edgeclient
+ */
+void edgeclient_flush(struct edgeclient * client_ptr);
+
+/**
+ * edgeclient_close waits for every submitted job to complete, then closes the
+ * connections and frees the client. No job may be submitted once it is
+ * called.
+ * @param client_ptr pointer to struct edgeclient
+ */
+void edgeclient_close(struct edgeclient * client_ptr);
+
+#endif
@@ -0,0 +1,232 @@
+/**
+ * jobfile.c
+ *
+ * Chunked mmap() reader for client job files. See jobfile.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "jobfile.h"
+
+/**
+ * isspacechar reports whether a character is ignored around fields.
+ * @param c char character
+ * @return int nonzero for spaces, tabs, and carriage returns
+ */
+static int isspacechar(char c)
+{
+   return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+/**
+ * trim narrows a field to exclude surrounding spaces.
+ * @param start_ptr pointer to start of field, advanced past leading spaces
+ * @param len_ptr pointer to length of field, shortened to exclude spaces
+ */
+static void trim(const char ** start_ptr, size_t * len_ptr)
+{
+   while ((*len_ptr != 0) && isspacechar(**start_ptr))
+   {
+      (*start_ptr)++;
+      (*len_ptr)--;
+   }
+
+   while ((*len_ptr != 0) && isspacechar((*start_ptr)[*len_ptr - 1]))
+   {
+      (*len_ptr)--;
+   }
+}
+
+/**
+ * splitline splits a job line into its three comma separated fields.
+ * @param line pointer to first byte of the line
+ * @param len size_t number of bytes in the line, excluding '\n'
+ * @param view_ptr pointer to struct job_view
+ * @return int 1 if successful, 0 if the line is blank, -1 if malformed
+ */
+static int splitline(const char * line, size_t len, struct job_view * view_ptr)
+{
+   trim(&line, &len);
+
+   if (len == 0)
+   {
+      return 0;
+   }
+
+   const char * end = line + len;
+   const char * comma1 = memchr(line, ',', len);
+   const char * comma2 = (comma1 == NULL) ? NULL :
+      memchr(comma1 + 1, ',', (size_t) (end - comma1 - 1));
+
+   if ((comma2 == NULL) ||
+      (memchr(comma2 + 1, ',', (size_t) (end - comma2 - 1)) != NULL))
+   {
+      return -1;
+   }
+
+   view_ptr->operator = line;
+   view_ptr->operator_len = (size_t) (comma1 - line);
+   view_ptr->operand1 = comma1 + 1;
+   view_ptr->operand1_len = (size_t) (comma2 - comma1 - 1);
+   view_ptr->operand2 = comma2 + 1;
+   view_ptr->operand2_len = (size_t) (end - comma2 - 1);
+
+   trim(&view_ptr->operator, &view_ptr->operator_len);
+   trim(&view_ptr->operand1, &view_ptr->operand1_len);
+   trim(&view_ptr->operand2, &view_ptr->operand2_len);
+
+   return 1;
+}
+
+/**
+ * mapnext maps the chunk that starts at the page holding the next unscanned
+ * byte, so a line cut off at the end of the previous chunk is whole again.
+ * @param file_ptr pointer to struct jobfile
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int mapnext(struct jobfile * file_ptr)
+{
+   off_t next = file_ptr->map_offset + (off_t) file_ptr->pos;
+   off_t offset = next & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+
+   if ((file_ptr->map != NULL) && (offset == file_ptr->map_offset))
+   {
+      fprintf(stderr, "ERROR: Line %lld of %s is too long.\n",
+         file_ptr->line + 1, file_ptr->filename);
+      return EXIT_FAILURE;
+   }
+
+   if (file_ptr->map != NULL)
+   {
+      munmap(file_ptr->map, file_ptr->map_len);
+      file_ptr->map = NULL;
+   }
+
+   file_ptr->map_offset = offset;
+   file_ptr->map_len = (file_ptr->size - offset > JOBFILE_CHUNK_BYTES) ?
+      JOBFILE_CHUNK_BYTES : (size_t) (file_ptr->size - offset);
+   file_ptr->pos = (size_t) (next - offset);
+
+   void * map = mmap(NULL, file_ptr->map_len, PROT_READ, MAP_PRIVATE,
+      file_ptr->fd, offset);
+
+   if (map == MAP_FAILED)
+   {
+      fprintf(stderr, "ERROR: Failed to map %s.\n", file_ptr->filename);
+      file_ptr->map_len = 0;
+      file_ptr->pos = 0;
+      return EXIT_FAILURE;
+   }
+
+   // The file is scanned once from front to back
+   madvise(map, file_ptr->map_len, MADV_SEQUENTIAL);
+   file_ptr->map = map;
+
+   return EXIT_SUCCESS;
+}
+
+int jobfile_open(struct jobfile * file_ptr, const char * filename)
+{
+   struct stat file_stat;
+
+   memset(file_ptr, 0, sizeof(struct jobfile));
+   file_ptr->filename = filename;
+
+   if ((file_ptr->fd = open(filename, O_RDONLY)) == -1)
+   {
+      fprintf(stderr, "ERROR: Unable to open %s\n", filename);
+      return EXIT_FAILURE;
+   }
+
+   if (fstat(file_ptr->fd, &file_stat) == -1)
+   {
+      fprintf(stderr, "ERROR: Unable to open %s\n", filename);
+      close(file_ptr->fd);
+      return EXIT_FAILURE;
+   }
+   file_ptr->size = file_stat.st_size;
+
+   // An empty file has nothing to map
+   if ((file_ptr->size != 0) && (mapnext(file_ptr) == EXIT_FAILURE))
+   {
+      close(file_ptr->fd);
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int jobfile_next(struct jobfile * file_ptr, struct job_view * view_ptr)
+{
+   if (file_ptr->map == NULL)
+   {
+      return 0;
+   }
+
+   while (1)
+   {
+      const char * line = file_ptr->map + file_ptr->pos;
+      size_t avail = file_ptr->map_len - file_ptr->pos;
+      const char * newline = (avail == 0) ? NULL : memchr(line, '\n', avail);
+      size_t len;
+
+      if (newline != NULL)
+      {
+         len = (size_t) (newline - line);
+         file_ptr->pos += len + 1;
+      }
+      else if (file_ptr->map_offset + (off_t) file_ptr->map_len <
+         file_ptr->size)
+      {
+         // Line continues past the mapped chunk
+         if (mapnext(file_ptr) == EXIT_FAILURE)
+         {
+            return -1;
+         }
+         continue;
+      }
+      else if (avail != 0)
+      {
+         // Last line has no '\n'
+         len = avail;
+         file_ptr->pos += len;
+      }
+      else
+      {
+         return 0;
+      }
+
+      file_ptr->line++;
+
+      int status = splitline(line, len, view_ptr);
+
+      if (status == -1)
+      {
+         fprintf(stderr, "ERROR: Invalid job on line %lld of %s.\n",
+            file_ptr->line, file_ptr->filename);
+      }
+
+      if (status != 0)
+      {
+         return status;
+      }
+   }
+}
+
+void jobfile_close(struct jobfile * file_ptr)
+{
+   if (file_ptr->map != NULL)
+   {
+      munmap(file_ptr->map, file_ptr->map_len);
+      file_ptr->map = NULL;
+   }
+
+   close(file_ptr->fd);
+}
@@ -0,0 +1,70 @@
+/**
+ * jobfile.h
+ *
+ * Zero-copy reader for client job files.
+ *
+ * The file is mapped read-only one chunk of at most JOBFILE_CHUNK_BYTES at a
+ * time with madvise(MADV_SEQUENTIAL), so files larger than memory can be
+ * streamed. Each job line "operator,operand1,operand2" is scanned in place and
+ * handed out as a view of its three fields. Views point into the mapped chunk
+ * and are only valid until the next call to jobfile_next().
+ */
+
+#ifndef JOBFILE_H
+#define JOBFILE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define JOBFILE_CHUNK_BYTES (64 * 1024 * 1024) // bytes mapped at a time
+
+/**
+ * struct to store the fields of one job line, not null terminated
+ */
+struct job_view {
+   const char * operator;
+   size_t operator_len;
+   const char * operand1;
+   size_t operand1_len;
+   const char * operand2;
+   size_t operand2_len;
+};
+
+/**
+ * struct to store an open job file
+ */
+struct jobfile {
+   const char * filename;
+   int fd;
+   off_t size; // number of bytes in the file
+   off_t map_offset; // file offset of the mapped chunk, page aligned
+   char * map; // mapped chunk, NULL if nothing is mapped
+   size_t map_len; // number of bytes in the mapped chunk
+   size_t pos; // offset of the next unscanned byte in the mapped chunk
+   long long line; // line number of the last job handed out
+};
+
+/**
+ * jobfile_open opens a job file for reading.
+ * @param file_ptr pointer to struct jobfile
+ * @param filename pointer to name of job file
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int jobfile_open(struct jobfile * file_ptr, const char * filename);
+
+/**
+ * jobfile_next scans the next non-empty line of a job file.
+ * @param file_ptr pointer to struct jobfile
+ * @param view_ptr pointer to struct job_view
+ * @return int 1 if a job was read, 0 at end of file, -1 if the line is not
+ *    three comma separated fields or cannot be mapped (error printed)
+ */
+int jobfile_next(struct jobfile * file_ptr, struct job_view * view_ptr);
+
+/**
+ * jobfile_close unmaps and closes a job file.
+ * @param file_ptr pointer to struct jobfile
+ */
+void jobfile_close(struct jobfile * file_ptr);
+
+#endif
@@ -0,0 +1,856 @@
+/**
+ * kernbench.c
+ *
+ * Microbenchmark suite for the backend AND/OR computations. Runs every
+ * implementation over generated operand sets of several widths and bit
+ * densities, checks each one's results against a reference implementation
+ * working on ASCII digit strings, and prints ns/job, cycles/job, and
+ * bytes/cycle for each.
+ *
+ * Usage: ./kernbench [-n jobs] [-r rounds] [-w widths] [-v bits]
+ *    [-d densities]
+ *
+ * -n number of random jobs per word operand set (default 100000)
+ * -r number of rounds over each set (default 20)
+ * -w comma separated operand widths of the word sets, 1 to 32 digits
+ *    (default 10,32)
+ * -v comma separated operand widths of the wide sets in bits
+ *    (default 1024,65536,1048576)
+ * -d comma separated densities, the share of operand bits that are 1
+ *    (default 0.1,0.5,0.9)
+ *
+ * Rows:
+ *    legacy strings  operands as digit strings, strcpy/strlen/strcat loop,
+ *                    word sets of at most 10 digits only
+ *    word end-to-end parse digit strings, one native &/|, format result
+ *    word kernel     operands already parsed, one native &/| per job, the
+ *                    loop andcalculation/orcalculation run in the backend
+ *                    servers
+ *    avx512, avx2,   the bit vector kernels the backend servers use for wide
+ *    scalar          jobs, each one the CPU supports
+ *
+ * Cycles are read from the CPU cycle counter through perf_event_open when the
+ * kernel allows it, and from the time stamp counter otherwise, which counts
+ * at a fixed reference rate rather than the core clock. Bytes/cycle counts
+ * the operand bytes each row reads: the digits of both operands for the
+ * string rows, 8 bytes for the word kernel, and both bit vectors for the
+ * wide kernels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <stdbool.h>
+
+#include "protocol.h"
+#include "bitvec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define KERNBENCH_TSC // fall back on the time stamp counter
+#endif
+
+#define OPERAND_BYTES 10 // maximum number of digits in a legacy operand
+#define RESULT_BYTES 10 // maximum number of digits in a legacy result
+
+#define MAX_SETS 16 // maximum number of widths or densities in a list
+#define WIDE_SET_BITS (1u << 22) // operand bits per wide set, fits in cache
+
+#define CYCLES_NONE 0 // no cycle counter
+#define CYCLES_PERF 1 // core cycles from perf_event_open
+#define CYCLES_TSC 2 // reference cycles from the time stamp counter
+
+/**
+ * struct to store one benchmark job in both representations
+ */
+struct bench_job {
+   int opcode; // PROTO_OP_AND or PROTO_OP_OR
+   char operand1[PROTO_MAX_WIDTH + 1];
+   char operand2[PROTO_MAX_WIDTH + 1];
+   uint32_t word1;
+   uint32_t word2;
+};
+
+/**
+ * struct to store wide jobs whose operands all have the same width
+ */
+struct wide_set {
+   int num_jobs;
+   uint64_t bits; // number of bits in every operand
+   size_t num_words; // number of words in every operand
+   int * opcodes; // PROTO_OP_AND or PROTO_OP_OR of each job
+   unsigned char * vecs1; // num_jobs operand 1 vectors of num_words words
+   unsigned char * vecs2; // num_jobs operand 2 vectors of num_words words
+   unsigned char * results; // num_jobs result vectors of num_words words
+};
+
+/**
+ * struct to store command line options
+ */
+struct options {
+   int num_jobs; // number of jobs per word set
+   int rounds; // number of rounds
+   int widths[MAX_SETS]; // operand digits of each word set
+   int num_widths;
+   long bits[MAX_SETS]; // operand bits of each wide set
+   int num_bits;
+   double densities[MAX_SETS]; // share of 1 bits of each set
+   int num_densities;
+};
+
+static struct options opts = {100000, 20, {10, 32}, 2,
+   {1024, 65536, 1048576}, 3, {0.1, 0.5, 0.9}, 3};
+
+static int cycles_source; // CYCLES_* value
+static int cycles_fd = -1; // perf event file descriptor, -1 if none
+static uint64_t rng = 450; // state of the random number generator
+
+/**
+ * legacycalculation is the original backend computation: it strcpy's the
+ * operands, calls strlen on every iteration, and builds the result with
+ * strcat.
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @param operand1 pointer to first operand c string
+ * @param operand2 pointer to second operand c string
+ * @param result pointer to at least RESULT_BYTES + 1 bytes
+ */
+void legacycalculation(int opcode, const char * operand1,
+   const char * operand2, char * result);
+
+/**
+ * referencecalculation computes a job digit by digit on ASCII strings of any
+ * length, the way legacycalculation does, and is the reference every other
+ * implementation is checked against.
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @param operand1 pointer to first operand c string
+ * @param operand2 pointer to second operand c string
+ * @param result pointer to at least as many bytes as the longer operand plus
+ *    one
+ */
+void referencecalculation(int opcode, const char * operand1,
+   const char * operand2, char * result);
+
+/**
+ * parselist parses a comma separated list of numbers.
+ * @param str pointer to c string list
+ * @param values array of MAX_SETS doubles
+ * @return int number of values, -1 if the list is invalid
+ */
+int parselist(const char * str, double values[]);
+
+/**
+ * benchwords checks and times the word rows over one set of random jobs.
+ * @param width int number of digits of every operand
+ * @param density double share of operand bits that are 1
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int benchwords(int width, double density);
+
+/**
+ * benchwide checks and times every bit vector kernel over one set of random
+ * wide jobs.
+ * @param bits uint64_t number of bits of every operand
+ * @param density double share of operand bits that are 1
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int benchwide(uint64_t bits, double density);
+
+/**
+ * checkwide checks the results of a wide set against the reference.
+ * @param set_ptr pointer to struct wide_set whose results are computed
+ * @return int 0 if every result matches, 1 otherwise
+ */
+int checkwide(const struct wide_set * set_ptr);
+
+/**
+ * makejobs fills an array with random jobs of a given width and density.
+ * @param jobs pointer to array of num_jobs struct bench_job
+ * @param num_jobs int number of jobs
+ * @param width int number of digits of every operand
+ * @param density double share of operand bits that are 1
+ */
+void makejobs(struct bench_job * jobs, int num_jobs, int width,
+   double density);
+
+/**
+ * randombits returns random bits, each 1 with a given probability.
+ * @param count int number of bits, at most 64
+ * @param density double probability of a 1 bit
+ * @return uint64_t bits, the low count bits random and the rest 0
+ */
+uint64_t randombits(int count, double density);
+
+/**
+ * nextrandom advances a xorshift64* random number generator.
+ * @return uint64_t random number
+ */
+uint64_t nextrandom();
+
+/**
+ * opencycles opens the best cycle counter available.
+ */
+void opencycles();
+
+/**
+ * readcycles reads the cycle counter.
+ * @return uint64_t cycles, 0 if there is no counter
+ */
+uint64_t readcycles();
+
+/**
+ * now returns the monotonic clock in seconds.
+ * @return double seconds
+ */
+double now();
+
+/**
+ * report prints the cost of one benchmark row.
+ * @param name pointer to row name c string
+ * @param jobs double number of jobs run
+ * @param bytes double number of operand bytes read
+ * @param seconds double elapsed time
+ * @param cycles uint64_t elapsed cycles
+ * @param checksum unsigned long checksum that keeps the work observable
+ */
+void report(const char * name, double jobs, double bytes, double seconds,
+   uint64_t cycles, unsigned long checksum);
+
+/**
+ * main
+ * random job sets are generated, each implementation is checked against the
+ * reference and timed over the same jobs.
+ * @param argc int number of arguments
+ * @param argv pointer to array of c string argument pointers
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int main(int argc, char * argv[])
+{
+   // Check command line arguments
+   int opt;
+   double values[MAX_SETS];
+   int count;
+
+   while ((opt = getopt(argc, argv, "n:r:w:v:d:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'n':
+            opts.num_jobs = atoi(optarg);
+            break;
+         case 'r':
+            opts.rounds = atoi(optarg);
+            break;
+         case 'w':
+            count = parselist(optarg, values);
+            opts.num_widths = count;
+            for (int k = 0; k < count; k++)
+            {
+               opts.widths[k] = (int) values[k];
+               if ((opts.widths[k] < 1) || (opts.widths[k] > PROTO_MAX_WIDTH))
+               {
+                  opts.num_widths = -1;
+               }
+            }
+            break;
+         case 'v':
+            count = parselist(optarg, values);
+            opts.num_bits = count;
+            for (int k = 0; k < count; k++)
+            {
+               opts.bits[k] = (long) values[k];
+               if (opts.bits[k] < 1)
+               {
+                  opts.num_bits = -1;
+               }
+            }
+            break;
+         case 'd':
+            count = parselist(optarg, values);
+            opts.num_densities = count;
+            for (int k = 0; k < count; k++)
+            {
+               opts.densities[k] = values[k];
+               if ((values[k] < 0.0) || (values[k] > 1.0))
+               {
+                  opts.num_densities = -1;
+               }
+            }
+            break;
+         default:
+            fprintf(stderr, "ERROR: Usage: %s [-n jobs] [-r rounds]"
+               " [-w widths] [-v bits] [-d densities]\n", argv[0]);
+            return EXIT_FAILURE;
+      }
+   }
+
+   if ((opts.num_jobs < 1) || (opts.rounds < 1) || (opts.num_widths == -1) ||
+      (opts.num_bits == -1) || (opts.num_densities < 1))
+   {
+      fprintf(stderr, "ERROR: Usage: %s [-n jobs] [-r rounds] [-w widths]"
+         " [-v bits] [-d densities]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   opencycles();
+   fprintf(stdout, "Cycles are %s.\n", (cycles_source == CYCLES_PERF) ?
+      "core cycles from perf counters" : (cycles_source == CYCLES_TSC) ?
+      "reference cycles from the time stamp counter (perf counters are not"
+      " available)" : "not available");
+
+   for (int w = 0; w < opts.num_widths; w++)
+   {
+      for (int d = 0; d < opts.num_densities; d++)
+      {
+         if (benchwords(opts.widths[w], opts.densities[d]) == EXIT_FAILURE)
+         {
+            return EXIT_FAILURE;
+         }
+      }
+   }
+
+   for (int v = 0; v < opts.num_bits; v++)
+   {
+      for (int d = 0; d < opts.num_densities; d++)
+      {
+         if (benchwide((uint64_t) opts.bits[v], opts.densities[d]) ==
+            EXIT_FAILURE)
+         {
+            return EXIT_FAILURE;
+         }
+      }
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int benchwords(int width, double density)
+{
+   struct bench_job * jobs = malloc((size_t) opts.num_jobs *
+      sizeof(struct bench_job));
+   uint32_t * results = malloc((size_t) opts.num_jobs * sizeof(uint32_t));
+
+   if ((jobs == NULL) || (results == NULL))
+   {
+      fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+      free(jobs);
+      free(results);
+      return EXIT_FAILURE;
+   }
+
+   makejobs(jobs, opts.num_jobs, width, density);
+
+   // Every implementation's results must match the reference digit for digit
+   for (int i = 0; i < opts.num_jobs; i++)
+   {
+      char expected[PROTO_MAX_WIDTH + 1];
+      char legacy[PROTO_MAX_WIDTH + 1];
+      char actual[PROTO_MAX_WIDTH + 1];
+      uint32_t word = (jobs[i].opcode == PROTO_OP_AND) ?
+         (jobs[i].word1 & jobs[i].word2) : (jobs[i].word1 | jobs[i].word2);
+
+      referencecalculation(jobs[i].opcode, jobs[i].operand1,
+         jobs[i].operand2, expected);
+      proto_wordtostr(word, 0, actual);
+
+      if (width <= OPERAND_BYTES)
+      {
+         legacycalculation(jobs[i].opcode, jobs[i].operand1,
+            jobs[i].operand2, legacy);
+      }
+      else
+      {
+         strcpy(legacy, expected); // legacy strings cannot hold the operands
+      }
+
+      if ((strcmp(expected, actual) != 0) || (strcmp(expected, legacy) != 0))
+      {
+         fprintf(stderr, "ERROR: %s %s %s gave %s (legacy %s), expected"
+            " %s.\n", proto_opname(jobs[i].opcode), jobs[i].operand1,
+            jobs[i].operand2, actual, legacy, expected);
+         free(jobs);
+         free(results);
+         return EXIT_FAILURE;
+      }
+   }
+
+   fprintf(stdout, "\n%d digit operands, density %.2f: %d jobs x %d rounds,"
+      " results match the ASCII reference\n", width, density, opts.num_jobs,
+      opts.rounds);
+
+   double total = (double) opts.num_jobs * opts.rounds;
+   double digits = 2.0 * width * total;
+
+   // Legacy character loop
+   unsigned long checksum = 0;
+   double start;
+   uint64_t cycles;
+
+   if (width <= OPERAND_BYTES)
+   {
+      start = now();
+      cycles = readcycles();
+
+      for (int r = 0; r < opts.rounds; r++)
+      {
+         for (int i = 0; i < opts.num_jobs; i++)
+         {
+            char result[RESULT_BYTES + 1];
+
+            legacycalculation(jobs[i].opcode, jobs[i].operand1,
+               jobs[i].operand2, result);
+            checksum += (unsigned long) result[0] + strlen(result);
+         }
+      }
+      cycles = readcycles() - cycles;
+      report("legacy strings", total, digits, now() - start, cycles, checksum);
+   }
+
+   // Word kernel including parsing the operands and formatting the result
+   checksum = 0;
+   start = now();
+   cycles = readcycles();
+
+   for (int r = 0; r < opts.rounds; r++)
+   {
+      for (int i = 0; i < opts.num_jobs; i++)
+      {
+         char result[PROTO_MAX_WIDTH + 1];
+         uint32_t word1;
+         uint32_t word2;
+
+         proto_strtoword(jobs[i].operand1, strlen(jobs[i].operand1), &word1);
+         proto_strtoword(jobs[i].operand2, strlen(jobs[i].operand2), &word2);
+         checksum += (unsigned long) result[proto_wordtostr((jobs[i].opcode
+            == PROTO_OP_AND) ? (word1 & word2) : (word1 | word2), 0,
+            result) - 1];
+      }
+   }
+   cycles = readcycles() - cycles;
+   report("word end-to-end", total, digits, now() - start, cycles, checksum);
+
+   // Word kernel alone, as the backend servers run it on binary records
+   checksum = 0;
+   start = now();
+   cycles = readcycles();
+
+   for (int r = 0; r < opts.rounds; r++)
+   {
+      for (int i = 0; i < opts.num_jobs; i++)
+      {
+         results[i] = (jobs[i].opcode == PROTO_OP_AND) ?
+            (jobs[i].word1 & jobs[i].word2) : (jobs[i].word1 | jobs[i].word2);
+      }
+      checksum += results[r % opts.num_jobs];
+   }
+   cycles = readcycles() - cycles;
+   report("word kernel", total, 8.0 * total, now() - start, cycles, checksum);
+
+   free(jobs);
+   free(results);
+
+   return EXIT_SUCCESS;
+}
+
+int benchwide(uint64_t bits, double density)
+{
+   struct wide_set set;
+   size_t vec_bytes;
+
+   set.bits = bits;
+   set.num_words = bitvec_words(bits);
+   set.num_jobs = (bits >= WIDE_SET_BITS) ? 1 : (int) (WIDE_SET_BITS / bits);
+   vec_bytes = set.num_words * BITVEC_WORD_BYTES;
+   set.opcodes = malloc((size_t) set.num_jobs * sizeof(int));
+   set.vecs1 = malloc((size_t) set.num_jobs * vec_bytes);
+   set.vecs2 = malloc((size_t) set.num_jobs * vec_bytes);
+   set.results = malloc((size_t) set.num_jobs * vec_bytes);
+
+   if ((set.opcodes == NULL) || (set.vecs1 == NULL) || (set.vecs2 == NULL) ||
+      (set.results == NULL))
+   {
+      fprintf(stderr, "ERROR: Failed to allocate wide jobs.\n");
+      free(set.opcodes);
+      free(set.vecs1);
+      free(set.vecs2);
+      free(set.results);
+      return EXIT_FAILURE;
+   }
+
+   for (int i = 0; i < set.num_jobs; i++)
+   {
+      set.opcodes[i] = (nextrandom() & 1) ? PROTO_OP_AND : PROTO_OP_OR;
+
+      for (size_t k = 0; k < set.num_words; k++)
+      {
+         uint64_t word1 = randombits(64, density);
+         uint64_t word2 = randombits(64, density);
+
+         // Vectors are little-endian on every host
+         for (int b = 0; b < BITVEC_WORD_BYTES; b++)
+         {
+            set.vecs1[i * vec_bytes + k * BITVEC_WORD_BYTES + b] =
+               (unsigned char) (word1 >> (8 * b));
+            set.vecs2[i * vec_bytes + k * BITVEC_WORD_BYTES + b] =
+               (unsigned char) (word2 >> (8 * b));
+         }
+      }
+      bitvec_truncate(set.vecs1 + i * vec_bytes, bits);
+      bitvec_truncate(set.vecs2 + i * vec_bytes, bits);
+   }
+
+   fprintf(stdout, "\n%lu bit operands, density %.2f: %d jobs x %d rounds\n",
+      (unsigned long) bits, density, set.num_jobs, opts.rounds);
+
+   static const char * const kernels[] = {"avx512", "avx2", "scalar"};
+   double total = (double) set.num_jobs * opts.rounds;
+   int status = EXIT_SUCCESS;
+
+   for (size_t n = 0; n < sizeof(kernels) / sizeof(kernels[0]); n++)
+   {
+      if (bitvec_usekernel(kernels[n]) == EXIT_FAILURE)
+      {
+         fprintf(stdout, "%-16s not supported by this CPU or build\n",
+            kernels[n]);
+         continue;
+      }
+
+      // Run once to check the results, then time the rounds
+      unsigned long checksum = 0;
+      double start = 0.0;
+      uint64_t cycles = 0;
+
+      for (int r = -1; r < opts.rounds; r++)
+      {
+         if (r == 0)
+         {
+            if (checkwide(&set) == EXIT_FAILURE)
+            {
+               fprintf(stderr, "ERROR: The %s kernel does not match the ASCII"
+                  " reference.\n", kernels[n]);
+               status = EXIT_FAILURE;
+               break;
+            }
+            start = now();
+            cycles = readcycles();
+         }
+
+         for (int i = 0; i < set.num_jobs; i++)
+         {
+            size_t at = (size_t) i * vec_bytes;
+
+            if (set.opcodes[i] == PROTO_OP_AND)
+            {
+               bitvec_and(set.results + at, set.vecs1 + at, set.vecs2 + at,
+                  set.num_words);
+            }
+            else
+            {
+               bitvec_or(set.results + at, set.vecs1 + at, set.vecs2 + at,
+                  set.num_words);
+            }
+         }
+         checksum += set.results[(size_t) (r + 1) % ((size_t) set.num_jobs *
+            vec_bytes)];
+      }
+
+      if (status == EXIT_FAILURE)
+      {
+         break;
+      }
+      cycles = readcycles() - cycles;
+      report(kernels[n], total, 2.0 * (double) vec_bytes * total,
+         now() - start, cycles, checksum);
+   }
+
+   free(set.opcodes);
+   free(set.vecs1);
+   free(set.vecs2);
+   free(set.results);
+
+   return status;
+}
+
+int checkwide(const struct wide_set * set_ptr)
+{
+   size_t vec_bytes = set_ptr->num_words * BITVEC_WORD_BYTES;
+   char * operand1 = malloc(set_ptr->bits + 1);
+   char * operand2 = malloc(set_ptr->bits + 1);
+   char * expected = malloc(set_ptr->bits + 1);
+   char * actual = malloc(set_ptr->bits + 1);
+   int status = EXIT_SUCCESS;
+
+   if ((operand1 == NULL) || (operand2 == NULL) || (expected == NULL) ||
+      (actual == NULL))
+   {
+      fprintf(stderr, "ERROR: Failed to allocate digit strings.\n");
+      status = EXIT_FAILURE;
+   }
+
+   for (int i = 0; (status == EXIT_SUCCESS) && (i < set_ptr->num_jobs); i++)
+   {
+      const unsigned char * result = set_ptr->results + (size_t) i * vec_bytes;
+
+      bitvec_tostr(set_ptr->vecs1 + (size_t) i * vec_bytes, set_ptr->bits,
+         operand1);
+      bitvec_tostr(set_ptr->vecs2 + (size_t) i * vec_bytes, set_ptr->bits,
+         operand2);
+      referencecalculation(set_ptr->opcodes[i], operand1, operand2, expected);
+      bitvec_tostr(result, bitvec_sigbits(result, set_ptr->num_words),
+         actual);
+
+      if (strcmp(expected, actual) != 0)
+      {
+         status = EXIT_FAILURE;
+      }
+   }
+
+   free(operand1);
+   free(operand2);
+   free(expected);
+   free(actual);
+
+   return status;
+}
+
+void legacycalculation(int opcode, const char * operand1,
+   const char * operand2, char * result)
+{
+   char large_op[OPERAND_BYTES + 1];
+   char small_op[OPERAND_BYTES + 1];
+   bool msb_found = false;
+
+   result[0] = '\0';
+
+   if (strlen(operand1) >= strlen(operand2))
+   {
+      strcpy(large_op, operand1);
+      strcpy(small_op, operand2);
+   }
+   else
+   {
+      strcpy(large_op, operand2);
+      strcpy(small_op, operand1);
+   }
+
+   if (opcode == PROTO_OP_AND)
+   {
+      for (int j = strlen(large_op) - strlen(small_op); j < strlen(large_op);
+         j++)
+      {
+         if ((large_op[j] == '1') && (small_op[j - (strlen(large_op) -
+            strlen(small_op))] == '1'))
+         {
+            strcat(result, "1");
+            msb_found = true;
+         }
+         else if (msb_found)
+         {
+            strcat(result, "0");
+         }
+      }
+   }
+   else
+   {
+      for (int j = 0; j < strlen(large_op) - strlen(small_op); j++)
+      {
+         if (large_op[j] == '1')
+         {
+            strcat(result, "1");
+            msb_found = true;
+         }
+         else if (msb_found)
+         {
+            strcat(result, "0");
+         }
+      }
+
+      for (int j = strlen(large_op) - strlen(small_op); j < strlen(large_op);
+         j++)
+      {
+         if ((large_op[j] == '1') || (small_op[j - (strlen(large_op) -
+            strlen(small_op))] == '1'))
+         {
+            strcat(result, "1");
+            msb_found = true;
+         }
+         else if (msb_found)
+         {
+            strcat(result, "0");
+         }
+      }
+   }
+
+   if (!msb_found)
+   {
+      strcat(result, "0");
+   }
+}
+
+void referencecalculation(int opcode, const char * operand1,
+   const char * operand2, char * result)
+{
+   size_t len1 = strlen(operand1);
+   size_t len2 = strlen(operand2);
+   size_t len = (len1 > len2) ? len1 : len2;
+   size_t used = 0;
+
+   // Digits missing from the shorter operand are leading zeros
+   for (size_t j = 0; j < len; j++)
+   {
+      char digit1 = (j + len1 >= len) ? operand1[j + len1 - len] : '0';
+      char digit2 = (j + len2 >= len) ? operand2[j + len2 - len] : '0';
+      bool one = (opcode == PROTO_OP_AND) ?
+         ((digit1 == '1') && (digit2 == '1')) :
+         ((digit1 == '1') || (digit2 == '1'));
+
+      if (one || (used > 0))
+      {
+         result[used++] = one ? '1' : '0';
+      }
+   }
+
+   if (used == 0)
+   {
+      result[used++] = '0';
+   }
+   result[used] = '\0';
+}
+
+int parselist(const char * str, double values[])
+{
+   int count = 0;
+   char * end;
+
+   while (count < MAX_SETS)
+   {
+      values[count++] = strtod(str, &end);
+
+      if ((end == str) || ((*end != ',') && (*end != '\0')))
+      {
+         return -1;
+      }
+      if (*end == '\0')
+      {
+         return count;
+      }
+      str = end + 1;
+   }
+
+   return -1;
+}
+
+void makejobs(struct bench_job * jobs, int num_jobs, int width,
+   double density)
+{
+   for (int i = 0; i < num_jobs; i++)
+   {
+      jobs[i].opcode = (nextrandom() & 1) ? PROTO_OP_AND : PROTO_OP_OR;
+      jobs[i].word1 = (uint32_t) randombits(width, density);
+      jobs[i].word2 = (uint32_t) randombits(width, density);
+      proto_wordtostr(jobs[i].word1, width, jobs[i].operand1);
+      proto_wordtostr(jobs[i].word2, width, jobs[i].operand2);
+   }
+}
+
+uint64_t randombits(int count, double density)
+{
+   uint64_t bits = 0;
+   uint64_t threshold = (uint64_t) (density * 4294967296.0);
+
+   for (int k = 0; k < count; k++)
+   {
+      if ((nextrandom() >> 32) < threshold)
+      {
+         bits |= (uint64_t) 1 << k;
+      }
+   }
+
+   return bits;
+}
+
+uint64_t nextrandom()
+{
+   rng ^= rng >> 12;
+   rng ^= rng << 25;
+   rng ^= rng >> 27;
+
+   return rng * 0x2545f4914f6cdd1dull;
+}
+
+void opencycles()
+{
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.size = sizeof(attr);
+   attr.config = PERF_COUNT_HW_CPU_CYCLES;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+
+   // This thread on any CPU
+   cycles_fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+   if (cycles_fd != -1)
+   {
+      cycles_source = CYCLES_PERF;
+      return;
+   }
+
+#ifdef KERNBENCH_TSC
+   cycles_source = CYCLES_TSC;
+#else
+   cycles_source = CYCLES_NONE;
+#endif
+}
+
+uint64_t readcycles()
+{
+   uint64_t cycles = 0;
+
+   if (cycles_source == CYCLES_PERF)
+   {
+      if (read(cycles_fd, &cycles, sizeof(cycles)) != sizeof(cycles))
+      {
+         cycles = 0;
+      }
+   }
+#ifdef KERNBENCH_TSC
+   else if (cycles_source == CYCLES_TSC)
+   {
+      cycles = __rdtsc();
+   }
+#endif
+
+   return cycles;
+}
+
+double now()
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+void report(const char * name, double jobs, double bytes, double seconds,
+   uint64_t cycles, unsigned long checksum)
+{
+   if (cycles_source == CYCLES_NONE)
+   {
+      fprintf(stdout, "%-16s %12.2f ns/job %12s cycles/job %8s bytes/cycle"
+         " (checksum %lu)\n", name, seconds * 1e9 / jobs, "-", "-",
+         checksum);
+      return;
+   }
+
+   fprintf(stdout, "%-16s %12.2f ns/job %12.2f cycles/job %8.3f bytes/cycle"
+      " (checksum %lu)\n", name, seconds * 1e9 / jobs, (double) cycles / jobs,
+      (cycles == 0) ? 0.0 : bytes / (double) cycles, checksum);
+}
@@ -0,0 +1,1077 @@
+/**
+ * loadgen.c
+ *
+ * Load generator for the edge server. Drives many client connections at once
+ * with randomly generated jobs, checks every result, and reports throughput
+ * and batch latency percentiles.
+ *
+ * Usage: ./loadgen [-c connections] [-n jobs] [-b batch_jobs] [-d depth]
+ *    [-m and_percent] [-w width | -w min_width-max_width] [-t threads]
+ *    [-s seed] [-k] [-l] [-j]
+ *
+ * -c number of concurrent connections (default 8)
+ * -n number of jobs sent over each connection (default 100000)
+ * -b number of jobs per batch (default 100)
+ * -d number of batches each connection keeps in flight (default 1)
+ * -m percentage of AND jobs, the rest are OR jobs (default 50)
+ * -w number of binary digits of each operand, or the range they are drawn
+ *    from, 1 to 32 (default 1-10)
+ * -t number of threads driving the connections (default 1)
+ * -s seed of the random jobs (default 1), the same seed sends the same jobs
+ * -k hold a keep-alive session on each connection: every batch carries its
+ *    number as request ID, and the edge server may answer them in any order
+ * -l submit every job on its own through the client library (edgeclient.h)
+ *    instead of sending batches: the threads share a pool of as many
+ *    connections, and the library batches their jobs (-b, -d, and -k do not
+ *    apply)
+ * -j print the report as one line of JSON
+ *
+ * A batch's latency is the time from encoding it until its last result has
+ * arrived, so it includes any time spent queued behind earlier batches of the
+ * same connection. Jobs per second counts every result received from when the
+ * connections are open until the last result. Latencies are kept in an HDR style
+ * histogram (see stats.h), so percentiles are accurate to about 3%. With -l
+ * the latencies are those of single jobs, from submitting each until its
+ * callback runs.
+ *
+ * The load generator uses the binary protocol and connects to the edge server
+ * at EDGE_IP:EDGE_PORT, retrying for a few seconds while it starts up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <stdbool.h>
+
+#include "protocol.h"
+#include "stats.h"
+#include "edgeclient.h"
+
+#define EDGE_IP "127.0.0.1" // edge server IPv4 address
+#define EDGE_PORT 23926 // edge server port number
+
+#define MAX_CONNECTIONS 4096 // maximum number of connections
+#define MAX_THREADS 256 // maximum number of threads
+#define MAX_BATCH_JOBS 65536 // maximum number of jobs per batch
+#define MAX_DEPTH 64 // maximum number of batches in flight per connection
+#define RESULT_CHUNK_BYTES 65536 // maximum number of result bytes per receive
+#define CONNECT_RETRIES 50 // attempts to connect while the edge server starts
+#define CONNECT_RETRY_USEC 100000 // wait between attempts to connect
+#define IDLE_TIMEOUT_MSEC 10000 // time without any progress before giving up
+
+#define STAGE_BATCH 0 // batch encoded until its last result arrived
+#define STAGE_JOB 1 // job submitted to the client library until it completed
+
+/**
+ * struct to store one connection to the edge server
+ */
+struct conn {
+   int sd; // connected stream socket descriptor, -1 once finished
+   uint64_t rng; // state of the connection's random number generator
+   int jobs_left; // number of jobs not yet encoded
+   unsigned char * payload; // batch being sent
+   size_t payload_len; // number of bytes in the batch being sent
+   size_t payload_sent; // number of bytes of the batch sent so far
+   bool shut; // the write side is shut down, every batch was sent
+   uint32_t * expected; // expected results of the jobs in flight,
+      //batch_jobs for each of depth slots, batch number b using slot
+      //b % depth
+   uint64_t * sent_nsec; // time the batch in each slot was encoded
+   uint32_t * slot_jobs; // number of jobs of the batch in each slot, 0 if
+      //the slot is free
+   long long num_sent; // number of jobs encoded
+   long long num_received; // number of results received
+   int batches_sent; // number of batches encoded
+   int batches_done; // number of batches whose results all arrived
+   int slot; // slot of the batch the current results message answers
+   uint32_t results_left; // records left in the current results message
+   unsigned char buffer[RESULT_CHUNK_BYTES]; // received bytes not yet decoded
+   size_t buffered; // number of bytes in buffer
+   unsigned long errors; // number of wrong results
+};
+
+/**
+ * struct to store a thread and the connections it drives
+ */
+struct worker {
+   pthread_t thread;
+   struct conn * conns; // array of connections
+   int num_conns;
+   int first_conn; // connection number of the first connection
+   uint64_t start_nsec; // time the thread's connections were open
+   int status; // 0 if every connection finished, 1 otherwise
+};
+
+/**
+ * struct to store one job submitted through the client library
+ */
+struct lib_job {
+   uint32_t expected; // expected result
+   uint64_t submit_nsec; // time the job was submitted
+};
+
+/**
+ * struct to store a thread submitting jobs through the client library
+ */
+struct submitter {
+   pthread_t thread;
+   struct edgeclient * client_ptr;
+   struct lib_job * jobs; // one per job the thread submits
+   long long num_jobs;
+   uint64_t rng; // state of the thread's random number generator
+   int status; // 0 if every job was submitted, 1 otherwise
+};
+
+/**
+ * struct to store command line options
+ */
+struct options {
+   int connections; // number of concurrent connections
+   int jobs; // number of jobs per connection
+   int batch_jobs; // number of jobs per batch
+   int depth; // number of batches in flight per connection
+   int and_percent; // percentage of AND jobs
+   int min_width; // fewest binary digits of an operand
+   int max_width; // most binary digits of an operand
+   int threads; // number of threads
+   uint64_t seed; // seed of the random jobs
+   bool session; // hold a keep-alive session on each connection
+   bool library; // submit single jobs through the client library
+   bool json; // print the report as JSON
+};
+
+static struct options opts = {8, 100000, 100, 1, 50, 1, 10, 1, 1, false,
+   false, false};
+
+static struct stats load_stats; // batch latencies of every thread
+static bool unreachable; // a connection gave up on the edge server, the
+   //others need not wait for it
+
+static long long lib_received; // results received through the library
+static unsigned long lib_errors; // wrong or failed results through the
+   //library
+
+static const char * const stage_names[] = {"batch", "job"};
+
+/**
+ * parsewidths parses an operand width or range of widths into the options.
+ * @param str pointer to c string "width" or "min_width-max_width"
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int parsewidths(const char * str);
+
+/**
+ * runworker drives a thread's connections until every one has received all
+ * of its results.
+ * @param worker_ptr pointer to struct worker
+ * @return void * NULL
+ */
+void * runworker(void * worker_ptr);
+
+/**
+ * runlibrary submits every job through the client library from opts.threads
+ * threads and waits for all of them to complete.
+ * @param jobs_ptr pointer to long long number of results received
+ * @param errors_ptr pointer to unsigned long number of wrong results
+ * @param seconds_ptr pointer to double time from the first submission to the
+ *    last result
+ * @return int 0 if every job was submitted, 1 otherwise
+ */
+int runlibrary(long long * jobs_ptr, unsigned long * errors_ptr,
+   double * seconds_ptr);
+
+/**
+ * runsubmitter submits a thread's share of the jobs one at a time.
+ * @param submitter_ptr pointer to struct submitter
+ * @return void * NULL
+ */
+void * runsubmitter(void * submitter_ptr);
+
+/**
+ * completejob is the callback of every job submitted through the library,
+ * it checks the result and records the job's latency.
+ * @param arg pointer to struct lib_job
+ * @param status int 0 if successful, 1 if the job failed
+ * @param result uint32_t result of the job
+ */
+void completejob(void * arg, int status, uint32_t result);
+
+/**
+ * connectedge connects to the edge server, retrying while it starts up.
+ * @return int connected stream socket descriptor, -1 if unsuccessful
+ */
+int connectedge();
+
+/**
+ * openconn connects to the edge server, retrying while it starts up, and
+ * allocates the connection's buffers.
+ * @param conn_ptr pointer to struct conn
+ * @param index int connection number, varies the random jobs
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int openconn(struct conn * conn_ptr, int index);
+
+/**
+ * closeconn closes a connection and frees its buffers.
+ * @param conn_ptr pointer to struct conn
+ */
+void closeconn(struct conn * conn_ptr);
+
+/**
+ * fillbatch encodes the connection's next batch of random jobs and notes
+ * their expected results.
+ * @param conn_ptr pointer to struct conn
+ */
+void fillbatch(struct conn * conn_ptr);
+
+/**
+ * sendbatch sends as much of the batch being sent as the socket takes.
+ * @param conn_ptr pointer to struct conn
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int sendbatch(struct conn * conn_ptr);
+
+/**
+ * recvresults receives the results that have arrived, checks each against
+ * its expected result, and records the latency of every finished batch.
+ * @param conn_ptr pointer to struct conn
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int recvresults(struct conn * conn_ptr);
+
+/**
+ * randomjob draws a random job and encodes it.
+ * @param rng_ptr pointer to uint64_t nonzero random number generator state
+ * @param record pointer to PROTO_CLIENT_JOB_BYTES destination bytes
+ * @return uint32_t expected result of the job
+ */
+uint32_t randomjob(uint64_t * rng_ptr, unsigned char * record);
+
+/**
+ * nextrandom advances a xorshift64* random number generator.
+ * @param rng_ptr pointer to uint64_t nonzero state
+ * @return uint64_t random number
+ */
+uint64_t nextrandom(uint64_t * rng_ptr);
+
+/**
+ * printreport prints throughput and latency percentiles.
+ * @param jobs long long number of results received
+ * @param errors unsigned long number of wrong results
+ * @param seconds double time from when the connections were open to the last
+ *    result
+ * @param status int 0 if every connection finished, 1 otherwise
+ */
+void printreport(long long jobs, unsigned long errors, double seconds,
+   int status);
+
+/**
+ * main function
+ * @param argc int number of command line arguments
+ * @param argv pointer to array of c string argument pointers
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int main(int argc, char * argv[])
+{
+   // Check command line arguments
+   int opt;
+
+   while ((opt = getopt(argc, argv, "c:n:b:d:m:w:t:s:klj")) != -1)
+   {
+      switch (opt)
+      {
+         case 'c':
+            opts.connections = atoi(optarg);
+            break;
+         case 'n':
+            opts.jobs = atoi(optarg);
+            break;
+         case 'b':
+            opts.batch_jobs = atoi(optarg);
+            break;
+         case 'd':
+            opts.depth = atoi(optarg);
+            break;
+         case 'm':
+            opts.and_percent = atoi(optarg);
+            break;
+         case 'w':
+            if (parsewidths(optarg) == EXIT_FAILURE)
+            {
+               return EXIT_FAILURE;
+            }
+            break;
+         case 't':
+            opts.threads = atoi(optarg);
+            break;
+         case 's':
+            opts.seed = strtoull(optarg, NULL, 10);
+            break;
+         case 'k':
+            opts.session = true;
+            break;
+         case 'l':
+            opts.library = true;
+            break;
+         case 'j':
+            opts.json = true;
+            break;
+         default:
+            fprintf(stderr, "ERROR: Usage: %s [-c connections] [-n jobs]"
+               " [-b batch_jobs] [-d depth] [-m and_percent] [-w width |"
+               " -w min_width-max_width] [-t threads] [-s seed] [-k] [-l]"
+               " [-j]\n", argv[0]);
+            return EXIT_FAILURE;
+      }
+   }
+
+   if ((opts.connections < 1) || (opts.connections > MAX_CONNECTIONS) ||
+      (opts.jobs < 1) || (opts.batch_jobs < 1) ||
+      (opts.batch_jobs > MAX_BATCH_JOBS) || (opts.depth < 1) ||
+      (opts.depth > MAX_DEPTH) || (opts.and_percent < 0) ||
+      (opts.and_percent > 100) || (opts.threads < 1) ||
+      (opts.threads > MAX_THREADS))
+   {
+      fprintf(stderr, "ERROR: Connections must be 1 to %d, jobs at least 1,"
+         " batch jobs 1 to %d, depth 1 to %d, AND percentage 0 to 100, and"
+         " threads 1 to %d.\n", MAX_CONNECTIONS, MAX_BATCH_JOBS, MAX_DEPTH,
+         MAX_THREADS);
+      return EXIT_FAILURE;
+   }
+
+   if (opts.library && (opts.connections > EDGECLIENT_MAX_CONNS))
+   {
+      fprintf(stderr, "ERROR: The client library holds at most %d"
+         " connections.\n", EDGECLIENT_MAX_CONNS);
+      return EXIT_FAILURE;
+   }
+
+   // Library threads share the connections, others each drive their own
+   if (!opts.library && (opts.threads > opts.connections))
+   {
+      opts.threads = opts.connections;
+   }
+
+   if (stats_init(&load_stats, "load generator", stage_names, 2, NULL, 0)
+      == EXIT_FAILURE)
+   {
+      return EXIT_FAILURE;
+   }
+
+   if (opts.library)
+   {
+      long long jobs;
+      unsigned long errors;
+      double seconds;
+      int status = runlibrary(&jobs, &errors, &seconds);
+
+      printreport(jobs, errors, seconds, status);
+
+      return ((status == EXIT_SUCCESS) && (errors == 0)) ? EXIT_SUCCESS :
+         EXIT_FAILURE;
+   }
+
+   // Give each thread an even share of the connections
+   struct conn * conns = calloc((size_t) opts.connections,
+      sizeof(struct conn));
+   struct worker workers[MAX_THREADS];
+
+   if (conns == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate connections.\n");
+      return EXIT_FAILURE;
+   }
+
+   int first_conn = 0;
+   int status = EXIT_SUCCESS;
+   int started;
+
+   for (int i = 0; i < opts.connections; i++)
+   {
+      conns[i].sd = -1;
+   }
+
+   for (started = 0; started < opts.threads; started++)
+   {
+      struct worker * worker_ptr = &workers[started];
+
+      worker_ptr->conns = conns + first_conn;
+      worker_ptr->first_conn = first_conn;
+      worker_ptr->start_nsec = stats_nownsec();
+      worker_ptr->num_conns = opts.connections / opts.threads +
+         ((started < opts.connections % opts.threads) ? 1 : 0);
+      worker_ptr->status = EXIT_SUCCESS;
+      first_conn += worker_ptr->num_conns;
+
+      if (pthread_create(&worker_ptr->thread, NULL, runworker, worker_ptr)
+         != 0)
+      {
+         fprintf(stderr, "ERROR: Failed to create thread.\n");
+         status = EXIT_FAILURE;
+         break;
+      }
+   }
+
+   long long jobs = 0;
+   unsigned long errors = 0;
+   uint64_t start_nsec = 0;
+
+   for (int t = 0; t < started; t++)
+   {
+      pthread_join(workers[t].thread, NULL);
+      if (workers[t].status == EXIT_FAILURE)
+      {
+         status = EXIT_FAILURE;
+      }
+
+      // Waiting for the edge server to start up is not part of the run
+      if ((start_nsec == 0) || (workers[t].start_nsec < start_nsec))
+      {
+         start_nsec = workers[t].start_nsec;
+      }
+   }
+
+   double seconds = (double) (stats_nownsec() - start_nsec) / 1e9;
+
+   for (int i = 0; i < opts.connections; i++)
+   {
+      jobs += conns[i].num_received;
+      errors += conns[i].errors;
+   }
+   free(conns);
+
+   printreport(jobs, errors, seconds, status);
+
+   return ((status == EXIT_SUCCESS) && (errors == 0)) ? EXIT_SUCCESS :
+      EXIT_FAILURE;
+}
+
+int parsewidths(const char * str)
+{
+   char * end;
+
+   opts.min_width = (int) strtol(str, &end, 10);
+   opts.max_width = (*end == '-') ? (int) strtol(end + 1, &end, 10) :
+      opts.min_width;
+
+   if ((*end != '\0') || (opts.min_width < 1) ||
+      (opts.max_width > PROTO_MAX_WIDTH) || (opts.min_width > opts.max_width))
+   {
+      fprintf(stderr, "ERROR: Operand widths must be 1 to %d digits.\n",
+         PROTO_MAX_WIDTH);
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+void * runworker(void * worker_ptr)
+{
+   struct worker * self = worker_ptr;
+   struct pollfd * poll_fds = malloc((size_t) self->num_conns *
+      sizeof(struct pollfd));
+   int * polled = malloc((size_t) self->num_conns * sizeof(int));
+   int active = 0;
+
+   if ((poll_fds == NULL) || (polled == NULL))
+   {
+      fprintf(stderr, "ERROR: Failed to allocate poll set.\n");
+      free(poll_fds);
+      free(polled);
+      self->status = EXIT_FAILURE;
+      return NULL;
+   }
+
+   for (int i = 0; i < self->num_conns; i++)
+   {
+      if (openconn(&self->conns[i], self->first_conn + i) == EXIT_FAILURE)
+      {
+         self->status = EXIT_FAILURE;
+         continue;
+      }
+      active++;
+   }
+   self->start_nsec = stats_nownsec();
+
+   while (active > 0)
+   {
+      int num_fds = 0;
+
+      for (int i = 0; i < self->num_conns; i++)
+      {
+         struct conn * conn_ptr = &self->conns[i];
+
+         if (conn_ptr->sd == -1)
+         {
+            continue;
+         }
+
+         // Encode the next batch once the last one is out and its slot is
+            //free
+         if ((conn_ptr->payload_sent == conn_ptr->payload_len) &&
+            (conn_ptr->jobs_left > 0) &&
+            (conn_ptr->slot_jobs[conn_ptr->batches_sent % opts.depth] == 0))
+         {
+            fillbatch(conn_ptr);
+         }
+
+         // Tell the edge server no more batches are coming
+         if ((conn_ptr->jobs_left == 0) && !conn_ptr->shut &&
+            (conn_ptr->payload_sent == conn_ptr->payload_len))
+         {
+            shutdown(conn_ptr->sd, SHUT_WR);
+            conn_ptr->shut = true;
+         }
+
+         if (conn_ptr->shut && (conn_ptr->num_received == conn_ptr->num_sent))
+         {
+            closeconn(conn_ptr);
+            active--;
+            continue;
+         }
+
+         poll_fds[num_fds].fd = conn_ptr->sd;
+         poll_fds[num_fds].events =
+            (conn_ptr->num_received < conn_ptr->num_sent) ? POLLIN : 0;
+         if (conn_ptr->payload_sent < conn_ptr->payload_len)
+         {
+            poll_fds[num_fds].events |= POLLOUT;
+         }
+         polled[num_fds++] = i;
+      }
+
+      if (num_fds == 0)
+      {
+         break;
+      }
+
+      int ready = poll(poll_fds, (nfds_t) num_fds, IDLE_TIMEOUT_MSEC);
+
+      if (ready == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         fprintf(stderr, "ERROR: Failed to wait for the edge server.\n");
+         break;
+      }
+      else if (ready == 0)
+      {
+         fprintf(stderr, "ERROR: The edge server made no progress for %d"
+            " ms.\n", IDLE_TIMEOUT_MSEC);
+         break;
+      }
+
+      for (int k = 0; k < num_fds; k++)
+      {
+         struct conn * conn_ptr = &self->conns[polled[k]];
+
+         if (((poll_fds[k].revents & POLLOUT) &&
+            (sendbatch(conn_ptr) == EXIT_FAILURE)) ||
+            ((poll_fds[k].revents & (POLLIN | POLLHUP | POLLERR)) &&
+            (recvresults(conn_ptr) == EXIT_FAILURE)))
+         {
+            closeconn(conn_ptr);
+            self->status = EXIT_FAILURE;
+            active--;
+         }
+      }
+   }
+
+   // Connections left open did not get all of their results
+   for (int i = 0; i < self->num_conns; i++)
+   {
+      if (self->conns[i].sd != -1)
+      {
+         closeconn(&self->conns[i]);
+         self->status = EXIT_FAILURE;
+      }
+   }
+
+   free(poll_fds);
+   free(polled);
+
+   return NULL;
+}
+
+int runlibrary(long long * jobs_ptr, unsigned long * errors_ptr,
+   double * seconds_ptr)
+{
+   struct submitter submitters[MAX_THREADS];
+   struct edgeclient * client_ptr;
+   long long total = (long long) opts.connections * opts.jobs;
+   int status = EXIT_SUCCESS;
+   int started;
+   int sock_desc;
+
+   *jobs_ptr = 0;
+   *errors_ptr = 0;
+   *seconds_ptr = 0.0;
+
+   // The library does not retry, so wait here for the edge server to start
+   if ((sock_desc = connectedge()) == -1)
+   {
+      return EXIT_FAILURE;
+   }
+   close(sock_desc);
+
+   if ((client_ptr = edgeclient_open(NULL, opts.connections)) == NULL)
+   {
+      return EXIT_FAILURE;
+   }
+
+   uint64_t start_nsec = stats_nownsec();
+
+   // Give each thread an even share of the jobs
+   for (started = 0; started < opts.threads; started++)
+   {
+      struct submitter * submitter_ptr = &submitters[started];
+
+      submitter_ptr->client_ptr = client_ptr;
+      submitter_ptr->num_jobs = total / opts.threads +
+         ((started < total % opts.threads) ? 1 : 0);
+      submitter_ptr->status = EXIT_SUCCESS;
+
+      // Every thread submits different jobs, the same ones on every run
+      submitter_ptr->rng = (opts.seed + 1) * 0x9e3779b97f4a7c15ull +
+         (uint64_t) started * 0xbf58476d1ce4e5b9ull;
+      if (submitter_ptr->rng == 0)
+      {
+         submitter_ptr->rng = 1;
+      }
+
+      if ((submitter_ptr->jobs = malloc((size_t) submitter_ptr->num_jobs *
+         sizeof(struct lib_job))) == NULL)
+      {
+         fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+         status = EXIT_FAILURE;
+         break;
+      }
+
+      if (pthread_create(&submitter_ptr->thread, NULL, runsubmitter,
+         submitter_ptr) != 0)
+      {
+         fprintf(stderr, "ERROR: Failed to create thread.\n");
+         free(submitter_ptr->jobs);
+         status = EXIT_FAILURE;
+         break;
+      }
+   }
+
+   for (int t = 0; t < started; t++)
+   {
+      pthread_join(submitters[t].thread, NULL);
+      if (submitters[t].status == EXIT_FAILURE)
+      {
+         status = EXIT_FAILURE;
+      }
+   }
+
+   // Closing waits for every submitted job to complete
+   edgeclient_close(client_ptr);
+   *seconds_ptr = (double) (stats_nownsec() - start_nsec) / 1e9;
+
+   for (int t = 0; t < started; t++)
+   {
+      free(submitters[t].jobs);
+   }
+
+   *jobs_ptr = lib_received;
+   *errors_ptr = lib_errors;
+
+   return (lib_received == total) ? status : EXIT_FAILURE;
+}
+
+void * runsubmitter(void * submitter_ptr)
+{
+   struct submitter * self = submitter_ptr;
+
+   for (long long i = 0; i < self->num_jobs; i++)
+   {
+      struct lib_job * job_ptr = &self->jobs[i];
+      unsigned char record[PROTO_CLIENT_JOB_BYTES];
+
+      job_ptr->expected = randomjob(&self->rng, record);
+      job_ptr->submit_nsec = stats_nownsec();
+
+      if (edgeclient_submitcb(self->client_ptr, record[0],
+         proto_getle32(record + 4), proto_getle32(record + 8), completejob,
+         job_ptr) == EXIT_FAILURE)
+      {
+         self->status = EXIT_FAILURE;
+         break;
+      }
+   }
+
+   return NULL;
+}
+
+void completejob(void * arg, int status, uint32_t result)
+{
+   struct lib_job * job_ptr = arg;
+
+   stats_record(&load_stats, STAGE_JOB, stats_nownsec() -
+      job_ptr->submit_nsec);
+
+   if (status == EXIT_FAILURE)
+   {
+      __atomic_add_fetch(&lib_errors, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   if (result != job_ptr->expected)
+   {
+      __atomic_add_fetch(&lib_errors, 1, __ATOMIC_RELAXED);
+   }
+   __atomic_add_fetch(&lib_received, 1, __ATOMIC_RELAXED);
+}
+
+int connectedge()
+{
+   struct sockaddr_in edge_addr;
+   int sock_desc = -1;
+
+   memset(&edge_addr, 0, sizeof(edge_addr));
+   edge_addr.sin_family = AF_INET;
+   edge_addr.sin_port = htons(EDGE_PORT); // store in network byte order
+   edge_addr.sin_addr.s_addr = inet_addr(EDGE_IP);
+
+   for (int attempt = 0; attempt < CONNECT_RETRIES; attempt++)
+   {
+      if ((sock_desc = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+      {
+         fprintf(stderr, "ERROR: Failed to create socket.\n");
+         return -1;
+      }
+
+      if (connect(sock_desc, (struct sockaddr *) &edge_addr,
+         sizeof(edge_addr)) == 0)
+      {
+         break;
+      }
+      close(sock_desc);
+      sock_desc = -1;
+
+      // The edge server may still be starting
+      if ((errno != ECONNREFUSED) ||
+         __atomic_load_n(&unreachable, __ATOMIC_RELAXED))
+      {
+         break;
+      }
+      usleep(CONNECT_RETRY_USEC);
+   }
+
+   if (sock_desc == -1)
+   {
+      __atomic_store_n(&unreachable, true, __ATOMIC_RELAXED);
+      fprintf(stderr, "ERROR: Failed to connect to the edge server.\n");
+   }
+
+   return sock_desc;
+}
+
+int openconn(struct conn * conn_ptr, int index)
+{
+   int sock_desc;
+   int yes = 1;
+
+   if ((sock_desc = connectedge()) == -1)
+   {
+      return EXIT_FAILURE;
+   }
+
+   // Batches are sent whole, waiting for acknowledgements only adds latency
+   setsockopt(sock_desc, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+   conn_ptr->payload = malloc(PROTO_MAX_HEADER_BYTES +
+      (size_t) opts.batch_jobs * PROTO_CLIENT_JOB_BYTES);
+   conn_ptr->expected = malloc((size_t) opts.depth *
+      (size_t) opts.batch_jobs * sizeof(uint32_t));
+   conn_ptr->sent_nsec = malloc((size_t) opts.depth * sizeof(uint64_t));
+   conn_ptr->slot_jobs = calloc((size_t) opts.depth, sizeof(uint32_t));
+
+   if ((conn_ptr->payload == NULL) || (conn_ptr->expected == NULL) ||
+      (conn_ptr->sent_nsec == NULL) || (conn_ptr->slot_jobs == NULL))
+   {
+      fprintf(stderr, "ERROR: Failed to allocate connection buffers.\n");
+      conn_ptr->sd = sock_desc;
+      closeconn(conn_ptr);
+      return EXIT_FAILURE;
+   }
+
+   conn_ptr->sd = sock_desc;
+   conn_ptr->jobs_left = opts.jobs;
+
+   // Every connection sends different jobs, the same ones on every run
+   conn_ptr->rng = (opts.seed + 1) * 0x9e3779b97f4a7c15ull +
+      (uint64_t) index * 0xbf58476d1ce4e5b9ull;
+   if (conn_ptr->rng == 0)
+   {
+      conn_ptr->rng = 1;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+void closeconn(struct conn * conn_ptr)
+{
+   close(conn_ptr->sd);
+   conn_ptr->sd = -1;
+   free(conn_ptr->payload);
+   free(conn_ptr->expected);
+   free(conn_ptr->sent_nsec);
+   free(conn_ptr->slot_jobs);
+   conn_ptr->payload = NULL;
+   conn_ptr->expected = NULL;
+   conn_ptr->sent_nsec = NULL;
+   conn_ptr->slot_jobs = NULL;
+}
+
+void fillbatch(struct conn * conn_ptr)
+{
+   int num_jobs = (conn_ptr->jobs_left < opts.batch_jobs) ?
+      conn_ptr->jobs_left : opts.batch_jobs;
+   int slot = conn_ptr->batches_sent % opts.depth;
+   uint16_t flags = opts.session ? PROTO_FLAG_SESSION : 0;
+   size_t header_len = proto_headerbytes(PROTO_OP_JOBS, flags);
+
+   proto_packheader(conn_ptr->payload, PROTO_OP_JOBS, flags,
+      (uint32_t) num_jobs);
+   if (opts.session)
+   {
+      proto_putle64(conn_ptr->payload + PROTO_HEADER_BYTES,
+         (uint64_t) conn_ptr->batches_sent);
+   }
+
+   for (int i = 0; i < num_jobs; i++)
+   {
+      conn_ptr->expected[(size_t) slot * (size_t) opts.batch_jobs + i] =
+         randomjob(&conn_ptr->rng, conn_ptr->payload + header_len +
+         (size_t) i * PROTO_CLIENT_JOB_BYTES);
+   }
+
+   conn_ptr->payload_len = header_len +
+      (size_t) num_jobs * PROTO_CLIENT_JOB_BYTES;
+   conn_ptr->payload_sent = 0;
+   conn_ptr->jobs_left -= num_jobs;
+   conn_ptr->num_sent += num_jobs;
+   conn_ptr->sent_nsec[slot] = stats_nownsec();
+   conn_ptr->slot_jobs[slot] = (uint32_t) num_jobs;
+   conn_ptr->batches_sent++;
+}
+
+int sendbatch(struct conn * conn_ptr)
+{
+   while (conn_ptr->payload_sent < conn_ptr->payload_len)
+   {
+      ssize_t sent = send(conn_ptr->sd, conn_ptr->payload +
+         conn_ptr->payload_sent, conn_ptr->payload_len -
+         conn_ptr->payload_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+      if (sent == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+         {
+            return EXIT_SUCCESS;
+         }
+         fprintf(stderr, "ERROR: Failed to send jobs.\n");
+         return EXIT_FAILURE;
+      }
+      conn_ptr->payload_sent += (size_t) sent;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int recvresults(struct conn * conn_ptr)
+{
+   ssize_t received = recv(conn_ptr->sd, conn_ptr->buffer + conn_ptr->buffered,
+      sizeof(conn_ptr->buffer) - conn_ptr->buffered, MSG_DONTWAIT);
+
+   if (received <= 0)
+   {
+      if ((received == -1) && ((errno == EINTR) || (errno == EAGAIN) ||
+         (errno == EWOULDBLOCK)))
+      {
+         return EXIT_SUCCESS;
+      }
+      fprintf(stderr, (received == 0) ? "ERROR: The edge server closed the"
+         " connection early.\n" : "ERROR: Failed to receive results.\n");
+      return EXIT_FAILURE;
+   }
+   conn_ptr->buffered += (size_t) received;
+
+   // Decode every complete results header and result record
+   uint16_t flags = opts.session ? PROTO_FLAG_SESSION : 0;
+   size_t header_len = proto_headerbytes(PROTO_OP_RESULTS, flags);
+   size_t used = 0;
+
+   while (1)
+   {
+      if (conn_ptr->results_left == 0)
+      {
+         // Every batch's results start with their own header, which names
+            //the batch in a session and otherwise answers the oldest one
+         struct proto_header header;
+         long long batch;
+
+         if (conn_ptr->buffered - used < header_len)
+         {
+            break;
+         }
+
+         // Batch b + depth is only sent once batch b is answered
+         if ((proto_unpackheader(conn_ptr->buffer + used, &header) ==
+            EXIT_FAILURE) || (header.opcode != PROTO_OP_RESULTS) ||
+            (header.flags != flags) || ((batch = opts.session ?
+            (long long) proto_getle64(conn_ptr->buffer + used +
+            PROTO_HEADER_BYTES) : conn_ptr->batches_done) < 0) ||
+            (batch >= conn_ptr->batches_sent) ||
+            (batch + opts.depth < conn_ptr->batches_sent) ||
+            (header.job_count == 0) || (header.job_count !=
+            conn_ptr->slot_jobs[batch % opts.depth]))
+         {
+            fprintf(stderr, "ERROR: Unexpected results header.\n");
+            return EXIT_FAILURE;
+         }
+
+         used += header_len;
+         conn_ptr->slot = (int) (batch % opts.depth);
+         conn_ptr->results_left = header.job_count;
+         continue;
+      }
+
+      if (conn_ptr->buffered - used < PROTO_CLIENT_RESULT_BYTES)
+      {
+         break;
+      }
+
+      int slot = conn_ptr->slot;
+      uint32_t i = conn_ptr->slot_jobs[slot] - conn_ptr->results_left;
+
+      if (proto_getle32(conn_ptr->buffer + used) != conn_ptr->expected[
+         (size_t) slot * (size_t) opts.batch_jobs + i])
+      {
+         conn_ptr->errors++;
+      }
+      used += PROTO_CLIENT_RESULT_BYTES;
+      conn_ptr->num_received++;
+
+      if (--conn_ptr->results_left == 0)
+      {
+         stats_record(&load_stats, STAGE_BATCH, stats_nownsec() -
+            conn_ptr->sent_nsec[slot]);
+         conn_ptr->slot_jobs[slot] = 0;
+         conn_ptr->batches_done++;
+      }
+   }
+
+   // Keep a partial header or record for the next receive
+   memmove(conn_ptr->buffer, conn_ptr->buffer + used,
+      conn_ptr->buffered - used);
+   conn_ptr->buffered -= used;
+
+   return EXIT_SUCCESS;
+}
+
+uint32_t randomjob(uint64_t * rng_ptr, unsigned char * record)
+{
+   int width_range = opts.max_width - opts.min_width + 1;
+   uint64_t bits = nextrandom(rng_ptr);
+   uint64_t pick = nextrandom(rng_ptr);
+   int width1 = opts.min_width + (int) (pick % (uint64_t) width_range);
+   int width2 = opts.min_width + (int) ((pick >> 16) % (uint64_t) width_range);
+   bool is_and = (int) ((pick >> 32) % 100) < opts.and_percent;
+   uint32_t operand1 = (uint32_t) bits & (uint32_t) ((1ull << width1) - 1);
+   uint32_t operand2 = (uint32_t) (bits >> 32) &
+      (uint32_t) ((1ull << width2) - 1);
+
+   record[0] = is_and ? PROTO_OP_AND : PROTO_OP_OR;
+   record[1] = (unsigned char) width1;
+   record[2] = (unsigned char) width2;
+   record[3] = 0;
+   proto_putle32(record + 4, operand1);
+   proto_putle32(record + 8, operand2);
+
+   return is_and ? operand1 & operand2 : operand1 | operand2;
+}
+
+uint64_t nextrandom(uint64_t * rng_ptr)
+{
+   uint64_t x = *rng_ptr;
+
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *rng_ptr = x;
+
+   return x * 0x2545f4914f6cdd1dull;
+}
+
+void printreport(long long jobs, unsigned long errors, double seconds,
+   int status)
+{
+   int stage = opts.library ? STAGE_JOB : STAGE_BATCH;
+   double jobs_per_sec = (seconds > 0.0) ? (double) jobs / seconds : 0.0;
+   double p50 = (double) stats_percentile(&load_stats, stage, 500) / 1000.0;
+   double p99 = (double) stats_percentile(&load_stats, stage, 990) / 1000.0;
+   double p999 = (double) stats_percentile(&load_stats, stage, 999) / 1000.0;
+   double max = (double) stats_percentile(&load_stats, stage, 1000) / 1000.0;
+
+   if (opts.json)
+   {
+      fprintf(stdout, "{\"connections\":%d,\"jobs_per_connection\":%d,"
+         "\"batch_jobs\":%d,\"depth\":%d,\"and_percent\":%d,\"min_width\":%d,"
+         "\"max_width\":%d,\"threads\":%d,\"seed\":%llu,\"session\":%s,"
+         "\"library\":%s,\"jobs\":%lld,"
+         "\"errors\":%lu,\"complete\":%s,\"seconds\":%.6f,"
+         "\"jobs_per_sec\":%.1f,\"%s_latency_us\":{\"p50\":%.3f,"
+         "\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}}\n", opts.connections,
+         opts.jobs, opts.batch_jobs, opts.depth, opts.and_percent,
+         opts.min_width, opts.max_width, opts.threads,
+         (unsigned long long) opts.seed, opts.session ? "true" : "false",
+         opts.library ? "true" : "false", jobs, errors,
+         (status == EXIT_SUCCESS) ? "true" : "false", seconds, jobs_per_sec,
+         stage_names[stage], p50, p99, p999, max);
+      return;
+   }
+
+   fprintf(stdout, "The load generator has received %lld results (%lu wrong)"
+      " over %d %sconnections in %.3f s: %.0f jobs/sec.\n", jobs, errors,
+      opts.connections, opts.library ? "client library " : (opts.session ?
+      "keep-alive session " : ""), seconds, jobs_per_sec);
+
+   if (opts.library)
+   {
+      fprintf(stdout, "Jobs took p50 %.3f us, p99 %.3f us, p99.9 %.3f us, and"
+         " at most %.3f us.\n", p50, p99, p999, max);
+   }
+   else
+   {
+      fprintf(stdout, "Batches of %d jobs took p50 %.3f us, p99 %.3f us,"
+         " p99.9 %.3f us, and at most %.3f us.\n", opts.batch_jobs, p50, p99,
+         p999, max);
+   }
+
+   if (status == EXIT_FAILURE)
+   {
+      fprintf(stdout, "Some connections did not receive all of their"
+         " results.\n");
+   }
+}
@@ -0,0 +1,329 @@
+/**
+ * logger.c
+ *
+ * Asynchronous logger for the edge and backend servers. See logger.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "logger.h"
+
+#define RING_MASK (LOGGER_RING_BYTES - 1)
+#define JOB_RING_BYTES (LOGGER_RING_BYTES / 4 * 3) // part of a ring LOGGER_JOB
+   //lines may fill
+
+/**
+ * struct to store the lines of one thread until they are written
+ */
+struct ring {
+   char * bytes; // LOGGER_RING_BYTES bytes, NULL until the ring is set up
+   unsigned long head; // bytes ever queued, advanced by the owning thread
+   unsigned long tail; // bytes ever written, advanced by the writer thread
+   unsigned long dropped; // lines dropped because the ring was full
+};
+
+static struct ring rings[LOGGER_MAX_THREADS];
+static int num_rings; // number of rings handed out
+static __thread struct ring * own_ring; // calling thread's ring, NULL if none
+
+static int max_level = LOGGER_JOB; // most detailed level kept
+static bool started; // the writer thread has been started
+static bool stopping; // the writer thread should write everything and stop
+static pthread_t writer; // thread writing the rings of this process
+static unsigned long reported; // dropped lines already reported
+
+/**
+ * getring returns the calling thread's ring, setting it up on first use.
+ * @return struct ring * the ring, NULL if none is left or it cannot be
+ *    allocated
+ */
+static struct ring * getring(void);
+
+/**
+ * writerings writes out every line queued so far and reports lines dropped
+ * since the last call.
+ * @return bool true if anything was written
+ */
+static bool writerings(void);
+
+/**
+ * writeall writes bytes to stdout, retrying partial writes.
+ * @param bytes pointer to bytes
+ * @param len size_t number of bytes
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+static int writeall(const char * bytes, size_t len);
+
+/**
+ * runwriter is the writer thread, it writes the rings until asked to stop.
+ * @param arg unused
+ * @return void * NULL
+ */
+static void * runwriter(void * arg);
+
+/**
+ * stopwriter writes every queued line and stops the writer thread when the
+ * process exits.
+ */
+static void stopwriter(void);
+
+/**
+ * restartwriter gives a forked child its own writer thread. The lines queued
+ * before the fork are the parent's to write.
+ */
+static void restartwriter(void);
+
+int logger_init(int level)
+{
+   max_level = level;
+
+   if (pthread_create(&writer, NULL, runwriter, NULL) != 0)
+   {
+      fprintf(stderr, "ERROR: Failed to create logger thread.\n");
+      return EXIT_FAILURE;
+   }
+
+   // Lines printed before now went to stdout directly
+   fflush(stdout);
+   __atomic_store_n(&started, true, __ATOMIC_RELEASE);
+
+   if ((atexit(stopwriter) != 0) ||
+      (pthread_atfork(NULL, NULL, restartwriter) != 0))
+   {
+      fprintf(stderr, "ERROR: Failed to register logger handlers.\n");
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+bool logger_enabled(int level)
+{
+   return level <= max_level;
+}
+
+void logger_printf(int level, const char * format, ...)
+{
+   char line[LOGGER_LINE_BYTES];
+   struct ring * ring_ptr;
+   va_list args;
+   int len;
+
+   if (level > max_level)
+   {
+      return;
+   }
+
+   va_start(args, format);
+   len = vsnprintf(line, sizeof(line), format, args);
+   va_end(args);
+
+   if (len < 0)
+   {
+      return;
+   }
+
+   // Cut long lines short but keep them lines
+   if ((size_t) len >= sizeof(line))
+   {
+      len = (int) sizeof(line) - 1;
+      line[len - 1] = '\n';
+   }
+
+   if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE) ||
+      ((ring_ptr = getring()) == NULL))
+   {
+      fputs(line, stdout);
+      return;
+   }
+
+   unsigned long head = ring_ptr->head;
+   unsigned long room = (level == LOGGER_JOB) ? JOB_RING_BYTES :
+      LOGGER_RING_BYTES;
+
+   // Waiting here would stall the caller on stdout after all
+   if (head + (unsigned long) len - __atomic_load_n(&ring_ptr->tail,
+      __ATOMIC_ACQUIRE) > room)
+   {
+      __atomic_add_fetch(&ring_ptr->dropped, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   size_t at = head & RING_MASK;
+   size_t first = ((size_t) len < LOGGER_RING_BYTES - at) ? (size_t) len :
+      LOGGER_RING_BYTES - at;
+
+   memcpy(ring_ptr->bytes + at, line, first);
+   memcpy(ring_ptr->bytes, line + first, (size_t) len - first);
+
+   // The writer thread may only see the head once the line is in place
+   __atomic_store_n(&ring_ptr->head, head + (unsigned long) len,
+      __ATOMIC_RELEASE);
+}
+
+static struct ring * getring(void)
+{
+   if (own_ring != NULL)
+   {
+      return own_ring;
+   }
+
+   int r = __atomic_fetch_add(&num_rings, 1, __ATOMIC_RELAXED);
+   char * bytes;
+
+   if ((r >= LOGGER_MAX_THREADS) ||
+      ((bytes = malloc(LOGGER_RING_BYTES)) == NULL))
+   {
+      return NULL;
+   }
+
+   // The bytes pointer tells the writer thread the ring is in use
+   own_ring = &rings[r];
+   __atomic_store_n(&own_ring->bytes, bytes, __ATOMIC_RELEASE);
+
+   return own_ring;
+}
+
+static bool writerings(void)
+{
+   int count = __atomic_load_n(&num_rings, __ATOMIC_RELAXED);
+   unsigned long dropped = 0;
+   bool wrote = false;
+
+   if (count > LOGGER_MAX_THREADS)
+   {
+      count = LOGGER_MAX_THREADS;
+   }
+
+   for (int r = 0; r < count; r++)
+   {
+      struct ring * ring_ptr = &rings[r];
+      char * bytes = __atomic_load_n(&ring_ptr->bytes, __ATOMIC_ACQUIRE);
+
+      if (bytes == NULL)
+      {
+         continue;
+      }
+
+      unsigned long head = __atomic_load_n(&ring_ptr->head, __ATOMIC_ACQUIRE);
+      unsigned long tail = ring_ptr->tail;
+
+      // Up to the end of the ring, then from its start
+      while (tail != head)
+      {
+         size_t at = tail & RING_MASK;
+         size_t len = (head - tail < LOGGER_RING_BYTES - at) ?
+            (size_t) (head - tail) : LOGGER_RING_BYTES - at;
+
+         // Lines stdout cannot take are lost, the ring must keep moving
+         writeall(bytes + at, len);
+         tail += len;
+         wrote = true;
+      }
+      __atomic_store_n(&ring_ptr->tail, tail, __ATOMIC_RELEASE);
+
+      dropped += __atomic_load_n(&ring_ptr->dropped, __ATOMIC_RELAXED);
+   }
+
+   if (dropped > reported)
+   {
+      char line[LOGGER_LINE_BYTES];
+      int len = snprintf(line, sizeof(line), "The logger has dropped %lu"
+         " lines because stdout could not keep up.\n", dropped - reported);
+
+      writeall(line, (size_t) len);
+      reported = dropped;
+   }
+
+   return wrote;
+}
+
+static int writeall(const char * bytes, size_t len)
+{
+   while (len > 0)
+   {
+      ssize_t n = write(STDOUT_FILENO, bytes, len);
+
+      if (n == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return EXIT_FAILURE;
+      }
+
+      bytes += n;
+      len -= (size_t) n;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+static void * runwriter(void * arg)
+{
+   (void) arg;
+
+   while (1)
+   {
+      // Read the flag first so the lines queued before it was set are written
+      bool stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+
+      if (writerings())
+      {
+         continue;
+      }
+
+      if (stop)
+      {
+         return NULL;
+      }
+
+      struct timespec idle = {0, LOGGER_FLUSH_USEC * 1000L};
+
+      nanosleep(&idle, NULL);
+   }
+}
+
+static void stopwriter(void)
+{
+   if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE))
+   {
+      return;
+   }
+
+   __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+   pthread_join(writer, NULL);
+}
+
+static void restartwriter(void)
+{
+   int count = __atomic_load_n(&num_rings, __ATOMIC_RELAXED);
+
+   if (count > LOGGER_MAX_THREADS)
+   {
+      count = LOGGER_MAX_THREADS;
+   }
+
+   reported = 0;
+
+   for (int r = 0; r < count; r++)
+   {
+      rings[r].tail = rings[r].head;
+      reported += rings[r].dropped;
+   }
+
+   if (pthread_create(&writer, NULL, runwriter, NULL) != 0)
+   {
+      // Without a writer thread the child prints to stdout directly
+      fprintf(stderr, "ERROR: Failed to create logger thread.\n");
+      __atomic_store_n(&started, false, __ATOMIC_RELEASE);
+   }
+}
@@ -0,0 +1,61 @@
+/**
+ * logger.h
+ *
+ * Asynchronous logger for the edge and backend servers.
+ *
+ * Printing a line to stdout takes a lock and a system call, and blocks for as
+ * long as the terminal or pipe behind it is slow, which stalled the loops that
+ * print a line for every job. Instead, every thread formats its lines into a
+ * ring buffer of its own, and a background thread writes the rings out. Each
+ * ring has one writer and one reader, so neither side ever takes a lock.
+ *
+ * Every line has a level: LOGGER_INFO for start up and summary messages,
+ * LOGGER_JOB for the lines printed for every job. Nothing ever waits for
+ * stdout. A line that does not fit its ring is dropped and the number dropped
+ * is reported, and LOGGER_JOB lines may only fill three quarters of a ring, so
+ * the summary lines still fit when stdout falls behind a flood of job lines.
+ * In quiet mode LOGGER_JOB lines are not even formatted.
+ *
+ * Until logger_init is called, lines are printed to stdout at once. Errors
+ * are still printed to stderr at once.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdbool.h>
+
+#define LOGGER_INFO 0 // start up and summary lines
+#define LOGGER_JOB 1 // one line per job
+
+#define LOGGER_MAX_THREADS 80 // maximum number of threads with a ring
+#define LOGGER_RING_BYTES (1 << 20) // size of each thread's ring, power of 2
+#define LOGGER_LINE_BYTES 512 // longest line, longer ones are cut short
+#define LOGGER_FLUSH_USEC 1000 // time the writer thread sleeps when idle
+
+/**
+ * logger_init starts the thread that writes the rings to stdout. Lines
+ * queued by the process are written when it exits, and a forked child starts
+ * a writer thread of its own.
+ * @param level int most detailed level kept, LOGGER_INFO for quiet mode
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int logger_init(int level);
+
+/**
+ * logger_enabled tells whether lines of a level are kept, so callers can skip
+ * preparing lines that would be thrown away.
+ * @param level int LOGGER_INFO or LOGGER_JOB
+ * @return bool true if lines of the level are kept
+ */
+bool logger_enabled(int level);
+
+/**
+ * logger_printf formats a line into the calling thread's ring.
+ * @param level int LOGGER_INFO or LOGGER_JOB
+ * @param format pointer to c string printf format, ending in a newline
+ */
+void logger_printf(int level, const char * format, ...)
+   __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,332 @@
+/**
+ * pool.c
+ *
+ * Pools of backend server replicas and their shared load counts. See pool.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pool.h"
+
+#define ADDR_BYTES 64 // maximum length of one "ip:port" address
+#define RECOMPUTE_SAMPLES 16 // new latencies before a percentile is redone
+
+/**
+ * mix scrambles a seed into 64 pseudorandom bits (splitmix64 finalizer).
+ * @param seed uint64_t seed
+ * @return uint64_t pseudorandom bits
+ */
+static uint64_t mix(uint64_t seed);
+
+/**
+ * load reads a replica's outstanding job count.
+ * @param replica_ptr pointer to struct replica
+ * @return long number of outstanding jobs
+ */
+static long load(const struct replica * replica_ptr);
+
+/**
+ * comparelongs orders longs for qsort.
+ * @param a pointer to long
+ * @param b pointer to long
+ * @return int negative, zero, or positive as a is less, equal, or greater
+ */
+static int comparelongs(const void * a, const void * b);
+
+int pool_init(struct pool * pool_ptr, const char * list)
+{
+   struct pool_shared * shared;
+
+   // Counts are shared with the forked children that send and receive jobs
+   if ((shared = mmap(NULL, sizeof(struct pool_shared), PROT_READ |
+      PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+   {
+      fprintf(stderr, "ERROR: Failed to map replica job counts.\n");
+      return EXIT_FAILURE;
+   }
+
+   pool_ptr->num_replicas = 0;
+   pool_ptr->shared = shared;
+   pool_ptr->percentile = 0;
+   pool_ptr->percentile_usec = -1;
+   pool_ptr->percentile_samples = 0;
+
+   while (*list != '\0')
+   {
+      size_t len = strcspn(list, ",");
+      char addr[ADDR_BYTES];
+      char * colon;
+      long port = 0;
+      struct replica * replica_ptr;
+
+      if ((len == 0) || (len >= ADDR_BYTES) ||
+         (pool_ptr->num_replicas == POOL_MAX_REPLICAS))
+      {
+         fprintf(stderr, "ERROR: Replica list must hold 1 to %d addresses.\n",
+            POOL_MAX_REPLICAS);
+         munmap(shared, sizeof(struct pool_shared));
+         return EXIT_FAILURE;
+      }
+      memcpy(addr, list, len);
+      addr[len] = '\0';
+
+      replica_ptr = &pool_ptr->replicas[pool_ptr->num_replicas];
+      memset(&replica_ptr->addr, 0, sizeof(replica_ptr->addr));
+      replica_ptr->addr.sin_family = AF_INET;
+
+      if ((colon = strchr(addr, ':')) != NULL)
+      {
+         *colon = '\0';
+         port = strtol(colon + 1, NULL, 10);
+      }
+
+      if ((colon == NULL) || (port < 1) || (port > 65535) ||
+         (inet_aton(addr, &replica_ptr->addr.sin_addr) == 0))
+      {
+         fprintf(stderr, "ERROR: Replica address must be ip:port.\n");
+         munmap(shared, sizeof(struct pool_shared));
+         return EXIT_FAILURE;
+      }
+      replica_ptr->addr.sin_port = htons((uint16_t) port);
+      replica_ptr->outstanding =
+         &shared->outstanding[pool_ptr->num_replicas];
+      replica_ptr->window_bytes =
+         &shared->window_bytes[pool_ptr->num_replicas];
+      replica_ptr->unread = &shared->unread[pool_ptr->num_replicas];
+      pool_ptr->num_replicas++;
+
+      list += len;
+      if (*list == ',')
+      {
+         list++;
+      }
+   }
+
+   if (pool_ptr->num_replicas == 0)
+   {
+      fprintf(stderr, "ERROR: Replica list must hold 1 to %d addresses.\n",
+         POOL_MAX_REPLICAS);
+      munmap(shared, sizeof(struct pool_shared));
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int pool_policy(const char * name)
+{
+   if (strcmp(name, "least") == 0)
+   {
+      return POOL_LEAST;
+   }
+
+   if (strcmp(name, "p2c") == 0)
+   {
+      return POOL_P2C;
+   }
+
+   fprintf(stderr, "ERROR: Balancing policy must be least or p2c.\n");
+   return -1;
+}
+
+int pool_pick(const struct pool * pool_ptr, int policy, uint64_t seed,
+   uint32_t excluded)
+{
+   int candidates[POOL_MAX_REPLICAS];
+   int num_candidates = 0;
+   uint64_t bits = mix(seed);
+
+   // Start at a different replica every time so ties are spread out
+   for (int k = 0; k < pool_ptr->num_replicas; k++)
+   {
+      int r = (int) ((bits + (uint64_t) k) %
+         (uint64_t) pool_ptr->num_replicas);
+
+      if ((excluded & (1u << r)) == 0)
+      {
+         candidates[num_candidates++] = r;
+      }
+   }
+
+   if (num_candidates == 0)
+   {
+      return -1;
+   }
+
+   if (policy == POOL_P2C)
+   {
+      if (num_candidates == 1)
+      {
+         return candidates[0];
+      }
+
+      // Two different candidates, the second drawn from the remaining ones
+      bits = mix(bits);
+      int first = (int) (bits % (uint64_t) num_candidates);
+      int second = (int) ((bits >> 32) % (uint64_t) (num_candidates - 1));
+
+      if (second >= first)
+      {
+         second++;
+      }
+
+      return (load(&pool_ptr->replicas[candidates[second]]) <
+         load(&pool_ptr->replicas[candidates[first]])) ?
+         candidates[second] : candidates[first];
+   }
+
+   int best = candidates[0];
+
+   for (int k = 1; k < num_candidates; k++)
+   {
+      if (load(&pool_ptr->replicas[candidates[k]]) <
+         load(&pool_ptr->replicas[best]))
+      {
+         best = candidates[k];
+      }
+   }
+
+   return best;
+}
+
+void pool_add(struct replica * replica_ptr, long num_jobs)
+{
+   __atomic_add_fetch(replica_ptr->outstanding, num_jobs, __ATOMIC_RELAXED);
+}
+
+void pool_observe(struct pool * pool_ptr, long usec)
+{
+   // Slots are claimed atomically, a racing reader may see an older value
+   unsigned long n = __atomic_fetch_add(&pool_ptr->shared->num_samples, 1,
+      __ATOMIC_RELAXED);
+
+   __atomic_store_n(&pool_ptr->shared->latencies[n % POOL_LATENCY_SAMPLES],
+      usec, __ATOMIC_RELAXED);
+}
+
+long pool_latency(struct pool * pool_ptr, int percentile)
+{
+   unsigned long num_samples = __atomic_load_n(&pool_ptr->shared->num_samples,
+      __ATOMIC_RELAXED);
+
+   if (num_samples < POOL_MIN_SAMPLES)
+   {
+      return -1;
+   }
+
+   if ((percentile != pool_ptr->percentile) ||
+      (num_samples - pool_ptr->percentile_samples >= RECOMPUTE_SAMPLES))
+   {
+      long sorted[POOL_LATENCY_SAMPLES];
+      size_t count = (num_samples < POOL_LATENCY_SAMPLES) ?
+         (size_t) num_samples : POOL_LATENCY_SAMPLES;
+
+      for (size_t i = 0; i < count; i++)
+      {
+         sorted[i] = __atomic_load_n(&pool_ptr->shared->latencies[i],
+            __ATOMIC_RELAXED);
+      }
+      qsort(sorted, count, sizeof(long), comparelongs);
+
+      pool_ptr->percentile = percentile;
+      pool_ptr->percentile_usec = sorted[(count - 1) * (size_t) percentile /
+         100];
+      pool_ptr->percentile_samples = num_samples;
+   }
+
+   return pool_ptr->percentile_usec;
+}
+
+void pool_rtt(struct pool * pool_ptr, long usec)
+{
+   struct pool_shared * shared = pool_ptr->shared;
+   long srtt = __atomic_load_n(&shared->srtt_usec, __ATOMIC_RELAXED);
+   long rttvar = __atomic_load_n(&shared->rttvar_usec, __ATOMIC_RELAXED);
+
+   // Gains of 1/8 and 1/4 as in TCP, a racing update from another process
+      //only loses one sample
+   if (srtt == 0)
+   {
+      srtt = usec;
+      rttvar = usec / 2;
+   }
+   else
+   {
+      long err = usec - srtt;
+
+      srtt += err / 8;
+      rttvar += ((err < 0 ? -err : err) - rttvar) / 4;
+   }
+
+   __atomic_store_n(&shared->srtt_usec, (srtt > 0) ? srtt : 1,
+      __ATOMIC_RELAXED);
+   __atomic_store_n(&shared->rttvar_usec, rttvar, __ATOMIC_RELAXED);
+}
+
+long pool_rto(struct pool * pool_ptr)
+{
+   long srtt = __atomic_load_n(&pool_ptr->shared->srtt_usec,
+      __ATOMIC_RELAXED);
+   long rto = srtt + 4 * __atomic_load_n(&pool_ptr->shared->rttvar_usec,
+      __ATOMIC_RELAXED);
+
+   if (srtt == 0)
+   {
+      return POOL_RTO_INITIAL_USEC;
+   }
+
+   return (rto < POOL_RTO_MIN_USEC) ? POOL_RTO_MIN_USEC :
+      (rto > POOL_RTO_MAX_USEC) ? POOL_RTO_MAX_USEC : rto;
+}
+
+void pool_advertise(struct replica * replica_ptr, long bytes)
+{
+   __atomic_store_n(replica_ptr->window_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+long pool_credit(const struct replica * replica_ptr, long dgram_cost,
+   long dgram_jobs)
+{
+   long bytes = __atomic_load_n(replica_ptr->window_bytes, __ATOMIC_RELAXED);
+
+   if (bytes == 0)
+   {
+      bytes = POOL_WINDOW_INITIAL_BYTES;
+   }
+
+   // The buffer fills up by whole datagrams, however few jobs they hold
+   return bytes / dgram_cost * dgram_jobs -
+      __atomic_load_n(replica_ptr->unread, __ATOMIC_RELAXED);
+}
+
+void pool_charge(struct replica * replica_ptr, long num_jobs)
+{
+   __atomic_add_fetch(replica_ptr->unread, num_jobs, __ATOMIC_RELAXED);
+}
+
+static uint64_t mix(uint64_t seed)
+{
+   seed += 0x9e3779b97f4a7c15ull;
+   seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+   seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+   return seed ^ (seed >> 31);
+}
+
+static long load(const struct replica * replica_ptr)
+{
+   return __atomic_load_n(replica_ptr->outstanding, __ATOMIC_RELAXED);
+}
+
+static int comparelongs(const void * a, const void * b)
+{
+   long x = *(const long *) a;
+   long y = *(const long *) b;
+
+   return (x > y) - (x < y);
+}
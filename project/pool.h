@@ -0,0 +1,178 @@
+/**
+ * pool.h
+ *
+ * Pools of backend server replicas for the edge server.
+ *
+ * A pool holds the socket addresses of every replica of one backend server
+ * (AND or OR) and the number of jobs each replica has been sent whose results
+ * have not arrived. The counts live in shared memory, so every process forked
+ * from the one that set up the pool balances on the same live numbers.
+ *
+ * Replicas are picked by one of two policies:
+ *    POOL_LEAST  the replica with the fewest outstanding jobs
+ *    POOL_P2C    the less loaded of two replicas chosen at random (power of
+ *                two choices), which avoids herding on one replica when many
+ *                processes read the same counts at once
+ *
+ * A pool also keeps the latencies of the last POOL_LATENCY_SAMPLES shards
+ * its replicas answered, in the same shared memory, so the edge server can
+ * tell when a replica is slower than usual, and a smoothed round trip time
+ * from which it derives how long to wait before resending lost jobs.
+ *
+ * Each replica also has a window: the receive buffer size it last advertised
+ * and the number of jobs sent to it that it is not yet known to have read off
+ * its socket. The edge server keeps the jobs in flight within the window so
+ * the replica's receive buffer does not overflow.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define POOL_MAX_REPLICAS 16 // maximum number of replicas in a pool
+#define POOL_LATENCY_SAMPLES 256 // number of recent latencies kept
+#define POOL_MIN_SAMPLES 32 // latencies needed before percentiles are known
+#define POOL_RTO_INITIAL_USEC 200000 // retransmission timeout before any
+   //round trip has been measured
+#define POOL_RTO_MIN_USEC 10000 // shortest retransmission timeout
+#define POOL_RTO_MAX_USEC 1000000 // longest retransmission timeout
+#define POOL_WINDOW_INITIAL_BYTES 212992 // receive buffer assumed before a
+   //replica advertises its own, the usual Linux default
+
+#define POOL_LEAST 0 // pick the replica with the fewest outstanding jobs
+#define POOL_P2C 1 // pick the less loaded of two random replicas
+
+/**
+ * struct to store one backend server replica
+ */
+struct replica {
+   struct sockaddr_in addr; // socket address jobs are sent to
+   long * outstanding; // jobs sent whose results have not arrived, shared
+   long * window_bytes; // receive buffer size last advertised, shared
+   long * unread; // jobs sent not yet known to be received, shared
+};
+
+/**
+ * struct to store the counts shared by every process using a pool
+ */
+struct pool_shared {
+   long outstanding[POOL_MAX_REPLICAS]; // outstanding jobs of each replica
+   long latencies[POOL_LATENCY_SAMPLES]; // recent latencies in microseconds
+   unsigned long num_samples; // number of latencies ever recorded
+   long srtt_usec; // smoothed round trip time, 0 until one is measured
+   long rttvar_usec; // smoothed round trip time variation
+   long window_bytes[POOL_MAX_REPLICAS]; // advertised receive buffer sizes,
+      //0 until advertised
+   long unread[POOL_MAX_REPLICAS]; // jobs each replica has not read yet
+};
+
+/**
+ * struct to store every replica of one backend server
+ */
+struct pool {
+   struct replica replicas[POOL_MAX_REPLICAS];
+   int num_replicas;
+   struct pool_shared * shared; // counts shared with forked processes
+   int percentile; // percentile last computed, 0 if none
+   long percentile_usec; // its value in microseconds
+   unsigned long percentile_samples; // num_samples when it was computed
+};
+
+/**
+ * pool_init parses a comma separated list of replica addresses and maps the
+ * shared outstanding job counts. Call it before forking.
+ * @param pool_ptr pointer to struct pool
+ * @param list pointer to c string of "ip:port" addresses separated by commas
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int pool_init(struct pool * pool_ptr, const char * list);
+
+/**
+ * pool_policy parses the name of a balancing policy.
+ * @param name pointer to c string "least" or "p2c"
+ * @return int POOL_LEAST or POOL_P2C, -1 if the name is unknown
+ */
+int pool_policy(const char * name);
+
+/**
+ * pool_pick chooses a replica to send jobs to.
+ * @param pool_ptr pointer to struct pool
+ * @param policy int POOL_LEAST or POOL_P2C
+ * @param seed uint64_t value the random choices and tie breaks are derived
+ *    from, different for every pick
+ * @param excluded uint32_t mask of replica indices that may not be picked
+ * @return int replica index, -1 if every replica is excluded
+ */
+int pool_pick(const struct pool * pool_ptr, int policy, uint64_t seed,
+   uint32_t excluded);
+
+/**
+ * pool_add adds to a replica's outstanding job count.
+ * @param replica_ptr pointer to struct replica
+ * @param num_jobs long number of jobs sent, negative for results received
+ */
+void pool_add(struct replica * replica_ptr, long num_jobs);
+
+/**
+ * pool_observe records how long a replica took to answer a shard.
+ * @param pool_ptr pointer to struct pool
+ * @param usec long latency in microseconds
+ */
+void pool_observe(struct pool * pool_ptr, long usec);
+
+/**
+ * pool_latency returns a percentile of the pool's recent latencies. It is
+ * recomputed only after enough new latencies have been recorded.
+ * @param pool_ptr pointer to struct pool
+ * @param percentile int percentile from 1 to 99
+ * @return long latency in microseconds, -1 if fewer than POOL_MIN_SAMPLES
+ *    latencies have been recorded
+ */
+long pool_latency(struct pool * pool_ptr, int percentile);
+
+/**
+ * pool_rtt folds a measured round trip time, from sending jobs that were
+ * never resent to their first results, into the pool's smoothed estimate.
+ * @param pool_ptr pointer to struct pool
+ * @param usec long round trip time in microseconds
+ */
+void pool_rtt(struct pool * pool_ptr, long usec);
+
+/**
+ * pool_rto returns how long to wait for results before resending jobs: the
+ * smoothed round trip time plus four times its variation.
+ * @param pool_ptr pointer to struct pool
+ * @return long retransmission timeout in microseconds, between
+ *    POOL_RTO_MIN_USEC and POOL_RTO_MAX_USEC
+ */
+long pool_rto(struct pool * pool_ptr);
+
+/**
+ * pool_advertise records the receive buffer size a replica advertised.
+ * @param replica_ptr pointer to struct replica
+ * @param bytes long receive buffer size in bytes
+ */
+void pool_advertise(struct replica * replica_ptr, long bytes);
+
+/**
+ * pool_credit returns how many more jobs may be sent to a replica before its
+ * receive buffer could overflow.
+ * @param replica_ptr pointer to struct replica
+ * @param dgram_cost long receive buffer bytes one datagram takes up
+ * @param dgram_jobs long number of jobs in a full datagram
+ * @return long number of jobs, 0 or less if the window is full
+ */
+long pool_credit(const struct replica * replica_ptr, long dgram_cost,
+   long dgram_jobs);
+
+/**
+ * pool_charge adds to the number of jobs a replica has not read yet.
+ * @param replica_ptr pointer to struct replica
+ * @param num_jobs long number of jobs sent, negative for jobs the replica has
+ *    reported reading
+ */
+void pool_charge(struct replica * replica_ptr, long num_jobs);
+
+#endif
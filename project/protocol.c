@@ -0,0 +1,313 @@
+/**
+ * protocol.c
+ *
+ * Encoding and decoding helpers for the binary wire protocol described in
+ * protocol.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+void proto_putle16(unsigned char * buf, uint16_t val)
+{
+   buf[0] = (unsigned char) val;
+   buf[1] = (unsigned char) (val >> 8);
+}
+
+void proto_putle32(unsigned char * buf, uint32_t val)
+{
+   buf[0] = (unsigned char) val;
+   buf[1] = (unsigned char) (val >> 8);
+   buf[2] = (unsigned char) (val >> 16);
+   buf[3] = (unsigned char) (val >> 24);
+}
+
+void proto_putle64(unsigned char * buf, uint64_t val)
+{
+   proto_putle32(buf, (uint32_t) val);
+   proto_putle32(buf + 4, (uint32_t) (val >> 32));
+}
+
+uint16_t proto_getle16(const unsigned char * buf)
+{
+   return (uint16_t) (buf[0] | (buf[1] << 8));
+}
+
+uint32_t proto_getle32(const unsigned char * buf)
+{
+   return (uint32_t) buf[0] | ((uint32_t) buf[1] << 8) |
+      ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+uint64_t proto_getle64(const unsigned char * buf)
+{
+   return (uint64_t) proto_getle32(buf) |
+      ((uint64_t) proto_getle32(buf + 4) << 32);
+}
+
+void proto_packheader(unsigned char * buf, int opcode, uint16_t flags,
+   uint32_t job_count)
+{
+   proto_putle32(buf, PROTO_MAGIC);
+   buf[4] = PROTO_VERSION;
+   buf[5] = (unsigned char) opcode;
+   proto_putle16(buf + 6, flags);
+   proto_putle32(buf + 8, job_count);
+}
+
+int proto_unpackheader(const unsigned char * buf,
+   struct proto_header * header_ptr)
+{
+   header_ptr->magic = proto_getle32(buf);
+   header_ptr->version = buf[4];
+   header_ptr->opcode = buf[5];
+   header_ptr->flags = proto_getle16(buf + 6);
+   header_ptr->job_count = proto_getle32(buf + 8);
+
+   if (header_ptr->magic != PROTO_MAGIC)
+   {
+      fprintf(stderr, "ERROR: Message does not start with protocol magic.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (header_ptr->version != PROTO_VERSION)
+   {
+      fprintf(stderr, "ERROR: Unsupported protocol version %d.\n",
+         header_ptr->version);
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+size_t proto_headerbytes(int opcode, uint16_t flags)
+{
+   return ((opcode == PROTO_OP_WIDE_JOBS) ? PROTO_WIDE_HEADER_BYTES :
+      PROTO_HEADER_BYTES) + (((flags & PROTO_FLAG_SESSION) != 0) ?
+      PROTO_REQUEST_ID_BYTES : 0);
+}
+
+void proto_packdgramheader(unsigned char * buf, int opcode,
+   uint64_t request_id, uint32_t job_count, uint32_t first_job,
+   uint32_t record_count)
+{
+   proto_packheader(buf, opcode, 0, job_count);
+   proto_putle64(buf + PROTO_HEADER_BYTES, request_id);
+   proto_putle32(buf + PROTO_HEADER_BYTES + 8, first_job);
+   proto_putle32(buf + PROTO_HEADER_BYTES + 12, record_count);
+}
+
+void proto_packsegheader(unsigned char * buf, int opcode, uint64_t request_id,
+   uint32_t job, uint32_t num_words, uint32_t first_word,
+   uint32_t segment_words)
+{
+   proto_packdgramheader(buf, opcode, request_id, num_words, first_word,
+      segment_words);
+   proto_putle16(buf + 6, PROTO_FLAG_SEGMENT);
+   proto_putle32(buf + PROTO_DGRAM_HEADER_BYTES, job);
+   proto_putle32(buf + PROTO_DGRAM_HEADER_BYTES + 4, 0);
+}
+
+int proto_unpackdgramheader(const unsigned char * buf, size_t len,
+   size_t record_bytes, struct proto_header * header_ptr)
+{
+   size_t header_bytes = PROTO_DGRAM_HEADER_BYTES;
+
+   if (len < PROTO_DGRAM_HEADER_BYTES)
+   {
+      fprintf(stderr, "ERROR: Datagram is too short.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (proto_unpackheader(buf, header_ptr) == EXIT_FAILURE)
+   {
+      return EXIT_FAILURE;
+   }
+
+   header_ptr->request_id = proto_getle64(buf + PROTO_HEADER_BYTES);
+   header_ptr->first_job = proto_getle32(buf + PROTO_HEADER_BYTES + 8);
+   header_ptr->record_count = proto_getle32(buf + PROTO_HEADER_BYTES + 12);
+   header_ptr->segment_job = 0;
+
+   if ((header_ptr->flags & PROTO_FLAG_SEGMENT) != 0)
+   {
+      if (len < PROTO_SEGMENT_HEADER_BYTES)
+      {
+         fprintf(stderr, "ERROR: Datagram is too short.\n");
+         return EXIT_FAILURE;
+      }
+
+      header_bytes = PROTO_SEGMENT_HEADER_BYTES;
+      header_ptr->segment_job = proto_getle32(buf + PROTO_DGRAM_HEADER_BYTES);
+      record_bytes = ((header_ptr->opcode == PROTO_OP_AND) ||
+         (header_ptr->opcode == PROTO_OP_OR)) ? PROTO_SEGMENT_JOB_BYTES :
+         PROTO_SEGMENT_RESULT_BYTES;
+   }
+   else if (header_ptr->opcode == PROTO_OP_MISSING)
+   {
+      record_bytes = PROTO_MISSING_BYTES;
+   }
+   else if (header_ptr->opcode == PROTO_OP_CREDIT)
+   {
+      record_bytes = PROTO_CREDIT_BYTES;
+   }
+
+   // Record range must lie inside the batch and match the datagram length
+   if ((header_ptr->record_count == 0) ||
+      (header_ptr->first_job >= header_ptr->job_count) ||
+      (header_ptr->record_count > header_ptr->job_count -
+      header_ptr->first_job) || (len != header_bytes +
+      (size_t) header_ptr->record_count * record_bytes))
+   {
+      fprintf(stderr, "ERROR: Datagram record range is invalid.\n");
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int proto_dgrambytes(const char * str)
+{
+   char * end;
+   long bytes = strtol(str, &end, 10);
+
+   // Smallest datagram must hold a segment of one word
+   if ((*end != '\0') || (bytes < PROTO_SEGMENT_HEADER_BYTES +
+      PROTO_SEGMENT_JOB_BYTES) || (bytes > PROTO_MAX_DGRAM_BYTES))
+   {
+      fprintf(stderr, "ERROR: Datagram size must be between %d and %d"
+         " bytes.\n", PROTO_SEGMENT_HEADER_BYTES + PROTO_SEGMENT_JOB_BYTES,
+         PROTO_MAX_DGRAM_BYTES);
+      return -1;
+   }
+
+   return (int) bytes;
+}
+
+int proto_opcode(const char * operator, size_t len)
+{
+   if ((len == 3) && (memcmp(operator, "and", 3) == 0))
+   {
+      return PROTO_OP_AND;
+   }
+   else if ((len == 2) && (memcmp(operator, "or", 2) == 0))
+   {
+      return PROTO_OP_OR;
+   }
+
+   return -1;
+}
+
+const char * proto_opname(int opcode)
+{
+   if (opcode == PROTO_OP_AND)
+   {
+      return "and";
+   }
+   else if (opcode == PROTO_OP_OR)
+   {
+      return "or";
+   }
+
+   return "?";
+}
+
+int proto_strtoword(const char * str, size_t len, uint32_t * word_ptr)
+{
+   if ((len == 0) || (len > PROTO_MAX_WIDTH))
+   {
+      return -1;
+   }
+
+   uint32_t word = 0;
+
+   for (size_t i = 0; i < len; i++)
+   {
+      if ((str[i] != '0') && (str[i] != '1'))
+      {
+         return -1;
+      }
+      word = (word << 1) | (uint32_t) (str[i] - '0');
+   }
+
+   *word_ptr = word;
+
+   return (int) len;
+}
+
+int proto_wordtostr(uint32_t word, int width, char * str)
+{
+   // Count significant digits from the leading zeros, a zero word still
+      //needs one digit
+   int digits = (word == 0) ? 1 : 32 - __builtin_clz(word);
+
+   if (width > digits)
+   {
+      digits = (width > PROTO_MAX_WIDTH) ? PROTO_MAX_WIDTH : width;
+   }
+
+   for (int i = 0; i < digits; i++)
+   {
+      int shift = digits - 1 - i;
+      str[i] = ((shift < 32) && ((word >> shift) & 1)) ? '1' : '0';
+   }
+   str[digits] = '\0';
+
+   return digits;
+}
+
+int proto_sendall(int sock_desc, const void * buf, size_t len)
+{
+   const unsigned char * bytes = buf;
+
+   while (len > 0)
+   {
+      ssize_t sent = send(sock_desc, bytes, len, 0);
+
+      if (sent == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return EXIT_FAILURE;
+      }
+      bytes += sent;
+      len -= (size_t) sent;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+int proto_recvall(int sock_desc, void * buf, size_t len)
+{
+   unsigned char * bytes = buf;
+
+   while (len > 0)
+   {
+      ssize_t received = recv(sock_desc, bytes, len, 0);
+
+      if (received == 0)
+      {
+         return EXIT_FAILURE; // peer closed the connection
+      }
+      else if (received == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return EXIT_FAILURE;
+      }
+      bytes += received;
+      len -= (size_t) received;
+   }
+
+   return EXIT_SUCCESS;
+}
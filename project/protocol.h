@@ -0,0 +1,351 @@
+/**
+ * protocol.h
+ *
+ * Binary wire protocol shared by the client, edge server, and backend servers.
+ *
+ * Every message starts with a fixed size batch header followed by packed
+ * records. All multi-byte fields are little-endian on the wire regardless of
+ * host byte order.
+ *
+ * Header (PROTO_HEADER_BYTES):
+ *    <magic (uint32)> <version (uint8)> <op code (uint8)> <flags (uint16)>
+ *    <job count (uint32)>
+ *
+ * Datagrams between the edge server and the backend servers extend the header
+ * with the request ID of the client batch and the range of backend job
+ * numbers the datagram carries (PROTO_DGRAM_HEADER_BYTES):
+ *    <header> <request ID (uint64)> <first job number (uint32)>
+ *    <record count (uint32)>
+ *
+ * As many records as fit are packed into each datagram. Backend job numbers
+ * count the jobs sent to one backend server from 0 to job count - 1. Backend
+ * servers echo the request ID in their results so the edge server can route
+ * results to the right client batch while many batches are in flight.
+ *
+ * Client to edge server records (PROTO_OP_JOBS):
+ *    <operator (uint8)> <width 1 (uint8)> <width 2 (uint8)> <pad (uint8)>
+ *    <operand 1 (uint32)> <operand 2 (uint32)>
+ *
+ * Edge server to backend server records (PROTO_OP_AND/PROTO_OP_OR):
+ *    <width 1 (uint8)> <width 2 (uint8)> <pad (uint16)>
+ *    <operand 1 (uint32)> <operand 2 (uint32)>
+ *
+ * Backend server to edge server records (PROTO_OP_AND_RESULTS/
+ * PROTO_OP_OR_RESULTS):
+ *    <result (uint32)>
+ *
+ * Edge server to client records (PROTO_OP_RESULTS):
+ *    <result (uint32)>
+ *
+ * Results are streamed as soon as they and every earlier result are known. A
+ * client that sets PROTO_FLAG_UNORDERED in its job header instead receives
+ * each result as soon as it is known, tagged with its job index
+ * (PROTO_OP_INDEXED_RESULTS):
+ *    <job index (uint32)> <result (uint32)>
+ *
+ * Operand widths are the number of binary digits the operand was written with
+ * so that leading zeros survive the round trip.
+ *
+ * Wide jobs carry operands of any length as bit vectors of little-endian
+ * 64-bit words, least significant word first (see bitvec.h). The client sends
+ * them as one PROTO_OP_WIDE_JOBS message whose header is followed by the
+ * number of record bytes (PROTO_WIDE_HEADER_BYTES):
+ *    <header> <record bytes (uint64)>
+ * and one variable length record per job:
+ *    <operator (uint8)> <pad (uint8) x 3> <bits 1 (uint32)> <bits 2 (uint32)>
+ *    <operand 1 words> <operand 2 words>
+ *
+ * The edge server splits every wide job into segments of as many words as fit
+ * in a datagram. Segment datagrams set PROTO_FLAG_SEGMENT and extend the
+ * datagram header with the job they belong to (PROTO_SEGMENT_HEADER_BYTES):
+ *    <datagram header> <job index (uint32)> <pad (uint32)>
+ * Here job count is the number of words in the job's result, first job number
+ * is the first word of the segment, and record count is the number of words
+ * in the segment. A segment of PROTO_OP_AND/PROTO_OP_OR jobs holds its words
+ * of operand 1 followed by its words of operand 2, the shorter operand padded
+ * with zero words. Backend servers answer each segment right away with a
+ * PROTO_OP_AND_RESULTS/PROTO_OP_OR_RESULTS segment holding the result words.
+ *
+ * Datagrams can be lost, so the edge server resends the jobs of a shard whose
+ * results are overdue, setting PROTO_FLAG_POLL on the last datagram it
+ * resends. Backend servers ignore jobs they already have and answer jobs of a
+ * batch they have finished with its stored results. A backend server that
+ * gets a PROTO_FLAG_POLL datagram for a batch it is still missing jobs of
+ * answers with a PROTO_OP_MISSING datagram, whose first job number is the
+ * first missing job and whose records are the ranges of missing jobs:
+ *    <first job number (uint32)> <job count (uint32)>
+ * The edge server resends just those jobs.
+ *
+ * The edge server sends a shard in bursts that fit the backend server's
+ * receive buffer, setting PROTO_FLAG_CREDIT on the last datagram of every
+ * burst but the final one. A backend server that gets a PROTO_FLAG_CREDIT
+ * datagram for a batch it is still missing jobs of answers with a
+ * PROTO_OP_CREDIT datagram, whose first job number is the number of the
+ * batch's jobs it has received and whose one record advertises its capacity:
+ *    <receive buffer bytes (uint32)>
+ * The edge server then sends the next burst.
+ *
+ * The edge server answers with one PROTO_OP_WIDE_RESULTS message holding one
+ * record per job, in job order:
+ *    <significant bits (uint32)> <word count (uint32)> <result words>
+ * A result is printed as its significant bits, or "0" if it has none, which
+ * drops leading zeros exactly like the results of ordinary jobs.
+ *
+ * A client may send any number of batches over one connection. One that sets
+ * PROTO_FLAG_SESSION in its job headers holds a keep-alive session: every job
+ * header, after the record bytes of wide jobs, ends with a request ID of the
+ * client's choosing that no other batch of the session in flight is using:
+ *    <header> [<record bytes (uint64)>] <request ID (uint64)>
+ * The results message of the batch sets PROTO_FLAG_SESSION too and ends its
+ * header with the same request ID:
+ *    <header> <request ID (uint64)>
+ * The first batch on a connection decides whether it is a session, and every
+ * later batch must agree. The edge server may answer a session's batches in
+ * any order, each in one results message, while other connections get their
+ * results in the order their batches were sent.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTO_MAGIC 0x30353445 // "E450" in little-endian byte order
+#define PROTO_VERSION 8 // current wire protocol version
+
+#define PROTO_HEADER_BYTES 12 // number of bytes in batch header
+#define PROTO_DGRAM_HEADER_BYTES 28 // number of bytes in datagram header
+#define PROTO_CLIENT_JOB_BYTES 12 // number of bytes in client job record
+#define PROTO_BACKEND_JOB_BYTES 12 // number of bytes in backend job record
+#define PROTO_BACKEND_RESULT_BYTES 4 // number of bytes in backend result record
+#define PROTO_CLIENT_RESULT_BYTES 4 // number of bytes in client result record
+#define PROTO_INDEXED_RESULT_BYTES 8 // number of bytes in indexed result record
+#define PROTO_WIDE_HEADER_BYTES 20 // number of bytes in wide jobs header
+#define PROTO_WIDE_JOB_BYTES 12 // number of bytes before wide job operands
+#define PROTO_WIDE_RESULT_BYTES 8 // number of bytes before wide result words
+#define PROTO_SEGMENT_HEADER_BYTES 36 // number of bytes in segment header
+#define PROTO_SEGMENT_JOB_BYTES 16 // number of bytes per word of a job segment
+#define PROTO_SEGMENT_RESULT_BYTES 8 // number of bytes per result segment word
+#define PROTO_MISSING_BYTES 8 // number of bytes in missing job range record
+#define PROTO_CREDIT_BYTES 4 // number of bytes in credit record
+#define PROTO_REQUEST_ID_BYTES 8 // number of bytes in a session batch's
+   //request ID
+#define PROTO_MAX_HEADER_BYTES (PROTO_WIDE_HEADER_BYTES + \
+   PROTO_REQUEST_ID_BYTES) // largest client job or results header
+#define PROTO_MAX_WIDE_BYTES (1u << 30) // maximum record bytes of wide jobs
+
+#define PROTO_DGRAM_BYTES 1472 // default datagram size, fits a 1500 byte MTU
+#define PROTO_MAX_DGRAM_BYTES 65507 // largest IPv4 UDP payload
+
+#define PROTO_OP_AND 1 // bitwise AND jobs
+#define PROTO_OP_OR 2 // bitwise OR jobs
+#define PROTO_OP_JOBS 3 // mixed jobs, operator stored in each record
+#define PROTO_OP_RESULTS 4 // computation results for the client
+#define PROTO_OP_AND_RESULTS 5 // bitwise AND results from a backend server
+#define PROTO_OP_OR_RESULTS 6 // bitwise OR results from a backend server
+#define PROTO_OP_INDEXED_RESULTS 7 // results for the client in any order
+#define PROTO_OP_WIDE_JOBS 8 // mixed jobs with bit vector operands
+#define PROTO_OP_WIDE_RESULTS 9 // bit vector results for the client
+#define PROTO_OP_MISSING 10 // jobs a backend server is still waiting for
+#define PROTO_OP_CREDIT 11 // jobs a backend server has received, and its
+   //receive buffer size
+
+#define PROTO_FLAG_UNORDERED 0x0001 // client accepts PROTO_OP_INDEXED_RESULTS
+#define PROTO_FLAG_SEGMENT 0x0002 // datagram carries one wide job segment
+#define PROTO_FLAG_POLL 0x0004 // resent datagram, report any missing jobs
+#define PROTO_FLAG_CREDIT 0x0008 // last of a burst, report jobs received
+#define PROTO_FLAG_SESSION 0x0010 // batch of a keep-alive session, its header
+   //ends with the client's request ID
+
+#define PROTO_MAX_WIDTH 32 // maximum number of binary digits in an operand
+
+/**
+ * struct to store a decoded batch header
+ */
+struct proto_header {
+   uint32_t magic;
+   uint8_t version;
+   uint8_t opcode;
+   uint16_t flags;
+   uint32_t job_count;
+   uint64_t request_id; // datagram headers only
+   uint32_t first_job; // datagram headers only
+   uint32_t record_count; // datagram headers only
+   uint32_t segment_job; // segment datagrams only
+};
+
+/**
+ * proto_putle16 stores a 16 bit value in little-endian byte order.
+ * @param buf pointer to destination bytes
+ * @param val uint16_t value
+ */
+void proto_putle16(unsigned char * buf, uint16_t val);
+
+/**
+ * proto_putle32 stores a 32 bit value in little-endian byte order.
+ * @param buf pointer to destination bytes
+ * @param val uint32_t value
+ */
+void proto_putle32(unsigned char * buf, uint32_t val);
+
+/**
+ * proto_putle64 stores a 64 bit value in little-endian byte order.
+ * @param buf pointer to destination bytes
+ * @param val uint64_t value
+ */
+void proto_putle64(unsigned char * buf, uint64_t val);
+
+/**
+ * proto_getle16 loads a 16 bit value stored in little-endian byte order.
+ * @param buf pointer to source bytes
+ * @return uint16_t value
+ */
+uint16_t proto_getle16(const unsigned char * buf);
+
+/**
+ * proto_getle32 loads a 32 bit value stored in little-endian byte order.
+ * @param buf pointer to source bytes
+ * @return uint32_t value
+ */
+uint32_t proto_getle32(const unsigned char * buf);
+
+/**
+ * proto_getle64 loads a 64 bit value stored in little-endian byte order.
+ * @param buf pointer to source bytes
+ * @return uint64_t value
+ */
+uint64_t proto_getle64(const unsigned char * buf);
+
+/**
+ * proto_packheader writes a batch header for the current protocol version.
+ * @param buf pointer to at least PROTO_HEADER_BYTES destination bytes
+ * @param opcode int PROTO_OP_* value
+ * @param flags uint16_t PROTO_FLAG_* values
+ * @param job_count uint32_t number of jobs in the batch
+ */
+void proto_packheader(unsigned char * buf, int opcode, uint16_t flags,
+   uint32_t job_count);
+
+/**
+ * proto_unpackheader reads and validates a batch header.
+ * @param buf pointer to PROTO_HEADER_BYTES source bytes
+ * @param header_ptr pointer to struct proto_header
+ * @return int 0 if successful, 1 if the magic or version is wrong
+ */
+int proto_unpackheader(const unsigned char * buf,
+   struct proto_header * header_ptr);
+
+/**
+ * proto_headerbytes returns the size of a client job or results header,
+ * including the record bytes of wide jobs and the request ID of a session
+ * batch.
+ * @param opcode int PROTO_OP_* value
+ * @param flags uint16_t PROTO_FLAG_* values
+ * @return size_t number of bytes in the header
+ */
+size_t proto_headerbytes(int opcode, uint16_t flags);
+
+/**
+ * proto_packdgramheader writes a datagram header for the current protocol
+ * version.
+ * @param buf pointer to at least PROTO_DGRAM_HEADER_BYTES destination bytes
+ * @param opcode int PROTO_OP_* value
+ * @param request_id uint64_t ID of the client batch the datagram belongs to
+ * @param job_count uint32_t number of jobs in the batch
+ * @param first_job uint32_t job number of the first record in the datagram
+ * @param record_count uint32_t number of records in the datagram
+ */
+void proto_packdgramheader(unsigned char * buf, int opcode,
+   uint64_t request_id, uint32_t job_count, uint32_t first_job,
+   uint32_t record_count);
+
+/**
+ * proto_packsegheader writes the header of a wide job segment datagram.
+ * @param buf pointer to at least PROTO_SEGMENT_HEADER_BYTES destination bytes
+ * @param opcode int PROTO_OP_* value
+ * @param request_id uint64_t ID of the client batch the segment belongs to
+ * @param job uint32_t index of the wide job in the client batch
+ * @param num_words uint32_t number of words in the job's result
+ * @param first_word uint32_t first word of the segment
+ * @param segment_words uint32_t number of words in the segment
+ */
+void proto_packsegheader(unsigned char * buf, int opcode, uint64_t request_id,
+   uint32_t job, uint32_t num_words, uint32_t first_word,
+   uint32_t segment_words);
+
+/**
+ * proto_unpackdgramheader reads and validates a datagram header, including
+ * the job index of a segment datagram.
+ * @param buf pointer to received datagram
+ * @param len size_t number of bytes received
+ * @param record_bytes size_t number of bytes in each record; segments have
+ *    PROTO_SEGMENT_JOB_BYTES or PROTO_SEGMENT_RESULT_BYTES per word instead,
+ *    according to their op code, and PROTO_OP_MISSING and PROTO_OP_CREDIT
+ *    datagrams have PROTO_MISSING_BYTES and PROTO_CREDIT_BYTES
+ * @param header_ptr pointer to struct proto_header
+ * @return int 0 if successful, 1 if the datagram is malformed
+ */
+int proto_unpackdgramheader(const unsigned char * buf, size_t len,
+   size_t record_bytes, struct proto_header * header_ptr);
+
+/**
+ * proto_dgrambytes parses and validates a datagram size argument.
+ * @param str pointer to c string containing a number of bytes
+ * @return int datagram size, -1 if the size is invalid
+ */
+int proto_dgrambytes(const char * str);
+
+/**
+ * proto_opcode converts an operator name to its op code.
+ * @param operator pointer to operator name ("and" or "or")
+ * @param len size_t number of characters in the name
+ * @return int PROTO_OP_AND or PROTO_OP_OR, -1 if the operator is invalid
+ */
+int proto_opcode(const char * operator, size_t len);
+
+/**
+ * proto_opname converts an op code to its operator name.
+ * @param opcode int PROTO_OP_AND or PROTO_OP_OR
+ * @return const char * operator c string, "?" if the op code is invalid
+ */
+const char * proto_opname(int opcode);
+
+/**
+ * proto_strtoword parses a string of binary digits into a word.
+ * @param str pointer to binary digits
+ * @param len size_t number of digits
+ * @param word_ptr pointer to uint32_t result
+ * @return int number of digits parsed, -1 if str is not a valid operand
+ */
+int proto_strtoword(const char * str, size_t len, uint32_t * word_ptr);
+
+/**
+ * proto_wordtostr formats a word as a string of binary digits.
+ * @param word uint32_t value
+ * @param width int minimum number of digits up to PROTO_MAX_WIDTH, 0 to drop
+ *    all leading zeros
+ * @param str pointer to at least PROTO_MAX_WIDTH + 1 bytes
+ * @return int number of digits written
+ */
+int proto_wordtostr(uint32_t word, int width, char * str);
+
+/**
+ * proto_sendall sends an entire buffer on a stream socket.
+ * @param sock_desc int connected stream socket descriptor
+ * @param buf pointer to bytes to send
+ * @param len size_t number of bytes to send
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int proto_sendall(int sock_desc, const void * buf, size_t len);
+
+/**
+ * proto_recvall receives exactly len bytes from a stream socket.
+ * @param sock_desc int connected stream socket descriptor
+ * @param buf pointer to destination bytes
+ * @param len size_t number of bytes to receive
+ * @return int 0 if successful, 1 if unsuccessful or the peer closed early
+ */
+int proto_recvall(int sock_desc, void * buf, size_t len);
+
+#endif
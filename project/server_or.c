@@ -4,9 +4,52 @@
  * Receives bitwise OR operation jobs from the edge server, completes the
  * jobs, and sends the results to the edge server.
  *
- * Usage: ./server_or
+ * Usage: ./server_or [-a] [-g] [-m datagram_bytes] [-t threads] [-p]
+ *    [-P port] [-r rcvbuf_bytes] [-s sndbuf_bytes] [-q] [-S stats_port] [-U]
+ *
+ * -a use the legacy fixed-width ASCII protocol instead of the binary protocol
+ * -g use UDP segmentation offload (UDP_SEGMENT/UDP_GRO) if the kernel has it
+ * -m maximum size of datagrams sent to the edge server (default 1472)
+ * -t number of worker threads (default 1)
+ * -p pin each worker thread to its own CPU
+ * -P port to listen on (default 21926), so several replicas can share a host
+ * -r SO_RCVBUF size asked for each socket (default: the kernel's)
+ * -s SO_SNDBUF size asked for each socket (default: the kernel's)
+ * -q quiet, log the summary lines of each batch but not one line per job
+ * -S serve stage latency histograms and counters on this 127.0.0.1 port
+ * -U receive datagrams through io_uring if the kernel has it (see dgramio.h),
+ *    with recvmmsg otherwise
+ *
+ * Every worker thread logs into a ring buffer of its own that a background
+ * thread writes to stdout (see logger.h), so printing never stalls a worker.
+ * How long each stage of every batch takes is recorded in histograms all the
+ * worker threads share (see stats.h).
+ *
+ * Segments of wide jobs (bit vectors of any length) are computed with the
+ * widest OR kernel the CPU supports and answered as soon as they arrive.
+ *
+ * With more than one worker thread, every thread binds its own socket to the
+ * OR port with SO_REUSEPORT and the kernel spreads the edge server's sockets
+ * across them. All datagrams from one edge server socket reach the same
+ * thread, so each thread receives, computes, and answers whole batches on its
+ * own without sharing any state.
+ *
+ * Datagrams from the edge server may be lost or arrive twice. Jobs that have
+ * already arrived are ignored, and the results of the last MAX_FINISHED
+ * batches are kept so jobs the edge server resends after a batch is finished
+ * are answered without computing them again. A resent datagram flagged
+ * PROTO_FLAG_POLL for a batch that is still missing jobs is answered with the
+ * ranges of jobs that are missing.
+ *
+ * The edge server sends a large batch in bursts that fit this server's
+ * receive buffer, so no job is dropped while a worker is busy computing. The
+ * last datagram of a burst is flagged PROTO_FLAG_CREDIT and answered with the
+ * number of the batch's jobs received so far and the receive buffer size,
+ * which tells the edge server it may send the next burst.
  */
 
+#define _GNU_SOURCE // SO_REUSEPORT, pthread_setaffinity_np
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -19,14 +62,22 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include <stdbool.h>
 
-#define RECV_BYTES 29 // number of bytes received from edge server
-#define SEND_BYTES 14 // number of bytes sent to edge server
+#include "protocol.h"
+#include "dgramio.h"
+#include "bitvec.h"
+#include "logger.h"
+#include "stats.h"
 
-#define OPERAND_BYTES 10 // maximum number of bytes used by operand
-#define RESULT_BYTES 10 // maximum number of bytes used by result
+#define RECV_BYTES 29 // number of bytes received from edge server (ASCII)
+#define SEND_BYTES 14 // number of bytes sent to edge server (ASCII)
+
+#define OPERAND_BYTES 10 // maximum number of bytes used by operand (ASCII)
 
 #define OR_IP "127.0.0.1" // OR server IPv4 address
 #define OR_PORT 21926 // OR server datagram socket port number
@@ -34,24 +85,141 @@
 #define EDGE_IP "127.0.0.1" // edge server IPv4 address
 #define EDGE_PORT 24926 // edge server datagram socket port number
 
+#define MAX_PENDING 64 // maximum number of batches being received at once
+#define MAX_FINISHED 64 // number of finished batches whose results are kept
+#define PENDING_TIMEOUT_USEC 1000000 // age at which a batch still missing
+   //jobs may make way for a new one
+#define MAX_THREADS 64 // maximum number of worker threads
+
+#define STAGE_RECVJOBS 0 // first datagram of a batch until all its jobs arrived
+#define STAGE_COMPUTE 1 // computing the batch's jobs
+#define STAGE_SENDRESULTS 2 // sending the batch's results
+#define STAGE_BATCH 3 // first datagram of a batch until its results are sent
+#define NUM_STAGES 4
+
+#define COUNTER_BATCHES 0 // batches answered
+#define COUNTER_JOBS 1 // jobs answered
+#define COUNTER_SEGMENTS 2 // wide job segments answered
+#define COUNTER_BYTES_RECEIVED 3 // bytes of datagrams received
+#define COUNTER_BYTES_SENT 4 // bytes of datagrams sent
+#define COUNTER_RESULTS_RESENT 5 // results sent again for resent jobs
+#define COUNTER_BATCHES_DROPPED 6 // batches abandoned while missing jobs
+#define COUNTER_DATAGRAMS_DROPPED 7 // datagrams turned away for lack of room
+#define NUM_COUNTERS 8
+
 /**
  * struct to store OR job data
  */
 struct or_job {
    int job_number; 
-   char operand1[OPERAND_BYTES + 1];
-   char operand2[OPERAND_BYTES + 1];
-   char result[RESULT_BYTES + 1]; 
+   uint8_t width1; // number of digits operand1 was written with
+   uint8_t width2; // number of digits operand2 was written with
+   uint32_t operand1;
+   uint32_t operand2;
+   uint32_t result;
+};
+
+/**
+ * struct to store a batch of OR jobs while its datagrams arrive
+ */
+struct or_batch {
+   uint64_t request_id; // ID the edge server gave the client batch
+   struct sockaddr_in edge_addr; // socket address the results are sent to
+   struct or_job * or_jobs; // NULL if the slot is free
+   unsigned char * received; // nonzero for each job number that has arrived
+   int num_or_jobs;
+   int num_received;
+   uint64_t last_usec; // time the batch's latest datagram arrived
+   uint64_t first_nsec; // time the batch's first datagram arrived
+};
+
+/**
+ * struct to store the results of a finished batch
+ */
+struct or_done {
+   uint64_t request_id;
+   struct sockaddr_in edge_addr;
+   uint32_t * results; // NULL if the slot is free
+   int num_or_jobs;
+};
+
+/**
+ * struct to store a worker thread and the socket it serves
+ */
+struct worker {
+   pthread_t thread;
+   int sock_desc;
+   int cpu; // CPU the thread is pinned to, -1 if not pinned
+   bool gso; // send with UDP_SEGMENT
 };
 
 /**
- * setupsocket creates a datagram socket and binds it.
+ * struct to store command line options
+ */
+struct options {
+   bool ascii; // use the legacy ASCII protocol
+   bool offload; // use UDP segmentation offload
+   int dgram_bytes; // maximum size of datagrams sent to edge server
+   int threads; // number of worker threads
+   bool pin; // pin each worker thread to its own CPU
+   int port; // port number to listen on
+   int rcvbuf; // SO_RCVBUF bytes to ask for, 0 for the default
+   int sndbuf; // SO_SNDBUF bytes to ask for, 0 for the default
+   bool quiet; // log summary lines only, not one line per job
+   int stats_port; // localhost port of the stats endpoint, 0 for none
+   bool uring; // receive datagrams through io_uring
+};
+
+static struct options opts = {false, false, PROTO_DGRAM_BYTES, 1, false,
+   OR_PORT, 0, 0, false, 0, false};
+
+static struct stats or_stats; // stage latencies and counters, shared by
+   //every worker thread
+static const char * const stage_names[NUM_STAGES] = {"recvjobs", "compute",
+   "sendresults", "batch"};
+static const char * const counter_names[NUM_COUNTERS] = {"batches", "jobs",
+   "segments", "bytes_received", "bytes_sent", "results_resent",
+   "batches_dropped", "datagrams_dropped"};
+
+static int rcvbuf_bytes; // receive buffer size granted to each socket
+static int sndbuf_bytes; // send buffer size granted to each socket
+
+// Every worker thread has its own datagram queues and pending batches
+static __thread struct dgram_tx edge_tx; // datagrams queued for edge server
+static __thread struct dgram_rx edge_rx; // datagrams received from edge server
+
+static __thread struct or_batch pending[MAX_PENDING]; // batches being received
+static __thread struct or_done finished[MAX_FINISHED]; // recent results
+static __thread int next_finished; // slot of finished to fill next
+
+/**
+ * setupsocket creates a datagram socket and binds it, sharing the port with
+ * the other worker threads' sockets when there is more than one.
  * @return int socket descriptor, -1 if unsuccessful
  */
 int setupsocket();
 
 /**
- * recvorjob receives an OR job from the edge server.
+ * pincpus chooses a CPU for each worker thread from the CPUs the process may
+ * run on, in turn.
+ * @param workers worker array
+ * @param num_workers int number of workers
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int pincpus(struct worker workers[], int num_workers);
+
+/**
+ * serveorjobs is the body of a worker thread: it receives jobs on the
+ * worker's socket, performs the bitwise OR operations, and sends the results
+ * back to the edge server until the process is killed.
+ * @param worker_ptr pointer to struct worker
+ * @return void * NULL if the worker fails to start
+ */
+void * serveorjobs(void * worker_ptr);
+
+/**
+ * recvorjob receives an OR job from the edge server using the ASCII
+ * protocol.
  * @param sock_desc int datagram socket descriptor
  * @param edge_addr_ptr pointer to edge server socket address
  * @param edge_addr_len socklen_t length of socket address
@@ -61,6 +229,101 @@ int setupsocket();
 int recvorjob(int sock_desc, struct sockaddr_in * edge_addr_ptr,
    socklen_t edge_addr_len, struct or_job * or_job_ptr);
 
+/**
+ * recvorjobs receives OR jobs from the edge server until a batch is
+ * complete. Datagrams of different batches may arrive interleaved.
+ * @param sock_desc int datagram socket descriptor
+ * @param edge_addr_ptr pointer to socket address the batch came from
+ * @param edge_addr_len socklen_t length of socket address
+ * @param num_or_jobs_ptr pointer to int number of OR jobs
+ * @param request_id_ptr pointer to uint64_t request ID of the batch
+ * @param first_nsec_ptr pointer to uint64_t time the batch's first datagram
+ *    arrived
+ * @return struct or_job * allocated array of OR jobs, NULL if unsuccessful
+ */
+struct or_job * recvorjobs(int sock_desc, struct sockaddr_in * edge_addr_ptr,
+   socklen_t edge_addr_len, int * num_or_jobs_ptr, uint64_t * request_id_ptr,
+   uint64_t * first_nsec_ptr);
+
+/**
+ * findbatch finds the pending batch a datagram belongs to, starting a new
+ * batch for a request ID not seen before.
+ * @param header_ptr pointer to struct proto_header of the datagram
+ * @param edge_addr_ptr pointer to socket address the datagram came from
+ * @return struct or_batch * pending batch, NULL if unsuccessful
+ */
+struct or_batch * findbatch(struct proto_header * header_ptr,
+   struct sockaddr_in * edge_addr_ptr);
+
+/**
+ * findfinished finds the finished batch a datagram belongs to.
+ * @param header_ptr pointer to struct proto_header of the datagram
+ * @param edge_addr_ptr pointer to socket address the datagram came from
+ * @return struct or_done * finished batch, NULL if there is none
+ */
+struct or_done * findfinished(struct proto_header * header_ptr,
+   struct sockaddr_in * edge_addr_ptr);
+
+/**
+ * keepresults stores the results of a finished batch, replacing the oldest
+ * stored batch.
+ * @param edge_addr_ptr pointer to socket address the batch came from
+ * @param or_jobs or_job array
+ * @param num_or_jobs int number of OR jobs
+ * @param request_id uint64_t request ID of the batch
+ */
+void keepresults(struct sockaddr_in * edge_addr_ptr,
+   struct or_job or_jobs[], int num_or_jobs, uint64_t request_id);
+
+/**
+ * resendresults queues the stored results of the jobs a resent datagram
+ * carries.
+ * @param sock_desc int datagram socket descriptor
+ * @param done_ptr pointer to struct or_done
+ * @param header_ptr pointer to struct proto_header of the resent datagram
+ * @param edge_addr_ptr pointer to socket address the datagram came from
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int resendresults(int sock_desc, struct or_done * done_ptr,
+   struct proto_header * header_ptr, struct sockaddr_in * edge_addr_ptr);
+
+/**
+ * sendmissing queues a datagram listing the ranges of jobs a batch is still
+ * missing, as many as fit.
+ * @param sock_desc int datagram socket descriptor
+ * @param batch_ptr pointer to struct or_batch
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int sendmissing(int sock_desc, struct or_batch * batch_ptr);
+
+/**
+ * sendcredit queues a datagram telling the edge server how many of a batch's
+ * jobs have arrived and how large the receive buffer is.
+ * @param sock_desc int datagram socket descriptor
+ * @param batch_ptr pointer to struct or_batch
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int sendcredit(int sock_desc, struct or_batch * batch_ptr);
+
+/**
+ * nowusec reads the monotonic clock.
+ * @return uint64_t time in microseconds
+ */
+uint64_t nowusec();
+
+/**
+ * orsegment computes one segment of a wide OR job and queues the result
+ * segment for the edge server. Segments need no batch state, so each one is
+ * answered as soon as it arrives.
+ * @param sock_desc int datagram socket descriptor
+ * @param header_ptr pointer to struct proto_header of the segment
+ * @param buffer pointer to received segment datagram
+ * @param edge_addr_ptr pointer to socket address the segment came from
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int orsegment(int sock_desc, struct proto_header * header_ptr,
+   const unsigned char * buffer, struct sockaddr_in * edge_addr_ptr);
+
 /**
  * orcalculation performs the bitwise OR calculation for an or_job array.
  * @param or_jobs or_job array
@@ -74,31 +337,283 @@ int orcalculation(struct or_job or_jobs[], int num_or_jobs);
  * @param sock_desc int datagram socket descriptor
  * @param edge_addr_ptr pointer to edge server datagram socket address
  * @param or_jobs or_job array
- * @param num_jobs int number of jobs
  * @param num_or_jobs int number of OR jobs
+ * @param request_id uint64_t request ID of the batch
  * @return int 0 if successful, 1 if unsuccessful
  */
 int sendresults(int sock_desc, struct sockaddr_in * edge_addr_ptr,
-   struct or_job or_jobs[], int num_or_jobs);
+   struct or_job or_jobs[], int num_or_jobs, uint64_t request_id);
 
 /**
  * main
- * socket is setup, jobs are received from the edge server, bitwise OR
- * operation jobs are completed, and the results are sent back to the edge
- * server.
+ * sockets are setup and each one is served by a worker thread: jobs are
+ * received from the edge server, bitwise OR operation jobs are completed,
+ * and the results are sent back to the edge server.
  * @param argc int number of arguments
  * @param argv pointer to array of c string argument pointers
  * @return int 0 if successful, 1 if unsuccessful
  */
-int main(void)
+int main(int argc, char * argv[])
 {
-   // Setup datagram socket
-   int sock_desc;
-   if ((sock_desc = setupsocket()) == -1)
+   // Check command line arguments
+   int opt;
+
+   while ((opt = getopt(argc, argv, "agm:t:pP:r:s:qS:U")) != -1)
+   {
+      switch (opt)
+      {
+         case 'a':
+            opts.ascii = true;
+            break;
+         case 'g':
+            opts.offload = true;
+            break;
+         case 'm':
+            if ((opts.dgram_bytes = proto_dgrambytes(optarg)) == -1)
+            {
+               return EXIT_FAILURE;
+            }
+            break;
+         case 't':
+            opts.threads = atoi(optarg);
+            if ((opts.threads < 1) || (opts.threads > MAX_THREADS))
+            {
+               fprintf(stderr, "ERROR: Number of threads must be 1 to %d.\n",
+                  MAX_THREADS);
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'p':
+            opts.pin = true;
+            break;
+         case 'P':
+            opts.port = atoi(optarg);
+            if ((opts.port < 1) || (opts.port > 65535))
+            {
+               fprintf(stderr, "ERROR: Port must be 1 to 65535.\n");
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'r':
+            if ((opts.rcvbuf = dgram_sockbufbytes(optarg)) == -1)
+            {
+               return EXIT_FAILURE;
+            }
+            break;
+         case 's':
+            if ((opts.sndbuf = dgram_sockbufbytes(optarg)) == -1)
+            {
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'q':
+            opts.quiet = true;
+            break;
+         case 'S':
+            opts.stats_port = atoi(optarg);
+            if ((opts.stats_port < 1) || (opts.stats_port > 65535))
+            {
+               fprintf(stderr, "ERROR: Stats port must be 1 to 65535.\n");
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'U':
+            opts.uring = true;
+            break;
+         default:
+            fprintf(stderr, "ERROR: Usage: %s [-a] [-g] [-m datagram_bytes]"
+               " [-t threads] [-p] [-P port] [-r rcvbuf_bytes]"
+               " [-s sndbuf_bytes] [-q] [-S stats_port] [-U]\n", argv[0]);
+            return EXIT_FAILURE;
+      }
+   }
+
+   if (opts.ascii && (opts.threads > 1))
    {
+      fprintf(stderr, "ERROR: Worker threads need the binary protocol.\n");
       return EXIT_FAILURE;
    }
 
+   if (opts.ascii && opts.uring)
+   {
+      fprintf(stderr, "ERROR: io_uring (-U) requires the binary protocol.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (logger_init(opts.quiet ? LOGGER_INFO : LOGGER_JOB) == EXIT_FAILURE)
+   {
+      return EXIT_FAILURE;
+   }
+
+   if ((stats_init(&or_stats, "OR server", stage_names, NUM_STAGES,
+      counter_names, NUM_COUNTERS) == EXIT_FAILURE) ||
+      ((opts.stats_port != 0) && (stats_serve(&or_stats, opts.stats_port)
+      == EXIT_FAILURE)))
+   {
+      return EXIT_FAILURE;
+   }
+
+   // Setup one datagram socket per worker thread
+   struct worker workers[MAX_THREADS];
+
+   for (int i = 0; i < opts.threads; i++)
+   {
+      workers[i].cpu = -1;
+      workers[i].gso = false;
+
+      if ((workers[i].sock_desc = setupsocket()) == -1)
+      {
+         return EXIT_FAILURE;
+      }
+
+      if (opts.offload)
+      {
+         bool gro = false;
+
+         dgram_enableoffload(workers[i].sock_desc, &workers[i].gso, &gro);
+
+         if (i == 0)
+         {
+            logger_printf(LOGGER_INFO, "The OR server is using UDP_SEGMENT %s"
+               " and UDP_GRO %s.\n", workers[i].gso ? "on" : "off", gro ? "on" :
+               "off");
+         }
+      }
+   }
+
+   // Print message indicating OR server is up and running
+   logger_printf(LOGGER_INFO, "The OR server is up and running using UDP on"
+      " port %d.\n", opts.port);
+   logger_printf(LOGGER_INFO, "The OR server's sockets have %d byte receive"
+      " and %d byte send buffers.\n", rcvbuf_bytes, sndbuf_bytes);
+
+   if (!opts.ascii)
+   {
+      logger_printf(LOGGER_INFO, "The OR server is using the %s bit vector"
+         " kernel.\n", bitvec_kernel());
+   }
+
+   if (opts.stats_port != 0)
+   {
+      logger_printf(LOGGER_INFO, "The OR server is serving stats on 127.0.0.1"
+         " port %d.\n", opts.stats_port);
+   }
+
+   // Every worker sets up a ring of its own, see whether the kernel allows it
+   if (opts.uring)
+   {
+      struct uring probe;
+
+      if (uring_init(&probe, 1) == EXIT_SUCCESS)
+      {
+         uring_free(&probe);
+         logger_printf(LOGGER_INFO, "The OR server is receiving datagrams"
+            " through io_uring.\n");
+      }
+      else
+      {
+         opts.uring = false;
+         logger_printf(LOGGER_INFO, "io_uring is not available, the OR server"
+            " is receiving datagrams with recvmmsg.\n");
+      }
+   }
+
+   if (opts.pin && (pincpus(workers, opts.threads) == EXIT_FAILURE))
+   {
+      return EXIT_FAILURE;
+   }
+
+   if (opts.threads == 1)
+   {
+      serveorjobs(&workers[0]);
+      return EXIT_FAILURE;
+   }
+
+   logger_printf(LOGGER_INFO, "The OR server is running %d worker threads.\n",
+      opts.threads);
+
+   for (int i = 0; i < opts.threads; i++)
+   {
+      if (pthread_create(&workers[i].thread, NULL, serveorjobs, &workers[i])
+         != 0)
+      {
+         fprintf(stderr, "ERROR: Failed to create worker thread.\n");
+         return EXIT_FAILURE;
+      }
+   }
+
+   // Workers only return if they fail to start
+   for (int i = 0; i < opts.threads; i++)
+   {
+      pthread_join(workers[i].thread, NULL);
+   }
+
+   return EXIT_FAILURE;
+}
+
+int pincpus(struct worker workers[], int num_workers)
+{
+   cpu_set_t allowed;
+
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+   {
+      fprintf(stderr, "ERROR: Failed to get CPU affinity.\n");
+      return EXIT_FAILURE;
+   }
+
+   int cpu = 0;
+
+   for (int i = 0; i < num_workers; i++)
+   {
+      // Next allowed CPU, wrapping around when there are more threads
+      for (int k = 0; k < CPU_SETSIZE; k++, cpu = (cpu + 1) % CPU_SETSIZE)
+      {
+         if (CPU_ISSET(cpu, &allowed))
+         {
+            break;
+         }
+      }
+
+      workers[i].cpu = cpu;
+      cpu = (cpu + 1) % CPU_SETSIZE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+void * serveorjobs(void * worker_ptr)
+{
+   struct worker * self = worker_ptr;
+   int sock_desc = self->sock_desc;
+
+   if (self->cpu != -1)
+   {
+      cpu_set_t cpus;
+
+      CPU_ZERO(&cpus);
+      CPU_SET(self->cpu, &cpus);
+
+      if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      {
+         fprintf(stderr, "ERROR: Failed to pin worker thread to CPU %d.\n",
+            self->cpu);
+      }
+   }
+
+   // Setup batched datagram I/O
+   if ((dgram_txinit(&edge_tx, self->gso) == EXIT_FAILURE) ||
+      (dgram_rxinit(&edge_rx) == EXIT_FAILURE))
+   {
+      close(sock_desc);
+      return NULL;
+   }
+
+   if (opts.uring && (dgram_rxuring(sock_desc, &edge_rx) == EXIT_FAILURE))
+   {
+      fprintf(stderr, "ERROR: Failed to set up io_uring, receiving datagrams"
+         " with recvmmsg.\n");
+   }
+
    // Specify edge server address information
    struct sockaddr_in edge_addr;
    edge_addr.sin_family = AF_INET;
@@ -111,48 +626,44 @@ int main(void)
 
    while (1)
    {
-      // Receive initial job from edge server to get number of OR jobs
-      struct or_job or_job0;
+      // Receive jobs from edge server
+      struct or_job * or_jobs;
       int num_or_jobs;
-      if ((num_or_jobs = recvorjob(sock_desc, &edge_addr, edge_addr_len,
-         &or_job0)) == -1)
-      {
-         continue;
-      }
-
-      // Print message indicating initial receipt of job(s) from edge server
-      fprintf(stdout, "The OR server has started receiving jobs from the edge"
-         " server for OR computation. The computation results are:\n");
+      uint64_t request_id = 0;
+      uint64_t first_nsec;
 
-      // Define array of structures to store job data
-      struct or_job or_jobs[num_or_jobs];
-      or_jobs[0] = or_job0;
-
-      // Receive remaining jobs from edge server
-      if (num_or_jobs > 1)
+      if ((or_jobs = recvorjobs(sock_desc, &edge_addr, edge_addr_len,
+         &num_or_jobs, &request_id, &first_nsec)) == NULL)
       {
-         for (int i = 1; i < num_or_jobs; i++)
-         {
-            if (recvorjob(sock_desc, &edge_addr, edge_addr_len, &or_jobs[i])
-               == EXIT_FAILURE)
-            {
-               continue;
-            }
-         }
+         continue;
       }
+      uint64_t compute_nsec = stats_nownsec();
 
       // Perform bitwise OR operations
       orcalculation(or_jobs, num_or_jobs);
+      uint64_t send_nsec = stats_nownsec();
+
+      // Send results to the edge server socket the jobs came from
+      sendresults(sock_desc, &edge_addr, or_jobs, num_or_jobs, request_id);
+      uint64_t done_nsec = stats_nownsec();
+
+      stats_record(&or_stats, STAGE_RECVJOBS, compute_nsec - first_nsec);
+      stats_record(&or_stats, STAGE_COMPUTE, send_nsec - compute_nsec);
+      stats_record(&or_stats, STAGE_SENDRESULTS, done_nsec - send_nsec);
+      stats_record(&or_stats, STAGE_BATCH, done_nsec - first_nsec);
+      stats_count(&or_stats, COUNTER_BATCHES, 1);
+      stats_count(&or_stats, COUNTER_JOBS, (unsigned long) num_or_jobs);
+      dgram_printcounters("OR server", num_or_jobs);
 
-      // Send results to edge server
-      if ((sendresults(sock_desc, &edge_addr, or_jobs, num_or_jobs))
-         == EXIT_FAILURE)
+      if (!opts.ascii)
       {
-         continue;
+         keepresults(&edge_addr, or_jobs, num_or_jobs, request_id);
       }
+
+      free(or_jobs);
    }
 
-   return EXIT_SUCCESS;
+   return NULL;
 }
 
 int setupsocket()
@@ -176,11 +687,20 @@ int setupsocket()
       close(sock_desc);
       return -1;
    }
+
+   // Let every worker thread bind its own socket to the port
+   if ((opts.threads > 1) && (setsockopt(sock_desc, SOL_SOCKET, SO_REUSEPORT,
+      &yes, sizeof(int)) == -1))
+   {
+      fprintf(stderr, "ERROR: setsockopt for SO_REUSEPORT failed.\n");
+      close(sock_desc);
+      return -1;
+   }
    
    // Specify socket address information
    struct sockaddr_in or_addr;
    or_addr.sin_family = AF_INET;
-   or_addr.sin_port = htons(OR_PORT); // store in network byte order
+   or_addr.sin_port = htons(opts.port); // store in network byte order
    or_addr.sin_addr.s_addr = inet_addr(OR_IP);
    memset(or_addr.sin_zero, '\0', sizeof(or_addr.sin_zero)); // allows for
       //typecasting
@@ -192,10 +712,14 @@ int setupsocket()
       close(sock_desc);
       return -1;
    }
-   
-   // Print message indicating OR server is up and running
-   fprintf(stdout, "The OR server is up and running using UDP on port %d.\n",
-      OR_PORT);
+
+   // Every socket asks for the same sizes, so every one is granted the same
+   if (dgram_setbuffers(sock_desc, opts.rcvbuf, opts.sndbuf, &rcvbuf_bytes,
+      &sndbuf_bytes) == EXIT_FAILURE)
+   {
+      close(sock_desc);
+      return -1;
+   }
 
    return sock_desc;
 }
@@ -212,97 +736,486 @@ int recvorjob(int sock_desc, struct sockaddr_in * edge_addr_ptr,
       return -1;
    }
    buffer[RECV_BYTES] = '\0'; // append null character to buffer
+   dgram_counters.recv_calls++;
+   dgram_counters.datagrams_received++;
+   stats_count(&or_stats, COUNTER_BYTES_RECEIVED, RECV_BYTES);
 
    int num_or_jobs;
+   char operand1[OPERAND_BYTES + 1];
+   char operand2[OPERAND_BYTES + 1];
+   int width1;
+   int width2;
 
-   // Extract data from edge server message
-   if (sscanf(buffer, "%s %s %d %d", or_job_ptr->operand1,
-      or_job_ptr->operand2, &(or_job_ptr->job_number), &num_or_jobs) != 4)
+   // Extract data from edge server message and parse operands into words
+   if ((sscanf(buffer, "%10s %10s %d %d", operand1, operand2,
+      &(or_job_ptr->job_number), &num_or_jobs) != 4) ||
+      ((width1 = proto_strtoword(operand1, strlen(operand1),
+      &or_job_ptr->operand1)) == -1) ||
+      ((width2 = proto_strtoword(operand2, strlen(operand2),
+      &or_job_ptr->operand2)) == -1))
    {
       fprintf(stderr, "ERROR: Failed to extract fields from job message.\n");
       return -1;
    }
+   or_job_ptr->width1 = (uint8_t) width1;
+   or_job_ptr->width2 = (uint8_t) width2;
 
    return num_or_jobs;
 }
 
-int orcalculation(struct or_job or_jobs[], int num_or_jobs)
+struct or_job * recvorjobs(int sock_desc, struct sockaddr_in * edge_addr_ptr,
+   socklen_t edge_addr_len, int * num_or_jobs_ptr, uint64_t * request_id_ptr,
+   uint64_t * first_nsec_ptr)
 {
-   for (int i = 0; i < num_or_jobs; i++)
+   struct or_job * or_jobs;
+   int num_or_jobs;
+
+   if (opts.ascii)
    {
-      char result[11] = "";
-      char large_op[11];
-      char small_op[11];
-      bool msb_found = false;
+      // Receive initial job from edge server to get number of OR jobs
+      struct or_job or_job0;
 
-      if (strlen(or_jobs[i].operand1) >= strlen(or_jobs[i].operand2))
+      if ((num_or_jobs = recvorjob(sock_desc, edge_addr_ptr, edge_addr_len,
+         &or_job0)) < 1)
       {
-         strcpy(large_op, or_jobs[i].operand1);
-         strcpy(small_op, or_jobs[i].operand2);
+         return NULL;
       }
-      else
+      *first_nsec_ptr = stats_nownsec();
+
+      // Print message indicating initial receipt of job(s) from edge server
+      logger_printf(LOGGER_INFO, "The OR server has started receiving jobs"
+         " from the edge server for OR computation. The computation results"
+         " are:\n");
+
+      if ((or_jobs = malloc(num_or_jobs * sizeof(struct or_job))) == NULL)
       {
-         strcpy(large_op, or_jobs[i].operand2);
-         strcpy(small_op, or_jobs[i].operand1);
+         fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+         return NULL;
       }
+      or_jobs[0] = or_job0;
 
-      for (int j = 0; j < strlen(large_op) - strlen(small_op); j++)
+      // Receive remaining jobs from edge server
+      for (int i = 1; i < num_or_jobs; i++)
       {
-         if (large_op[j] == '1')
-         {
-            strcat(result, "1");
-            msb_found = true;
-         }
-         else if (msb_found)
+         recvorjob(sock_desc, edge_addr_ptr, edge_addr_len, &or_jobs[i]);
+      }
+
+      *num_or_jobs_ptr = num_or_jobs;
+
+      return or_jobs;
+   }
+
+   // Receive datagrams until every job in some batch has arrived
+   while (1)
+   {
+      unsigned char * buffer;
+      ssize_t len;
+      struct proto_header header;
+      struct sockaddr_in src_addr;
+      struct or_batch * batch_ptr;
+      struct or_done * done_ptr;
+
+      // Send queued segment results before waiting for more datagrams
+      if (!dgram_rxpending(&edge_rx) &&
+         (dgram_txflush(sock_desc, &edge_tx) == EXIT_FAILURE))
+      {
+         fprintf(stderr, "ERROR: Failed to send results to edge server.\n");
+      }
+
+      if ((len = dgram_recv(sock_desc, &edge_rx, &buffer, &src_addr)) == -1)
+      {
+         fprintf(stderr, "ERROR: Failed to receive jobs from edge server.\n");
+         return NULL;
+      }
+      stats_count(&or_stats, COUNTER_BYTES_RECEIVED, (unsigned long) len);
+
+      if ((proto_unpackdgramheader(buffer, (size_t) len,
+         PROTO_BACKEND_JOB_BYTES, &header) == EXIT_FAILURE) ||
+         (header.opcode != PROTO_OP_OR))
+      {
+         fprintf(stderr, "ERROR: Failed to extract fields from job message.\n");
+         continue;
+      }
+
+      if ((header.flags & PROTO_FLAG_SEGMENT) != 0)
+      {
+         orsegment(sock_desc, &header, buffer, &src_addr);
+         continue;
+      }
+
+      // The results of a finished batch were lost on the way back
+      if ((done_ptr = findfinished(&header, &src_addr)) != NULL)
+      {
+         resendresults(sock_desc, done_ptr, &header, &src_addr);
+         continue;
+      }
+
+      if ((batch_ptr = findbatch(&header, &src_addr)) == NULL)
+      {
+         continue;
+      }
+
+      // Extract data from each record the batch does not have yet
+      for (uint32_t k = 0; k < header.record_count; k++)
+      {
+         unsigned char * record = buffer + PROTO_DGRAM_HEADER_BYTES +
+            k * PROTO_BACKEND_JOB_BYTES;
+         int job_number = (int) (header.first_job + k);
+         struct or_job * or_job_ptr = &batch_ptr->or_jobs[job_number];
+
+         if (batch_ptr->received[job_number])
          {
-            strcat(result, "0");
+            continue; // resent or duplicated datagram
          }
-      } 
+         batch_ptr->received[job_number] = 1;
+         batch_ptr->num_received++;
 
-      for (int j = strlen(large_op) - strlen(small_op); j < strlen(large_op);
-         j++)
+         or_job_ptr->job_number = job_number;
+         or_job_ptr->width1 = record[0] > PROTO_MAX_WIDTH ? 0 : record[0];
+         or_job_ptr->width2 = record[1] > PROTO_MAX_WIDTH ? 0 : record[1];
+         or_job_ptr->operand1 = proto_getle32(record + 4);
+         or_job_ptr->operand2 = proto_getle32(record + 8);
+      }
+      batch_ptr->last_usec = nowusec();
+
+      if (batch_ptr->num_received == batch_ptr->num_or_jobs)
       {
-         if ((large_op[j] == '1') || (small_op[j - (strlen(large_op) -
-            strlen(small_op))] == '1'))
+         // Hand the batch over and free its slot
+         or_jobs = batch_ptr->or_jobs;
+         *num_or_jobs_ptr = batch_ptr->num_or_jobs;
+         *request_id_ptr = batch_ptr->request_id;
+         *first_nsec_ptr = batch_ptr->first_nsec;
+         *edge_addr_ptr = batch_ptr->edge_addr;
+         free(batch_ptr->received);
+         batch_ptr->or_jobs = NULL;
+         batch_ptr->received = NULL;
+
+         return or_jobs;
+      }
+
+      if ((header.flags & PROTO_FLAG_POLL) != 0)
+      {
+         sendmissing(sock_desc, batch_ptr);
+      }
+
+      // The edge server is waiting to send the next burst of the batch
+      if ((header.flags & PROTO_FLAG_CREDIT) != 0)
+      {
+         sendcredit(sock_desc, batch_ptr);
+      }
+   }
+}
+
+struct or_batch * findbatch(struct proto_header * header_ptr,
+   struct sockaddr_in * edge_addr_ptr)
+{
+   struct or_batch * free_ptr = NULL;
+   struct or_batch * oldest_ptr = NULL;
+
+   for (int i = 0; i < MAX_PENDING; i++)
+   {
+      struct or_batch * batch_ptr = &pending[i];
+
+      if (batch_ptr->or_jobs == NULL)
+      {
+         if (free_ptr == NULL)
          {
-            strcat(result, "1");
-            msb_found = true;
+            free_ptr = batch_ptr;
          }
-         else if (msb_found)
+         continue;
+      }
+
+      if ((batch_ptr->request_id == header_ptr->request_id) &&
+         (batch_ptr->edge_addr.sin_addr.s_addr ==
+         edge_addr_ptr->sin_addr.s_addr) && (batch_ptr->edge_addr.sin_port
+         == edge_addr_ptr->sin_port))
+      {
+         if (header_ptr->job_count != (uint32_t) batch_ptr->num_or_jobs)
          {
-            strcat(result, "0");
+            fprintf(stderr, "ERROR: Job count does not match its batch.\n");
+            return NULL;
          }
+         return batch_ptr;
+      }
+
+      if ((oldest_ptr == NULL) ||
+         (batch_ptr->last_usec < oldest_ptr->last_usec))
+      {
+         oldest_ptr = batch_ptr;
+      }
+   }
+
+   // A batch whose jobs stopped arriving long ago was abandoned by the edge
+      //server
+   if ((free_ptr == NULL) && (nowusec() - oldest_ptr->last_usec >
+      PENDING_TIMEOUT_USEC))
+   {
+      fprintf(stderr, "ERROR: Dropping a batch that is still missing jobs.\n");
+      stats_count(&or_stats, COUNTER_BATCHES_DROPPED, 1);
+      free(oldest_ptr->or_jobs);
+      free(oldest_ptr->received);
+      oldest_ptr->or_jobs = NULL;
+      oldest_ptr->received = NULL;
+      free_ptr = oldest_ptr;
+   }
+
+   if (free_ptr == NULL)
+   {
+      fprintf(stderr, "ERROR: Too many batches in progress, dropping jobs.\n");
+      stats_count(&or_stats, COUNTER_DATAGRAMS_DROPPED, 1);
+      return NULL;
+   }
+
+   if (((free_ptr->or_jobs = malloc(header_ptr->job_count *
+      sizeof(struct or_job))) == NULL) || ((free_ptr->received =
+      calloc(header_ptr->job_count, 1)) == NULL))
+   {
+      fprintf(stderr, "ERROR: Failed to allocate jobs.\n");
+      free(free_ptr->or_jobs);
+      free_ptr->or_jobs = NULL;
+      return NULL;
+   }
+   free_ptr->request_id = header_ptr->request_id;
+   free_ptr->edge_addr = *edge_addr_ptr;
+   free_ptr->num_or_jobs = (int) header_ptr->job_count;
+   free_ptr->num_received = 0;
+   free_ptr->last_usec = nowusec();
+   free_ptr->first_nsec = stats_nownsec();
+
+   // Print message indicating initial receipt of job(s) from edge server
+   logger_printf(LOGGER_INFO, "The OR server has started receiving jobs from"
+      " the edge server for OR computation. The computation results are:\n");
+
+   return free_ptr;
+}
+
+struct or_done * findfinished(struct proto_header * header_ptr,
+   struct sockaddr_in * edge_addr_ptr)
+{
+   for (int i = 0; i < MAX_FINISHED; i++)
+   {
+      struct or_done * done_ptr = &finished[i];
+
+      if ((done_ptr->results != NULL) &&
+         (done_ptr->request_id == header_ptr->request_id) &&
+         (done_ptr->edge_addr.sin_addr.s_addr ==
+         edge_addr_ptr->sin_addr.s_addr) && (done_ptr->edge_addr.sin_port ==
+         edge_addr_ptr->sin_port) &&
+         (header_ptr->job_count == (uint32_t) done_ptr->num_or_jobs))
+      {
+         return done_ptr;
       }
+   }
+
+   return NULL;
+}
+
+void keepresults(struct sockaddr_in * edge_addr_ptr,
+   struct or_job or_jobs[], int num_or_jobs, uint64_t request_id)
+{
+   struct or_done * done_ptr = &finished[next_finished];
 
-      if (!msb_found)
+   free(done_ptr->results);
+   if ((done_ptr->results = malloc(num_or_jobs * sizeof(uint32_t))) == NULL)
+   {
+      return; // resent jobs will just be computed again
+   }
+   next_finished = (next_finished + 1) % MAX_FINISHED;
+
+   for (int i = 0; i < num_or_jobs; i++)
+   {
+      done_ptr->results[i] = or_jobs[i].result;
+   }
+   done_ptr->request_id = request_id;
+   done_ptr->edge_addr = *edge_addr_ptr;
+   done_ptr->num_or_jobs = num_or_jobs;
+}
+
+int resendresults(int sock_desc, struct or_done * done_ptr,
+   struct proto_header * header_ptr, struct sockaddr_in * edge_addr_ptr)
+{
+   unsigned char * payload = dgram_txbuf(&edge_tx);
+
+   // A resent job datagram never holds more records than a result datagram
+   proto_packdgramheader(payload, PROTO_OP_OR_RESULTS, done_ptr->request_id,
+      (uint32_t) done_ptr->num_or_jobs, header_ptr->first_job,
+      header_ptr->record_count);
+
+   for (uint32_t k = 0; k < header_ptr->record_count; k++)
+   {
+      proto_putle32(payload + PROTO_DGRAM_HEADER_BYTES +
+         k * PROTO_BACKEND_RESULT_BYTES,
+         done_ptr->results[header_ptr->first_job + k]);
+   }
+
+   if (dgram_txpush(sock_desc, &edge_tx, PROTO_DGRAM_HEADER_BYTES +
+      header_ptr->record_count * PROTO_BACKEND_RESULT_BYTES, edge_addr_ptr)
+      == EXIT_FAILURE)
+   {
+      fprintf(stderr, "ERROR: Failed to send results to edge server.\n");
+      return EXIT_FAILURE;
+   }
+   stats_count(&or_stats, COUNTER_RESULTS_RESENT, header_ptr->record_count);
+   stats_count(&or_stats, COUNTER_BYTES_SENT, PROTO_DGRAM_HEADER_BYTES +
+      header_ptr->record_count * PROTO_BACKEND_RESULT_BYTES);
+
+   return EXIT_SUCCESS;
+}
+
+int sendmissing(int sock_desc, struct or_batch * batch_ptr)
+{
+   unsigned char * payload = dgram_txbuf(&edge_tx);
+   int max_records = (opts.dgram_bytes - PROTO_DGRAM_HEADER_BYTES) /
+      PROTO_MISSING_BYTES;
+   int num_records = 0;
+   int first_missing = -1;
+
+   for (int j = 0; (j < batch_ptr->num_or_jobs) &&
+      (num_records < max_records); j++)
+   {
+      if (batch_ptr->received[j])
+      {
+         continue;
+      }
+
+      // Extend the range up to the next job that has arrived
+      int end = j + 1;
+
+      while ((end < batch_ptr->num_or_jobs) && !batch_ptr->received[end])
+      {
+         end++;
+      }
+
+      unsigned char * record = payload + PROTO_DGRAM_HEADER_BYTES +
+         num_records * PROTO_MISSING_BYTES;
+
+      proto_putle32(record, (uint32_t) j);
+      proto_putle32(record + 4, (uint32_t) (end - j));
+      num_records++;
+
+      if (first_missing == -1)
       {
-         strcat(result, "0");
+         first_missing = j;
       }
+      j = end;
+   }
+
+   proto_packdgramheader(payload, PROTO_OP_MISSING, batch_ptr->request_id,
+      (uint32_t) batch_ptr->num_or_jobs, (uint32_t) first_missing,
+      (uint32_t) num_records);
+
+   if (dgram_txpush(sock_desc, &edge_tx, PROTO_DGRAM_HEADER_BYTES +
+      num_records * PROTO_MISSING_BYTES, &batch_ptr->edge_addr)
+      == EXIT_FAILURE)
+   {
+      fprintf(stderr, "ERROR: Failed to send missing jobs to edge server.\n");
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
 
-      strcpy(or_jobs[i].result, result);
+int sendcredit(int sock_desc, struct or_batch * batch_ptr)
+{
+   unsigned char * payload = dgram_txbuf(&edge_tx);
+
+   proto_packdgramheader(payload, PROTO_OP_CREDIT, batch_ptr->request_id,
+      (uint32_t) batch_ptr->num_or_jobs, (uint32_t) batch_ptr->num_received,
+      1);
+   proto_putle32(payload + PROTO_DGRAM_HEADER_BYTES, (uint32_t) rcvbuf_bytes);
+
+   if (dgram_txpush(sock_desc, &edge_tx, PROTO_DGRAM_HEADER_BYTES +
+      PROTO_CREDIT_BYTES, &batch_ptr->edge_addr) == EXIT_FAILURE)
+   {
+      fprintf(stderr, "ERROR: Failed to send credit to edge server.\n");
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+uint64_t nowusec()
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+int orsegment(int sock_desc, struct proto_header * header_ptr,
+   const unsigned char * buffer, struct sockaddr_in * edge_addr_ptr)
+{
+   unsigned char * payload = dgram_txbuf(&edge_tx);
+   const unsigned char * operand1 = buffer + PROTO_SEGMENT_HEADER_BYTES;
+   size_t num_words = header_ptr->record_count;
+
+   proto_packsegheader(payload, PROTO_OP_OR_RESULTS, header_ptr->request_id,
+      header_ptr->segment_job, header_ptr->job_count, header_ptr->first_job,
+      header_ptr->record_count);
+
+   // Operand 2 words follow operand 1 words
+   bitvec_or(payload + PROTO_SEGMENT_HEADER_BYTES, operand1,
+      operand1 + num_words * BITVEC_WORD_BYTES, num_words);
+
+   if (dgram_txpush(sock_desc, &edge_tx, PROTO_SEGMENT_HEADER_BYTES +
+      num_words * PROTO_SEGMENT_RESULT_BYTES, edge_addr_ptr) == EXIT_FAILURE)
+   {
+      fprintf(stderr, "ERROR: Failed to send results to edge server.\n");
+      return EXIT_FAILURE;
+   }
+   stats_count(&or_stats, COUNTER_SEGMENTS, 1);
+   stats_count(&or_stats, COUNTER_BYTES_SENT, PROTO_SEGMENT_HEADER_BYTES +
+      num_words * PROTO_SEGMENT_RESULT_BYTES);
+
+   return EXIT_SUCCESS;
+}
+
+int orcalculation(struct or_job or_jobs[], int num_or_jobs)
+{
+   for (int i = 0; i < num_or_jobs; i++)
+   {
+      or_jobs[i].result = or_jobs[i].operand1 | or_jobs[i].operand2;
+   }
+
+   // Unless only summary lines are logged
+   for (int i = 0; logger_enabled(LOGGER_JOB) && (i < num_or_jobs); i++)
+   {
+      char operand1[PROTO_MAX_WIDTH + 1];
+      char operand2[PROTO_MAX_WIDTH + 1];
+      char result[PROTO_MAX_WIDTH + 1];
+
+      proto_wordtostr(or_jobs[i].operand1, or_jobs[i].width1, operand1);
+      proto_wordtostr(or_jobs[i].operand2, or_jobs[i].width2, operand2);
+      proto_wordtostr(or_jobs[i].result, 0, result);
 
       // Print message displaying OR computation result
-      fprintf(stdout, "%s or %s = %s\n", or_jobs[i].operand1,
-         or_jobs[i].operand2, result);
+      logger_printf(LOGGER_JOB, "%s or %s = %s\n", operand1, operand2,
+         result);
    }
    
    // Print message indicating all jobs were received and computations are
       //complete
-   fprintf(stdout, "The OR server has successfully received %d jobs from the"
-      " edge server and finished all OR computations.\n", num_or_jobs);
+   logger_printf(LOGGER_INFO, "The OR server has successfully received %d jobs"
+      " from the edge server and finished all OR computations.\n",
+      num_or_jobs);
 
    return EXIT_SUCCESS;
 }
 
 int sendresults(int sock_desc, struct sockaddr_in * edge_addr_ptr,
-   struct or_job or_jobs[], int num_or_jobs)
+   struct or_job or_jobs[], int num_or_jobs, uint64_t request_id)
 {
-   for (int i = 0; i < num_or_jobs; i++)
+   if (opts.ascii)
+   {
+      for (int i = 0; i < num_or_jobs; i++)
       {
          char payload[SEND_BYTES + 1];
+         char result[PROTO_MAX_WIDTH + 1];
 
-         sprintf(payload, "%3d %10s", or_jobs[i].job_number,
-            or_jobs[i].result);
+         proto_wordtostr(or_jobs[i].result, 0, result);
+         snprintf(payload, sizeof(payload), "%3d %10.10s",
+            or_jobs[i].job_number, result);
 
          if (sendto(sock_desc, payload, strlen(payload), 0,
             (struct sockaddr *) edge_addr_ptr, sizeof(*edge_addr_ptr))
@@ -311,11 +1224,56 @@ int sendresults(int sock_desc, struct sockaddr_in * edge_addr_ptr,
             fprintf(stderr, "ERROR: Failed to send result to edge server.\n");
             return EXIT_FAILURE;
          }
+         dgram_counters.send_calls++;
+         dgram_counters.datagrams_sent++;
+      }
+      stats_count(&or_stats, COUNTER_BYTES_SENT,
+         (unsigned long) num_or_jobs * SEND_BYTES);
+   }
+   else
+   {
+      int max_records = (opts.dgram_bytes - PROTO_DGRAM_HEADER_BYTES) /
+         PROTO_BACKEND_RESULT_BYTES;
+
+      // Pack as many results as fit into each datagram
+      for (int first_job = 0; first_job < num_or_jobs;
+         first_job += max_records)
+      {
+         unsigned char * payload = dgram_txbuf(&edge_tx);
+         int num_records = num_or_jobs - first_job < max_records ?
+            num_or_jobs - first_job : max_records;
+         size_t payload_len = PROTO_DGRAM_HEADER_BYTES +
+            num_records * PROTO_BACKEND_RESULT_BYTES;
+
+         proto_packdgramheader(payload, PROTO_OP_OR_RESULTS, request_id,
+            (uint32_t) num_or_jobs, (uint32_t) first_job,
+            (uint32_t) num_records);
+
+         for (int k = 0; k < num_records; k++)
+         {
+            proto_putle32(payload + PROTO_DGRAM_HEADER_BYTES +
+               k * PROTO_BACKEND_RESULT_BYTES, or_jobs[first_job + k].result);
+         }
+
+         if (dgram_txpush(sock_desc, &edge_tx, payload_len, edge_addr_ptr)
+            == EXIT_FAILURE)
+         {
+            fprintf(stderr, "ERROR: Failed to send results to edge server.\n");
+            return EXIT_FAILURE;
+         }
+         stats_count(&or_stats, COUNTER_BYTES_SENT, payload_len);
+      }
+
+      if (dgram_txflush(sock_desc, &edge_tx) == EXIT_FAILURE)
+      {
+         fprintf(stderr, "ERROR: Failed to send results to edge server.\n");
+         return EXIT_FAILURE;
       }
+   }
 
    // Print message indicating all results have been sent to edge server
-   fprintf(stdout, "The OR server has successfully finished sending all"
-      " computation results to the edge server.\n");
+   logger_printf(LOGGER_INFO, "The OR server has successfully finished sending"
+      " all computation results to the edge server.\n");
 
    return EXIT_SUCCESS;
 }
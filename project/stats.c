@@ -0,0 +1,379 @@
+/**
+ * stats.c
+ *
+ * Latency histograms and counters for the edge and backend servers. See
+ * stats.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "stats.h"
+
+#define REQUEST_BYTES 512 // longest request line read
+#define SNAPSHOT_BYTES 16384 // largest snapshot, with room for an HTTP header
+#define REQUEST_TIMEOUT_SEC 1 // time a client gets to send its request
+
+static int endpoint_sd = -1; // listening socket of this process, -1 if none
+
+/**
+ * bucketof returns the histogram bucket a latency falls in.
+ * @param nsec uint64_t latency in nanoseconds
+ * @return int bucket index
+ */
+static int bucketof(uint64_t nsec);
+
+/**
+ * bucketmax returns the largest latency that falls in a bucket.
+ * @param b int bucket index
+ * @return uint64_t latency in nanoseconds
+ */
+static uint64_t bucketmax(int b);
+
+/**
+ * percentile returns the latency a given share of a histogram's latencies
+ * are at or below, to within a bucket.
+ * @param histogram_ptr pointer to struct stats_histogram
+ * @param count unsigned long number of latencies in the snapshot
+ * @param per_mille int share of latencies in thousandths
+ * @return uint64_t latency in nanoseconds, 0 if there are none
+ */
+static uint64_t percentile(const struct stats_histogram * histogram_ptr,
+   unsigned long count, int per_mille);
+
+/**
+ * append adds formatted text to a buffer, as much as fits.
+ * @param buffer pointer to char buffer
+ * @param len size_t size of the buffer
+ * @param used_ptr pointer to size_t number of bytes already in the buffer
+ * @param format pointer to c string printf format
+ */
+static void append(char * buffer, size_t len, size_t * used_ptr,
+   const char * format, ...) __attribute__((format(printf, 4, 5)));
+
+/**
+ * serveendpoint is the endpoint thread, it answers one request per
+ * connection.
+ * @param stats_ptr pointer to struct stats
+ * @return void * NULL
+ */
+static void * serveendpoint(void * stats_ptr);
+
+/**
+ * closeendpoint closes the listening socket in a forked child.
+ */
+static void closeendpoint(void);
+
+int stats_init(struct stats * stats_ptr, const char * name,
+   const char * const stage_names[], int num_stages,
+   const char * const counter_names[], int num_counters)
+{
+   // Numbers are shared with the forked children that serve clients
+   if ((stats_ptr->shared = mmap(NULL, sizeof(struct stats_shared),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
+      MAP_FAILED)
+   {
+      fprintf(stderr, "ERROR: Failed to map stats.\n");
+      return EXIT_FAILURE;
+   }
+
+   stats_ptr->name = name;
+   stats_ptr->stage_names = stage_names;
+   stats_ptr->num_stages = (num_stages < STATS_MAX_STAGES) ? num_stages :
+      STATS_MAX_STAGES;
+   stats_ptr->counter_names = counter_names;
+   stats_ptr->num_counters = (num_counters < STATS_MAX_COUNTERS) ?
+      num_counters : STATS_MAX_COUNTERS;
+
+   return EXIT_SUCCESS;
+}
+
+int stats_serve(struct stats * stats_ptr, int port)
+{
+   struct sockaddr_in addr;
+   int yes = 1;
+   pthread_t thread;
+
+   if ((endpoint_sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+   {
+      fprintf(stderr, "ERROR: Failed to create stats socket.\n");
+      return EXIT_FAILURE;
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons((uint16_t) port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   if ((setsockopt(endpoint_sd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))
+      == -1) || (bind(endpoint_sd, (struct sockaddr *) &addr, sizeof(addr))
+      == -1) || (listen(endpoint_sd, SOMAXCONN) == -1))
+   {
+      fprintf(stderr, "ERROR: Failed to listen on stats port %d.\n", port);
+      close(endpoint_sd);
+      endpoint_sd = -1;
+      return EXIT_FAILURE;
+   }
+
+   if ((pthread_atfork(NULL, NULL, closeendpoint) != 0) ||
+      (pthread_create(&thread, NULL, serveendpoint, stats_ptr) != 0))
+   {
+      fprintf(stderr, "ERROR: Failed to create stats thread.\n");
+      close(endpoint_sd);
+      endpoint_sd = -1;
+      return EXIT_FAILURE;
+   }
+   pthread_detach(thread);
+
+   return EXIT_SUCCESS;
+}
+
+uint64_t stats_nownsec()
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+void stats_record(struct stats * stats_ptr, int stage, uint64_t nsec)
+{
+   struct stats_histogram * histogram_ptr = &stats_ptr->shared->stages[stage];
+   unsigned long max = __atomic_load_n(&histogram_ptr->max_nsec,
+      __ATOMIC_RELAXED);
+
+   __atomic_add_fetch(&histogram_ptr->buckets[bucketof(nsec)], 1,
+      __ATOMIC_RELAXED);
+   __atomic_add_fetch(&histogram_ptr->count, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&histogram_ptr->sum_nsec, nsec, __ATOMIC_RELAXED);
+
+   // A new maximum is rare, so the loop almost never runs
+   while ((nsec > max) && !__atomic_compare_exchange_n(
+      &histogram_ptr->max_nsec, &max, nsec, true, __ATOMIC_RELAXED,
+      __ATOMIC_RELAXED))
+   {
+   }
+}
+
+void stats_count(struct stats * stats_ptr, int counter, unsigned long n)
+{
+   __atomic_add_fetch(&stats_ptr->shared->counters[counter], n,
+      __ATOMIC_RELAXED);
+}
+
+uint64_t stats_percentile(struct stats * stats_ptr, int stage, int per_mille)
+{
+   const struct stats_histogram * histogram_ptr =
+      &stats_ptr->shared->stages[stage];
+
+   return percentile(histogram_ptr, __atomic_load_n(&histogram_ptr->count,
+      __ATOMIC_RELAXED), per_mille);
+}
+
+size_t stats_format(struct stats * stats_ptr, bool json, char * buffer,
+   size_t len)
+{
+   size_t used = 0;
+
+   buffer[0] = '\0';
+
+   if (json)
+   {
+      append(buffer, len, &used, "{\"server\":\"%s\",\"stages\":{",
+         stats_ptr->name);
+   }
+   else
+   {
+      append(buffer, len, &used, "The %s's stages took (microseconds):\n",
+         stats_ptr->name);
+   }
+
+   for (int s = 0; s < stats_ptr->num_stages; s++)
+   {
+      const struct stats_histogram * histogram_ptr =
+         &stats_ptr->shared->stages[s];
+      unsigned long count = __atomic_load_n(&histogram_ptr->count,
+         __ATOMIC_RELAXED);
+      double mean = (count == 0) ? 0.0 : (double) __atomic_load_n(
+         &histogram_ptr->sum_nsec, __ATOMIC_RELAXED) / (double) count;
+      double p50 = (double) percentile(histogram_ptr, count, 500);
+      double p90 = (double) percentile(histogram_ptr, count, 900);
+      double p99 = (double) percentile(histogram_ptr, count, 990);
+      double p999 = (double) percentile(histogram_ptr, count, 999);
+      double max = (double) __atomic_load_n(&histogram_ptr->max_nsec,
+         __ATOMIC_RELAXED);
+
+      append(buffer, len, &used, json ? "%s\"%s\":{\"count\":%lu,"
+         "\"mean_us\":%.3f,\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,"
+         "\"p999_us\":%.3f,\"max_us\":%.3f}" : "%s%-16s count %lu mean %.3f"
+         " p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+         (json && (s > 0)) ? "," : "", stats_ptr->stage_names[s], count,
+         mean / 1000.0, p50 / 1000.0, p90 / 1000.0, p99 / 1000.0,
+         p999 / 1000.0, max / 1000.0);
+   }
+
+   append(buffer, len, &used, json ? "},\"counters\":{" :
+      "The %s's counters are:\n", stats_ptr->name);
+
+   for (int c = 0; c < stats_ptr->num_counters; c++)
+   {
+      append(buffer, len, &used, json ? "%s\"%s\":%lu" : "%s%-16s %lu\n",
+         (json && (c > 0)) ? "," : "", stats_ptr->counter_names[c],
+         __atomic_load_n(&stats_ptr->shared->counters[c], __ATOMIC_RELAXED));
+   }
+
+   if (json)
+   {
+      append(buffer, len, &used, "}}\n");
+   }
+
+   return used;
+}
+
+static int bucketof(uint64_t nsec)
+{
+   if (nsec > STATS_MAX_NSEC)
+   {
+      nsec = STATS_MAX_NSEC;
+   }
+
+   if (nsec < STATS_SUB_BUCKETS)
+   {
+      return (int) nsec;
+   }
+
+   // Top STATS_SUB_BITS + 1 bits, the first of which is always set
+   int exponent = 63 - __builtin_clzll(nsec);
+
+   return (exponent - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS +
+      (int) (nsec >> (exponent - STATS_SUB_BITS)) - STATS_SUB_BUCKETS;
+}
+
+static uint64_t bucketmax(int b)
+{
+   if (b < STATS_SUB_BUCKETS)
+   {
+      return (uint64_t) b;
+   }
+
+   int shift = b / STATS_SUB_BUCKETS - 1;
+   uint64_t mantissa = (uint64_t) (b % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS);
+
+   return ((mantissa + 1) << shift) - 1;
+}
+
+static uint64_t percentile(const struct stats_histogram * histogram_ptr,
+   unsigned long count, int per_mille)
+{
+   // Rank of the latency wanted, counting from 1
+   unsigned long rank = (count * (unsigned long) per_mille + 999) / 1000;
+   unsigned long seen = 0;
+   uint64_t max = __atomic_load_n(&histogram_ptr->max_nsec, __ATOMIC_RELAXED);
+
+   if (count == 0)
+   {
+      return 0;
+   }
+
+   for (int b = 0; b < STATS_BUCKETS; b++)
+   {
+      seen += __atomic_load_n(&histogram_ptr->buckets[b], __ATOMIC_RELAXED);
+
+      if (seen >= rank)
+      {
+         return (bucketmax(b) < max) ? bucketmax(b) : max;
+      }
+   }
+
+   return max;
+}
+
+static void append(char * buffer, size_t len, size_t * used_ptr,
+   const char * format, ...)
+{
+   va_list args;
+   int n;
+
+   if (*used_ptr + 1 >= len)
+   {
+      return;
+   }
+
+   va_start(args, format);
+   n = vsnprintf(buffer + *used_ptr, len - *used_ptr, format, args);
+   va_end(args);
+
+   if (n > 0)
+   {
+      *used_ptr = (*used_ptr + (size_t) n < len) ? *used_ptr + (size_t) n :
+         len - 1;
+   }
+}
+
+static void * serveendpoint(void * stats_ptr)
+{
+   static char snapshot[SNAPSHOT_BYTES];
+   static char response[SNAPSHOT_BYTES];
+
+   while (1)
+   {
+      char request[REQUEST_BYTES];
+      struct timeval timeout = {REQUEST_TIMEOUT_SEC, 0};
+      int connect_sd;
+      ssize_t received;
+
+      if ((connect_sd = accept(endpoint_sd, NULL, NULL)) == -1)
+      {
+         continue;
+      }
+
+      // A client that never sends its request must not hold up the others
+      setsockopt(connect_sd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+         sizeof(timeout));
+
+      if ((received = recv(connect_sd, request, sizeof(request) - 1, 0)) <= 0)
+      {
+         close(connect_sd);
+         continue;
+      }
+      request[received] = '\0';
+      request[strcspn(request, "\r\n")] = '\0';
+
+      bool json = (strstr(request, "json") != NULL);
+      size_t len = stats_format(stats_ptr, json, snapshot, sizeof(snapshot));
+      size_t used = 0;
+
+      if (strncmp(request, "GET ", 4) == 0)
+      {
+         append(response, sizeof(response), &used, "HTTP/1.0 200 OK\r\n"
+            "Content-Type: %s\r\nContent-Length: %zu\r\n\r\n", json ?
+            "application/json" : "text/plain", len);
+      }
+      append(response, sizeof(response), &used, "%s", snapshot);
+
+      send(connect_sd, response, used, MSG_NOSIGNAL);
+      close(connect_sd);
+   }
+
+   return NULL;
+}
+
+static void closeendpoint(void)
+{
+   if (endpoint_sd != -1)
+   {
+      close(endpoint_sd);
+      endpoint_sd = -1;
+   }
+}
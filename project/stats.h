@@ -0,0 +1,136 @@
+/**
+ * stats.h
+ *
+ * Latency histograms and counters for the edge and backend servers.
+ *
+ * Every stage of serving a batch (receiving its jobs, sending them on,
+ * waiting for results, and so on) has a histogram of how long it took, kept
+ * HDR style: values below STATS_SUB_BUCKETS nanoseconds get a bucket each,
+ * and every power of two above is split into STATS_SUB_BUCKETS buckets, so
+ * any latency up to STATS_MAX_NSEC is known to within about 3%. Recording a
+ * value is a handful of relaxed atomic additions, cheap enough to leave on.
+ * Counters keep totals such as jobs, bytes, drops, and retries.
+ *
+ * The histograms and counters live in shared memory, so every process
+ * forked from the one that set them up, and every thread, adds to the same
+ * numbers. They are read through a stream socket on 127.0.0.1: a client that
+ * connects and sends a line gets a snapshot in JSON if the line mentions
+ * "json" and as text otherwise, behind an HTTP header if the line is an HTTP
+ * GET request (curl http://127.0.0.1:port/json).
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_MAX_STAGES 8 // maximum number of histograms
+#define STATS_MAX_COUNTERS 16 // maximum number of counters
+#define STATS_SUB_BITS 5 // log2 of the number of buckets per power of two
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_EXPONENT 41 // highest power of two with buckets of its own
+#define STATS_BUCKETS ((STATS_MAX_EXPONENT - STATS_SUB_BITS + 2) * \
+   STATS_SUB_BUCKETS) // number of buckets per histogram
+#define STATS_MAX_NSEC ((1ull << (STATS_MAX_EXPONENT + 1)) - 1) // largest
+   //latency told apart from larger ones, about 73 minutes
+
+/**
+ * struct to store the latencies of one stage
+ */
+struct stats_histogram {
+   unsigned long buckets[STATS_BUCKETS]; // number of latencies in each bucket
+   unsigned long count; // number of latencies recorded
+   unsigned long sum_nsec; // sum of every latency recorded
+   unsigned long max_nsec; // largest latency recorded
+};
+
+/**
+ * struct to store the numbers shared by every process and thread
+ */
+struct stats_shared {
+   struct stats_histogram stages[STATS_MAX_STAGES];
+   unsigned long counters[STATS_MAX_COUNTERS];
+};
+
+/**
+ * struct to store the histograms and counters of one server
+ */
+struct stats {
+   struct stats_shared * shared; // numbers shared with forked processes
+   const char * name; // server name printed with the text snapshot
+   const char * const * stage_names; // name of each stage
+   int num_stages;
+   const char * const * counter_names; // name of each counter
+   int num_counters;
+};
+
+/**
+ * stats_init maps zeroed histograms and counters. Call it before forking.
+ * @param stats_ptr pointer to struct stats
+ * @param name pointer to c string server name, such as "edge server"
+ * @param stage_names array of num_stages c strings
+ * @param num_stages int number of stages, at most STATS_MAX_STAGES
+ * @param counter_names array of num_counters c strings
+ * @param num_counters int number of counters, at most STATS_MAX_COUNTERS
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int stats_init(struct stats * stats_ptr, const char * name,
+   const char * const stage_names[], int num_stages,
+   const char * const counter_names[], int num_counters);
+
+/**
+ * stats_serve starts a thread answering snapshot requests on 127.0.0.1.
+ * Processes forked afterwards do not inherit the socket.
+ * @param stats_ptr pointer to struct stats
+ * @param port int port number
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int stats_serve(struct stats * stats_ptr, int port);
+
+/**
+ * stats_nownsec reads the monotonic clock.
+ * @return uint64_t time in nanoseconds
+ */
+uint64_t stats_nownsec();
+
+/**
+ * stats_record adds a latency to a stage's histogram.
+ * @param stats_ptr pointer to struct stats
+ * @param stage int stage index
+ * @param nsec uint64_t latency in nanoseconds
+ */
+void stats_record(struct stats * stats_ptr, int stage, uint64_t nsec);
+
+/**
+ * stats_count adds to a counter.
+ * @param stats_ptr pointer to struct stats
+ * @param counter int counter index
+ * @param n unsigned long amount to add
+ */
+void stats_count(struct stats * stats_ptr, int counter, unsigned long n);
+
+/**
+ * stats_percentile returns the latency a share of a stage's latencies are at
+ * or below, to within a bucket.
+ * @param stats_ptr pointer to struct stats
+ * @param stage int stage index
+ * @param per_mille int share of latencies in thousandths, 1000 for the max
+ * @return uint64_t latency in nanoseconds, 0 if none were recorded
+ */
+uint64_t stats_percentile(struct stats * stats_ptr, int stage, int per_mille);
+
+/**
+ * stats_format writes a snapshot of every histogram and counter.
+ * @param stats_ptr pointer to struct stats
+ * @param json bool write JSON instead of text
+ * @param buffer pointer to char buffer
+ * @param len size_t size of the buffer
+ * @return size_t number of bytes written, without the terminating null
+ *    character, cut short if the buffer is too small
+ */
+size_t stats_format(struct stats * stats_ptr, bool json, char * buffer,
+   size_t len);
+
+#endif
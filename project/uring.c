@@ -0,0 +1,335 @@
+/**
+ * uring.c
+ *
+ * Minimal io_uring support built on the raw io_uring system calls. See
+ * uring.h.
+ */
+
+#define _GNU_SOURCE // syscall
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#ifndef IORING_FEAT_REG_REG_RING
+#define IORING_FEAT_REG_REG_RING (1U << 13) // Linux 6.3, older headers lack it
+#endif
+
+/**
+ * enter makes the io_uring_enter() system call.
+ * @param fd int ring file descriptor or registered index
+ * @param to_submit unsigned number of submissions to hand over
+ * @param wait_nr unsigned number of completions to wait for
+ * @param flags unsigned IORING_ENTER_* values
+ * @param arg pointer to struct io_uring_getevents_arg, may be NULL
+ * @return int number of submissions taken, -1 if unsuccessful
+ */
+static int enter(int fd, unsigned to_submit, unsigned wait_nr, unsigned flags,
+   struct io_uring_getevents_arg * arg)
+{
+   return (int) syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags,
+      arg, arg != NULL ? sizeof(*arg) : 0);
+}
+
+int uring_init(struct uring * ring_ptr, unsigned entries)
+{
+   struct io_uring_params params;
+
+   memset(ring_ptr, 0, sizeof(*ring_ptr));
+   ring_ptr->fd = -1;
+
+   memset(&params, 0, sizeof(params));
+   params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+   params.cq_entries = entries * 4;
+
+   int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+
+   if (fd == -1)
+   {
+      return EXIT_FAILURE;
+   }
+
+   if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_NODROP) ||
+      !(params.features & IORING_FEAT_EXT_ARG) ||
+      !(params.features & IORING_FEAT_REG_REG_RING))
+   {
+      close(fd);
+      return EXIT_FAILURE;
+   }
+
+   // Both rings share one mapping, the submissions themselves another
+   size_t sq_bytes = params.sq_off.array + params.sq_entries *
+      sizeof(unsigned);
+   size_t cq_bytes = params.cq_off.cqes + params.cq_entries *
+      sizeof(struct io_uring_cqe);
+
+   ring_ptr->ring_bytes = (sq_bytes > cq_bytes) ? sq_bytes : cq_bytes;
+   ring_ptr->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+
+   unsigned char * map = mmap(NULL, ring_ptr->ring_bytes,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+      IORING_OFF_SQ_RING);
+
+   if (map == MAP_FAILED)
+   {
+      close(fd);
+      return EXIT_FAILURE;
+   }
+
+   ring_ptr->sqes = mmap(NULL, ring_ptr->sqes_bytes, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+   if (ring_ptr->sqes == MAP_FAILED)
+   {
+      munmap(map, ring_ptr->ring_bytes);
+      close(fd);
+      return EXIT_FAILURE;
+   }
+
+   ring_ptr->fd = fd;
+   ring_ptr->ring_map = map;
+   ring_ptr->sq_head = (unsigned *) (map + params.sq_off.head);
+   ring_ptr->sq_tail = (unsigned *) (map + params.sq_off.tail);
+   ring_ptr->sq_array = (unsigned *) (map + params.sq_off.array);
+   ring_ptr->sq_mask = *(unsigned *) (map + params.sq_off.ring_mask);
+   ring_ptr->sq_entries = params.sq_entries;
+   ring_ptr->sqe_tail = *ring_ptr->sq_tail;
+   ring_ptr->cq_head = (unsigned *) (map + params.cq_off.head);
+   ring_ptr->cq_tail = (unsigned *) (map + params.cq_off.tail);
+   ring_ptr->cq_mask = *(unsigned *) (map + params.cq_off.ring_mask);
+   ring_ptr->cqes = (struct io_uring_cqe *) (map + params.cq_off.cqes);
+
+   // Register the ring's descriptor so entering it skips the lookup
+   struct io_uring_rsrc_update update;
+
+   memset(&update, 0, sizeof(update));
+   update.offset = -1U;
+   update.data = (uint64_t) fd;
+
+   if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_RING_FDS, &update,
+      1) == 1)
+   {
+      ring_ptr->enter_fd = (int) update.offset;
+      ring_ptr->enter_flags = IORING_ENTER_REGISTERED_RING;
+   }
+   else
+   {
+      ring_ptr->enter_fd = fd;
+      ring_ptr->enter_flags = 0;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+void uring_free(struct uring * ring_ptr)
+{
+   if (ring_ptr->fd == -1)
+   {
+      return;
+   }
+
+   // A registered descriptor keeps the ring alive until it is unregistered
+   if (ring_ptr->enter_flags & IORING_ENTER_REGISTERED_RING)
+   {
+      struct io_uring_rsrc_update update;
+
+      memset(&update, 0, sizeof(update));
+      update.offset = (uint32_t) ring_ptr->enter_fd;
+      syscall(__NR_io_uring_register, ring_ptr->fd,
+         IORING_UNREGISTER_RING_FDS, &update, 1);
+   }
+
+   munmap(ring_ptr->sqes, ring_ptr->sqes_bytes);
+   munmap(ring_ptr->ring_map, ring_ptr->ring_bytes);
+   close(ring_ptr->fd);
+   ring_ptr->fd = -1;
+}
+
+struct io_uring_sqe * uring_getsqe(struct uring * ring_ptr, int opcode, int fd,
+   uint64_t user_data)
+{
+   // Hand a full queue over before taking another entry
+   if ((ring_ptr->sqe_tail - __atomic_load_n(ring_ptr->sq_head,
+      __ATOMIC_ACQUIRE) >= ring_ptr->sq_entries) &&
+      ((uring_enter(ring_ptr, 0, -1) == EXIT_FAILURE) ||
+      (ring_ptr->sqe_tail - __atomic_load_n(ring_ptr->sq_head,
+      __ATOMIC_ACQUIRE) >= ring_ptr->sq_entries)))
+   {
+      fprintf(stderr, "ERROR: io_uring submission queue is full.\n");
+      return NULL;
+   }
+
+   unsigned index = ring_ptr->sqe_tail & ring_ptr->sq_mask;
+   struct io_uring_sqe * sqe = &ring_ptr->sqes[index];
+
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->opcode = (uint8_t) opcode;
+   sqe->fd = fd;
+   sqe->user_data = user_data;
+   ring_ptr->sq_array[index] = index;
+   ring_ptr->sqe_tail++;
+
+   return sqe;
+}
+
+int uring_enter(struct uring * ring_ptr, unsigned wait_nr, int timeout_msec)
+{
+   struct __kernel_timespec ts;
+   struct io_uring_getevents_arg arg;
+   unsigned flags = ring_ptr->enter_flags;
+
+   // Publish the queued submissions, the kernel takes them all
+   __atomic_store_n(ring_ptr->sq_tail, ring_ptr->sqe_tail, __ATOMIC_RELEASE);
+
+   unsigned to_submit = ring_ptr->sqe_tail -
+      __atomic_load_n(ring_ptr->sq_head, __ATOMIC_ACQUIRE);
+
+   memset(&arg, 0, sizeof(arg));
+   if (wait_nr > 0)
+   {
+      flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+      arg.sigmask_sz = _NSIG / 8;
+
+      if (timeout_msec != -1)
+      {
+         ts.tv_sec = timeout_msec / 1000;
+         ts.tv_nsec = (long long) (timeout_msec % 1000) * 1000000;
+         arg.ts = (uint64_t) (uintptr_t) &ts;
+      }
+   }
+
+   if ((to_submit == 0) && (wait_nr == 0))
+   {
+      return EXIT_SUCCESS;
+   }
+
+   if ((enter(ring_ptr->enter_fd, to_submit, wait_nr, flags,
+      (wait_nr > 0) ? &arg : NULL) == -1) && (errno != EINTR) &&
+      (errno != ETIME) && (errno != EAGAIN) && (errno != EBUSY))
+   {
+      fprintf(stderr, "ERROR: io_uring_enter failed.\n");
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+struct io_uring_cqe * uring_peek(struct uring * ring_ptr)
+{
+   unsigned head = *ring_ptr->cq_head;
+
+   if (head == __atomic_load_n(ring_ptr->cq_tail, __ATOMIC_ACQUIRE))
+   {
+      return NULL;
+   }
+
+   return &ring_ptr->cqes[head & ring_ptr->cq_mask];
+}
+
+void uring_seen(struct uring * ring_ptr)
+{
+   __atomic_store_n(ring_ptr->cq_head, *ring_ptr->cq_head + 1,
+      __ATOMIC_RELEASE);
+}
+
+int uring_bufsinit(struct uring * ring_ptr, struct uring_bufs * bufs_ptr,
+   uint16_t group, unsigned count, size_t buf_bytes)
+{
+   size_t ring_bytes = count * sizeof(struct io_uring_buf);
+
+   memset(bufs_ptr, 0, sizeof(*bufs_ptr));
+
+   // The ring must be page aligned, the buffers need not be
+   bufs_ptr->br = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+   if (bufs_ptr->br == MAP_FAILED)
+   {
+      bufs_ptr->br = NULL;
+      fprintf(stderr, "ERROR: Failed to allocate provided buffer ring.\n");
+      return EXIT_FAILURE;
+   }
+
+   if ((bufs_ptr->bufs = malloc(count * buf_bytes)) == NULL)
+   {
+      fprintf(stderr, "ERROR: Failed to allocate provided buffers.\n");
+      munmap(bufs_ptr->br, ring_bytes);
+      bufs_ptr->br = NULL;
+      return EXIT_FAILURE;
+   }
+
+   struct io_uring_buf_reg reg;
+
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (uint64_t) (uintptr_t) bufs_ptr->br;
+   reg.ring_entries = count;
+   reg.bgid = group;
+
+   if (syscall(__NR_io_uring_register, ring_ptr->fd, IORING_REGISTER_PBUF_RING,
+      &reg, 1) == -1)
+   {
+      free(bufs_ptr->bufs);
+      munmap(bufs_ptr->br, ring_bytes);
+      bufs_ptr->bufs = NULL;
+      bufs_ptr->br = NULL;
+      return EXIT_FAILURE;
+   }
+
+   bufs_ptr->buf_bytes = buf_bytes;
+   bufs_ptr->count = count;
+   bufs_ptr->group = group;
+
+   for (unsigned i = 0; i < count; i++)
+   {
+      uring_bufput(bufs_ptr, (uint16_t) i);
+   }
+
+   return EXIT_SUCCESS;
+}
+
+void uring_bufsfree(struct uring * ring_ptr, struct uring_bufs * bufs_ptr)
+{
+   struct io_uring_buf_reg reg;
+
+   if (bufs_ptr->br == NULL)
+   {
+      return;
+   }
+
+   memset(&reg, 0, sizeof(reg));
+   reg.bgid = bufs_ptr->group;
+   syscall(__NR_io_uring_register, ring_ptr->fd, IORING_UNREGISTER_PBUF_RING,
+      &reg, 1);
+
+   munmap(bufs_ptr->br, bufs_ptr->count * sizeof(struct io_uring_buf));
+   free(bufs_ptr->bufs);
+   bufs_ptr->br = NULL;
+   bufs_ptr->bufs = NULL;
+}
+
+unsigned char * uring_buf(const struct uring_bufs * bufs_ptr, uint16_t bid)
+{
+   return bufs_ptr->bufs + (size_t) bid * bufs_ptr->buf_bytes;
+}
+
+void uring_bufput(struct uring_bufs * bufs_ptr, uint16_t bid)
+{
+   struct io_uring_buf * buf =
+      &bufs_ptr->br->bufs[bufs_ptr->tail & (bufs_ptr->count - 1)];
+
+   buf->addr = (uint64_t) (uintptr_t) uring_buf(bufs_ptr, bid);
+   buf->len = (uint32_t) bufs_ptr->buf_bytes;
+   buf->bid = bid;
+
+   // The kernel may take the buffer as soon as the tail moves past it
+   bufs_ptr->tail++;
+   __atomic_store_n(&bufs_ptr->br->tail, bufs_ptr->tail, __ATOMIC_RELEASE);
+}
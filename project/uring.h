@@ -0,0 +1,153 @@
+/**
+ * uring.h
+ *
+ * Minimal io_uring support for the edge and backend servers, made straight
+ * from the io_uring_setup(), io_uring_enter(), and io_uring_register() system
+ * calls so no library is needed.
+ *
+ * Operations are queued in the submission ring shared with the kernel without
+ * a system call and handed over by the next uring_enter(), which also waits
+ * for completions. Completions are read straight from the shared completion
+ * ring, so a loop that finds completions waiting does not enter the kernel at
+ * all. The ring's own descriptor is registered, which saves looking it up on
+ * every uring_enter().
+ *
+ * A multishot receive picks a buffer for every completion from a provided
+ * buffer ring (struct uring_bufs) registered with the kernel, and the buffer
+ * is handed back with uring_bufput() once its bytes have been used.
+ *
+ * io_uring is only used on Linux 6.3 or later, which has everything relied
+ * on here: multishot accept and receive, provided buffer rings, and
+ * registered ring descriptors. uring_init fails on older kernels and where
+ * io_uring is disabled, so callers can fall back to epoll or recvmmsg().
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/**
+ * struct to store a ring shared with the kernel
+ */
+struct uring {
+   int fd; // ring file descriptor, -1 if not set up
+   int enter_fd; // registered index of the ring, or fd if not registered
+   unsigned enter_flags; // IORING_ENTER_REGISTERED_RING if registered
+   unsigned * sq_head; // next submission the kernel will take
+   unsigned * sq_tail; // submissions published to the kernel
+   unsigned * sq_array; // submission ring indices into sqes
+   unsigned sq_mask;
+   unsigned sq_entries;
+   unsigned sqe_tail; // submissions queued, published by uring_enter
+   struct io_uring_sqe * sqes;
+   unsigned * cq_head; // next completion to read
+   unsigned * cq_tail; // completions posted by the kernel
+   unsigned cq_mask;
+   struct io_uring_cqe * cqes;
+   void * ring_map; // mapping of both rings
+   size_t ring_bytes;
+   size_t sqes_bytes;
+};
+
+/**
+ * struct to store a provided buffer ring
+ */
+struct uring_bufs {
+   struct io_uring_buf_ring * br; // ring of free buffers shared with the kernel
+   unsigned char * bufs; // count buffers of buf_bytes
+   size_t buf_bytes; // size of each buffer
+   unsigned count; // number of buffers, a power of 2
+   uint16_t group; // buffer group ID operations select from
+   uint16_t tail; // free buffers published to the kernel
+};
+
+/**
+ * uring_init sets up a ring, failing quietly if io_uring is not available.
+ * @param ring_ptr pointer to struct uring
+ * @param entries unsigned number of submission entries, a power of 2; the
+ *    completion ring holds four times as many
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int uring_init(struct uring * ring_ptr, unsigned entries);
+
+/**
+ * uring_free tears down a ring, ending every operation still in flight.
+ * @param ring_ptr pointer to struct uring
+ */
+void uring_free(struct uring * ring_ptr);
+
+/**
+ * uring_getsqe queues a cleared submission, handing the queue to the kernel
+ * first if it is full.
+ * @param ring_ptr pointer to struct uring
+ * @param opcode int IORING_OP_* value
+ * @param fd int file descriptor the operation works on
+ * @param user_data uint64_t value passed back in the operation's completions
+ * @return struct io_uring_sqe * submission to fill in, NULL if unsuccessful
+ */
+struct io_uring_sqe * uring_getsqe(struct uring * ring_ptr, int opcode, int fd,
+   uint64_t user_data);
+
+/**
+ * uring_enter hands queued submissions to the kernel and waits for
+ * completions. Being interrupted or timing out is not a failure.
+ * @param ring_ptr pointer to struct uring
+ * @param wait_nr unsigned number of completions to wait for, 0 not to wait
+ * @param timeout_msec int longest to wait in milliseconds, -1 for no limit
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int uring_enter(struct uring * ring_ptr, unsigned wait_nr, int timeout_msec);
+
+/**
+ * uring_peek returns the oldest completion not yet seen.
+ * @param ring_ptr pointer to struct uring
+ * @return struct io_uring_cqe * completion, NULL if none is waiting
+ */
+struct io_uring_cqe * uring_peek(struct uring * ring_ptr);
+
+/**
+ * uring_seen hands the completion returned by uring_peek back to the kernel.
+ * @param ring_ptr pointer to struct uring
+ */
+void uring_seen(struct uring * ring_ptr);
+
+/**
+ * uring_bufsinit allocates buffers and registers them as a provided buffer
+ * ring, every buffer free.
+ * @param ring_ptr pointer to struct uring
+ * @param bufs_ptr pointer to struct uring_bufs
+ * @param group uint16_t buffer group ID, unique within the ring
+ * @param count unsigned number of buffers, a power of 2 up to 32768
+ * @param buf_bytes size_t size of each buffer
+ * @return int 0 if successful, 1 if unsuccessful
+ */
+int uring_bufsinit(struct uring * ring_ptr, struct uring_bufs * bufs_ptr,
+   uint16_t group, unsigned count, size_t buf_bytes);
+
+/**
+ * uring_bufsfree unregisters a provided buffer ring and frees its buffers.
+ * @param ring_ptr pointer to struct uring
+ * @param bufs_ptr pointer to struct uring_bufs
+ */
+void uring_bufsfree(struct uring * ring_ptr, struct uring_bufs * bufs_ptr);
+
+/**
+ * uring_buf returns the buffer with a given ID.
+ * @param bufs_ptr pointer to struct uring_bufs
+ * @param bid uint16_t buffer ID from a completion's flags
+ * @return unsigned char * pointer to buf_bytes bytes
+ */
+unsigned char * uring_buf(const struct uring_bufs * bufs_ptr, uint16_t bid);
+
+/**
+ * uring_bufput hands a buffer back to the kernel to receive into again.
+ * @param bufs_ptr pointer to struct uring_bufs
+ * @param bid uint16_t buffer ID
+ */
+void uring_bufput(struct uring_bufs * bufs_ptr, uint16_t bid);
+
+#endif